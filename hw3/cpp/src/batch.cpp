@@ -0,0 +1,430 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include "bim_obj.cpp"
+#include "cjson.cpp"
+#include "distance_transform.cpp"
+#include "io.cpp"
+#include "parallel.cpp"
+#include "progress.cpp"
+#include "room_stats.cpp"
+#include "types.h"
+#include "voxelgrid.cpp"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <tuple>
+
+// Batch mode: runs the whole pipeline for every model of a manifest. Jobs run
+// concurrently on a fixed set of worker threads that take the next job when
+// they finish one; the hardware threads are shared out between the workers
+// for the parallel stages of their job. A job only allocates its grid once
+// its estimated memory fits into the budget next to the jobs that are
+// running, so a batch of large models does not run out of memory by starting
+// them all at once.
+//
+// The manifest is JSON:
+//   {"memory_budget_mib": 4096,
+//    "jobs": [{"input": "a.obj", "resolution": 0.25, "offset": 2,
+//              "obj": "a_voxels.obj", "ply": "a_voxels.ply",
+//              "cityjson": "a.city.json", "room_stats": "a_rooms.csv"}, ...]}
+// Only "input" is required; relative paths are relative to the manifest.
+
+struct BatchJob {
+    string input;
+    double resolution = 0.5;
+    unsigned int offset = 2;
+    // Outputs; an empty name is not written
+    string obj_output;
+    string ply_output;
+    string cityjson_output;
+    string room_stats_output;
+};
+
+// Settings shared by all jobs of a batch
+struct BatchOptions {
+    unsigned int num_threads = 0;  // 0: all hardware threads
+    unsigned int concurrent_jobs = 0; // 0: one per thread, at most one per job
+    size_t memory_budget = 0;      // bytes, 0: unlimited
+    Connectivity connectivity = Connectivity::Eighteen;
+    VoxelLayout layout = VoxelLayout::Linear;
+    VoxelizeMethod voxelize_method = VoxelizeMethod::Flat;
+    ExteriorMethod exterior_method = ExteriorMethod::FloodFill;
+    ExportMesh mesh = ExportMesh::Voxels;
+    CityJSONFormat cityjson_format = CityJSONFormat::Document;
+    int indent = -1;
+    double gap_width = 0;
+    vec<VoxelExportGroup> export_groups = {{"", {VoxelLabel::INTERSECTED}}};
+};
+
+struct BatchJobResult {
+    bool ok = false;
+    string error;
+    size_t triangles = 0;
+    size_t voxels = 0;
+    size_t rooms = 0;
+    size_t estimated_bytes = 0;
+    double wait_seconds = 0; // for the memory budget
+    double read_seconds = 0;
+    double voxelize_seconds = 0; // grid creation and intersection
+    double label_seconds = 0;    // including gap closing
+    double surface_seconds = 0;
+    double export_seconds = 0;   // room statistics and all outputs
+    double total_seconds = 0;    // without the wait
+};
+
+// Reads the jobs of a manifest. A "memory_budget_mib" in it is only used
+// when `memory_budget` is 0 (not given on the command line).
+bool read_batch_manifest(const string &filename, vec<BatchJob> &jobs,
+                         size_t &memory_budget) {
+    ifstream input(filename);
+    if (!input.is_open()) {
+        cerr << "Failed to open " << filename << endl;
+        return false;
+    }
+    const json manifest = json::parse(input, nullptr, false);
+    if (manifest.is_discarded() || !manifest.is_object() ||
+        !manifest.contains("jobs") || !manifest["jobs"].is_array()) {
+        cerr << filename << " is not a batch manifest" << endl;
+        return false;
+    }
+    const filesystem::path base = filesystem::path(filename).parent_path();
+    // Members of the wrong type are reported instead of thrown by json
+    bool valid = true;
+    auto invalid = [&](const string &what) {
+        cerr << filename << ": " << what << endl;
+        valid = false;
+    };
+    auto resolve = [&](const json &entry, const char *key) {
+        if (!entry.contains(key)) {
+            return string();
+        }
+        if (!entry[key].is_string()) {
+            invalid("job " + to_string(jobs.size()) + " has a non-string \"" +
+                    key + "\"");
+            return string();
+        }
+        return (base / entry[key].get<string>()).string();
+    };
+    jobs.clear();
+    for (const auto &entry: manifest["jobs"]) {
+        if (!entry.is_object() || !entry.contains("input") ||
+            !entry["input"].is_string()) {
+            cerr << filename << ": job " << jobs.size()
+                 << " has no \"input\"" << endl;
+            return false;
+        }
+        BatchJob job;
+        job.input = resolve(entry, "input");
+        if (entry.contains("resolution")) {
+            // Anything but a number fails the check for a positive one
+            const json &resolution = entry["resolution"];
+            job.resolution = resolution.is_number() ? resolution.get<double>()
+                                                    : 0;
+        }
+        if (entry.contains("offset")) {
+            if (entry["offset"].is_number_unsigned()) {
+                job.offset = entry["offset"].get<unsigned int>();
+            } else {
+                invalid("job " + to_string(jobs.size()) +
+                        " needs a non-negative integer offset");
+            }
+        }
+        job.obj_output = resolve(entry, "obj");
+        job.ply_output = resolve(entry, "ply");
+        job.cityjson_output = resolve(entry, "cityjson");
+        job.room_stats_output = resolve(entry, "room_stats");
+        if (!(job.resolution > 0)) {
+            invalid("job " + to_string(jobs.size()) +
+                    " needs a positive resolution");
+        }
+        if (!valid) {
+            return false;
+        }
+        jobs.push_back(job);
+    }
+    if (memory_budget == 0 && manifest.contains("memory_budget_mib")) {
+        const json &mib = manifest["memory_budget_mib"];
+        if (!mib.is_number() || mib.get<double>() < 0) {
+            invalid("\"memory_budget_mib\" must be a non-negative number");
+            return false;
+        }
+        memory_budget = static_cast<size_t>(mib.get<double>() * 1024 * 1024);
+    }
+    return true;
+}
+
+// Peak memory of a job from the size of its grid: the stages that produce a
+// new grid hold the old one next to it, and the labelling needs up to 4 bytes
+// of scratch per voxel (union-find, distances for the gap closing)
+size_t estimate_job_memory(const GridExtent &extent, unsigned int offset,
+                           VoxelLayout layout) {
+    const size_t grid_bytes = grid_memory_estimate(extent, offset, layout);
+    const size_t voxels = grid_bytes / (sizeof(VoxelInfo) + sizeof(RoomID));
+    return 2 * grid_bytes + voxels * sizeof(uint32_t);
+}
+
+// Memory that the running jobs have reserved. A reservation waits until it
+// fits into the budget; one that is larger than the whole budget waits until
+// nothing else is reserved and then runs alone.
+class MemoryBudget {
+public:
+    explicit MemoryBudget(size_t budget) : budget(budget) {}
+
+    void acquire(size_t bytes) {
+        unique_lock<mutex> lock(guard);
+        released.wait(lock, [&] {
+            return budget == 0 || reserved == 0 || reserved + bytes <= budget;
+        });
+        reserved += bytes;
+    }
+
+    void release(size_t bytes) {
+        {
+            lock_guard<mutex> lock(guard);
+            reserved -= bytes;
+        }
+        released.notify_all();
+    }
+
+private:
+    const size_t budget;
+    size_t reserved = 0;
+    mutex guard;
+    condition_variable released;
+};
+
+// A reservation in a MemoryBudget that is released when it goes out of
+// scope, also when the job throws
+class MemoryReservation {
+public:
+    MemoryReservation(MemoryBudget &budget, size_t bytes)
+        : budget(budget), bytes(bytes) {
+        budget.acquire(bytes);
+    }
+
+    ~MemoryReservation() { budget.release(bytes); }
+
+    MemoryReservation(const MemoryReservation &) = delete;
+    MemoryReservation &operator=(const MemoryReservation &) = delete;
+
+private:
+    MemoryBudget &budget;
+    const size_t bytes;
+};
+
+// Runs one job with `num_threads` threads for its parallel stages
+BatchJobResult run_batch_job(const BatchJob &job, const BatchOptions &options,
+                             unsigned int num_threads, MemoryBudget &budget) {
+    BatchJobResult result;
+    auto seconds_since = [](chrono::steady_clock::time_point start) {
+        return chrono::duration<double>(chrono::steady_clock::now() - start)
+                .count();
+    };
+    const auto job_start = chrono::steady_clock::now();
+    auto stage_start = job_start;
+    auto lap = [&](double &seconds) {
+        seconds = seconds_since(stage_start);
+        stage_start = chrono::steady_clock::now();
+    };
+
+    TriangleStore triangles;
+    vec<double> vertices;
+    {
+        BIMObjects bim_objects;
+        tie(bim_objects, vertices) = read_obj(job.input);
+        assign_semantics(bim_objects);
+        triangles = make_triangle_store(bim_objects);
+    }
+    result.triangles = triangles.size();
+    if (result.triangles == 0) {
+        result.error = "no triangles read";
+        return result;
+    }
+    lap(result.read_seconds);
+
+    const GridExtent extent = grid_extent(vertices, job.resolution);
+    result.estimated_bytes = estimate_job_memory(extent, job.offset,
+                                                 options.layout);
+    // Declared before the grid, so the grid is freed before the release
+    const MemoryReservation reservation(budget, result.estimated_bytes);
+    result.wait_seconds = seconds_since(stage_start);
+    stage_start = chrono::steady_clock::now();
+
+    VoxelGrid grid = create_voxel(vertices, job.offset, job.resolution,
+                                  options.layout);
+    result.voxels = static_cast<size_t>(grid.size_x) * grid.size_y * grid.size_z;
+    grid = intersection_with_bim_obj(grid, triangles, num_threads,
+                                     options.voxelize_method);
+    lap(result.voxelize_seconds);
+
+    const vec<size_t> sealed = options.gap_width > 0
+                               ? close_gaps(grid, options.gap_width, num_threads)
+                               : vec<size_t>();
+    grid = mark_exterior_interior(grid, options.connectivity, num_threads,
+                                  options.exterior_method, &triangles);
+    if (!sealed.empty()) {
+        reopen_gaps(grid, sealed, options.connectivity);
+    }
+    lap(result.label_seconds);
+
+    extract_surface(grid, eighteen_connectivity, num_threads);
+    lap(result.surface_seconds);
+
+    const vec<RoomStatistics> rooms = room_statistics(grid, num_threads);
+    for (const auto &room: rooms) {
+        result.rooms += room.voxels > 0;
+    }
+    bool written = true;
+    if (!job.obj_output.empty()) {
+        written &= write_voxel_obj(job.obj_output, grid, options.export_groups,
+                                   options.mesh) != 0;
+    }
+    if (!job.ply_output.empty()) {
+        written &= write_voxel_ply(job.ply_output, grid, options.export_groups,
+                                   options.mesh) != 0;
+    }
+    if (!job.cityjson_output.empty()) {
+        written &= write_voxel_cityjson(job.cityjson_output, grid, options.mesh,
+                                        options.cityjson_format, options.indent,
+                                        room_attributes(grid, rooms));
+    }
+    if (!job.room_stats_output.empty()) {
+        written &= write_room_statistics_csv(job.room_stats_output, grid, rooms);
+    }
+    lap(result.export_seconds);
+
+    result.total_seconds = seconds_since(job_start) - result.wait_seconds;
+    result.ok = written;
+    if (!written) {
+        result.error = "failed to write an output";
+    }
+    return result;
+}
+
+void print_batch_summary(ostream &out, const vec<BatchJob> &jobs,
+                         const vec<BatchJobResult> &results,
+                         double wall_seconds) {
+    out << left << setw(5) << "job" << setw(28) << "input" << right
+        << setw(12) << "voxels" << setw(10) << "triangles" << setw(7)
+        << "rooms" << setw(10) << "est MiB" << setw(8) << "wait" << setw(8)
+        << "read" << setw(9) << "voxelize" << setw(8) << "label" << setw(9)
+        << "surface" << setw(8) << "export" << setw(8) << "total"
+        << setw(11) << "voxels/s" << "  status\n";
+    size_t voxels = 0, triangles = 0, failed = 0;
+    double busy_seconds = 0;
+    for (size_t i = 0; i < jobs.size(); i++) {
+        const BatchJobResult &result = results[i];
+        string input = jobs[i].input;
+        if (input.size() > 27) {
+            input = "..." + input.substr(input.size() - 24);
+        }
+        ostringstream rate;
+        if (result.ok && result.total_seconds > 0) {
+            rate << scientific << setprecision(2)
+                 << result.voxels / result.total_seconds;
+        } else {
+            rate << "-";
+        }
+        out << left << setw(5) << i << setw(28) << input << right
+            << setw(12) << result.voxels << setw(10) << result.triangles
+            << setw(7) << result.rooms << fixed << setprecision(1) << setw(10)
+            << result.estimated_bytes / (1024.0 * 1024.0) << setprecision(3)
+            << setw(8) << result.wait_seconds << setw(8) << result.read_seconds
+            << setw(9) << result.voxelize_seconds << setw(8)
+            << result.label_seconds << setw(9) << result.surface_seconds
+            << setw(8) << result.export_seconds << setw(8)
+            << result.total_seconds << setw(11) << rate.str() << "  "
+            << (result.ok ? "ok" : result.error) << "\n";
+        if (result.ok) {
+            voxels += result.voxels;
+            triangles += result.triangles;
+            busy_seconds += result.total_seconds;
+        } else {
+            failed++;
+        }
+    }
+    out << jobs.size() << " jobs (" << failed << " failed) in " << fixed
+        << setprecision(3) << wall_seconds << " s, " << scientific
+        << setprecision(2) << (wall_seconds > 0 ? voxels / wall_seconds : 0)
+        << " voxels/s, "
+        << (wall_seconds > 0 ? triangles / wall_seconds : 0)
+        << " triangles/s; jobs ran " << fixed << setprecision(2)
+        << (wall_seconds > 0 ? busy_seconds / wall_seconds : 0)
+        << "x concurrent on average\n";
+    out.unsetf(ios::floatfield);
+}
+
+// Runs all jobs and prints a line when each one finishes and a summary at
+// the end. The progress messages of the stages are turned off in every
+// worker, so these lines are all that goes to cout. A job that throws fails
+// with the exception as its error, the other jobs go on. Returns false if a
+// job failed.
+bool run_batch(const vec<BatchJob> &jobs, const BatchOptions &options) {
+    const unsigned int threads = resolve_thread_count(options.num_threads);
+    const unsigned int workers = static_cast<unsigned int>(min<size_t>(
+            options.concurrent_jobs > 0 ? options.concurrent_jobs : threads,
+            max<size_t>(1, jobs.size())));
+    const unsigned int job_threads = max(1u, threads / workers);
+    cout << "Batch of " << jobs.size() << " jobs, " << workers
+         << " at a time with " << job_threads << " threads each";
+    if (options.memory_budget > 0) {
+        cout << ", memory budget "
+             << options.memory_budget / (1024.0 * 1024.0) << " MiB";
+    }
+    cout << endl;
+
+    MemoryBudget budget(options.memory_budget);
+    vec<BatchJobResult> results(jobs.size());
+    atomic<size_t> next_job(0);
+    mutex report_guard;
+    const auto start = chrono::steady_clock::now();
+    auto work = [&] {
+        const QuietProgress quiet;
+        for (size_t i = next_job++; i < jobs.size(); i = next_job++) {
+            try {
+                results[i] = run_batch_job(jobs[i], options, job_threads,
+                                           budget);
+            } catch (const exception &error) {
+                results[i] = BatchJobResult();
+                results[i].error = error.what();
+            } catch (...) {
+                results[i] = BatchJobResult();
+                results[i].error = "unknown exception";
+            }
+            lock_guard<mutex> lock(report_guard);
+            cout << "job " << i << " " << jobs[i].input << ": "
+                 << (results[i].ok ? "done" : results[i].error) << " in "
+                 << results[i].total_seconds << " s" << endl;
+        }
+    };
+    vec<thread> pool;
+    for (unsigned int w = 1; w < workers; w++) {
+        pool.emplace_back(work);
+    }
+    work();
+    for (auto &worker: pool) {
+        worker.join();
+    }
+    const double wall_seconds =
+            chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    print_batch_summary(cout, jobs, results, wall_seconds);
+    for (const auto &result: results) {
+        if (!result.ok) {
+            return false;
+        }
+    }
+    return true;
+}
+
+#endif
@@ -0,0 +1,317 @@
+#include "../bim_obj.cpp"
+#include "../cjson.cpp"
+#include "../distance_transform.cpp"
+#include "../io.cpp"
+#include "../room_stats.cpp"
+#include "../types.h"
+#include "../voxel_runs.cpp"
+#include "../voxelgrid.cpp"
+#include <chrono>
+#include <cstdio>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+
+// Stage-level benchmark of the whole pipeline, on an OBJ file or on a
+// generated building. Every stage is timed separately and reported with its
+// throughput and the peak memory of the process so far.
+// Usage: hw3_bench_pipeline [input.obj | --generate XxYxF] [--resolution R]
+//                           [--threads N] [--layout linear|brick|sparse]
+//                           [--voxelize flat|hierarchical]
+//                           [--exterior bfs|bitwise|coarse]
+//                           [--mesh voxels|greedy]
+//                           [--cityjson document|seq] [--close-gaps W]
+//                           [--runs] [--repeat K] [--verbose]
+
+// Appends an axis-aligned box as a group of 12 triangles
+void add_box(string &obj, size_t &num_vertices, const string &name, double x0,
+             double y0, double z0, double x1, double y1, double z1) {
+  obj += "g " + name + "\n";
+  const double xs[2] = {x0, x1}, ys[2] = {y0, y1}, zs[2] = {z0, z1};
+  char line[128];
+  for (int i = 0; i < 8; i++) {
+    snprintf(line, sizeof(line), "v %.4f %.4f %.4f\n", xs[i & 1],
+             ys[(i >> 1) & 1], zs[i >> 2]);
+    obj += line;
+  }
+  // Corners are numbered by their x, y, z bits
+  const int quads[6][4] = {{0, 2, 3, 1}, {4, 5, 7, 6}, {0, 1, 5, 4},
+                           {2, 6, 7, 3}, {0, 4, 6, 2}, {1, 3, 7, 5}};
+  for (const auto &quad : quads) {
+    const size_t a = num_vertices + quad[0] + 1, b = num_vertices + quad[1] + 1,
+                 c = num_vertices + quad[2] + 1, d = num_vertices + quad[3] + 1;
+    obj += "f " + to_string(a) + " " + to_string(b) + " " + to_string(c) + "\n";
+    obj += "f " + to_string(a) + " " + to_string(c) + " " + to_string(d) + "\n";
+  }
+  num_vertices += 8;
+}
+
+// A block of rooms_x * rooms_y rooms on each of `floors` storeys, with slabs,
+// outer and inner walls, a door into every room and a window in every outer
+// wall segment. The names follow what assign_semantics looks for.
+string generate_building(unsigned int rooms_x, unsigned int rooms_y,
+                         unsigned int floors) {
+  const double room_x = 5.0, room_y = 4.0, storey = 3.0, t = 0.2;
+  const double size_x = rooms_x * room_x, size_y = rooms_y * room_y;
+  string obj;
+  size_t num_vertices = 0;
+  unsigned int id = 0;
+  auto name = [&](const string &kind) { return kind + "-" + to_string(id++); };
+  for (unsigned int f = 0; f < floors; f++) {
+    const double z0 = f * storey, z1 = z0 + storey;
+    add_box(obj, num_vertices, name("Floor"), 0, 0, z0, size_x, size_y, z0 + t);
+    add_box(obj, num_vertices, name("Wall"), 0, 0, z0 + t, size_x, t, z1);
+    add_box(obj, num_vertices, name("Wall"), 0, size_y - t, z0 + t, size_x,
+            size_y, z1);
+    add_box(obj, num_vertices, name("Wall"), 0, t, z0 + t, t, size_y - t, z1);
+    add_box(obj, num_vertices, name("Wall"), size_x - t, t, z0 + t, size_x,
+            size_y - t, z1);
+    for (unsigned int i = 1; i < rooms_x; i++) {
+      add_box(obj, num_vertices, name("Wall:Interior"), i * room_x - t / 2, t,
+              z0 + t, i * room_x + t / 2, size_y - t, z1);
+    }
+    for (unsigned int j = 1; j < rooms_y; j++) {
+      add_box(obj, num_vertices, name("Wall:Interior"), t, j * room_y - t / 2,
+              z0 + t, size_x - t, j * room_y + t / 2, z1);
+    }
+    for (unsigned int i = 0; i < rooms_x; i++) {
+      const double x = i * room_x + room_x / 2;
+      add_box(obj, num_vertices, name("Window"), x - 0.6, -0.05, z0 + 1.0,
+              x + 0.6, t + 0.05, z0 + 2.2);
+      for (unsigned int j = 0; j < rooms_y; j++) {
+        add_box(obj, num_vertices, name("Door"), i * room_x + 0.5,
+                j * room_y - 0.15, z0 + t, i * room_x + 1.4, j * room_y + 0.15,
+                z0 + 2.3);
+      }
+    }
+  }
+  add_box(obj, num_vertices, name("Roof"), 0, 0, floors * storey, size_x,
+          size_y, floors * storey + t);
+  return obj;
+}
+
+struct StageTiming {
+  string name;
+  double seconds = numeric_limits<double>::max(); // best of all repeats
+  size_t voxels = 0;
+  size_t triangles = 0;
+  double peak_mib = 0;
+};
+
+int main(int argc, const char *argv[]) {
+  string filename = "../../input/open_house_ifc4.obj";
+  unsigned int rooms_x = 0, rooms_y = 0, floors = 0;
+  double resolution = 0.5;
+  unsigned int num_threads = 0;
+  VoxelLayout layout = VoxelLayout::Linear;
+  VoxelizeMethod voxelize_method = VoxelizeMethod::Flat;
+  ExteriorMethod exterior_method = ExteriorMethod::FloodFill;
+  ExportMesh mesh = ExportMesh::Voxels;
+  CityJSONFormat cityjson_format = CityJSONFormat::Document;
+  double gap_width = 0;
+  unsigned int repeat = 1;
+  bool verbose = false;
+  bool use_runs = false;
+  for (int i = 1; i < argc; i++) {
+    const string arg = argv[i];
+    if (arg == "--generate" && i + 1 < argc) {
+      if (sscanf(argv[++i], "%ux%ux%u", &rooms_x, &rooms_y, &floors) != 3 ||
+          rooms_x == 0 || rooms_y == 0 || floors == 0) {
+        cerr << "--generate expects XxYxF, e.g. 4x3x2" << endl;
+        return 1;
+      }
+    } else if (arg == "--resolution" && i + 1 < argc) {
+      resolution = stod(argv[++i]);
+    } else if ((arg == "--threads" || arg == "-j") && i + 1 < argc) {
+      num_threads = stoul(argv[++i]);
+    } else if (arg == "--layout" && i + 1 < argc) {
+      const string value = argv[++i];
+      layout = value == "sparse" ? VoxelLayout::SparseBrick
+               : value == "brick" ? VoxelLayout::Brick
+                                  : VoxelLayout::Linear;
+    } else if (arg == "--voxelize" && i + 1 < argc) {
+      voxelize_method = string(argv[++i]) == "hierarchical"
+                            ? VoxelizeMethod::Hierarchical
+                            : VoxelizeMethod::Flat;
+    } else if (arg == "--exterior" && i + 1 < argc) {
+      const string value = argv[++i];
+      exterior_method = value == "bitwise"  ? ExteriorMethod::Bitwise
+                        : value == "coarse" ? ExteriorMethod::Coarse
+                        : value == "parity" ? ExteriorMethod::Parity
+                                            : ExteriorMethod::FloodFill;
+    } else if (arg == "--mesh" && i + 1 < argc) {
+      mesh = string(argv[++i]) == "greedy" ? ExportMesh::Greedy
+                                           : ExportMesh::Voxels;
+    } else if (arg == "--cityjson" && i + 1 < argc) {
+      cityjson_format = string(argv[++i]) == "seq" ? CityJSONFormat::Sequence
+                                                   : CityJSONFormat::Document;
+    } else if (arg == "--close-gaps" && i + 1 < argc) {
+      gap_width = stod(argv[++i]);
+    } else if (arg == "--repeat" && i + 1 < argc) {
+      repeat = max(1ul, stoul(argv[++i]));
+    } else if (arg == "--runs") {
+      use_runs = true;
+    } else if (arg == "--verbose") {
+      verbose = true;
+    } else {
+      filename = arg;
+    }
+  }
+  if (floors > 0) {
+    filename = "bench_generated.obj";
+    ofstream generated(filename);
+    generated << generate_building(rooms_x, rooms_y, floors);
+  }
+  const string obj_out = "bench_out.obj", ply_out = "bench_out.ply",
+               cityjson_out = "bench_out.city.json";
+
+  // The stages report progress on cout; the table goes to the original
+  // stream while that output is discarded
+  ostream report(cout.rdbuf());
+  if (!verbose) {
+    cout.rdbuf(nullptr);
+  }
+
+  vec<StageTiming> timings;
+  for (unsigned int run = 0; run < repeat; run++) {
+    size_t stage = 0;
+    auto timed = [&](const string &name, auto fn) {
+      const auto start = chrono::steady_clock::now();
+      fn();
+      const double seconds =
+          chrono::duration<double>(chrono::steady_clock::now() - start).count();
+      if (timings.size() <= stage) {
+        timings.push_back(StageTiming());
+        timings.back().name = name;
+      }
+      StageTiming &timing = timings[stage++];
+      timing.seconds = min(timing.seconds, seconds);
+      // The peak only grows, so later runs would report the first run's peak
+      if (run == 0) {
+        timing.peak_mib = peak_memory_mib();
+      }
+      return &timing;
+    };
+
+    pair<BIMObjects, vec<double>> obj;
+    StageTiming *timing = timed("read_obj", [&] { obj = read_obj(filename); });
+    BIMObjects &bim_objects = obj.first;
+    size_t triangles = 0;
+    for (const auto &bim_obj : bim_objects) {
+      triangles += bim_obj.second.shells.size();
+    }
+    if (triangles == 0) {
+      cerr << "No triangles read from " << filename << endl;
+      return 1;
+    }
+    timing->triangles = triangles;
+    timed("assign_semantics", [&] { assign_semantics(bim_objects); })
+        ->triangles = triangles;
+    TriangleStore store;
+    timed("make_triangle_store", [&] {
+      store = make_triangle_store(bim_objects);
+    })->triangles = triangles;
+    // hw3 drops the objects once the store exists
+    bim_objects = BIMObjects();
+
+    VoxelGrid grid(0, 0, 0, {0, 0, 0});
+    timing = timed("create_voxel", [&] {
+      grid = create_voxel(obj.second, 2, resolution, layout);
+    });
+    const size_t voxels = grid.num_voxels();
+    timing->voxels = voxels;
+
+    timing = timed("intersection_with_bim_obj", [&] {
+      grid = intersection_with_bim_obj(grid, store, num_threads,
+                                       voxelize_method);
+    });
+    timing->voxels = voxels;
+    timing->triangles = triangles;
+    vec<size_t> sealed;
+    if (gap_width > 0) {
+      timed("close_gaps", [&] {
+        sealed = close_gaps(grid, gap_width, num_threads);
+      })->voxels = voxels;
+    }
+    timed("mark_exterior_interior", [&] {
+      grid = mark_exterior_interior(grid, Connectivity::Eighteen, num_threads,
+                                    exterior_method, &store);
+    })->voxels = voxels;
+    if (gap_width > 0) {
+      timed("reopen_gaps", [&] {
+        reopen_gaps(grid, sealed, Connectivity::Eighteen);
+      })->voxels = voxels;
+    }
+    // The outputs, from the grid or from its runs as hw3 --runs does
+    auto write_outputs = [&](const auto &voxels_of) {
+      vec<RoomStatistics> rooms;
+      timed("room_statistics", [&] {
+        rooms = room_statistics(voxels_of, num_threads);
+      })->voxels = voxels;
+
+      timed("write_voxel_cityjson", [&] {
+        write_voxel_cityjson(cityjson_out, voxels_of, mesh, cityjson_format, -1,
+                             room_attributes(voxels_of, rooms));
+      })->voxels = voxels;
+      timed("write_voxel_obj", [&] {
+        write_voxel_obj(obj_out, voxels_of, {VoxelLabel::INTERSECTED}, mesh);
+      })->voxels = voxels;
+      timed("write_voxel_ply", [&] {
+        write_voxel_ply(ply_out, voxels_of, {{"", {VoxelLabel::INTERSECTED}}},
+                        mesh);
+      })->voxels = voxels;
+    };
+    if (use_runs) {
+      VoxelRuns runs(grid);
+      timed("encode_voxel_runs", [&] {
+        runs = encode_voxel_runs(grid, num_threads);
+      })->voxels = voxels;
+      grid = VoxelGrid(0, 0, 0, {0, 0, 0});
+      timed("extract_surface", [&] {
+        extract_surface(runs, eighteen_connectivity, num_threads);
+      })->voxels = voxels;
+      write_outputs(runs);
+    } else {
+      timed("extract_surface", [&] {
+        extract_surface(grid, eighteen_connectivity, num_threads);
+      })->voxels = voxels;
+      write_outputs(grid);
+    }
+  }
+  cout.rdbuf(report.rdbuf());
+  cout.clear();
+
+  report << "input: " << filename << ", resolution " << resolution << ", "
+         << resolve_thread_count(num_threads) << " threads, best of "
+         << repeat << "\n";
+  report << left << setw(28) << "stage" << right << setw(10) << "seconds"
+         << setw(14) << "voxels/s" << setw(14) << "triangles/s" << setw(12)
+         << "peak MiB" << "\n";
+  double total = 0;
+  for (const auto &timing : timings) {
+    auto rate = [&](size_t count) {
+      ostringstream out;
+      if (count == 0 || timing.seconds <= 0) {
+        out << "-";
+      } else {
+        out << scientific << setprecision(2) << count / timing.seconds;
+      }
+      return out.str();
+    };
+    report << left << setw(28) << timing.name << right << fixed
+           << setprecision(4) << setw(10) << timing.seconds << setw(14)
+           << rate(timing.voxels) << setw(14) << rate(timing.triangles)
+           << setprecision(1) << setw(12) << timing.peak_mib << "\n";
+    total += timing.seconds;
+  }
+  report << left << setw(28) << "total" << right << fixed << setprecision(4)
+         << setw(10) << total << "\n";
+
+  remove(obj_out.c_str());
+  remove(ply_out.c_str());
+  remove(cityjson_out.c_str());
+  if (floors > 0) {
+    remove(filename.c_str());
+  }
+  return 0;
+}
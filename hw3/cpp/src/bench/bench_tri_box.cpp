@@ -0,0 +1,114 @@
+#include "../tri_box.cpp"
+#include "../types.h"
+#include "../voxelgrid.cpp"
+#include <chrono>
+#include <iostream>
+#include <random>
+
+// Microbenchmark of the triangle/box overlap test: every random triangle is
+// tested against the voxels of its bounding box, once with the exact CGAL
+// predicate only and once with the batched separating-axis classifier that
+// falls back to CGAL for uncertain boxes.
+// Usage: hw3_bench_tri_box [num_triangles] [resolution]
+int main(int argc, const char *argv[]) {
+  const unsigned int num_triangles = argc > 1 ? stoul(argv[1]) : 20000;
+  const double resolution = argc > 2 ? stod(argv[2]) : 0.1;
+  const double half_res = resolution / 2;
+  const double extent = 20.0;
+
+  mt19937 rng(42);
+  uniform_real_distribution<double> position(0, extent);
+  uniform_real_distribution<double> spread(-1.0, 1.0);
+  vec<Triangle3> triangles;
+  for (unsigned int i = 0; i < num_triangles; i++) {
+    const Point3 p(position(rng), position(rng), position(rng));
+    triangles.emplace_back(
+        p, Point3(p.x() + spread(rng), p.y() + spread(rng), p.z() + spread(rng)),
+        Point3(p.x() + spread(rng), p.y() + spread(rng), p.z() + spread(rng)));
+  }
+  // Every fourth triangle is axis-aligned and lies on voxel faces, the common
+  // case for IfcConvert output and the hard case for the fast test
+  for (unsigned int i = 0; i < num_triangles; i += 4) {
+    const double z = floor(position(rng) / resolution) * resolution;
+    const Point3 p(position(rng), position(rng), z);
+    triangles[i] = Triangle3(p, Point3(p.x() + 1, p.y(), z),
+                             Point3(p.x(), p.y() + 1, z));
+  }
+
+  auto box_center = [&](double min) {
+    return floor(min / resolution) * resolution - resolution / 2;
+  };
+
+  size_t pairs = 0, hits_exact = 0;
+  auto start = chrono::steady_clock::now();
+  for (const auto &triangle : triangles) {
+    const Bbox3 bbox = triangle_bbox(triangle);
+    for (double x = box_center(bbox.xmin()); x <= bbox.xmax() + resolution;
+         x += resolution) {
+      for (double y = box_center(bbox.ymin()); y <= bbox.ymax() + resolution;
+           y += resolution) {
+        for (double z = box_center(bbox.zmin()); z <= bbox.zmax() + resolution;
+             z += resolution) {
+          const Bbox3 box(x - half_res, y - half_res, z - half_res,
+                          x + half_res, y + half_res, z + half_res);
+          pairs++;
+          hits_exact += bbox_overlap(bbox, box) &&
+                        CGAL::do_intersect(box, triangle);
+        }
+      }
+    }
+  }
+  const double exact_seconds =
+      chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+  size_t hits_fast = 0, uncertain = 0;
+  double center_z[TRI_BOX_BATCH];
+  TriBoxOverlap overlap[TRI_BOX_BATCH];
+  start = chrono::steady_clock::now();
+  for (const auto &triangle : triangles) {
+    const Bbox3 bbox = triangle_bbox(triangle);
+    const TriBoxAxes axes = make_tri_box_axes(triangle, half_res, extent + 2);
+    for (double x = box_center(bbox.xmin()); x <= bbox.xmax() + resolution;
+         x += resolution) {
+      for (double y = box_center(bbox.ymin()); y <= bbox.ymax() + resolution;
+           y += resolution) {
+        unsigned int count = 0;
+        for (double z = box_center(bbox.zmin()); z <= bbox.zmax() + resolution;
+             z += resolution) {
+          center_z[count++] = z;
+          if (count < TRI_BOX_BATCH &&
+              z + resolution <= bbox.zmax() + resolution) {
+            continue;
+          }
+          classify_box_row(axes, x, y, center_z, count, overlap);
+          for (unsigned int i = 0; i < count; i++) {
+            if (overlap[i] == TriBoxOverlap::Overlap) {
+              hits_fast++;
+            } else if (overlap[i] == TriBoxOverlap::Uncertain) {
+              uncertain++;
+              const Bbox3 box(x - half_res, y - half_res, center_z[i] - half_res,
+                              x + half_res, y + half_res, center_z[i] + half_res);
+              hits_fast += bbox_overlap(bbox, box) &&
+                           CGAL::do_intersect(box, triangle);
+            }
+          }
+          count = 0;
+        }
+      }
+    }
+  }
+  const double fast_seconds =
+      chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+  // The baseline is whatever CGAL::do_intersect this is built against
+  cout << "pairs: " << pairs << "\n";
+  cout << "do_intersect:    " << pairs / exact_seconds << " pairs/s ("
+       << exact_seconds << " s)\n";
+  cout << "batched SAT:     " << pairs / fast_seconds << " pairs/s ("
+       << fast_seconds << " s)\n";
+  cout << "exact fallbacks: " << uncertain << " ("
+       << 100.0 * uncertain / pairs << " %)\n";
+  cout << "hits: " << hits_exact << " exact, " << hits_fast << " batched"
+       << endl;
+  return hits_exact == hits_fast ? 0 : 1;
+}
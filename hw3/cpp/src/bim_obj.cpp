@@ -1,6 +1,7 @@
 #ifndef BIM_OBJ_H
 #define BIM_OBJ_H
 
+#include "metrics.cpp"
 #include "types.h"
 #include <algorithm>
 #include <fstream>
@@ -47,6 +48,7 @@ bool containsSubstring(const string &str, const string &substr) {
 }
 
 void assign_semantics(BIMObjects &bim_objs) {
+  StageTimer stage("assign_semantics");
   // check if object name contains "wall", "floor", "wall:interior",
   // "window", "door". If these are contained in the name, assign the
   // corresponding semantics
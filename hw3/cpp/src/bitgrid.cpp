@@ -0,0 +1,224 @@
+#ifndef BITGRID_H
+#define BITGRID_H
+
+#include "parallel.cpp"
+#include "types.h"
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+
+// Boolean voxel layers, packed 64 voxels per word along z. A z column is
+// words_z consecutive words and columns are stored x-major like the linear
+// grid. Growing a region then works on whole words: the z neighbours of 64
+// voxels are two shifts, and the x/y neighbours are the same words of the
+// adjacent columns.
+
+struct BitGrid {
+    unsigned int size_x, size_y, size_z;
+    unsigned int words_z; // words per z column
+    vec<uint64_t> words;
+
+    BitGrid(unsigned int x, unsigned int y, unsigned int z)
+        : size_x(x), size_y(y), size_z(z), words_z((z + 63) / 64),
+          words(static_cast<size_t>(x) * y * ((z + 63) / 64), 0) {}
+
+    uint64_t *column(unsigned int x, unsigned int y) {
+        return &words[(static_cast<size_t>(x) * size_y + y) * words_z];
+    }
+
+    const uint64_t *column(unsigned int x, unsigned int y) const {
+        return &words[(static_cast<size_t>(x) * size_y + y) * words_z];
+    }
+
+    bool test(unsigned int x, unsigned int y, unsigned int z) const {
+        return (column(x, y)[z / 64] >> (z % 64)) & 1;
+    }
+
+    void set(unsigned int x, unsigned int y, unsigned int z) {
+        column(x, y)[z / 64] |= uint64_t(1) << (z % 64);
+    }
+
+    void reset(unsigned int x, unsigned int y, unsigned int z) {
+        column(x, y)[z / 64] &= ~(uint64_t(1) << (z % 64));
+    }
+
+    // Bits of the last word of a column that lie inside the grid
+    uint64_t tail_mask() const {
+        return size_z % 64 == 0 ? ~uint64_t(0)
+                                : (uint64_t(1) << (size_z % 64)) - 1;
+    }
+};
+
+// Occluded fills (Kogge-Stone): every set bit of `gen` spreads towards higher
+// (fill_up) or lower (fill_down) bits for as long as `pro` is set
+inline uint64_t fill_up(uint64_t gen, uint64_t pro) {
+    gen |= pro & (gen << 1);
+    pro &= pro << 1;
+    gen |= pro & (gen << 2);
+    pro &= pro << 2;
+    gen |= pro & (gen << 4);
+    pro &= pro << 4;
+    gen |= pro & (gen << 8);
+    pro &= pro << 8;
+    gen |= pro & (gen << 16);
+    pro &= pro << 16;
+    gen |= pro & (gen << 32);
+    return gen;
+}
+
+inline uint64_t fill_down(uint64_t gen, uint64_t pro) {
+    gen |= pro & (gen >> 1);
+    pro &= pro >> 1;
+    gen |= pro & (gen >> 2);
+    pro &= pro >> 2;
+    gen |= pro & (gen >> 4);
+    pro &= pro >> 4;
+    gen |= pro & (gen >> 8);
+    pro &= pro >> 8;
+    gen |= pro & (gen >> 16);
+    pro &= pro >> 16;
+    gen |= pro & (gen >> 32);
+    return gen;
+}
+
+// Grows the set bits of one column through the runs of `mask` that contain
+// them. `bits` must be a subset of `mask`.
+void fill_column_z(uint64_t *bits, const uint64_t *mask, unsigned int words) {
+    uint64_t carry = 0;
+    for (unsigned int w = 0; w < words; w++) {
+        bits[w] = fill_up(bits[w] | (carry & mask[w]), mask[w]);
+        carry = bits[w] >> 63;
+    }
+    carry = 0;
+    for (unsigned int w = words; w-- > 0;) {
+        bits[w] = fill_down(bits[w] | ((carry << 63) & mask[w]), mask[w]);
+        carry = bits[w] & 1;
+    }
+}
+
+// ORs into `out` every voxel of column (x, y) that has a neighbour in `grid`
+// under the given connectivity, or is set in `grid` itself
+void gather_neighbourhood(const BitGrid &grid, unsigned int x, unsigned int y,
+                          Connectivity connectivity, uint64_t *out) {
+    const unsigned int words = grid.words_z;
+    for (int dx = -1; dx <= 1; dx++) {
+        for (int dy = -1; dy <= 1; dy++) {
+            const long nx = static_cast<long>(x) + dx;
+            const long ny = static_cast<long>(y) + dy;
+            if (nx < 0 || ny < 0 || nx >= grid.size_x || ny >= grid.size_y) {
+                continue;
+            }
+            // Offsets to the neighbouring column in x and y; whether the z
+            // neighbours in that column count as well depends on how many
+            // axes the full offset would change
+            const int lateral = (dx != 0) + (dy != 0);
+            bool along_z;
+            if (connectivity == Connectivity::Six) {
+                if (lateral == 2) {
+                    continue;
+                }
+                along_z = lateral == 0;
+            } else if (connectivity == Connectivity::Eighteen) {
+                along_z = lateral < 2;
+            } else {
+                along_z = true;
+            }
+            const uint64_t *in = grid.column(nx, ny);
+            if (!along_z) {
+                for (unsigned int w = 0; w < words; w++) {
+                    out[w] |= in[w];
+                }
+                continue;
+            }
+            for (unsigned int w = 0; w < words; w++) {
+                uint64_t v = in[w] | (in[w] << 1) | (in[w] >> 1);
+                if (w > 0) {
+                    v |= in[w - 1] >> 63;
+                }
+                if (w + 1 < words) {
+                    v |= in[w + 1] << 63;
+                }
+                out[w] |= v;
+            }
+        }
+    }
+    out[words - 1] &= grid.tail_mask();
+}
+
+// Morphological dilation with the voxel neighbourhood of `connectivity`
+BitGrid dilate(const BitGrid &grid, Connectivity connectivity,
+               unsigned int num_threads = 0) {
+    BitGrid out(grid.size_x, grid.size_y, grid.size_z);
+    if (grid.words_z == 0) {
+        return out;
+    }
+    parallel_for_chunks(0, grid.size_x, num_threads,
+                        [&](size_t begin, size_t end, size_t) {
+                            for (size_t x = begin; x < end; x++) {
+                                for (unsigned int y = 0; y < grid.size_y; y++) {
+                                    gather_neighbourhood(grid, x, y, connectivity,
+                                                         out.column(x, y));
+                                }
+                            }
+                        });
+    return out;
+}
+
+// Grows `region` within `mask` until it is closed under the neighbourhood of
+// `connectivity`; `region` must be a subset of `mask`. Instead of dilating the
+// whole grid once per step, the columns are swept alternately forwards and
+// backwards: each column takes in the neighbours of the already updated
+// columns and is then filled along z, so a region typically crosses the grid
+// in a handful of sweeps. Returns the number of sweeps, the last one being
+// the sweep that changed nothing.
+unsigned int propagate_to_fixed_point(BitGrid &region, const BitGrid &mask,
+                                      Connectivity connectivity) {
+    const unsigned int words = region.words_z;
+    if (words == 0) {
+        return 0;
+    }
+    for (unsigned int x = 0; x < region.size_x; x++) {
+        for (unsigned int y = 0; y < region.size_y; y++) {
+            fill_column_z(region.column(x, y), mask.column(x, y), words);
+        }
+    }
+    vec<uint64_t> grown(words);
+    auto update_column = [&](unsigned int x, unsigned int y) {
+        fill(grown.begin(), grown.end(), 0);
+        gather_neighbourhood(region, x, y, connectivity, grown.data());
+        uint64_t *bits = region.column(x, y);
+        const uint64_t *allowed = mask.column(x, y);
+        bool changed = false;
+        for (unsigned int w = 0; w < words; w++) {
+            const uint64_t added = grown[w] & allowed[w] & ~bits[w];
+            bits[w] |= added;
+            changed = changed || added != 0;
+        }
+        if (changed) {
+            fill_column_z(bits, allowed, words);
+        }
+        return changed;
+    };
+    unsigned int sweeps = 0;
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        if (sweeps % 2 == 0) {
+            for (unsigned int x = 0; x < region.size_x; x++) {
+                for (unsigned int y = 0; y < region.size_y; y++) {
+                    changed = update_column(x, y) || changed;
+                }
+            }
+        } else {
+            for (unsigned int x = region.size_x; x-- > 0;) {
+                for (unsigned int y = region.size_y; y-- > 0;) {
+                    changed = update_column(x, y) || changed;
+                }
+            }
+        }
+        sweeps++;
+    }
+    return sweeps;
+}
+
+#endif
@@ -0,0 +1,409 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include "metrics.cpp"
+#include "progress.cpp"
+#include "types.h"
+#include "voxelgrid.cpp"
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Binary snapshot of a voxel grid after a pipeline stage, so that a run can
+// pick up from there instead of parsing, intersecting and labelling again.
+// The file is a fixed header followed by four arrays in x, y, z scan order:
+// labels, city object types and semantics with one byte per voxel, and room
+// ids with four. Each array is stored either as is or as (run length, value)
+// pairs, which turns the large uniform regions of a grid into a few bytes.
+// Numbers are in the byte order of the machine that wrote the file.
+
+// Stages after which a checkpoint can be taken, in pipeline order
+enum class PipelineStage : uint8_t { Voxelized, Intersected, Labelled, Surface };
+
+const char CHECKPOINT_MAGIC[8] = {'H', 'W', '3', 'V', 'O', 'X', 'E', 'L'};
+const uint32_t CHECKPOINT_VERSION = 1;
+
+struct CheckpointHeader {
+    char magic[8];
+    uint32_t version;
+    uint8_t stage;      // PipelineStage
+    uint8_t layout;     // VoxelLayout the grid had when it was written
+    uint8_t compressed; // 1 if the arrays are run-length encoded
+    uint8_t background[3]; // label, city object type, semantics
+    uint8_t padding[6];
+    uint32_t max_x, max_y, max_z, offset;
+    double resolution;
+    double origin[3];
+    uint64_t array_bytes[4]; // labels, types, semantics, room ids
+};
+
+static_assert(sizeof(CheckpointHeader) == 104,
+              "the checkpoint header is written as raw bytes");
+
+const char *pipeline_stage_name(PipelineStage stage) {
+    switch (stage) {
+        case PipelineStage::Voxelized:
+            return "voxelize";
+        case PipelineStage::Intersected:
+            return "intersect";
+        case PipelineStage::Labelled:
+            return "label";
+        default:
+            return "surface";
+    }
+}
+
+bool parse_pipeline_stage(const string &name, PipelineStage &stage) {
+    for (PipelineStage candidate: {PipelineStage::Voxelized,
+                                   PipelineStage::Intersected,
+                                   PipelineStage::Labelled,
+                                   PipelineStage::Surface}) {
+        if (name == pipeline_stage_name(candidate)) {
+            stage = candidate;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Appends values one by one to `bytes`, merging equal neighbours into runs
+// when compressing
+template<typename T>
+struct CheckpointArrayWriter {
+    bool compress;
+    vec<char> bytes;
+    T value{};
+    uint32_t run = 0;
+
+    explicit CheckpointArrayWriter(bool compress) : compress(compress) {}
+
+    void append(const void *data, size_t size) {
+        const char *begin = static_cast<const char *>(data);
+        bytes.insert(bytes.end(), begin, begin + size);
+    }
+
+    void push(T next) {
+        if (!compress) {
+            append(&next, sizeof(T));
+            return;
+        }
+        if (run > 0 && next == value && run < numeric_limits<uint32_t>::max()) {
+            run++;
+            return;
+        }
+        finish();
+        value = next;
+        run = 1;
+    }
+
+    void finish() {
+        if (run > 0) {
+            append(&run, sizeof(run));
+            append(&value, sizeof(T));
+            run = 0;
+        }
+    }
+};
+
+// Reads back what CheckpointArrayWriter wrote; false once the data runs out
+template<typename T>
+struct CheckpointArrayReader {
+    bool compressed;
+    const char *data, *end;
+    T value{};
+    uint32_t run = 0;
+
+    bool next(T &out) {
+        if (!compressed) {
+            if (end - data < static_cast<ptrdiff_t>(sizeof(T))) {
+                return false;
+            }
+            memcpy(&out, data, sizeof(T));
+            data += sizeof(T);
+            return true;
+        }
+        if (run == 0) {
+            if (end - data < static_cast<ptrdiff_t>(sizeof(run) + sizeof(T))) {
+                return false;
+            }
+            memcpy(&run, data, sizeof(run));
+            memcpy(&value, data + sizeof(run), sizeof(T));
+            data += sizeof(run) + sizeof(T);
+            if (run == 0) {
+                return false;
+            }
+        }
+        run--;
+        out = value;
+        return true;
+    }
+};
+
+bool write_checkpoint(const string &filename, const VoxelGrid &vg,
+                      PipelineStage stage, bool compress = true) {
+    StageTimer timer("write_checkpoint");
+    CheckpointHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic));
+    header.version = CHECKPOINT_VERSION;
+    header.stage = static_cast<uint8_t>(stage);
+    header.layout = static_cast<uint8_t>(vg.layout);
+    header.compressed = compress;
+    header.background[0] = static_cast<uint8_t>(vg.background.label);
+    header.background[1] = static_cast<uint8_t>(vg.background.city_object_type);
+    header.background[2] = static_cast<uint8_t>(vg.background.semantics);
+    header.max_x = vg.max_x;
+    header.max_y = vg.max_y;
+    header.max_z = vg.max_z;
+    header.offset = vg.offset;
+    header.resolution = vg.resolution;
+    for (int i = 0; i < 3; i++) {
+        header.origin[i] = vg.origin[i];
+    }
+
+    CheckpointArrayWriter<uint8_t> labels(compress), types(compress),
+            semantics(compress);
+    CheckpointArrayWriter<uint32_t> rooms(compress);
+    for (unsigned int x = 0; x < vg.size_x; x++) {
+        for (unsigned int y = 0; y < vg.size_y; y++) {
+            // One hash lookup per brick instead of per voxel on sparse grids
+            const VoxelBrick *brick = nullptr;
+            for (unsigned int z = 0; z < vg.size_z; z++) {
+                VoxelInfo voxel = vg.background;
+                RoomID room_id = 0;
+                if (!vg.is_sparse()) {
+                    const size_t i = vg.index(x, y, z);
+                    voxel = vg.voxels[i];
+                    room_id = vg.room_ids[i];
+                } else {
+                    if (z % BRICK_SIZE == 0) {
+                        brick = vg.sparse_brick(x, y, z);
+                    }
+                    if (brick != nullptr) {
+                        const size_t i = brick_local_index(x, y, z);
+                        voxel = brick->voxels[i];
+                        room_id = brick->room_ids[i];
+                    }
+                }
+                labels.push(static_cast<uint8_t>(voxel.label));
+                types.push(static_cast<uint8_t>(voxel.city_object_type));
+                semantics.push(static_cast<uint8_t>(voxel.semantics));
+                rooms.push(room_id);
+            }
+        }
+    }
+    labels.finish();
+    types.finish();
+    semantics.finish();
+    rooms.finish();
+    const vec<char> *arrays[4] = {&labels.bytes, &types.bytes, &semantics.bytes,
+                                  &rooms.bytes};
+    for (int i = 0; i < 4; i++) {
+        header.array_bytes[i] = arrays[i]->size();
+    }
+
+    ofstream out(filename, ios::binary);
+    if (!out.is_open()) {
+        cerr << "Failed to open " << filename << endl;
+        return false;
+    }
+    out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    for (const vec<char> *array: arrays) {
+        out.write(array->data(), array->size());
+    }
+    out.close();
+    if (!out) {
+        cerr << "Failed to write " << filename << endl;
+        return false;
+    }
+    add_metric_counter("bytes", sizeof(header) + header.array_bytes[0] +
+                                header.array_bytes[1] + header.array_bytes[2] +
+                                header.array_bytes[3]);
+    progress() << "Checkpoint after " << pipeline_stage_name(stage)
+               << " written to " << filename << endl;
+    return true;
+}
+
+// Whether the bytes of a checkpoint name a known label, city object type and
+// semantics
+bool checkpoint_voxel_known(uint8_t label, uint8_t type, uint8_t semantics) {
+    return label <= static_cast<uint8_t>(VoxelLabel::INTERIOR) &&
+           type <= static_cast<uint8_t>(CityObjectType::BuildingFurniture) &&
+           semantics <= static_cast<uint8_t>(Semantics::FloorSurface);
+}
+
+// Whether the array of `bytes` bytes at `data` holds exactly `count` values,
+// as is or as runs
+template<typename T>
+bool checkpoint_array_holds(const char *data, uint64_t bytes, bool compressed,
+                            uint64_t count) {
+    if (!compressed) {
+        return bytes % sizeof(T) == 0 && bytes / sizeof(T) == count;
+    }
+    const uint64_t entry = sizeof(uint32_t) + sizeof(T);
+    if (bytes % entry != 0) {
+        return false;
+    }
+    uint64_t total = 0;
+    for (uint64_t i = 0; i < bytes; i += entry) {
+        uint32_t run;
+        memcpy(&run, data + i, sizeof(run));
+        if (run == 0 || run > count - total) {
+            return false;
+        }
+        total += run;
+    }
+    return total == count;
+}
+
+// Rebuilds the grid from checkpoint data in [begin, end). The header is
+// checked against the arrays before the grid is allocated, so a corrupt file
+// is rejected instead of allocating whatever size it claims.
+bool parse_checkpoint(const char *begin, const char *end, VoxelGrid &vg,
+                      PipelineStage &stage) {
+    CheckpointHeader header;
+    if (end - begin < static_cast<ptrdiff_t>(sizeof(header))) {
+        return false;
+    }
+    memcpy(&header, begin, sizeof(header));
+    if (memcmp(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != CHECKPOINT_VERSION ||
+        header.stage > static_cast<uint8_t>(PipelineStage::Surface) ||
+        header.layout > static_cast<uint8_t>(VoxelLayout::SparseBrick)) {
+        return false;
+    }
+    const char *arrays[5];
+    arrays[0] = begin + sizeof(header);
+    for (int i = 0; i < 4; i++) {
+        if (header.array_bytes[i] > static_cast<uint64_t>(end - arrays[i])) {
+            return false;
+        }
+        arrays[i + 1] = arrays[i] + header.array_bytes[i];
+    }
+    const uint64_t sizes[3] = {
+            header.max_x + 2 * static_cast<uint64_t>(header.offset),
+            header.max_y + 2 * static_cast<uint64_t>(header.offset),
+            header.max_z + 2 * static_cast<uint64_t>(header.offset)};
+    uint64_t voxels = 1;
+    for (const uint64_t size: sizes) {
+        if (size > numeric_limits<unsigned int>::max() ||
+            (size > 0 && voxels > numeric_limits<uint64_t>::max() / size)) {
+            return false;
+        }
+        voxels *= size;
+    }
+    const bool compressed = header.compressed != 0;
+    if (!checkpoint_array_holds<uint8_t>(arrays[0], header.array_bytes[0],
+                                         compressed, voxels) ||
+        !checkpoint_array_holds<uint8_t>(arrays[1], header.array_bytes[1],
+                                         compressed, voxels) ||
+        !checkpoint_array_holds<uint8_t>(arrays[2], header.array_bytes[2],
+                                         compressed, voxels) ||
+        !checkpoint_array_holds<uint32_t>(arrays[3], header.array_bytes[3],
+                                          compressed, voxels) ||
+        !checkpoint_voxel_known(header.background[0], header.background[1],
+                                header.background[2])) {
+        return false;
+    }
+
+    stage = static_cast<PipelineStage>(header.stage);
+    vg = VoxelGrid(header.max_x, header.max_y, header.max_z,
+                   {header.origin[0], header.origin[1], header.origin[2]},
+                   header.offset, header.resolution,
+                   static_cast<VoxelLayout>(header.layout));
+    vg.background.label = static_cast<VoxelLabel>(header.background[0]);
+    vg.background.city_object_type =
+            static_cast<CityObjectType>(header.background[1]);
+    vg.background.semantics = static_cast<Semantics>(header.background[2]);
+
+    CheckpointArrayReader<uint8_t> labels{compressed, arrays[0], arrays[1]};
+    CheckpointArrayReader<uint8_t> types{compressed, arrays[1], arrays[2]};
+    CheckpointArrayReader<uint8_t> semantics{compressed, arrays[2], arrays[3]};
+    CheckpointArrayReader<uint32_t> rooms{compressed, arrays[3], arrays[4]};
+    for (unsigned int x = 0; x < vg.size_x; x++) {
+        for (unsigned int y = 0; y < vg.size_y; y++) {
+            for (unsigned int z = 0; z < vg.size_z; z++) {
+                uint8_t label, type, semantic;
+                RoomID room_id;
+                if (!labels.next(label) || !types.next(type) ||
+                    !semantics.next(semantic) || !rooms.next(room_id) ||
+                    !checkpoint_voxel_known(label, type, semantic)) {
+                    return false;
+                }
+                VoxelInfo voxel;
+                voxel.label = static_cast<VoxelLabel>(label);
+                voxel.city_object_type = static_cast<CityObjectType>(type);
+                voxel.semantics = static_cast<Semantics>(semantic);
+                // Sparse grids only allocate the bricks that differ from the
+                // background
+                if (vg.is_sparse() && room_id == 0 &&
+                    voxel.label == vg.background.label &&
+                    voxel.city_object_type == vg.background.city_object_type &&
+                    voxel.semantics == vg.background.semantics) {
+                    continue;
+                }
+                vg(x, y, z) = voxel;
+                vg.room_id(x, y, z) = room_id;
+            }
+        }
+    }
+    return true;
+}
+
+// Maps the file into memory and decodes the arrays straight from the page
+// cache. Returns false, leaving `vg` unspecified, if the file is not a
+// checkpoint of this version.
+bool read_checkpoint(const string &filename, VoxelGrid &vg,
+                     PipelineStage &stage) {
+    StageTimer timer("read_checkpoint");
+    bool parsed;
+#ifdef _WIN32
+    ifstream input(filename, ios::binary);
+    if (!input.is_open()) {
+        cerr << "Failed to open " << filename << endl;
+        return false;
+    }
+    const string data((istreambuf_iterator<char>(input)),
+                      istreambuf_iterator<char>());
+    parsed = parse_checkpoint(data.data(), data.data() + data.size(), vg, stage);
+#else
+    const int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        cerr << "Failed to open " << filename << endl;
+        return false;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size == 0) {
+        close(fd);
+        cerr << "Failed to read " << filename << endl;
+        return false;
+    }
+    const size_t size = info.st_size;
+    void *data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        cerr << "Failed to map " << filename << endl;
+        return false;
+    }
+    madvise(data, size, MADV_SEQUENTIAL);
+    const char *begin = static_cast<const char *>(data);
+    parsed = parse_checkpoint(begin, begin + size, vg, stage);
+    munmap(data, size);
+#endif
+    if (!parsed) {
+        cerr << filename << " is not a valid checkpoint" << endl;
+        return false;
+    }
+    return true;
+}
+
+#endif
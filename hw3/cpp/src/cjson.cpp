@@ -1,8 +1,21 @@
 #ifndef CJSON_H
 #define CJSON_H
 
+#include "greedy_mesh.cpp"
+#include "metrics.cpp"
+#include "progress.cpp"
 #include "types.h"
+#include "voxel_runs.cpp"
+#include "voxelgrid.cpp"
+#include <algorithm>
+#include <cassert>
+#include <charconv>
 #include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <limits>
+#include <ostream>
+#include <unordered_map>
 #include <vector>
 
 using namespace std;
@@ -84,17 +97,190 @@ string semantics_to_string(Semantics semantics) {
   }
 }
 
-json export_voxel_to_cityjson(VoxelGrid &vg) {
-  const vec<double> scale = {0.001, 0.001, 0.001};
-  const vec<double> translate = {0, 0, 0};
+// The voxels of one city object, collected before any JSON is built
+struct CityObjectVoxels {
+  string key;
+  CityObjectType type;
+  vec<uint32_t> corners;     // 8 vertex indices per voxel
+  vec<int> voxel_surfaces;   // index into surfaces per voxel, -1 if none
+  // Merged boundary faces as rings of vertex indices, back to back
+  vec<uint32_t> ring_vertices;
+  vec<uint32_t> ring_begin;  // first vertex of every ring, then the end
+  vec<int> quad_surfaces;    // index into surfaces per ring, -1 if none
+  vec<uint32_t> shell_begin; // first ring of every shell, then the end
+  vec<uint32_t> solid_begin; // first shell of every solid, then the end
+  vec<Semantics> surfaces;   // in order of first use
+};
+
+// Index of `semantics` in the surfaces of `object`, added on first use
+int object_surface(CityObjectVoxels &object, Semantics semantics) {
+  if (semantics == Semantics::UNKOWN) {
+    return -1;
+  }
+  auto known =
+      find(object.surfaces.begin(), object.surfaces.end(), semantics);
+  if (known == object.surfaces.end()) {
+    object.surfaces.push_back(semantics);
+    return object.surfaces.size() - 1;
+  }
+  return known - object.surfaces.begin();
+}
+
+const vec<double> CITYJSON_SCALE = {0.001, 0.001, 0.001};
+const vec<double> CITYJSON_TRANSLATE = {0, 0, 0};
+const string PARENT_BUILDING_KEY = "obj_parent_building";
+
+// Extra "attributes" of city objects, by city object key
+typedef map<string, json> CityObjectAttributes;
+
+string room_object_key(RoomID room_id) {
+  return "objroom" + to_string(room_id);
+}
+
+// The city objects of a grid and the vertices they refer to
+struct VoxelCityObjects {
+  vec<CityObjectVoxels> objects; // in order of their first voxel
+  vec<int> vertices;             // quantised x, y, z of every vertex in turn
+};
+
+// Groups the INTERSECTED voxels of the grid into city objects: every room is
+// an object of its own, everything else is grouped by city object type.
+// Voxels that share a corner share its vertex. The grid is a VoxelGrid or
+// VoxelRuns.
+template <typename Grid>
+VoxelCityObjects collect_city_objects(const Grid &vg, ExportMesh mesh) {
+  // Quantised coordinate of every lattice plane
+  const unsigned int sizes[3] = {vg.size_x, vg.size_y, vg.size_z};
+  vec<int> lattice[3];
+  for (int axis = 0; axis < 3; axis++) {
+    assert(sizes[axis] < (1u << 21));
+    lattice[axis].resize(sizes[axis] + 1);
+    for (unsigned int i = 0; i <= sizes[axis]; i++) {
+      lattice[axis][i] = static_cast<int>(
+          (vg.offset_origin[axis] + i * vg.resolution -
+           CITYJSON_TRANSLATE[axis]) /
+          CITYJSON_SCALE[axis]);
+    }
+  }
+
+  VoxelCityObjects result;
+  vec<CityObjectVoxels> &objects = result.objects;
+  unordered_map<uint64_t, uint32_t> vertex_index;
+  auto vertex_of = [&](unsigned int cx, unsigned int cy, unsigned int cz) {
+    const auto inserted =
+        vertex_index.emplace(corner_key(cx, cy, cz), vertex_index.size());
+    if (inserted.second) {
+      result.vertices.push_back(lattice[0][cx]);
+      result.vertices.push_back(lattice[1][cy]);
+      result.vertices.push_back(lattice[2][cz]);
+    }
+    return inserted.first->second;
+  };
+  const string object_name_prefix = "obj";
+  unordered_map<uint64_t, uint32_t> object_index; // type and room id
+  for_each_voxel_with_labels(vg, {VoxelLabel::INTERSECTED}, [&](
+      unsigned int x, unsigned int y, unsigned int z) {
+    const VoxelInfo voxel = vg(x, y, z);
+    const bool is_room = voxel.city_object_type == CityObjectType::BuildingRoom;
+    const RoomID room_id = is_room ? vg.room_id(x, y, z) : 0;
+    const uint64_t object_id =
+        (uint64_t(voxel.city_object_type) << 32) | room_id;
+    auto found = object_index.find(object_id);
+    if (found == object_index.end()) {
+      found = object_index.emplace(object_id, objects.size()).first;
+      objects.emplace_back();
+      objects.back().type = voxel.city_object_type;
+      objects.back().key =
+          is_room ? room_object_key(room_id)
+                  : object_name_prefix +
+                        city_object_type_to_string(voxel.city_object_type);
+    }
+    CityObjectVoxels &object = objects[found->second];
+    if (mesh == ExportMesh::Greedy) {
+      return;
+    }
+
+    // Corner c of the voxel is offset by its bits (x, y, z)
+    for (unsigned int c = 0; c < 8; c++) {
+      const unsigned int cx = x + (c & 1), cy = y + ((c >> 1) & 1),
+                         cz = z + (c >> 2);
+      object.corners.push_back(vertex_of(cx, cy, cz));
+    }
+    object.voxel_surfaces.push_back(object_surface(object, voxel.semantics));
+  });
+
+  if (mesh == ExportMesh::Greedy) {
+    const auto quads = greedy_boundary_quads(
+        vg, [&](unsigned int x, unsigned int y, unsigned int z) {
+          const VoxelInfo voxel = vg(x, y, z);
+          if (voxel.label != VoxelLabel::INTERSECTED) {
+            return VoxelRegion{NO_REGION, 0};
+          }
+          const bool is_room =
+              voxel.city_object_type == CityObjectType::BuildingRoom;
+          const uint64_t object_id =
+              (uint64_t(voxel.city_object_type) << 32) |
+              (is_room ? vg.room_id(x, y, z) : 0);
+          return VoxelRegion{object_index.at(object_id),
+                             static_cast<uint8_t>(voxel.semantics)};
+        });
+    vec<vec<BoundaryQuad>> object_quads(objects.size());
+    for (const auto &quad : quads) {
+      object_quads[quad.region].push_back(quad);
+    }
+    vec<RegionShells> shells(objects.size());
+    parallel_for_chunks(0, objects.size(), 0,
+                        [&](size_t begin, size_t end, size_t) {
+      for (size_t i = begin; i < end; i++) {
+        shells[i] = region_shells(object_quads[i]);
+      }
+    }, 1);
+    unsigned int corner[3];
+    for (size_t i = 0; i < objects.size(); i++) {
+      CityObjectVoxels &object = objects[i];
+      for (const uint64_t key : shells[i].ring_corners) {
+        corner_of_key(key, corner);
+        object.ring_vertices.push_back(
+            vertex_of(corner[0], corner[1], corner[2]));
+      }
+      for (const uint32_t q : shells[i].ring_quad) {
+        object.quad_surfaces.push_back(object_surface(
+            object, static_cast<Semantics>(object_quads[i][q].tag)));
+      }
+      object.ring_begin = move(shells[i].ring_begin);
+      object.shell_begin = move(shells[i].shell_begin);
+      object.solid_begin = move(shells[i].solid_begin);
+    }
+  }
+  return result;
+}
+
+// CityJSON geometry type of a city object: a Solid for the greedy boundary of
+// one connected part, a CompositeSolid of the parts or of the voxels otherwise
+string geometry_type(const CityObjectVoxels &object, ExportMesh mesh) {
+  return mesh == ExportMesh::Greedy && object.solid_begin.size() == 2
+             ? "Solid"
+             : "CompositeSolid";
+}
+
+// With ExportMesh::Voxels every voxel is a solid of a CompositeSolid. With
+// ExportMesh::Greedy the boundary of each connected part of a city object is
+// a solid, an outer shell and a shell around every cavity, with coplanar
+// faces of equal semantics merged into rectangles. The rings of the
+// rectangles also run through the corners of their neighbours, so every edge
+// is shared by exactly two rings.
+template <typename Grid>
+json export_voxel_to_cityjson(const Grid &vg,
+                              ExportMesh mesh = ExportMesh::Voxels,
+                              const CityObjectAttributes &attributes = {}) {
   json j;
   j["type"] = "CityJSON";
   j["version"] = "2.0";
   j["CityObjects"] = json::object();
   j["vertices"] = json::array();
   j["transform"] = json::object();
-  j["transform"]["scale"] = scale;
-  j["transform"]["translate"] = translate;
+  j["transform"]["scale"] = CITYJSON_SCALE;
+  j["transform"]["translate"] = CITYJSON_TRANSLATE;
   j["metadata"] = json::object();
   j["metadata"]["identifier"] = "hw3";
   j["extensions"] = json::object();
@@ -105,178 +291,625 @@ json export_voxel_to_cityjson(VoxelGrid &vg) {
       city_object_type_to_string(CityObjectType::Building);
   parent_building["geometry"] = json::array();
   parent_building["children"] = json::array();
-  const string parent_building_key = "obj_parent_building";
 
-  map<string, int> uniqueVertices;
-  vec<vec<int>> vertices;
-  const string object_name_prefix = "obj";
-  map<string, json> semantics_surfaces;
-  map<string, json> semantics_values;
-  for (unsigned int x = 0; x < vg.voxels.size(); ++x) {
-    for (unsigned int y = 0; y < vg.voxels[x].size(); ++y) {
-      for (unsigned int z = 0; z < vg.voxels[x][y].size(); ++z) {
-
-        auto voxel_label = vg.voxels[x][y][z].label;
-        auto city_object_type = vg.voxels[x][y][z].city_object_type;
-        auto room_id = vg.voxels[x][y][z].room_id;
-
-        auto semantics = vg.voxels[x][y][z].semantics;
-
-        if (voxel_label == VoxelLabel::INTERSECTED) {
-          double min_x = vg.offset_origin[0] + x * vg.resolution;
-          double min_y = vg.offset_origin[1] + y * vg.resolution;
-          double min_z = vg.offset_origin[2] + z * vg.resolution;
-          double max_x = min_x + vg.resolution;
-          double max_y = min_y + vg.resolution;
-          double max_z = min_z + vg.resolution;
-          vec<vec<double>> voxel_vertices = {
-              {min_x, min_y, min_z}, {max_x, min_y, min_z},
-              {min_x, max_y, min_z}, {max_x, max_y, min_z},
-              {min_x, min_y, max_z}, {max_x, min_y, max_z},
-              {min_x, max_y, max_z}, {max_x, max_y, max_z}};
-
-          vec<vec<int>> transformed_voxel_vertices = {
-              rev_transform(voxel_vertices[0], scale, translate),
-              rev_transform(voxel_vertices[1], scale, translate),
-              rev_transform(voxel_vertices[2], scale, translate),
-              rev_transform(voxel_vertices[3], scale, translate),
-              rev_transform(voxel_vertices[4], scale, translate),
-              rev_transform(voxel_vertices[5], scale, translate),
-              rev_transform(voxel_vertices[6], scale, translate),
-              rev_transform(voxel_vertices[7], scale, translate)};
-          // indices to vertices. Orientation is CCW so that normal vector of
-          // cube direct outward
-          vec<vec<int>> voxel_faces = {{0, 2, 3, 1}, {4, 5, 7, 6},
-                                       {0, 1, 5, 4}, {2, 6, 7, 3},
-                                       {1, 3, 7, 5}, {0, 4, 6, 2}};
-          map<int, int> vertex_map; // {old_index: new_index}
-          for (const auto &v : transformed_voxel_vertices) {
-            string key =
-                to_string(v[0]) + "," + to_string(v[1]) + "," + to_string(v[2]);
-            if (uniqueVertices.count(key) == 0) { // Vertex not yet in the map
-              vertices.push_back({v[0], v[1], v[2]});
-              int new_index = vertices.size() - 1;
-              uniqueVertices[key] = new_index;
-              vertex_map[&v - &transformed_voxel_vertices[0]] = new_index;
-            } else { // Vertex already exists, use its index
-              vertex_map[&v - &transformed_voxel_vertices[0]] =
-                  uniqueVertices[key];
-            }
+  const VoxelCityObjects collected = collect_city_objects(vg, mesh);
+  for (const auto &object : collected.objects) {
+    json boundaries = json::array();
+    // This is because CityJSON defines values should be an array of
+    // arrays in case "type" is CompositeSolid
+    json values = json::array();
+    for (size_t s = 0; s + 1 < object.solid_begin.size(); s++) {
+      json solid = json::array();
+      json solid_values = json::array();
+      for (uint32_t shell = object.solid_begin[s];
+           shell < object.solid_begin[s + 1]; shell++) {
+        json shell_boundary = json::array();
+        json shell_values = json::array();
+        for (uint32_t q = object.shell_begin[shell];
+             q < object.shell_begin[shell + 1]; q++) {
+          json ring = json::array();
+          for (uint32_t i = object.ring_begin[q]; i < object.ring_begin[q + 1];
+               i++) {
+            ring.push_back(object.ring_vertices[i]);
           }
+          shell_boundary.push_back(json::array({move(ring)}));
+          const int surface = object.quad_surfaces[q];
+          shell_values.push_back(surface < 0 ? json(nullptr) : json(surface));
+        }
+        solid.push_back(move(shell_boundary));
+        solid_values.push_back(move(shell_values));
+      }
+      boundaries.push_back(move(solid));
+      values.push_back(move(solid_values));
+    }
+    if (geometry_type(object, mesh) == "Solid") {
+      // A Solid is just the shells of its one solid
+      boundaries = json(boundaries[0]);
+      values = json(values[0]);
+    }
+    for (size_t v = 0; v < object.voxel_surfaces.size(); v++) {
+      const uint32_t *corners = &object.corners[8 * v];
+      json outer_shell_boundary = json::array();
+      for (const auto &face : VOXEL_FACES) {
+        // inner face doesn't exist as it's voxel
+        outer_shell_boundary.push_back(json::array(
+            {{corners[face[0]], corners[face[1]], corners[face[2]],
+              corners[face[3]]}}));
+      }
+      // inner shell doesn't exist as it's voxel
+      boundaries.push_back(json::array({move(outer_shell_boundary)}));
+      const int surface = object.voxel_surfaces[v];
+      json inner_values = json::array();
+      for (int i = 0; i < 6; i++) {
+        inner_values.push_back(surface < 0 ? json(nullptr) : json(surface));
+      }
+      values.push_back(move(inner_values));
+    }
+    json surfaces;
+    for (const Semantics semantics : object.surfaces) {
+      json sem_obj = json::object();
+      sem_obj["type"] = semantics_to_string(semantics);
+      surfaces.push_back(sem_obj);
+    }
 
-          vec<vec<vec<vec<int>>>> solid_boundary;
-          vec<vec<vec<int>>> outer_shell_boundary;
-
-          for (const auto &face : voxel_faces) {
-            vec<vec<int>> face_boundary;
-            vec<int> outer_face_indices;
-            for (const auto &vertex_index : face) {
-              outer_face_indices.push_back(vertex_map[vertex_index]);
-            }
-            // inner face doesn't exist as it's voxel
-            face_boundary.push_back(outer_face_indices);
-            outer_shell_boundary.push_back(face_boundary);
-          }
-          solid_boundary.push_back(
-              outer_shell_boundary); // inner shell doesn't exist as it's voxel
-
-          // check if there is already a city object whose key looks like
-          // "obj{voxel_label}". If exist, add the voxel boundary to the
-          // existing city object. If not exist, create a new city object.
-          string city_object_key;
-          if (city_object_type == CityObjectType::BuildingRoom) {
-            city_object_key = object_name_prefix + "room" + to_string(room_id);
-
-          } else if (!(city_object_type == CityObjectType::UNKOWN)) {
-            city_object_key = object_name_prefix +
-                              city_object_type_to_string(city_object_type);
-          } else {
-            city_object_key = object_name_prefix +
-                              city_object_type_to_string(city_object_type);
-          }
+    json lod3_geometry = json::object();
+    lod3_geometry["type"] = geometry_type(object, mesh);
+    lod3_geometry["lod"] = "4";
+    lod3_geometry["boundaries"] = move(boundaries);
+    lod3_geometry["semantics"] = json::object();
+    lod3_geometry["semantics"]["values"] = move(values);
+    lod3_geometry["semantics"]["surfaces"] = move(surfaces);
+    json city_object;
+    city_object["type"] =
+        city_object_type_to_string(object.type); // TODO: check later
+    city_object["geometry"].push_back(move(lod3_geometry));
+    city_object["parents"] = json::array({PARENT_BUILDING_KEY});
+    const auto found = attributes.find(object.key);
+    if (found != attributes.end()) {
+      city_object["attributes"] = found->second;
+    }
+    parent_building["children"].push_back(object.key);
+    j["CityObjects"][object.key] = move(city_object);
+  }
 
-          if (semantics != Semantics::UNKOWN) {
-            // check if semantics already exist
-            if (semantics_surfaces.find(city_object_key) ==
-                semantics_surfaces.end()) {
-              semantics_surfaces[city_object_key] = json::array();
-              semantics_values[city_object_key] = json::array();
-            }
-
-            string sem_str = semantics_to_string(semantics);
-
-            auto found = find_if(semantics_surfaces[city_object_key].begin(),
-                                 semantics_surfaces[city_object_key].end(),
-                                 [sem_str](const auto &obj) {
-                                   if (obj.contains("type")) {
-                                     return obj["type"] == sem_str;
-                                   }
-                                   return false;
-                                 });
-
-            if (found == semantics_surfaces[city_object_key].end()) {
-              json sem_obj = json::object();
-              sem_obj["type"] = sem_str;
-              semantics_surfaces[city_object_key].push_back(sem_obj);
-              // This is because CityJSON defines values should be an array of
-              // arrays in case "type" is CompositeSolid
-              vec<int> inner_values;
-              for (int i = 0; i < 6; i++) {
-                inner_values.push_back(
-                    semantics_surfaces[city_object_key].size() - 1);
-              }
-              semantics_values[city_object_key].push_back(inner_values);
-            } else {
-              // add the index of the existing semantics
-              vec<int> inner_values;
-              for (int i = 0; i < 6; i++) {
-                inner_values.push_back(
-                    found - semantics_surfaces[city_object_key].begin());
-              }
-              semantics_values[city_object_key].push_back(inner_values);
-            }
-          } else {
-            json inner_values = json::array();
-            for (int i = 0; i < 6; i++) {
-              inner_values.push_back(nullptr);
-            }
-            semantics_values[city_object_key].push_back(inner_values);
-          }
+  j["CityObjects"][PARENT_BUILDING_KEY] = parent_building;
 
-          if (j["CityObjects"].find(city_object_key) !=
-              j["CityObjects"].end()) {
-            j["CityObjects"][city_object_key]["geometry"][0]["boundaries"]
-                .push_back(solid_boundary);
-          } else {
-            json city_object;
-            city_object["type"] = city_object_type_to_string(
-                city_object_type); // TODO: check later
-            json lod3_geometry = json::object();
-            lod3_geometry["type"] = "CompositeSolid";
-            lod3_geometry["lod"] = "4";
-            lod3_geometry["boundaries"] = json::array();
-            lod3_geometry["boundaries"].push_back(solid_boundary);
-            city_object["geometry"].push_back(lod3_geometry);
-            city_object["parents"] = json::array({parent_building_key});
-            parent_building["children"].push_back(city_object_key);
-            j["CityObjects"][city_object_key] = city_object;
-          }
+  json vertices = json::array();
+  for (size_t i = 0; i < collected.vertices.size(); i += 3) {
+    vertices.push_back({collected.vertices[i], collected.vertices[i + 1],
+                        collected.vertices[i + 2]});
+  }
+  j["vertices"] = move(vertices);
+
+  return j;
+}
+
+// Writes JSON text straight to a stream through a buffer, laid out exactly
+// like json::dump with the same indent (-1 for compact output), so large
+// documents never have to exist as a json value. Object keys are written in
+// the order they are given; dump() sorts them.
+class JsonWriter {
+public:
+  explicit JsonWriter(ostream &out, int indent = -1)
+      : out(out), indent(indent) {
+    buffer.reserve(FLUSH_SIZE + 256);
+  }
+
+  ~JsonWriter() { flush(); }
+
+  void begin_object() { open('{'); }
+  void end_object() { close('}'); }
+  void begin_array() { open('['); }
+  void end_array() { close(']'); }
+
+  void key(const string &name) {
+    separate();
+    quoted(name);
+    buffer += indent >= 0 ? ": " : ":";
+    after_key = true;
+  }
+
+  void integer(long long value) {
+    separate();
+    char digits[24];
+    const auto end = to_chars(digits, digits + sizeof(digits), value).ptr;
+    buffer.append(digits, end);
+    flush_if_full();
+  }
+
+  // Shortest representation that reads back exactly; whole numbers keep a
+  // ".0" like dump() writes them
+  void number(double value) {
+    separate();
+    char digits[32];
+    const auto end = to_chars(digits, digits + sizeof(digits), value).ptr;
+    buffer.append(digits, end);
+    if (find_if(digits, end, [](char c) {
+          return c == '.' || c == 'e' || c == 'n' || c == 'i';
+        }) == end) {
+      buffer += ".0";
+    }
+    flush_if_full();
+  }
+
+  void text(const string &value) {
+    separate();
+    quoted(value);
+    flush_if_full();
+  }
+
+  void null() {
+    separate();
+    buffer += "null";
+    flush_if_full();
+  }
+
+  // Any json value, laid out the way dump() lays it out
+  void value(const json &j) {
+    switch (j.type()) {
+    case json::value_t::object:
+      begin_object();
+      for (const auto &member : j.items()) {
+        key(member.key());
+        value(member.value());
+      }
+      end_object();
+      break;
+    case json::value_t::array:
+      begin_array();
+      for (const auto &element : j) {
+        value(element);
+      }
+      end_array();
+      break;
+    case json::value_t::string:
+      text(j.get_ref<const string &>());
+      break;
+    case json::value_t::boolean:
+      separate();
+      buffer += j.get<bool>() ? "true" : "false";
+      break;
+    case json::value_t::number_integer:
+    case json::value_t::number_unsigned:
+      integer(j.get<long long>());
+      break;
+    case json::value_t::number_float:
+      number(j.get<double>());
+      break;
+    default:
+      null();
+    }
+  }
+
+  // Ends a top-level value, e.g. one line of JSON Lines
+  void end_line() {
+    assert(open_has_elements.empty());
+    buffer += '\n';
+    flush_if_full();
+  }
+
+  void flush() {
+    out.write(buffer.data(), buffer.size());
+    buffer.clear();
+  }
+
+private:
+  static const size_t FLUSH_SIZE = 1 << 16;
+
+  ostream &out;
+  int indent;
+  string buffer;
+  // Whether each open object or array has an element yet
+  vec<bool> open_has_elements;
+  bool after_key = false;
+
+  // Comma and line break before an element, nothing after a key
+  void separate() {
+    if (after_key) {
+      after_key = false;
+      return;
+    }
+    if (open_has_elements.empty()) {
+      return;
+    }
+    if (open_has_elements.back()) {
+      buffer += ',';
+    }
+    open_has_elements.back() = true;
+    line_break();
+  }
+
+  void line_break() {
+    if (indent >= 0) {
+      buffer += '\n';
+      buffer.append(static_cast<size_t>(indent) * open_has_elements.size(),
+                    ' ');
+    }
+  }
+
+  void open(char bracket) {
+    separate();
+    buffer += bracket;
+    open_has_elements.push_back(false);
+  }
+
+  void close(char bracket) {
+    const bool any = open_has_elements.back();
+    open_has_elements.pop_back();
+    if (any) {
+      line_break();
+    }
+    buffer += bracket;
+    flush_if_full();
+  }
+
+  // Escaped like dump(): the short escapes where JSON has them, \u00xx for
+  // the other control characters
+  void quoted(const string &value) {
+    buffer += '"';
+    for (const char c : value) {
+      switch (c) {
+      case '"':
+        buffer += "\\\"";
+        break;
+      case '\\':
+        buffer += "\\\\";
+        break;
+      case '\b':
+        buffer += "\\b";
+        break;
+      case '\f':
+        buffer += "\\f";
+        break;
+      case '\n':
+        buffer += "\\n";
+        break;
+      case '\r':
+        buffer += "\\r";
+        break;
+      case '\t':
+        buffer += "\\t";
+        break;
+      default:
+        if (static_cast<unsigned char>(c) < 0x20) {
+          char escaped[8];
+          snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+          buffer += escaped;
+        } else {
+          buffer += c;
+        }
+      }
+    }
+    buffer += '"';
+  }
+
+  void flush_if_full() {
+    if (buffer.size() >= FLUSH_SIZE) {
+      flush();
+    }
+  }
+};
+
+// The "metadata", "transform" etc. members shared by a CityJSON document and
+// the first line of a CityJSONSeq, from "extensions" up to "version"
+void write_cityjson_header(JsonWriter &writer) {
+  writer.key("extensions");
+  writer.begin_object();
+  writer.end_object();
+  writer.key("metadata");
+  writer.begin_object();
+  writer.key("identifier");
+  writer.text("hw3");
+  writer.end_object();
+  writer.key("transform");
+  writer.begin_object();
+  writer.key("scale");
+  writer.begin_array();
+  for (const double scale : CITYJSON_SCALE) {
+    writer.number(scale);
+  }
+  writer.end_array();
+  writer.key("translate");
+  writer.begin_array();
+  for (const double translate : CITYJSON_TRANSLATE) {
+    writer.number(translate);
+  }
+  writer.end_array();
+  writer.end_object();
+  writer.key("type");
+  writer.text("CityJSON");
+  writer.key("version");
+  writer.text("2.0");
+}
+
+// One city object, as export_voxel_to_cityjson builds it. vertex_id maps the
+// vertex indices of the object to the indices written.
+template <typename VertexId>
+void write_city_object(JsonWriter &writer, const CityObjectVoxels &object,
+                       ExportMesh mesh, const json *attributes,
+                       VertexId vertex_id) {
+  auto write_ring = [&](const uint32_t *corners, const int *order) {
+    writer.begin_array();
+    writer.begin_array();
+    for (int i = 0; i < 4; i++) {
+      writer.integer(vertex_id(corners[order[i]]));
+    }
+    writer.end_array();
+    writer.end_array();
+  };
+  auto write_surface = [&](int surface) {
+    if (surface < 0) {
+      writer.null();
+    } else {
+      writer.integer(surface);
+    }
+  };
+  const bool is_solid = geometry_type(object, mesh) == "Solid";
+  // The shells of solid s, or their semantics values
+  auto write_solid = [&](size_t s, bool values) {
+    if (!is_solid) {
+      writer.begin_array();
+    }
+    for (uint32_t shell = object.solid_begin[s];
+         shell < object.solid_begin[s + 1]; shell++) {
+      writer.begin_array();
+      for (uint32_t q = object.shell_begin[shell];
+           q < object.shell_begin[shell + 1]; q++) {
+        if (values) {
+          write_surface(object.quad_surfaces[q]);
+          continue;
+        }
+        writer.begin_array();
+        writer.begin_array();
+        for (uint32_t i = object.ring_begin[q]; i < object.ring_begin[q + 1];
+             i++) {
+          writer.integer(vertex_id(object.ring_vertices[i]));
         }
+        writer.end_array();
+        writer.end_array();
       }
+      writer.end_array();
+    }
+    if (!is_solid) {
+      writer.end_array();
+    }
+  };
+
+  writer.begin_object();
+  if (attributes != nullptr) {
+    writer.key("attributes");
+    writer.value(*attributes);
+  }
+  writer.key("geometry");
+  writer.begin_array();
+  writer.begin_object();
+  writer.key("boundaries");
+  writer.begin_array();
+  for (size_t s = 0; s + 1 < object.solid_begin.size(); s++) {
+    write_solid(s, false);
+  }
+  for (size_t v = 0; v < object.voxel_surfaces.size(); v++) {
+    writer.begin_array();
+    writer.begin_array();
+    for (const auto &face : VOXEL_FACES) {
+      write_ring(&object.corners[8 * v], face);
+    }
+    writer.end_array();
+    writer.end_array();
+  }
+  writer.end_array();
+  writer.key("lod");
+  writer.text("4");
+  writer.key("semantics");
+  writer.begin_object();
+  writer.key("surfaces");
+  if (object.surfaces.empty()) {
+    writer.null();
+  } else {
+    writer.begin_array();
+    for (const Semantics semantics : object.surfaces) {
+      writer.begin_object();
+      writer.key("type");
+      writer.text(semantics_to_string(semantics));
+      writer.end_object();
     }
+    writer.end_array();
+  }
+  writer.key("values");
+  writer.begin_array();
+  for (size_t s = 0; s + 1 < object.solid_begin.size(); s++) {
+    write_solid(s, true);
   }
-  for (auto &[key, city_object] : j["CityObjects"].items()) {
-    city_object["geometry"][0]["semantics"] = json::object();
-    city_object["geometry"][0]["semantics"]["values"] = semantics_values[key];
-    city_object["geometry"][0]["semantics"]["surfaces"] =
-        semantics_surfaces[key];
+  for (const int surface : object.voxel_surfaces) {
+    writer.begin_array();
+    for (int i = 0; i < 6; i++) {
+      write_surface(surface);
+    }
+    writer.end_array();
   }
+  writer.end_array();
+  writer.end_object();
+  writer.key("type");
+  writer.text(geometry_type(object, mesh));
+  writer.end_object();
+  writer.end_array();
+  writer.key("parents");
+  writer.begin_array();
+  writer.text(PARENT_BUILDING_KEY);
+  writer.end_array();
+  writer.key("type");
+  writer.text(city_object_type_to_string(object.type));
+  writer.end_object();
+}
 
-  j["CityObjects"][parent_building_key] = parent_building;
+void write_parent_building(JsonWriter &writer,
+                           const vec<CityObjectVoxels> &objects) {
+  writer.begin_object();
+  writer.key("children");
+  writer.begin_array();
+  for (const auto &object : objects) {
+    writer.text(object.key);
+  }
+  writer.end_array();
+  writer.key("geometry");
+  writer.begin_array();
+  writer.end_array();
+  writer.key("type");
+  writer.text(city_object_type_to_string(CityObjectType::Building));
+  writer.end_object();
+}
 
-  j["vertices"] = vertices;
+// The objects of `objects` listed in `members` and, if requested, the parent
+// building, as the "CityObjects" member in sorted key order
+template <typename VertexId>
+void write_city_objects(JsonWriter &writer,
+                        const vec<CityObjectVoxels> &objects,
+                        const vec<uint32_t> &members, bool with_parent,
+                        ExportMesh mesh, const CityObjectAttributes &attributes,
+                        VertexId vertex_id) {
+  const uint32_t parent = numeric_limits<uint32_t>::max();
+  vec<uint32_t> order = members;
+  if (with_parent) {
+    order.push_back(parent);
+  }
+  auto key_of = [&](uint32_t i) -> const string & {
+    return i == parent ? PARENT_BUILDING_KEY : objects[i].key;
+  };
+  sort(order.begin(), order.end(),
+       [&](uint32_t a, uint32_t b) { return key_of(a) < key_of(b); });
+  writer.key("CityObjects");
+  writer.begin_object();
+  for (const uint32_t i : order) {
+    writer.key(key_of(i));
+    if (i == parent) {
+      write_parent_building(writer, objects);
+    } else {
+      const auto found = attributes.find(objects[i].key);
+      write_city_object(writer, objects[i], mesh,
+                        found == attributes.end() ? nullptr : &found->second,
+                        vertex_id);
+    }
+  }
+  writer.end_object();
+}
 
-  return j;
+// Streams the city objects of the grid as CityJSON without building a json
+// value. The voxels are grouped per object first, since objects interleave
+// in the grid, but only as vertex indices; the JSON text goes straight to
+// `out`. A Document with the same indent is byte for byte what
+// write_json(export_voxel_to_cityjson(vg, mesh, attributes)) writes. A Sequence is
+// CityJSONSeq: a CityJSON header line, then a CityJSONFeature line with its
+// own vertices for the building, with its parts and rooms, as a feature must
+// hold a parent and all its children. Sequence lines are always compact.
+template <typename Grid>
+void write_voxel_cityjson(ostream &out, const Grid &vg,
+                          ExportMesh mesh = ExportMesh::Voxels,
+                          CityJSONFormat format = CityJSONFormat::Document,
+                          int indent = -1,
+                          const CityObjectAttributes &attributes = {}) {
+  StageTimer stage("write_cityjson");
+  const VoxelCityObjects collected = collect_city_objects(vg, mesh);
+  const vec<CityObjectVoxels> &objects = collected.objects;
+  const vec<int> &vertices = collected.vertices;
+  if (metrics_enabled()) {
+    size_t faces = 0;
+    for (const auto &object : objects) {
+      faces += mesh == ExportMesh::Greedy ? object.quad_surfaces.size()
+                                          : object.corners.size() / 8 * 6;
+    }
+    add_metric_counter("city_objects", objects.size());
+    add_metric_counter("vertices", vertices.size() / 3);
+    add_metric_counter("faces", faces);
+  }
+  auto write_vertex = [&](JsonWriter &writer, uint32_t v) {
+    writer.begin_array();
+    for (int i = 0; i < 3; i++) {
+      writer.integer(vertices[3 * v + i]);
+    }
+    writer.end_array();
+  };
+
+  if (format == CityJSONFormat::Document) {
+    JsonWriter writer(out, indent);
+    vec<uint32_t> all(objects.size());
+    for (uint32_t i = 0; i < all.size(); i++) {
+      all[i] = i;
+    }
+    writer.begin_object();
+    write_city_objects(writer, objects, all, true, mesh, attributes,
+                       [](uint32_t v) { return v; });
+    write_cityjson_header(writer);
+    writer.key("vertices");
+    writer.begin_array();
+    for (uint32_t v = 0; v < vertices.size() / 3; v++) {
+      write_vertex(writer, v);
+    }
+    writer.end_array();
+    writer.end_object();
+    writer.end_line();
+    return;
+  }
+
+  JsonWriter writer(out);
+  writer.begin_object();
+  writer.key("CityObjects");
+  writer.begin_object();
+  writer.end_object();
+  write_cityjson_header(writer);
+  writer.key("vertices");
+  writer.begin_array();
+  writer.end_array();
+  writer.end_object();
+  writer.end_line();
+
+  // The building and its parts and rooms form one feature: CityJSONSeq keeps
+  // a parent and all its children together. Vertices are numbered in order
+  // of first use.
+  const uint32_t unused = numeric_limits<uint32_t>::max();
+  vec<uint32_t> local_id(vertices.size() / 3, unused);
+  vec<uint32_t> feature_vertices;
+  auto vertex_id = [&](uint32_t v) {
+    if (local_id[v] == unused) {
+      local_id[v] = feature_vertices.size();
+      feature_vertices.push_back(v);
+    }
+    return local_id[v];
+  };
+  vec<uint32_t> members(objects.size());
+  for (uint32_t i = 0; i < members.size(); i++) {
+    members[i] = i;
+  }
+  writer.begin_object();
+  write_city_objects(writer, objects, members, true, mesh, attributes,
+                     vertex_id);
+  writer.key("id");
+  writer.text(PARENT_BUILDING_KEY);
+  writer.key("type");
+  writer.text("CityJSONFeature");
+  writer.key("vertices");
+  writer.begin_array();
+  for (const uint32_t v : feature_vertices) {
+    write_vertex(writer, v);
+  }
+  writer.end_array();
+  writer.end_object();
+  writer.end_line();
+}
+
+template <typename Grid>
+bool write_voxel_cityjson(const string &filename, const Grid &vg,
+                          ExportMesh mesh = ExportMesh::Voxels,
+                          CityJSONFormat format = CityJSONFormat::Document,
+                          int indent = -1,
+                          const CityObjectAttributes &attributes = {}) {
+  ofstream out(filename, ios::binary);
+  if (!out.is_open()) {
+    return false;
+  }
+  write_voxel_cityjson(out, vg, mesh, format, indent, attributes);
+  out.close();
+  progress() << "file written" << endl;
+  return true;
 }
 
 #endif
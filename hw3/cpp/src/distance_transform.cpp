@@ -0,0 +1,333 @@
+#ifndef DISTANCE_TRANSFORM_H
+#define DISTANCE_TRANSFORM_H
+
+#include "bitgrid.cpp"
+#include "metrics.cpp"
+#include "parallel.cpp"
+#include "types.h"
+#include "voxelgrid.cpp"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+
+// Squared Euclidean distance transform of a voxel layer and the gap closing
+// built on it. The transform is separable: a 1D pass along z, then y, then x,
+// each computing the lower envelope of the parabolas rooted at the samples
+// (Felzenszwalb & Huttenlocher), so the whole grid costs linear time.
+//
+// Gaps are closed by thickening the walls before the labelling and thinning
+// them again afterwards: close_gaps seals every voxel near the geometry,
+// reopen_gaps gives back the ones that do not separate two regions. Rooms
+// can then be told apart at a resolution too coarse to resolve their walls
+// without holes.
+
+// Distance of a voxel that has no site at all
+const uint32_t EDT_INFINITY = numeric_limits<uint32_t>::max();
+
+// Scratch space of one thread for distance_transform_1d
+struct EnvelopeBuffers {
+    vec<uint32_t> values; // copy of the input line
+    vec<long long> sites; // positions of the parabolas of the envelope
+    vec<long long> roots; // values at those positions
+    vec<double> bounds;   // where each parabola starts to be the lowest
+
+    void reserve(size_t n) {
+        values.resize(n);
+        sites.resize(n);
+        roots.resize(n);
+        bounds.resize(n + 1);
+    }
+};
+
+// Replaces the n samples data[0], data[stride], ... by
+// min over p of (q - p)^2 + data[p], skipping samples of EDT_INFINITY
+void distance_transform_1d(uint32_t *data, size_t n, size_t stride,
+                           EnvelopeBuffers &buffers) {
+    for (size_t q = 0; q < n; q++) {
+        buffers.values[q] = data[q * stride];
+    }
+    const double infinity = numeric_limits<double>::infinity();
+    int k = -1;
+    auto add_site = [&](long long p, long long value) {
+        double start = -infinity;
+        while (k >= 0) {
+            const long long s = buffers.sites[k];
+            start = ((value + p * p) - (buffers.roots[k] + s * s)) /
+                    (2.0 * (p - s));
+            if (start > buffers.bounds[k]) {
+                break;
+            }
+            k--;
+        }
+        k++;
+        buffers.sites[k] = p;
+        buffers.roots[k] = value;
+        buffers.bounds[k] = k == 0 ? -infinity : start;
+        buffers.bounds[k + 1] = infinity;
+    };
+    for (size_t p = 0; p < n; p++) {
+        if (buffers.values[p] != EDT_INFINITY) {
+            add_site(p, buffers.values[p]);
+        }
+    }
+    if (k < 0) {
+        return; // no sites, everything stays infinite
+    }
+    int j = 0;
+    for (size_t q = 0; q < n; q++) {
+        while (buffers.bounds[j + 1] < q) {
+            j++;
+        }
+        const long long offset = static_cast<long long>(q) - buffers.sites[j];
+        const long long distance = offset * offset + buffers.roots[j];
+        data[q * stride] = distance >= EDT_INFINITY
+                           ? EDT_INFINITY - 1
+                           : static_cast<uint32_t>(distance);
+    }
+}
+
+// In-place squared distance transform of a grid of sx * sy * sz values in
+// x, y, z scan order (see scan_index). Sites are 0 and everything else
+// EDT_INFINITY on input; on output every voxel holds its squared distance, in
+// voxels, to the nearest site.
+void squared_distance_transform(vec<uint32_t> &distance, unsigned int sx,
+                                unsigned int sy, unsigned int sz,
+                                unsigned int num_threads) {
+    const size_t slice = static_cast<size_t>(sy) * sz;
+    // z and y lines lie within one x slab, x lines within one y slab
+    parallel_for_chunks(0, sx, num_threads, [&](size_t x_begin, size_t x_end,
+                                                size_t) {
+        EnvelopeBuffers buffers;
+        buffers.reserve(max(sy, sz));
+        for (size_t x = x_begin; x < x_end; x++) {
+            for (unsigned int y = 0; y < sy; y++) {
+                distance_transform_1d(&distance[x * slice + y * sz], sz, 1, buffers);
+            }
+            for (unsigned int z = 0; z < sz; z++) {
+                distance_transform_1d(&distance[x * slice + z], sy, sz, buffers);
+            }
+        }
+    });
+    parallel_for_chunks(0, sy, num_threads, [&](size_t y_begin, size_t y_end,
+                                                size_t) {
+        EnvelopeBuffers buffers;
+        buffers.reserve(sx);
+        for (size_t y = y_begin; y < y_end; y++) {
+            for (unsigned int z = 0; z < sz; z++) {
+                distance_transform_1d(&distance[y * sz + z], sx, slice, buffers);
+            }
+        }
+    });
+}
+
+// Seals gaps of up to `width` (model units) in the intersected voxels for
+// the labelling: every voxel within half the gap of an intersected voxel is
+// labelled INTERSECTED with ClosureSurface semantics, so that the exterior
+// cannot leak through a gap in a wall. The half gap is counted in whole
+// voxels, rounded up, so a gap of floor(width / resolution) voxels closes.
+// The voxels on the border of the grid are left open for the exterior to
+// start from. Returns the sealed voxels as scan indices, in scan order; most
+// of them are given back after the labelling by reopen_gaps.
+vec<size_t> close_gaps(VoxelGrid &vg, double width, unsigned int num_threads = 0) {
+    StageTimer stage("close_gaps");
+    const long long gap_voxels = static_cast<long long>(floor(width / vg.resolution));
+    const long long radius = (gap_voxels + 1) / 2;
+    vec<size_t> sealed;
+    if (radius < 1) {
+        return sealed;
+    }
+    const uint32_t radius_sq = static_cast<uint32_t>(radius * radius);
+    const VoxelGrid &stored = vg;
+    // num_voxels() counts the padding of brick layouts
+    vec<uint32_t> distance(static_cast<size_t>(vg.size_x) * vg.size_y * vg.size_z);
+    parallel_for_chunks(0, vg.size_x, num_threads, [&](size_t x_begin,
+                                                       size_t x_end, size_t) {
+        for (unsigned int x = x_begin; x < x_end; x++) {
+            for (unsigned int y = 0; y < vg.size_y; y++) {
+                for (unsigned int z = 0; z < vg.size_z; z++) {
+                    distance[scan_index(vg, x, y, z)] =
+                            stored(x, y, z).label == VoxelLabel::INTERSECTED
+                            ? 0 : EDT_INFINITY;
+                }
+            }
+        }
+    });
+    squared_distance_transform(distance, vg.size_x, vg.size_y, vg.size_z,
+                               num_threads);
+    for (size_t i = 0; i < distance.size(); i++) {
+        if (distance[i] == 0 || distance[i] > radius_sq) {
+            continue;
+        }
+        unsigned int x, y, z;
+        scan_index_to_xyz(vg, i, x, y, z);
+        if (x == 0 || y == 0 || z == 0 || x + 1 == vg.size_x ||
+            y + 1 == vg.size_y || z + 1 == vg.size_z) {
+            continue;
+        }
+        VoxelInfo &voxel = vg(x, y, z);
+        voxel.label = VoxelLabel::INTERSECTED;
+        voxel.semantics = Semantics::ClosureSurface;
+        sealed.push_back(i);
+    }
+    add_metric_counter("sealed_voxels", sealed.size());
+    return sealed;
+}
+
+// After labelling, gives the sealed voxels that do not separate anything back
+// to the regions they border, which undoes the thickening of the walls and
+// of rooms that were filled altogether. Sealed voxels are handed out
+// breadth-first from the labelled voxels: one that touches a single region (a
+// room or the exterior) joins it, and one that touches two stays sealed and
+// separates them, so that no two regions end up adjacent. A group of sealed
+// voxels that no region reaches was a room of its own and gets a new room id.
+// `sealed` is the result of close_gaps, and only those voxels are given back,
+// so geometry with ClosureSurface semantics stays; returns the number of
+// voxels given back.
+size_t reopen_gaps(VoxelGrid &vg, const vec<size_t> &sealed,
+                   Connectivity connectivity) {
+    StageTimer stage("reopen_gaps");
+    const VoxelGrid &stored = vg;
+    const vec<vec<int>> &offsets = connectivity_offsets(connectivity);
+    // The sealed voxels not given back yet
+    BitGrid still_sealed(vg.size_x, vg.size_y, vg.size_z);
+    for (const size_t index: sealed) {
+        unsigned int x, y, z;
+        scan_index_to_xyz(vg, index, x, y, z);
+        still_sealed.set(x, y, z);
+    }
+    // As int, to compare with the neighbour coordinates
+    const int size_x = static_cast<int>(vg.size_x),
+              size_y = static_cast<int>(vg.size_y),
+              size_z = static_cast<int>(vg.size_z);
+    auto for_each_neighbour = [&](size_t index, auto fn) {
+        unsigned int x, y, z;
+        scan_index_to_xyz(vg, index, x, y, z);
+        for (const auto &offset: offsets) {
+            const int adj_x = static_cast<int>(x) + offset[0];
+            const int adj_y = static_cast<int>(y) + offset[1];
+            const int adj_z = static_cast<int>(z) + offset[2];
+            if (adj_x < 0 || adj_y < 0 || adj_z < 0 || adj_x >= size_x ||
+                adj_y >= size_y || adj_z >= size_z) {
+                continue;
+            }
+            if (!fn(static_cast<unsigned int>(adj_x),
+                    static_cast<unsigned int>(adj_y),
+                    static_cast<unsigned int>(adj_z))) {
+                return;
+            }
+        }
+    };
+    auto give_back = [&](size_t index, VoxelLabel label, RoomID room_id) {
+        unsigned int x, y, z;
+        scan_index_to_xyz(vg, index, x, y, z);
+        VoxelInfo &voxel = vg(x, y, z);
+        voxel.label = label;
+        voxel.semantics = Semantics::UNKOWN;
+        vg.room_id(x, y, z) = room_id;
+        still_sealed.reset(x, y, z);
+    };
+
+    size_t reopened = 0;
+    vec<size_t> queue = sealed;
+    for (size_t head = 0; head < queue.size(); head++) {
+        const size_t index = queue[head];
+        unsigned int x, y, z;
+        scan_index_to_xyz(vg, index, x, y, z);
+        if (!still_sealed.test(x, y, z)) {
+            continue; // given back already
+        }
+        int regions = 0;
+        VoxelLabel label = VoxelLabel::UNLABELED;
+        RoomID room_id = 0;
+        for_each_neighbour(index, [&](unsigned int adj_x, unsigned int adj_y,
+                                      unsigned int adj_z) {
+            const VoxelLabel adj_label = stored(adj_x, adj_y, adj_z).label;
+            if (adj_label != VoxelLabel::EXTERIOR &&
+                adj_label != VoxelLabel::INTERIOR) {
+                return true;
+            }
+            const RoomID adj_room = adj_label == VoxelLabel::INTERIOR
+                                    ? stored.room_id(adj_x, adj_y, adj_z) : 0;
+            if (regions == 0) {
+                regions = 1;
+                label = adj_label;
+                room_id = adj_room;
+            } else if (adj_label != label || adj_room != room_id) {
+                regions = 2;
+                return false;
+            }
+            return true;
+        });
+        if (regions != 1) {
+            continue;
+        }
+        give_back(index, label, room_id);
+        reopened++;
+        for_each_neighbour(index, [&](unsigned int adj_x, unsigned int adj_y,
+                                      unsigned int adj_z) {
+            if (still_sealed.test(adj_x, adj_y, adj_z)) {
+                queue.push_back(scan_index(vg, adj_x, adj_y, adj_z));
+            }
+            return true;
+        });
+    }
+
+    // What is left are the separating seals and the rooms that were filled;
+    // the groups of sealed voxels without a labelled neighbour are the latter
+    RoomID next_room = 0;
+    for_each_stored_voxel(stored, [&](unsigned int x, unsigned int y,
+                                      unsigned int z) {
+        if (stored(x, y, z).label == VoxelLabel::INTERIOR) {
+            next_room = max(next_room, stored.room_id(x, y, z) + 1);
+        }
+    });
+    vec<bool> visited(sealed.size(), false);
+    auto sealed_position = [&](size_t index) {
+        return lower_bound(sealed.begin(), sealed.end(), index) - sealed.begin();
+    };
+    size_t new_rooms = 0;
+    for (size_t i = 0; i < sealed.size(); i++) {
+        unsigned int x, y, z;
+        scan_index_to_xyz(vg, sealed[i], x, y, z);
+        if (visited[i] || !still_sealed.test(x, y, z)) {
+            continue;
+        }
+        vec<size_t> group = {sealed[i]};
+        visited[i] = true;
+        bool labelled_neighbour = false;
+        for (size_t head = 0; head < group.size(); head++) {
+            for_each_neighbour(group[head], [&](unsigned int adj_x,
+                                                unsigned int adj_y,
+                                                unsigned int adj_z) {
+                const VoxelInfo adjacent = stored(adj_x, adj_y, adj_z);
+                if (adjacent.label == VoxelLabel::EXTERIOR ||
+                    adjacent.label == VoxelLabel::INTERIOR) {
+                    labelled_neighbour = true;
+                } else if (still_sealed.test(adj_x, adj_y, adj_z)) {
+                    const size_t position =
+                            sealed_position(scan_index(vg, adj_x, adj_y, adj_z));
+                    if (!visited[position]) {
+                        visited[position] = true;
+                        group.push_back(sealed[position]);
+                    }
+                }
+                return true;
+            });
+        }
+        if (labelled_neighbour) {
+            continue;
+        }
+        for (const size_t index: group) {
+            give_back(index, VoxelLabel::INTERIOR, next_room);
+        }
+        next_room++;
+        new_rooms++;
+        reopened += group.size();
+    }
+    add_metric_counter("reopened_voxels", reopened);
+    add_metric_counter("restored_rooms", new_rooms);
+    return reopened;
+}
+
+#endif
@@ -0,0 +1,464 @@
+#ifndef GREEDY_MESH_H
+#define GREEDY_MESH_H
+
+#include "parallel.cpp"
+#include "types.h"
+#include "voxelgrid.cpp"
+#include <algorithm>
+#include <array>
+#include <cstdint>
+
+// Boundary surfaces of labelled voxel regions, merged into rectangles.
+// Every voxel belongs to at most one region and carries a small tag (e.g.
+// its semantics). A voxel face is on the boundary of its region when the
+// voxel on the other side belongs to another region or to none. Boundary
+// faces in the same plane with the same region, tag and orientation are
+// merged greedily into maximal rectangles, so a flat wall becomes a handful
+// of quads instead of two faces per voxel.
+
+const uint32_t NO_REGION = numeric_limits<uint32_t>::max();
+
+struct VoxelRegion {
+    uint32_t region; // NO_REGION for voxels that are not exported
+    uint8_t tag;
+};
+
+struct BoundaryQuad {
+    uint32_t region;
+    uint8_t tag;
+    uint8_t axis;      // axis of the face normal
+    bool positive;     // whether the normal points towards +axis
+    unsigned int plane; // lattice coordinate along `axis`
+    // Lattice extent along the axes (axis + 1) % 3 and (axis + 2) % 3
+    unsigned int lo[2], hi[2];
+};
+
+// Packs the integer lattice coordinate of a voxel corner into one key
+inline uint64_t corner_key(unsigned int x, unsigned int y, unsigned int z) {
+    return (uint64_t(x) << 42) | (uint64_t(y) << 21) | z;
+}
+
+// Lattice coordinate of the voxel corner packed by corner_key
+inline void corner_of_key(uint64_t key, unsigned int corner[3]) {
+    const uint64_t mask = (uint64_t(1) << 21) - 1;
+    corner[0] = static_cast<unsigned int>(key >> 42);
+    corner[1] = static_cast<unsigned int>((key >> 21) & mask);
+    corner[2] = static_cast<unsigned int>(key & mask);
+}
+
+// Faces of a voxel as indices of its corners, where bits 0, 1 and 2 of a
+// corner index step along x, y and z. Orientation is CCW so that normal
+// vector of cube direct outward
+const int VOXEL_FACES[6][4] = {{0, 2, 3, 1}, {4, 5, 7, 6}, {0, 1, 5, 4},
+                               {2, 6, 7, 3}, {1, 3, 7, 5}, {0, 4, 6, 2}};
+
+// Lattice coordinates of the four corners of a quad, counter-clockwise seen
+// from the side its normal points to
+void quad_corners(const BoundaryQuad &quad, unsigned int corners[4][3]) {
+    const int u = (quad.axis + 1) % 3, v = (quad.axis + 2) % 3;
+    const unsigned int uv[4][2] = {{quad.lo[0], quad.lo[1]},
+                                   {quad.hi[0], quad.lo[1]},
+                                   {quad.hi[0], quad.hi[1]},
+                                   {quad.lo[0], quad.hi[1]}};
+    for (int i = 0; i < 4; i++) {
+        // (u, v, axis) is right-handed, so this order faces +axis
+        const int k = quad.positive ? i : 3 - i;
+        corners[i][quad.axis] = quad.plane;
+        corners[i][u] = uv[k][0];
+        corners[i][v] = uv[k][1];
+    }
+}
+
+// Packed region and tag of a voxel; 0 for no region
+inline uint64_t region_key(const VoxelRegion &voxel) {
+    return voxel.region == NO_REGION
+           ? 0
+           : ((static_cast<uint64_t>(voxel.region) + 1) << 8) | voxel.tag;
+}
+
+// Greedy merge of one plane of boundary faces. `mask` holds the region key of
+// every face (nu rows of nv faces) and is cleared on the way.
+void merge_plane(vec<uint64_t> &mask, unsigned int nu, unsigned int nv,
+                 uint8_t axis, bool positive, unsigned int plane,
+                 vec<BoundaryQuad> &quads) {
+    for (unsigned int iu = 0; iu < nu; iu++) {
+        for (unsigned int iv = 0; iv < nv; iv++) {
+            const uint64_t key = mask[static_cast<size_t>(iu) * nv + iv];
+            if (key == 0) {
+                continue;
+            }
+            unsigned int h = 1;
+            while (iv + h < nv && mask[static_cast<size_t>(iu) * nv + iv + h] == key) {
+                h++;
+            }
+            unsigned int w = 1;
+            while (iu + w < nu) {
+                const uint64_t *row = &mask[static_cast<size_t>(iu + w) * nv + iv];
+                bool same = true;
+                for (unsigned int k = 0; k < h && same; k++) {
+                    same = row[k] == key;
+                }
+                if (!same) {
+                    break;
+                }
+                w++;
+            }
+            for (unsigned int a = 0; a < w; a++) {
+                fill_n(&mask[static_cast<size_t>(iu + a) * nv + iv], h, 0);
+            }
+            BoundaryQuad quad;
+            quad.region = static_cast<uint32_t>((key >> 8) - 1);
+            quad.tag = key & 0xff;
+            quad.axis = axis;
+            quad.positive = positive;
+            quad.plane = plane;
+            quad.lo[0] = iu;
+            quad.lo[1] = iv;
+            quad.hi[0] = iu + w;
+            quad.hi[1] = iv + h;
+            quads.push_back(quad);
+        }
+    }
+}
+
+// Merged boundary faces of the regions given by region_of(x, y, z), which
+// returns a VoxelRegion. The planes of each axis are split over the threads;
+// the result is in the same order for any thread count. Only the shape of the
+// grid (a VoxelGrid or VoxelRuns) is used.
+template<typename Grid, typename RegionFn>
+vec<BoundaryQuad> greedy_boundary_quads(const Grid &vg, RegionFn region_of,
+                                        unsigned int num_threads = 0) {
+    const unsigned int sizes[3] = {vg.size_x, vg.size_y, vg.size_z};
+    vec<BoundaryQuad> quads;
+    for (uint8_t axis = 0; axis < 3; axis++) {
+        const int u = (axis + 1) % 3, v = (axis + 2) % 3;
+        const unsigned int nu = sizes[u], nv = sizes[v];
+        const size_t plane_size = static_cast<size_t>(nu) * nv;
+        // Region keys of the voxel layer at `slice` along the axis
+        auto read_layer = [&](unsigned int slice, vec<uint64_t> &keys) {
+            if (slice >= sizes[axis]) {
+                fill(keys.begin(), keys.end(), 0);
+                return;
+            }
+            unsigned int xyz[3];
+            xyz[axis] = slice;
+            for (unsigned int iu = 0; iu < nu; iu++) {
+                xyz[u] = iu;
+                for (unsigned int iv = 0; iv < nv; iv++) {
+                    xyz[v] = iv;
+                    keys[static_cast<size_t>(iu) * nv + iv] =
+                            region_key(region_of(xyz[0], xyz[1], xyz[2]));
+                }
+            }
+        };
+        // Planes 0..size lie between layer plane - 1 and layer plane
+        const unsigned int num_planes = sizes[axis] + 1;
+        vec<vec<BoundaryQuad>> chunk_quads(resolve_thread_count(num_threads));
+        parallel_for_chunks(0, num_planes, num_threads,
+                            [&](size_t begin, size_t end, size_t chunk) {
+            vec<uint64_t> below(plane_size), above(plane_size);
+            vec<uint64_t> positive(plane_size), negative(plane_size);
+            if (begin > 0) {
+                read_layer(begin - 1, below);
+            }
+            for (size_t plane = begin; plane < end; plane++) {
+                read_layer(plane, above);
+                bool any = false;
+                for (size_t i = 0; i < plane_size; i++) {
+                    const uint64_t b = below[i], a = above[i];
+                    positive[i] = 0;
+                    negative[i] = 0;
+                    if ((b >> 8) != (a >> 8)) {
+                        positive[i] = b;
+                        negative[i] = a;
+                        any = true;
+                    }
+                }
+                if (any) {
+                    merge_plane(positive, nu, nv, axis, true, plane,
+                                chunk_quads[chunk]);
+                    merge_plane(negative, nu, nv, axis, false, plane,
+                                chunk_quads[chunk]);
+                }
+                swap(below, above);
+            }
+        });
+        for (const auto &part: chunk_quads) {
+            quads.insert(quads.end(), part.begin(), part.end());
+        }
+    }
+    return quads;
+}
+
+// The boundary quads of one region as closed shells, grouped into solids
+struct RegionShells {
+    vec<uint64_t> ring_corners; // corner_key of every ring vertex, back to back
+    vec<uint32_t> ring_begin;   // first vertex of every ring, then the end
+    vec<uint32_t> ring_quad;    // quad every ring was made from
+    vec<uint32_t> shell_begin;  // first ring of every shell, then the end
+    vec<uint32_t> solid_begin;  // first shell of every solid, then the end
+};
+
+// Turns the quads of one region into rings that share whole edges: every
+// ring also passes through the corners of the other quads that lie on its
+// edges, which leaves no T-junctions. Rings that share an edge belong to the
+// same shell; where four rings meet at an edge (voxels touching only along
+// it), rings are paired up by the voxel they bound. A shell enclosing a
+// positive volume is the outer shell of a solid; one enclosing a negative
+// volume is a cavity and goes with the smallest outer shell around it, which
+// comes first in its solid.
+RegionShells region_shells(const vec<BoundaryQuad> &quads) {
+    const uint32_t num_quads = static_cast<uint32_t>(quads.size());
+    // Axis along which the edge from corner a to corner b runs
+    auto edge_axis = [](const unsigned int a[3], const unsigned int b[3]) {
+        return a[0] != b[0] ? 0 : (a[1] != b[1] ? 1 : 2);
+    };
+    // Key of the lattice line along axis d through corner c
+    auto line_key = [](const unsigned int c[3], int d) {
+        unsigned int on_line[3] = {c[0], c[1], c[2]};
+        on_line[d] = 0;
+        return corner_key(on_line[0], on_line[1], on_line[2]);
+    };
+
+    // Sorted positions of the quad corners on every line the quads have an
+    // edge on, per axis of the line
+    unordered_map<uint64_t, vec<unsigned int>> lines[3];
+    unsigned int corners[4][3];
+    for (const auto &quad : quads) {
+        quad_corners(quad, corners);
+        for (int i = 0; i < 4; i++) {
+            const unsigned int *a = corners[i], *b = corners[(i + 1) % 4];
+            const int d = edge_axis(a, b);
+            auto &line = lines[d][line_key(a, d)];
+            line.push_back(a[d]);
+            line.push_back(b[d]);
+        }
+    }
+    for (auto &axis_lines : lines) {
+        for (auto &line : axis_lines) {
+            sort(line.second.begin(), line.second.end());
+            line.second.erase(unique(line.second.begin(), line.second.end()),
+                              line.second.end());
+        }
+    }
+
+    vec<uint64_t> ring_corners;
+    vec<uint32_t> ring_begin;
+    for (const auto &quad : quads) {
+        ring_begin.push_back(static_cast<uint32_t>(ring_corners.size()));
+        quad_corners(quad, corners);
+        for (int i = 0; i < 4; i++) {
+            const unsigned int *a = corners[i], *b = corners[(i + 1) % 4];
+            ring_corners.push_back(corner_key(a[0], a[1], a[2]));
+            const int d = edge_axis(a, b);
+            const auto &line = lines[d].at(line_key(a, d));
+            unsigned int between[3] = {a[0], a[1], a[2]};
+            auto it = lower_bound(line.begin(), line.end(), a[d]);
+            if (a[d] < b[d]) {
+                while (*++it < b[d]) {
+                    between[d] = *it;
+                    ring_corners.push_back(
+                            corner_key(between[0], between[1], between[2]));
+                }
+            } else {
+                while (*--it > b[d]) {
+                    between[d] = *it;
+                    ring_corners.push_back(
+                            corner_key(between[0], between[1], between[2]));
+                }
+            }
+        }
+    }
+    ring_begin.push_back(static_cast<uint32_t>(ring_corners.size()));
+
+    // Rings at every edge, keyed by the two vertices of the edge
+    unordered_map<uint64_t, uint32_t> vertex_index;
+    vec<uint32_t> ring_vertex(ring_corners.size());
+    for (size_t i = 0; i < ring_corners.size(); i++) {
+        ring_vertex[i] = vertex_index.emplace(ring_corners[i],
+                                              vertex_index.size()).first->second;
+    }
+    // Each entry is a ring and the offset of the edge's first vertex in it
+    unordered_map<uint64_t, vec<pair<uint32_t, uint32_t>>> edge_rings;
+    for (uint32_t q = 0; q < num_quads; q++) {
+        for (uint32_t i = ring_begin[q]; i < ring_begin[q + 1]; i++) {
+            const uint32_t a = ring_vertex[i];
+            const uint32_t b = ring_vertex[i + 1 < ring_begin[q + 1]
+                                           ? i + 1 : ring_begin[q]];
+            edge_rings[(uint64_t(min(a, b)) << 32) | max(a, b)].emplace_back(q, i);
+        }
+    }
+
+    vec<uint32_t> parent(num_quads);
+    for (uint32_t q = 0; q < num_quads; q++) {
+        parent[q] = q;
+    }
+    auto find = [&](uint32_t q) {
+        while (parent[q] != q) {
+            parent[q] = parent[parent[q]];
+            q = parent[q];
+        }
+        return q;
+    };
+    auto unite = [&](uint32_t a, uint32_t b) {
+        a = find(a);
+        b = find(b);
+        parent[max(a, b)] = min(a, b);
+    };
+    // Quadrant around the edge holding the voxel behind the quad, as the
+    // signs along the quad's axis and the other axis across the edge
+    auto voxel_side = [&](uint32_t q, uint32_t vertex) {
+        const BoundaryQuad &quad = quads[q];
+        unsigned int a[3], b[3];
+        corner_of_key(ring_corners[vertex], a);
+        const uint32_t next = vertex + 1 < ring_begin[q + 1] ? vertex + 1
+                                                              : ring_begin[q];
+        corner_of_key(ring_corners[next], b);
+        const int across = 3 - quad.axis - edge_axis(a, b);
+        const int k = across == (quad.axis + 1) % 3 ? 0 : 1;
+        return (static_cast<int>(!quad.positive) << quad.axis) |
+               (static_cast<int>(quad.lo[k] == a[across]) << across);
+    };
+    for (const auto &edge : edge_rings) {
+        const auto &rings = edge.second;
+        if (rings.size() == 2) {
+            unite(rings[0].first, rings[1].first);
+            continue;
+        }
+        for (size_t i = 0; i < rings.size(); i++) {
+            for (size_t j = i + 1; j < rings.size(); j++) {
+                if (voxel_side(rings[i].first, rings[i].second) ==
+                    voxel_side(rings[j].first, rings[j].second)) {
+                    unite(rings[i].first, rings[j].first);
+                }
+            }
+        }
+    }
+
+    // Shells in order of their first ring, with their signed volume (from the
+    // x faces, by the divergence theorem) and bounding box
+    vec<uint32_t> shell_of(num_quads), shell_root;
+    for (uint32_t q = 0; q < num_quads; q++) {
+        const uint32_t root = find(q);
+        if (root == q) {
+            shell_of[q] = static_cast<uint32_t>(shell_root.size());
+            shell_root.push_back(q);
+        } else {
+            shell_of[q] = shell_of[root];
+        }
+    }
+    const size_t num_shells = shell_root.size();
+    vec<int64_t> volume(num_shells, 0);
+    vec<array<unsigned int, 6>> bbox(num_shells);
+    for (auto &box : bbox) {
+        box = {numeric_limits<unsigned int>::max(),
+               numeric_limits<unsigned int>::max(),
+               numeric_limits<unsigned int>::max(), 0, 0, 0};
+    }
+    vec<vec<uint32_t>> x_quads(num_shells);
+    for (uint32_t q = 0; q < num_quads; q++) {
+        const BoundaryQuad &quad = quads[q];
+        const uint32_t shell = shell_of[q];
+        quad_corners(quad, corners);
+        for (const auto &corner : corners) {
+            for (int axis = 0; axis < 3; axis++) {
+                bbox[shell][axis] = min(bbox[shell][axis], corner[axis]);
+                bbox[shell][3 + axis] = max(bbox[shell][3 + axis], corner[axis]);
+            }
+        }
+        if (quad.axis == 0) {
+            const int64_t area = int64_t(quad.hi[0] - quad.lo[0]) *
+                                 (quad.hi[1] - quad.lo[1]);
+            volume[shell] += (quad.positive ? 1 : -1) * area * quad.plane;
+            x_quads[shell].push_back(q);
+        }
+    }
+
+    // Owning outer shell of every shell, itself for the outer ones. The
+    // centre of the voxel behind a quad of a cavity, in half voxel units,
+    // is inside an outer shell if a ray along +x crosses it an odd number of
+    // times.
+    vec<uint32_t> owner(num_shells);
+    for (uint32_t shell = 0; shell < num_shells; shell++) {
+        owner[shell] = shell;
+        if (volume[shell] > 0) {
+            continue;
+        }
+        const BoundaryQuad &quad = quads[shell_root[shell]];
+        const int u = (quad.axis + 1) % 3, v = (quad.axis + 2) % 3;
+        int64_t point[3];
+        point[quad.axis] = 2 * int64_t(quad.plane) + (quad.positive ? -1 : 1);
+        point[u] = 2 * int64_t(quad.lo[0]) + 1;
+        point[v] = 2 * int64_t(quad.lo[1]) + 1;
+        int64_t smallest = numeric_limits<int64_t>::max();
+        for (uint32_t outer = 0; outer < num_shells; outer++) {
+            if (volume[outer] <= 0 || volume[outer] >= smallest) {
+                continue;
+            }
+            bool inside = true;
+            for (int axis = 0; axis < 3 && inside; axis++) {
+                inside = 2 * int64_t(bbox[outer][axis]) < point[axis] &&
+                         point[axis] < 2 * int64_t(bbox[outer][3 + axis]);
+            }
+            if (!inside) {
+                continue;
+            }
+            bool odd = false;
+            for (const uint32_t q : x_quads[outer]) {
+                const BoundaryQuad &face = quads[q];
+                odd ^= 2 * int64_t(face.plane) > point[0] &&
+                       2 * int64_t(face.lo[0]) < point[1] &&
+                       point[1] < 2 * int64_t(face.hi[0]) &&
+                       2 * int64_t(face.lo[1]) < point[2] &&
+                       point[2] < 2 * int64_t(face.hi[1]);
+            }
+            if (odd) {
+                owner[shell] = outer;
+                smallest = volume[outer];
+            }
+        }
+    }
+
+    // Solids in order of their outer shell, each outer shell followed by its
+    // cavities
+    vec<vec<uint32_t>> shell_quads(num_shells);
+    for (uint32_t q = 0; q < num_quads; q++) {
+        shell_quads[shell_of[q]].push_back(q);
+    }
+    vec<vec<uint32_t>> cavities(num_shells);
+    for (uint32_t shell = 0; shell < num_shells; shell++) {
+        if (owner[shell] != shell) {
+            cavities[owner[shell]].push_back(shell);
+        }
+    }
+    RegionShells result;
+    auto add_shell = [&](uint32_t shell) {
+        result.shell_begin.push_back(
+                static_cast<uint32_t>(result.ring_quad.size()));
+        for (const uint32_t q : shell_quads[shell]) {
+            result.ring_begin.push_back(
+                    static_cast<uint32_t>(result.ring_corners.size()));
+            result.ring_quad.push_back(q);
+            result.ring_corners.insert(result.ring_corners.end(),
+                                       ring_corners.begin() + ring_begin[q],
+                                       ring_corners.begin() + ring_begin[q + 1]);
+        }
+    };
+    for (uint32_t shell = 0; shell < num_shells; shell++) {
+        if (owner[shell] != shell) {
+            continue;
+        }
+        result.solid_begin.push_back(
+                static_cast<uint32_t>(result.shell_begin.size()));
+        add_shell(shell);
+        for (const uint32_t cavity : cavities[shell]) {
+            add_shell(cavity);
+        }
+    }
+    result.ring_begin.push_back(static_cast<uint32_t>(result.ring_corners.size()));
+    result.shell_begin.push_back(static_cast<uint32_t>(result.ring_quad.size()));
+    result.solid_begin.push_back(static_cast<uint32_t>(result.shell_begin.size() - 1));
+    return result;
+}
+
+#endif
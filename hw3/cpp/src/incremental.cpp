@@ -0,0 +1,395 @@
+#ifndef INCREMENTAL_H
+#define INCREMENTAL_H
+
+#include "checkpoint.cpp"
+#include "metrics.cpp"
+#include "progress.cpp"
+#include "types.h"
+#include "voxelgrid.cpp"
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <string>
+
+// Incremental re-voxelization. A run can leave behind its final grid (as a
+// surface checkpoint) and, next to it, one record per BIM object: a hash of
+// its triangles and semantics and the box of voxels its triangles can reach.
+// When the model is run again, only the objects that were added, removed or
+// whose hash changed are looked at. The voxels in their old and new boxes are
+// cleared and intersected again with every object that reaches them, in the
+// usual object order, which gives exactly what a full intersection would.
+//
+// Labels are local only as long as nothing opens or closes: a moved wall can
+// join two rooms or let the exterior in anywhere in the building. They are
+// therefore reused as they are when the intersected voxels come out the same
+// (e.g. an object was renamed, retyped or re-exported), and otherwise the
+// whole grid is labelled again.
+
+// Inclusive range of voxel indices per axis
+struct VoxelBox {
+    unsigned int first[3], last[3];
+};
+
+struct ObjectRecord {
+    uint64_t hash = 0;
+    bool in_grid = false; // false if no triangle reaches the grid
+    VoxelBox box{};
+};
+
+typedef map<string, ObjectRecord> ObjectIndex;
+
+struct IncrementalStats {
+    size_t changed_objects = 0;
+    size_t recomputed_voxels = 0; // voxels intersected again
+    size_t relabelled_voxels = 0; // voxels labelled again
+    size_t total_voxels = 0;
+};
+
+const uint32_t OBJECT_INDEX_VERSION = 1;
+
+// FNV-1a over the vertex coordinates and the semantics of object `id`
+uint64_t bim_object_hash(const TriangleStore &triangles, size_t id) {
+    uint64_t hash = 14695981039346656037ull;
+    auto mix = [&](const void *data, size_t size) {
+        const unsigned char *bytes = static_cast<const unsigned char *>(data);
+        for (size_t i = 0; i < size; i++) {
+            hash = (hash ^ bytes[i]) * 1099511628211ull;
+        }
+    };
+    const uint8_t sem = static_cast<uint8_t>(triangles.object_semantics[id]);
+    mix(&sem, sizeof(sem));
+    for (size_t t = triangles.object_begin[id];
+         t < triangles.object_begin[id + 1]; t++) {
+        for (int i = 0; i < 3; i++) {
+            const double xyz[3] = {triangles.x[i][t], triangles.y[i][t],
+                                   triangles.z[i][t]};
+            mix(xyz, sizeof(xyz));
+        }
+    }
+    return hash;
+}
+
+// Hash and voxel box of every object, with the same ranges the intersection
+// gives its triangles
+ObjectIndex index_bim_objects(const VoxelGrid &vg,
+                              const TriangleStore &triangles) {
+    const vec<unsigned int> shape = vg.voxel_shape_with_offset();
+    ObjectIndex index;
+    for (size_t id = 0; id < triangles.num_objects(); id++) {
+        ObjectRecord &record = index[triangles.object_names[id]];
+        record.hash = bim_object_hash(triangles, id);
+        for (size_t t = triangles.object_begin[id];
+             t < triangles.object_begin[id + 1]; t++) {
+            const Bbox3 bbox = triangles.bbox(t);
+            VoxelBox box;
+            bool in_grid = true;
+            for (int axis = 0; axis < 3 && in_grid; axis++) {
+                in_grid = voxel_index_range(bbox.min(axis), bbox.max(axis),
+                                            vg.offset_origin[axis],
+                                            vg.resolution, shape[axis],
+                                            box.first[axis], box.last[axis]);
+            }
+            if (!in_grid) {
+                continue;
+            }
+            if (!record.in_grid) {
+                record.box = box;
+                record.in_grid = true;
+                continue;
+            }
+            for (int axis = 0; axis < 3; axis++) {
+                record.box.first[axis] =
+                        min(record.box.first[axis], box.first[axis]);
+                record.box.last[axis] = max(record.box.last[axis], box.last[axis]);
+            }
+        }
+    }
+    return index;
+}
+
+bool boxes_overlap(const VoxelBox &a, const VoxelBox &b) {
+    for (int axis = 0; axis < 3; axis++) {
+        if (a.first[axis] > b.last[axis] || b.first[axis] > a.last[axis]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Replaces overlapping boxes by their bounding box until none overlap, so that
+// no voxel is recomputed twice
+void merge_boxes(vec<VoxelBox> &boxes) {
+    bool merged = true;
+    while (merged) {
+        merged = false;
+        for (size_t i = 0; i < boxes.size() && !merged; i++) {
+            for (size_t j = i + 1; j < boxes.size() && !merged; j++) {
+                if (!boxes_overlap(boxes[i], boxes[j])) {
+                    continue;
+                }
+                for (int axis = 0; axis < 3; axis++) {
+                    boxes[i].first[axis] =
+                            min(boxes[i].first[axis], boxes[j].first[axis]);
+                    boxes[i].last[axis] =
+                            max(boxes[i].last[axis], boxes[j].last[axis]);
+                }
+                boxes.erase(boxes.begin() + j);
+                merged = true;
+            }
+        }
+    }
+}
+
+template<typename Fn>
+void for_each_box_voxel(const VoxelBox &box, Fn fn) {
+    for (unsigned int x = box.first[0]; x <= box.last[0]; x++) {
+        for (unsigned int y = box.first[1]; y <= box.last[1]; y++) {
+            for (unsigned int z = box.first[2]; z <= box.last[2]; z++) {
+                fn(x, y, z);
+            }
+        }
+    }
+}
+
+void add_incremental_counters(const IncrementalStats &stats) {
+    add_metric_counter("changed_objects", stats.changed_objects);
+    add_metric_counter("recomputed_voxels", stats.recomputed_voxels);
+    add_metric_counter("relabelled_voxels", stats.relabelled_voxels);
+}
+
+bool same_grid_geometry(const VoxelGrid &a, const VoxelGrid &b) {
+    return a.max_x == b.max_x && a.max_y == b.max_y && a.max_z == b.max_z &&
+           a.offset == b.offset && a.resolution == b.resolution &&
+           a.origin == b.origin && a.layout == b.layout;
+}
+
+// Brings `grid`, fresh from create_voxel for the new input, to the state after
+// extract_surface, starting from `previous` (the final grid of an earlier run
+// with the same settings) and its object index. Returns false, leaving `grid`
+// as it was, if the grid has another shape or position than before.
+bool update_voxel_grid(const VoxelGrid &previous,
+                       const ObjectIndex &previous_index,
+                       const TriangleStore &triangles, const ObjectIndex &index,
+                       VoxelGrid &grid, Connectivity connectivity,
+                       unsigned int num_threads, VoxelizeMethod voxelize_method,
+                       ExteriorMethod exterior_method, IncrementalStats &stats) {
+    if (!same_grid_geometry(previous, grid)) {
+        return false;
+    }
+    StageTimer stage("incremental_update");
+    stats = IncrementalStats();
+    stats.total_voxels = grid.num_voxels();
+
+    vec<VoxelBox> dirty;
+    auto add_box = [&](const ObjectRecord &record) {
+        if (record.in_grid) {
+            dirty.push_back(record.box);
+        }
+    };
+    for (const auto &entry: previous_index) {
+        const auto found = index.find(entry.first);
+        if (found == index.end() || found->second.hash != entry.second.hash) {
+            stats.changed_objects++;
+            add_box(entry.second);
+            if (found != index.end()) {
+                add_box(found->second);
+            }
+        }
+    }
+    for (const auto &entry: index) {
+        if (previous_index.count(entry.first) == 0) {
+            stats.changed_objects++;
+            add_box(entry.second);
+        }
+    }
+    merge_boxes(dirty);
+
+    // The previous grid as intersection_with_bim_obj left it
+    VoxelGrid intersected = grid;
+    const VoxelGrid &stored = intersected;
+    for_each_stored_voxel(previous, [&](unsigned int x, unsigned int y,
+                                        unsigned int z) {
+        const VoxelInfo voxel = previous(x, y, z);
+        if (voxel.label == VoxelLabel::INTERSECTED) {
+            intersected(x, y, z).label = VoxelLabel::INTERSECTED;
+            intersected(x, y, z).semantics = voxel.semantics;
+        }
+    });
+
+    bool occupancy_changed = false;
+    for (const auto &box: dirty) {
+        for_each_box_voxel(box, [&](unsigned int x, unsigned int y,
+                                    unsigned int z) {
+            if (stored(x, y, z).label == VoxelLabel::INTERSECTED) {
+                intersected(x, y, z) = VoxelInfo();
+            }
+        });
+        intersect_voxel_region(intersected, triangles, box.first, box.last,
+                               num_threads, voxelize_method);
+        for_each_box_voxel(box, [&](unsigned int x, unsigned int y,
+                                    unsigned int z) {
+            occupancy_changed = occupancy_changed ||
+                                (stored(x, y, z).label == VoxelLabel::INTERSECTED) !=
+                                (previous(x, y, z).label == VoxelLabel::INTERSECTED);
+        });
+        stats.recomputed_voxels += static_cast<size_t>(
+                box.last[0] - box.first[0] + 1) * (box.last[1] - box.first[1] + 1) *
+                                   (box.last[2] - box.first[2] + 1);
+    }
+
+    // Ray parity follows the triangles themselves, which may have changed
+    // inside the same voxels
+    if (occupancy_changed ||
+        (exterior_method == ExteriorMethod::Parity && !dirty.empty())) {
+        grid = mark_exterior_interior(intersected, connectivity, num_threads,
+                                      exterior_method, &triangles);
+        extract_surface(grid, eighteen_connectivity, num_threads);
+        stats.relabelled_voxels = stats.total_voxels;
+        add_incremental_counters(stats);
+        return true;
+    }
+    // Same voxels, so the same labels, rooms and city object types; only the
+    // semantics can differ
+    grid = previous;
+    for (const auto &box: dirty) {
+        for_each_box_voxel(box, [&](unsigned int x, unsigned int y,
+                                    unsigned int z) {
+            const VoxelInfo voxel = stored(x, y, z);
+            if (voxel.label == VoxelLabel::INTERSECTED &&
+                voxel.semantics != previous(x, y, z).semantics) {
+                grid(x, y, z).semantics = voxel.semantics;
+            }
+        });
+    }
+    add_incremental_counters(stats);
+    return true;
+}
+
+// The object index is kept as JSON next to the grid checkpoint
+string object_index_filename(const string &state_file) {
+    return state_file + ".objects.json";
+}
+
+// `parity` records whether the labels came from ray parity, which an update
+// must not mix with labels from a fill
+bool write_incremental_state(const string &state_file, const VoxelGrid &grid,
+                             const ObjectIndex &index,
+                             Connectivity connectivity, bool parity) {
+    if (!write_checkpoint(state_file, grid, PipelineStage::Surface)) {
+        return false;
+    }
+    json j;
+    j["version"] = OBJECT_INDEX_VERSION;
+    j["connectivity"] = static_cast<int>(connectivity);
+    j["parity"] = parity;
+    j["objects"] = json::object();
+    for (const auto &entry: index) {
+        json record;
+        record["hash"] = entry.second.hash;
+        if (entry.second.in_grid) {
+            const VoxelBox &box = entry.second.box;
+            record["first"] = {box.first[0], box.first[1], box.first[2]};
+            record["last"] = {box.last[0], box.last[1], box.last[2]};
+        }
+        j["objects"][entry.first] = record;
+    }
+    const string filename = object_index_filename(state_file);
+    ofstream out(filename);
+    if (!out.is_open()) {
+        cerr << "Failed to open " << filename << endl;
+        return false;
+    }
+    out << j.dump() << endl;
+    return true;
+}
+
+bool read_object_index(const string &filename, ObjectIndex &index,
+                       Connectivity &connectivity, bool &parity) {
+    ifstream input(filename);
+    if (!input.is_open()) {
+        return false;
+    }
+    const json j = json::parse(input, nullptr, false);
+    if (j.is_discarded() || !j.is_object() ||
+        j.value("version", 0u) != OBJECT_INDEX_VERSION ||
+        !j.contains("objects") || !j["objects"].is_object()) {
+        return false;
+    }
+    connectivity = static_cast<Connectivity>(j.value("connectivity", 18));
+    parity = j.value("parity", false);
+    index.clear();
+    for (const auto &entry: j["objects"].items()) {
+        const json &value = entry.value();
+        if (!value.is_object() || !value.contains("hash") ||
+            !value["hash"].is_number_unsigned()) {
+            return false;
+        }
+        ObjectRecord &record = index[entry.key()];
+        record.hash = value["hash"].get<uint64_t>();
+        record.in_grid = value.contains("first") && value.contains("last");
+        for (int axis = 0; axis < 3 && record.in_grid; axis++) {
+            record.box.first[axis] = value["first"].at(axis).get<unsigned int>();
+            record.box.last[axis] = value["last"].at(axis).get<unsigned int>();
+        }
+    }
+    return true;
+}
+
+// Updates `grid` from the state an earlier run left in `state_file`. Returns
+// false, after saying why, when the state is missing or cannot be reused;
+// the caller then runs the whole pipeline.
+bool update_from_incremental_state(const string &state_file,
+                                   const TriangleStore &triangles,
+                                   const ObjectIndex &index, VoxelGrid &grid,
+                                   Connectivity connectivity,
+                                   unsigned int num_threads,
+                                   VoxelizeMethod voxelize_method,
+                                   ExteriorMethod exterior_method) {
+    if (!ifstream(state_file).is_open()) {
+        progress() << "No previous state in " << state_file
+                   << ", running in full" << endl;
+        return false;
+    }
+    VoxelGrid previous(0, 0, 0, {0, 0, 0});
+    PipelineStage stage;
+    ObjectIndex previous_index;
+    Connectivity previous_connectivity;
+    bool previous_parity;
+    if (!read_checkpoint(state_file, previous, stage) ||
+        stage != PipelineStage::Surface ||
+        !read_object_index(object_index_filename(state_file), previous_index,
+                           previous_connectivity, previous_parity)) {
+        progress() << "Previous state in " << state_file
+                   << " is incomplete, running in full" << endl;
+        return false;
+    }
+    if (previous_connectivity != connectivity) {
+        progress() << "Previous state used another connectivity, running in "
+                      "full" << endl;
+        return false;
+    }
+    if (previous_parity != (exterior_method == ExteriorMethod::Parity)) {
+        progress() << "Previous state was labelled by another method, "
+                      "running in full" << endl;
+        return false;
+    }
+    IncrementalStats stats;
+    if (!update_voxel_grid(previous, previous_index, triangles, index, grid,
+                           connectivity, num_threads, voxelize_method,
+                           exterior_method, stats)) {
+        progress() << "The voxel grid changed shape or position, running in "
+                      "full" << endl;
+        return false;
+    }
+    progress() << "Incremental update: " << stats.changed_objects << " of "
+               << index.size() << " objects changed, "
+               << stats.recomputed_voxels << " of " << stats.total_voxels
+               << " voxels intersected again ("
+               << 100.0 * stats.recomputed_voxels / stats.total_voxels << "%), "
+               << stats.relabelled_voxels << " labelled again" << endl;
+    return true;
+}
+
+#endif
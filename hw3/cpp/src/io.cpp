@@ -1,12 +1,32 @@
 #ifndef IO_H
 #define IO_H
 
+#include "greedy_mesh.cpp"
+#include "metrics.cpp"
+#include "progress.cpp"
 #include "types.h"
+#include "voxel_runs.cpp"
+#include "voxelgrid.cpp"
+#include <algorithm>
+#include <charconv>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
 #include <fstream>
 #include <iostream>
+#include <iterator>
+#include <limits>
 #include <map>
 #include <sstream>
 #include <string>
+#include <unordered_map>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 bool write_json(const json &j, const std::string &filename) {
     std::ofstream o(filename);
@@ -15,7 +35,7 @@ bool write_json(const json &j, const std::string &filename) {
     }
     o << j.dump(2) << std::endl;
     o.close();
-    std::cout << "file written" << std::endl;
+    progress() << "file written" << std::endl;
     return true;
 }
 
@@ -24,114 +44,597 @@ BIMObject::BIMObject(string name, vec<Triangle3> shells)
 
 BIMObject::BIMObject() = default;
 
-pair<BIMObjects, vec<vec<double>>> read_obj(ifstream &input_stream) {
+// Scanners for the OBJ parser. They work on [p, end) without copying or
+// allocating and advance p past what they consumed.
+
+inline bool is_obj_space(char c) { return c == ' ' || c == '\t'; }
+
+inline void skip_obj_spaces(const char *&p, const char *end) {
+    while (p < end && is_obj_space(*p)) {
+        p++;
+    }
+}
+
+inline void skip_obj_line(const char *&p, const char *end) {
+    const void *newline = memchr(p, '\n', end - p);
+    p = newline ? static_cast<const char *>(newline) + 1 : end;
+}
+
+bool scan_obj_int(const char *&p, const char *end, long &value) {
+    bool negative = false;
+    if (p < end && (*p == '-' || *p == '+')) {
+        negative = *p == '-';
+        p++;
+    }
+    if (p == end || *p < '0' || *p > '9') {
+        return false;
+    }
+    long result = 0;
+    while (p < end && *p >= '0' && *p <= '9') {
+        result = result * 10 + (*p - '0');
+        p++;
+    }
+    value = negative ? -result : result;
+    return true;
+}
+
+// Decimal numbers with at most 19 significant digits and a small exponent are
+// converted with one exact multiplication or division (Clinger's fast path),
+// which rounds correctly. Anything else goes to strtod so that the result is
+// always the same as with stream extraction.
+bool scan_obj_double(const char *&p, const char *end, double &value) {
+    static const double powers_of_ten[] = {
+            1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,
+            1e8,  1e9,  1e10, 1e11, 1e12, 1e13, 1e14, 1e15,
+            1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+    const char *start = p;
+    const char *q = p;
+    bool negative = false;
+    if (q < end && (*q == '-' || *q == '+')) {
+        negative = *q == '-';
+        q++;
+    }
+    uint64_t mantissa = 0;
+    int digits = 0;
+    int exponent = 0;
+    bool any_digit = false;
+    while (q < end && *q >= '0' && *q <= '9') {
+        any_digit = true;
+        if (mantissa != 0 || *q != '0') {
+            if (digits < 19) {
+                mantissa = mantissa * 10 + (*q - '0');
+            } else {
+                exponent++;
+            }
+            digits++;
+        }
+        q++;
+    }
+    if (q < end && *q == '.') {
+        q++;
+        while (q < end && *q >= '0' && *q <= '9') {
+            any_digit = true;
+            if (mantissa != 0 || *q != '0') {
+                if (digits < 19) {
+                    mantissa = mantissa * 10 + (*q - '0');
+                    exponent--;
+                }
+                digits++;
+            } else {
+                exponent--;
+            }
+            q++;
+        }
+    }
+    if (!any_digit) {
+        return false;
+    }
+    if (q < end && (*q == 'e' || *q == 'E')) {
+        const char *e = q + 1;
+        long exp_value;
+        if (scan_obj_int(e, end, exp_value)) {
+            exponent += static_cast<int>(max(-100000L, min(100000L, exp_value)));
+            q = e;
+        }
+    }
+    if (digits <= 19 && mantissa <= (uint64_t(1) << 53) && exponent >= -22 &&
+        exponent <= 22) {
+        double result = static_cast<double>(mantissa);
+        result = exponent < 0 ? result / powers_of_ten[-exponent]
+                              : result * powers_of_ten[exponent];
+        value = negative ? -result : result;
+        p = q;
+        return true;
+    }
+    // Slow path; the token is copied because the input is not terminated
+    char buffer[128];
+    const size_t length = min<size_t>(q - start, sizeof(buffer) - 1);
+    memcpy(buffer, start, length);
+    buffer[length] = '\0';
+    value = strtod(buffer, nullptr);
+    p = q;
+    return true;
+}
+
+// Parses an OBJ file held in memory. Vertices are returned as one flat array
+// (x, y, z of every vertex in turn). Faces become triangles of the current
+// group; polygons with more than three corners are split into a fan around
+// their first corner, and only the vertex index of a v/vt/vn corner is used.
+pair<BIMObjects, vec<double>> parse_obj(const char *p, const char *end) {
     BIMObjects bim_objects;
-    vec<vec<double>> vertices;
-    vec<Triangle3> shells;
-
-    if (input_stream.is_open()) {
-        std::string line;
-        BIMObject bim_obj;
-        int group_num = 0;
-        int temp_num = 0;
-        // Parse line by line
-        while (getline(input_stream, line)) {
-
-            istringstream line_stream(line);
-            string line_type;
-            line_stream >> line_type;
-            if (line_type == "g") {
-                temp_num++;
-                if (!bim_obj.name.empty()) {
-                    bim_objects[bim_obj.name] = bim_obj;
-                    bim_obj = BIMObject();
+    vec<double> vertices;
+    BIMObject bim_obj;
+    int group_num = 0;
+    size_t skipped_faces = 0;
+    vec<long> corners;
+
+    while (p < end) {
+        skip_obj_spaces(p, end);
+        if (p == end) {
+            break;
+        }
+        const char type = *p;
+        const bool keyword_ends = p + 1 == end || is_obj_space(p[1]) ||
+                                  p[1] == '\r' || p[1] == '\n';
+        if (type == 'v' && keyword_ends) {
+            p++;
+            for (int i = 0; i < 3; i++) {
+                skip_obj_spaces(p, end);
+                double coordinate = 0;
+                scan_obj_double(p, end, coordinate);
+                vertices.push_back(coordinate);
+            }
+        } else if (type == 'f' && keyword_ends) {
+            p++;
+            corners.clear();
+            bool valid = true;
+            const long num_vertices = static_cast<long>(vertices.size() / 3);
+            while (true) {
+                skip_obj_spaces(p, end);
+                long index;
+                if (!scan_obj_int(p, end, index)) {
+                    break;
                 }
-                std::string rest_of_line;
-                getline(line_stream, rest_of_line);
-                rest_of_line.erase(0, rest_of_line.find_first_not_of(" \t"));
-                std::replace(rest_of_line.begin(), rest_of_line.end(), ' ', '_');
-                bim_obj.name = rest_of_line.empty() ? "Unnamed_" + to_string(group_num) : rest_of_line;
-                group_num++;
-            } else if (line_type == "v") {
-                vec<double> vertex(3);
-                line_stream >> vertex[0] >> vertex[1] >> vertex[2];
-                vertices.push_back(vertex);
-            } else if (line_type == "f") {
-                vec<Point3> points;
-                Triangle3 triangle;
-                string vertex;
-                while (line_stream >> vertex) {
-                    istringstream vertex_stream(vertex);
-                    int vi;
-                    vertex_stream >> vi;
-                    vec<double> v = vertices[vi - 1];
-
-                    points.emplace_back(vertices[vi - 1][0], vertices[vi - 1][1],
-                                        vertices[vi - 1][2]);
+                // Negative indices count back from the latest vertex
+                index = index < 0 ? num_vertices + index : index - 1;
+                valid = valid && index >= 0 && index < num_vertices;
+                corners.push_back(index);
+                // Skip the /vt/vn part of the corner
+                while (p < end && !is_obj_space(*p) && *p != '\n' && *p != '\r') {
+                    p++;
                 }
-                triangle = Triangle3(points.at(0), points.at(1), points.at(2));
-                bim_obj.shells.push_back(triangle);
             }
+            if (!valid || corners.size() < 3) {
+                skipped_faces++;
+            } else {
+                auto point = [&](long index) {
+                    const double *v = &vertices[3 * index];
+                    return Point3(v[0], v[1], v[2]);
+                };
+                const Point3 first = point(corners[0]);
+                for (size_t i = 1; i + 1 < corners.size(); i++) {
+                    bim_obj.shells.emplace_back(first, point(corners[i]),
+                                                point(corners[i + 1]));
+                }
+            }
+        } else if (type == 'g' && keyword_ends) {
+            if (!bim_obj.name.empty()) {
+                const string key = bim_obj.name;
+                bim_objects[key] = move(bim_obj);
+                bim_obj = BIMObject();
+            }
+            p++;
+            skip_obj_spaces(p, end);
+            const char *name_end = p;
+            while (name_end < end && *name_end != '\n' && *name_end != '\r') {
+                name_end++;
+            }
+            string name(p, name_end);
+            replace(name.begin(), name.end(), ' ', '_');
+            bim_obj.name = name.empty() ? "Unnamed_" + to_string(group_num) : name;
+            group_num++;
+            p = name_end;
         }
-        if (!bim_obj.name.empty()) {
-            bim_objects[bim_obj.name] = bim_obj;
+        // Comments, vt, vn, o, usemtl, ... and the rest of every line
+        skip_obj_line(p, end);
+    }
+    if (!bim_obj.name.empty()) {
+        const string key = bim_obj.name;
+        bim_objects[key] = move(bim_obj);
+    }
+    if (skipped_faces > 0) {
+        cerr << "Skipped " << skipped_faces
+             << " faces with fewer than 3 corners or invalid vertex indices"
+             << endl;
+    }
+    if (metrics_enabled()) {
+        size_t triangles = 0;
+        for (const auto &bim: bim_objects) {
+            triangles += bim.second.shells.size();
         }
+        add_metric_counter("objects", bim_objects.size());
+        add_metric_counter("vertices", vertices.size() / 3);
+        add_metric_counter("triangles", triangles);
+        add_metric_counter("skipped_faces", skipped_faces);
     }
-    return make_pair(bim_objects, vertices);
+    return make_pair(move(bim_objects), move(vertices));
 }
 
-// This is for debugging purposes
-int write_voxel_obj(const string &outfile, const VoxelGrid &vg,
-                    vec<VoxelLabel> export_labels = {VoxelLabel::INTERSECTED}) {
-    ofstream outFile(outfile);
+pair<BIMObjects, vec<double>> read_obj(ifstream &input_stream) {
+    if (!input_stream.is_open()) {
+        return {};
+    }
+    const string content((istreambuf_iterator<char>(input_stream)),
+                         istreambuf_iterator<char>());
+    return parse_obj(content.data(), content.data() + content.size());
+}
+
+// Maps the file into memory instead of reading it, so the parser runs
+// directly on the page cache
+pair<BIMObjects, vec<double>> read_obj(const string &filename) {
+    StageTimer stage("read_obj");
+#ifdef _WIN32
+    ifstream input(filename, ios::binary);
+    if (!input.is_open()) {
+        cerr << "Failed to open " << filename << endl;
+        return {};
+    }
+    return read_obj(input);
+#else
+    const int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        cerr << "Failed to open " << filename << endl;
+        return {};
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size == 0) {
+        close(fd);
+        return {};
+    }
+    const size_t size = info.st_size;
+    void *data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        ifstream input(filename, ios::binary);
+        return read_obj(input);
+    }
+    madvise(data, size, MADV_SEQUENTIAL);
+    const char *begin = static_cast<const char *>(data);
+    auto result = parse_obj(begin, begin + size);
+    munmap(data, size);
+    return result;
+#endif
+}
+
+// Output collected in a large buffer and written to the stream in blocks.
+// Numbers are formatted with to_chars, which is much faster than ostream <<
+// and does not depend on the locale. Doubles get 15 significant digits: as
+// many as a double holds for sure, and few enough to drop the rounding noise
+// of origin + index * resolution.
+class OutputBuffer {
+public:
+    explicit OutputBuffer(ostream &out) : out(out) {
+        buffer.reserve(FLUSH_SIZE + 256);
+    }
+
+    ~OutputBuffer() { flush(); }
+
+    void text(const char *value) {
+        buffer += value;
+        flush_if_full();
+    }
+
+    void text(const string &value) {
+        buffer += value;
+        flush_if_full();
+    }
+
+    void number(double value) {
+        char digits[32];
+        buffer.append(digits, to_chars(digits, digits + sizeof(digits), value,
+                                       chars_format::general, 15).ptr);
+    }
+
+    void number(uint64_t value) {
+        char digits[24];
+        buffer.append(digits, to_chars(digits, digits + sizeof(digits), value).ptr);
+    }
+
+    // Bytes of a value in the byte order of the host
+    template<typename T>
+    void binary(T value) {
+        buffer.append(reinterpret_cast<const char *>(&value), sizeof(T));
+        flush_if_full();
+    }
+
+    void flush() {
+        out.write(buffer.data(), buffer.size());
+        buffer.clear();
+    }
+
+private:
+    static const size_t FLUSH_SIZE = 1 << 20;
+
+    ostream &out;
+    string buffer;
+
+    void flush_if_full() {
+        if (buffer.size() >= FLUSH_SIZE) {
+            flush();
+        }
+    }
+};
+
+// Labels exported together as one OBJ group (PLY face group)
+struct VoxelExportGroup {
+    string name;
+    vec<VoxelLabel> labels;
+};
+
+// Voxel corners, numbered from 0 in the order they are first added, so that
+// neighbouring voxels share the corners they have in common. Dense grids look
+// corners up in a flat array over the lattice, sparse ones in a hash map.
+class LatticeVertices {
+public:
+    explicit LatticeVertices(const VoxelGrid &vg)
+            : size_y(vg.size_y + 1), size_z(vg.size_z + 1) {
+        if (!vg.is_sparse()) {
+            index.assign(static_cast<size_t>(vg.size_x + 1) * size_y * size_z,
+                         NO_VERTEX);
+        }
+    }
+
+    // Runs are kept to save memory, so their corners are hashed too
+    explicit LatticeVertices(const VoxelRuns &runs)
+            : size_y(runs.size_y + 1), size_z(runs.size_z + 1) {}
+
+    // Number of the corner; `added` tells whether it is new
+    uint32_t add(unsigned int x, unsigned int y, unsigned int z, bool &added) {
+        uint32_t &number = index.empty()
+                           ? sparse_index.emplace(corner_key(x, y, z), NO_VERTEX)
+                                     .first->second
+                           : index[(static_cast<size_t>(x) * size_y + y) *
+                                   size_z + z];
+        added = number == NO_VERTEX;
+        if (added) {
+            number = count++;
+        }
+        return number;
+    }
+
+    size_t size() const { return count; }
+
+private:
+    static constexpr uint32_t NO_VERTEX = numeric_limits<uint32_t>::max();
+
+    const size_t size_y, size_z;
+    vec<uint32_t> index;
+    unordered_map<uint64_t, uint32_t> sparse_index;
+    uint32_t count = 0;
+};
+
+// Boundary of the voxels of each group, merged into rectangles, with the
+// group as region; sorted by group
+template<typename Grid>
+vec<BoundaryQuad> group_boundary_quads(const Grid &vg,
+                                       const vec<VoxelExportGroup> &groups) {
+    auto quads = greedy_boundary_quads(
+            vg, [&](unsigned int x, unsigned int y, unsigned int z) {
+                const VoxelLabel label = vg(x, y, z).label;
+                for (size_t group = 0; group < groups.size(); group++) {
+                    const auto &labels = groups[group].labels;
+                    if (find(labels.begin(), labels.end(), label) !=
+                        labels.end()) {
+                        return VoxelRegion{static_cast<uint32_t>(group), 0};
+                    }
+                }
+                return VoxelRegion{NO_REGION, 0};
+            });
+    stable_sort(quads.begin(), quads.end(),
+                [](const BoundaryQuad &a, const BoundaryQuad &b) {
+                    return a.region < b.region;
+                });
+    return quads;
+}
+
+// The voxel faces of every group, or with ExportMesh::Greedy the `quads` of
+// group_boundary_quads, as quads over shared lattice vertices. Calls
+// vertex(corner) for every vertex the first time it is used, then
+// face(group, ids) with its four vertex numbers; the faces come group by
+// group. Voxel faces take one pass over the grid per group.
+template<typename Grid, typename VertexFn, typename FaceFn>
+void for_each_export_quad(const Grid &vg,
+                          const vec<VoxelExportGroup> &groups, ExportMesh mesh,
+                          const vec<BoundaryQuad> &quads,
+                          LatticeVertices &vertices, VertexFn vertex,
+                          FaceFn face) {
+    uint32_t ids[8];
+    bool added;
+    if (mesh == ExportMesh::Voxels) {
+        for (size_t group = 0; group < groups.size(); group++) {
+            for_each_voxel_with_labels(vg, groups[group].labels, [&](
+                    unsigned int x, unsigned int y, unsigned int z) {
+                for (unsigned int c = 0; c < 8; c++) {
+                    const unsigned int corner[3] = {x + (c & 1),
+                                                    y + ((c >> 1) & 1),
+                                                    z + ((c >> 2) & 1)};
+                    ids[c] = vertices.add(corner[0], corner[1], corner[2], added);
+                    if (added) {
+                        vertex(corner);
+                    }
+                }
+                for (const auto &corners: VOXEL_FACES) {
+                    const uint32_t quad[4] = {ids[corners[0]], ids[corners[1]],
+                                              ids[corners[2]], ids[corners[3]]};
+                    face(group, quad);
+                }
+            });
+        }
+        return;
+    }
+    unsigned int corners[4][3];
+    for (const auto &quad: quads) {
+        quad_corners(quad, corners);
+        for (int i = 0; i < 4; i++) {
+            ids[i] = vertices.add(corners[i][0], corners[i][1], corners[i][2],
+                                  added);
+            if (added) {
+                vertex(corners[i]);
+            }
+        }
+        face(quad.region, ids);
+    }
+}
+
+// Writes the voxels with the labels of each group as an OBJ group. Voxels
+// share their corner vertices, which are written right before their first
+// use. With ExportMesh::Greedy only the boundary of each group is written,
+// merged into rectangles. The grid is a VoxelGrid or VoxelRuns.
+template<typename Grid>
+int write_voxel_obj(const string &outfile, const Grid &vg,
+                    const vec<VoxelExportGroup> &groups,
+                    ExportMesh mesh = ExportMesh::Voxels) {
+    StageTimer stage("write_obj");
+    ofstream outFile(outfile, ios::binary);
     if (!outFile.is_open()) {
         cerr << "Failed to open " << outfile << endl;
         return 0;
     }
-    cout << "Writing to " << outfile << endl;
-    unsigned int vertex_count = 0;
-    for (unsigned int x = 0; x < vg.voxels.size(); x++) {
-        for (unsigned int y = 0; y < vg.voxels[x].size(); y++) {
-            for (unsigned int z = 0; z < vg.voxels[x][y].size(); z++) {
-                if (find(export_labels.begin(), export_labels.end(),
-                         vg.voxels[x][y][z].label) != export_labels.end()) {
-                    double min_x = vg.offset_origin[0] + x * vg.resolution;
-                    double min_y = vg.offset_origin[1] + y * vg.resolution;
-                    double min_z = vg.offset_origin[2] + z * vg.resolution;
-                    double max_x = min_x + vg.resolution;
-                    double max_y = min_y + vg.resolution;
-                    double max_z = min_z + vg.resolution;
-
-                    outFile << "v " << min_x << " " << min_y << " " << min_z << "\n";
-                    outFile << "v " << max_x << " " << min_y << " " << min_z << "\n";
-                    outFile << "v " << min_x << " " << max_y << " " << min_z << "\n";
-                    outFile << "v " << max_x << " " << max_y << " " << min_z << "\n";
-                    outFile << "v " << min_x << " " << min_y << " " << max_z << "\n";
-                    outFile << "v " << max_x << " " << min_y << " " << max_z << "\n";
-                    outFile << "v " << min_x << " " << max_y << " " << max_z << "\n";
-                    outFile << "v " << max_x << " " << max_y << " " << max_z << "\n";
-
-                    unsigned int v1 = vertex_count + 1;
-                    outFile << "f " << v1 + 0 << " " << v1 + 1 << " " << v1 + 3 << " "
-                            << v1 + 2 << "\n";
-                    outFile << "f " << v1 + 4 << " " << v1 + 5 << " " << v1 + 7 << " "
-                            << v1 + 6 << "\n";
-                    outFile << "f " << v1 + 0 << " " << v1 + 1 << " " << v1 + 5 << " "
-                            << v1 + 4 << "\n";
-                    outFile << "f " << v1 + 2 << " " << v1 + 3 << " " << v1 + 7 << " "
-                            << v1 + 6 << "\n";
-                    outFile << "f " << v1 + 1 << " " << v1 + 3 << " " << v1 + 7 << " "
-                            << v1 + 5 << "\n";
-                    outFile << "f " << v1 + 0 << " " << v1 + 2 << " " << v1 + 6 << " "
-                            << v1 + 4 << "\n";
-
-                    vertex_count += 8;
+    progress() << "Writing to " << outfile << endl;
+    const vec<BoundaryQuad> quads = mesh == ExportMesh::Greedy
+                                    ? group_boundary_quads(vg, groups)
+                                    : vec<BoundaryQuad>();
+    LatticeVertices vertices(vg);
+    size_t faces = 0;
+    {
+        OutputBuffer out(outFile);
+        size_t current_group = groups.size();
+        for_each_export_quad(vg, groups, mesh, quads, vertices, [&](
+                const unsigned int corner[3]) {
+            out.text("v ");
+            for (int axis = 0; axis < 3; axis++) {
+                if (axis > 0) {
+                    out.text(" ");
+                }
+                out.number(vg.offset_origin[axis] + corner[axis] * vg.resolution);
+            }
+            out.text("\n");
+        }, [&](size_t group, const uint32_t ids[4]) {
+            if (group != current_group) {
+                current_group = group;
+                if (!groups[group].name.empty()) {
+                    out.text("g ");
+                    out.text(groups[group].name);
+                    out.text("\n");
                 }
             }
+            out.text("f");
+            for (int i = 0; i < 4; i++) {
+                out.text(" ");
+                out.number(static_cast<uint64_t>(ids[i]) + 1);
+            }
+            out.text("\n");
+            faces++;
+        });
+    }
+    outFile.close();
+    if (!outFile) {
+        cerr << "Failed to write " << outfile << endl;
+        return 0;
+    }
+    add_metric_counter("vertices", vertices.size());
+    add_metric_counter("faces", faces);
+    progress() << "File has been written " << outfile << endl;
+    return 1;
+}
+
+// The voxels with any of the labels, as a single group without a name
+template<typename Grid>
+int write_voxel_obj(const string &outfile, const Grid &vg,
+                    vec<VoxelLabel> export_labels = {VoxelLabel::INTERSECTED},
+                    ExportMesh mesh = ExportMesh::Voxels) {
+    return write_voxel_obj(outfile, vg, vec<VoxelExportGroup>{{"", export_labels}},
+                           mesh);
+}
+
+// Same mesh as write_voxel_obj as a binary PLY, which viewers load much
+// faster: float vertices and quad faces, each with the index of its group
+// (named in the header comments). PLY needs the counts up front, so the
+// vertices are collected first and the faces come from a second walk over
+// the voxels.
+template<typename Grid>
+int write_voxel_ply(const string &outfile, const Grid &vg,
+                    const vec<VoxelExportGroup> &groups,
+                    ExportMesh mesh = ExportMesh::Voxels) {
+    StageTimer stage("write_ply");
+    if (groups.size() > 256) {
+        cerr << "At most 256 groups fit into a PLY" << endl;
+        return 0;
+    }
+    ofstream outFile(outfile, ios::binary);
+    if (!outFile.is_open()) {
+        cerr << "Failed to open " << outfile << endl;
+        return 0;
+    }
+    progress() << "Writing to " << outfile << endl;
+    const vec<BoundaryQuad> quads = mesh == ExportMesh::Greedy
+                                    ? group_boundary_quads(vg, groups)
+                                    : vec<BoundaryQuad>();
+    vec<float> coordinates;
+    size_t faces = 0;
+    {
+        LatticeVertices vertices(vg);
+        for_each_export_quad(vg, groups, mesh, quads, vertices, [&](
+                const unsigned int corner[3]) {
+            for (int axis = 0; axis < 3; axis++) {
+                coordinates.push_back(static_cast<float>(
+                        vg.offset_origin[axis] + corner[axis] * vg.resolution));
+            }
+        }, [&](size_t, const uint32_t *) { faces++; });
+    }
+    const uint16_t byte_order = 1;
+    const bool little_endian = *reinterpret_cast<const uint8_t *>(&byte_order) == 1;
+    {
+        OutputBuffer out(outFile);
+        out.text("ply\nformat ");
+        out.text(little_endian ? "binary_little_endian" : "binary_big_endian");
+        out.text(" 1.0\n");
+        for (size_t group = 0; group < groups.size(); group++) {
+            out.text("comment group ");
+            out.number(static_cast<uint64_t>(group));
+            out.text(" ");
+            out.text(groups[group].name);
+            out.text("\n");
+        }
+        out.text("element vertex ");
+        out.number(static_cast<uint64_t>(coordinates.size() / 3));
+        out.text("\nproperty float x\nproperty float y\nproperty float z\n"
+                 "element face ");
+        out.number(static_cast<uint64_t>(faces));
+        out.text("\nproperty list uchar int vertex_indices\n"
+                 "property uchar group\nend_header\n");
+        for (const float coordinate: coordinates) {
+            out.binary(coordinate);
         }
+        LatticeVertices vertices(vg);
+        for_each_export_quad(vg, groups, mesh, quads, vertices,
+                             [](const unsigned int *) {},
+                             [&](size_t group, const uint32_t ids[4]) {
+            out.binary(static_cast<uint8_t>(4));
+            for (int i = 0; i < 4; i++) {
+                out.binary(static_cast<int32_t>(ids[i]));
+            }
+            out.binary(static_cast<uint8_t>(group));
+        });
     }
     outFile.close();
-    cout << "File has been written " << outfile << endl;
+    if (!outFile) {
+        cerr << "Failed to write " << outfile << endl;
+        return 0;
+    }
+    add_metric_counter("vertices", coordinates.size() / 3);
+    add_metric_counter("faces", faces);
+    progress() << "File has been written " << outfile << endl;
     return 1;
 }
 
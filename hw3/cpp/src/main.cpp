@@ -1,87 +1,523 @@
 
+#include "batch.cpp"
 #include "bim_obj.cpp"
+#include "checkpoint.cpp"
 #include "cjson.cpp"
+#include "distance_transform.cpp"
+#include "incremental.cpp"
 #include "io.cpp"
+#include "metrics.cpp"
+#include "room_stats.cpp"
+#include "tiled.cpp"
 #include "types.h"
+#include "voxel_runs.cpp"
 #include "voxelgrid.cpp"
+#include <cctype>
+#include <cerrno>
+#include <cmath>
+#include <cstdlib>
 #include <fstream>
 #include <iostream>
+#include <limits>
 #include <map>
 #include <sstream>
 #include <string>
+#include <tuple>
 #include <utility>
 #include <vector>
 
 using namespace std;
 
+// Whole-string numbers of command line values; false on anything else
+bool parse_unsigned(const string &text, unsigned int &value) {
+    if (text.empty() || !isdigit(static_cast<unsigned char>(text[0]))) {
+        return false;
+    }
+    char *end = nullptr;
+    errno = 0;
+    const unsigned long parsed = strtoul(text.c_str(), &end, 10);
+    if (*end != '\0' || errno == ERANGE ||
+        parsed > numeric_limits<unsigned int>::max()) {
+        return false;
+    }
+    value = static_cast<unsigned int>(parsed);
+    return true;
+}
+
+bool parse_double(const string &text, double &value) {
+    if (text.empty() || isspace(static_cast<unsigned char>(text[0]))) {
+        return false;
+    }
+    char *end = nullptr;
+    errno = 0;
+    const double parsed = strtod(text.c_str(), &end);
+    if (*end != '\0' || errno == ERANGE || !isfinite(parsed)) {
+        return false;
+    }
+    value = parsed;
+    return true;
+}
+
 int main(int argc, const char *argv[]) {
-//    vec<vec<string>> input_outputs = {
-//            {"../../input/open_house_ifc4_2.obj",
-//             "../../out/voxel.obj",
-//             "../../out/out_open_house.city.json"},
-//            {"../../input/wellness_center_sama.obj",
-//             "../../out/voxel_wellness_sama.obj",
-//             "../../out/wellness_center_sama.city.json"},
-//            {"../../input/special_case1.obj",
-//             "../../out/special_case1.obj",
-//             "../../out/special_case1.json"},
-//    };
-
-//    for (const auto &input_output: input_outputs) {
-//        std::cout << "Processing: " << input_output[0] << std::endl;
-//        std::ifstream input;
-//        input.open(input_output[0]);
-//        auto [bim_objects, vertices] = read_obj(input);
-//        input.close();
-//
-//        assign_semantics(bim_objects);
-//
-//        cout << "Reading obj finished :" << bim_objects.size() << "faces" << endl;
-//        auto voxel_grid = create_voxel(vertices, 2, 0.2);
-//        cout << "Finished creating voxel" << voxel_grid.voxels.size() << endl;
-//        auto intersected_voxel_grid =
-//                intersection_with_bim_obj(voxel_grid, bim_objects);
-//
-//        auto marked_voxel_grid = mark_exterior_interior(intersected_voxel_grid);
-//
-//        extract_surface(marked_voxel_grid);
-//
-//
-//        bool res = write_voxel_obj(input_output[1], marked_voxel_grid);
-//
-//        json cj = export_voxel_to_cityjson(marked_voxel_grid);
-//
-//        write_json(cj, input_output[2]);
-//    }
-
-
-    const char *filename =
-            (argc > 1) ? argv[1] : "../../input/open_house_ifc4.obj";
-    std::cout << "Processing: " << filename << std::endl;
-    std::ifstream input;
-
-    input.open(filename);
-    auto [bim_objects, vertices] = read_obj(input);
-    input.close();
-
-    assign_semantics(bim_objects);
-
-    cout << "Reading obj finished :" << bim_objects.size() << "faces" << endl;
-    auto voxel_grid = create_voxel(vertices, 2, 0.5);
-    cout << "Finished creating voxel" << voxel_grid.voxels.size() << endl;
-    auto intersected_voxel_grid =
-            intersection_with_bim_obj(voxel_grid, bim_objects);
-
-    auto marked_voxel_grid = mark_exterior_interior(intersected_voxel_grid);
-
-    extract_surface(marked_voxel_grid);
-
-
-    bool res = write_voxel_obj("out.obj", marked_voxel_grid);
-
-    json cj = export_voxel_to_cityjson(marked_voxel_grid);
-
-    write_json(cj, "out.city.json");
+    // Usage: hw3 [input.obj] [--threads N] [--connectivity 6|18|26]
+    //            [--layout linear|brick|sparse] [--resolution R]
+    //            [--voxelize flat|hierarchical]
+    //            [--exterior bfs|bitwise|coarse|parity] [--mesh voxels|greedy]
+    //            [--cityjson document|seq] [--indent N]
+    //            [--save voxelize|intersect|label|surface FILE]...
+    //            [--resume FILE] [--checkpoint-compression rle|none]
+    //            [--incremental STATE] [--metrics FILE] [--trace FILE]
+    //            [--room-stats FILE] [--close-gaps WIDTH]
+    //            [--export-labels LABEL,...] [--ply FILE]
+    //            [--tiles DIR] [--tile-budget MIB] [--runs]
+    //        hw3 --batch MANIFEST [--jobs K] [--memory-budget MIB] [options]
+    const char *filename = "../../input/open_house_ifc4.obj";
+    unsigned int num_threads = 0; // 0: use all hardware threads
+    Connectivity connectivity = Connectivity::Eighteen;
+    VoxelLayout layout = VoxelLayout::Linear;
+    double resolution = 0.5;
+    VoxelizeMethod voxelize_method = VoxelizeMethod::Flat;
+    ExteriorMethod exterior_method = ExteriorMethod::FloodFill;
+    bool exterior_given = false;
+    ExportMesh mesh = ExportMesh::Voxels;
+    CityJSONFormat cityjson_format = CityJSONFormat::Document;
+    int indent = -1; // compact
+    map<PipelineStage, string> checkpoints; // stage -> file to save it to
+    string resume_file;
+    bool compress_checkpoints = true;
+    string incremental_state;
+    string metrics_file, trace_file;
+    string room_stats_file;
+    double gap_width = 0; // widest gap to seal before labelling, 0: none
+    // Groups of the OBJ (and PLY) export; by default the intersected voxels
+    // without a group name
+    vec<VoxelExportGroup> export_groups = {{"", {VoxelLabel::INTERSECTED}}};
+    string ply_file;
+    string batch_manifest;
+    unsigned int concurrent_jobs = 0;
+    size_t memory_budget = 0; // bytes, 0: unlimited
+    string tiles_directory;
+    size_t tile_budget = TiledOptions().tile_budget;
+    bool use_runs = false; // keep the labelled grid as run-length columns
+    for (int i = 1; i < argc; i++) {
+        const string arg = argv[i];
+        if ((arg == "--threads" || arg == "-j") && i + 1 < argc) {
+            if (!parse_unsigned(argv[++i], num_threads)) {
+                cerr << "Invalid thread count " << argv[i]
+                     << ", expected a non-negative integer" << endl;
+                return 1;
+            }
+        } else if (arg == "--connectivity" && i + 1 < argc) {
+            const string value = argv[++i];
+            if (value == "6") {
+                connectivity = Connectivity::Six;
+            } else if (value == "26") {
+                connectivity = Connectivity::TwentySix;
+            } else if (value != "18") {
+                cerr << "Unsupported connectivity " << value
+                     << ", expected 6, 18 or 26" << endl;
+                return 1;
+            }
+        } else if (arg == "--layout" && i + 1 < argc) {
+            const string value = argv[++i];
+            if (value == "linear") {
+                layout = VoxelLayout::Linear;
+            } else if (value == "brick") {
+                layout = VoxelLayout::Brick;
+            } else if (value == "sparse") {
+                layout = VoxelLayout::SparseBrick;
+            } else {
+                cerr << "Unsupported layout " << value
+                     << ", expected linear, brick or sparse" << endl;
+                return 1;
+            }
+        } else if (arg == "--exterior" && i + 1 < argc) {
+            const string value = argv[++i];
+            if (value == "bfs") {
+                exterior_method = ExteriorMethod::FloodFill;
+            } else if (value == "bitwise") {
+                exterior_method = ExteriorMethod::Bitwise;
+            } else if (value == "coarse") {
+                exterior_method = ExteriorMethod::Coarse;
+            } else if (value == "parity") {
+                exterior_method = ExteriorMethod::Parity;
+            } else {
+                cerr << "Unsupported exterior method " << value
+                     << ", expected bfs, bitwise, coarse or parity" << endl;
+                return 1;
+            }
+            exterior_given = true;
+        } else if (arg == "--voxelize" && i + 1 < argc) {
+            const string value = argv[++i];
+            if (value == "flat") {
+                voxelize_method = VoxelizeMethod::Flat;
+            } else if (value == "hierarchical") {
+                voxelize_method = VoxelizeMethod::Hierarchical;
+            } else {
+                cerr << "Unsupported voxelize method " << value
+                     << ", expected flat or hierarchical" << endl;
+                return 1;
+            }
+        } else if (arg == "--mesh" && i + 1 < argc) {
+            const string value = argv[++i];
+            if (value == "voxels") {
+                mesh = ExportMesh::Voxels;
+            } else if (value == "greedy") {
+                mesh = ExportMesh::Greedy;
+            } else {
+                cerr << "Unsupported mesh " << value
+                     << ", expected voxels or greedy" << endl;
+                return 1;
+            }
+        } else if (arg == "--cityjson" && i + 1 < argc) {
+            const string value = argv[++i];
+            if (value == "document") {
+                cityjson_format = CityJSONFormat::Document;
+            } else if (value == "seq") {
+                cityjson_format = CityJSONFormat::Sequence;
+            } else {
+                cerr << "Unsupported CityJSON format " << value
+                     << ", expected document or seq" << endl;
+                return 1;
+            }
+        } else if (arg == "--indent" && i + 1 < argc) {
+            const unsigned int max_indent = numeric_limits<int>::max();
+            unsigned int spaces;
+            if (!parse_unsigned(argv[++i], spaces) || spaces > max_indent) {
+                cerr << "Invalid indent " << argv[i]
+                     << ", expected a non-negative integer" << endl;
+                return 1;
+            }
+            indent = static_cast<int>(spaces);
+        } else if (arg == "--save" && i + 2 < argc) {
+            PipelineStage stage;
+            if (!parse_pipeline_stage(argv[++i], stage)) {
+                cerr << "Unsupported stage " << argv[i]
+                     << ", expected voxelize, intersect, label or surface"
+                     << endl;
+                return 1;
+            }
+            checkpoints[stage] = argv[++i];
+        } else if (arg == "--resume" && i + 1 < argc) {
+            resume_file = argv[++i];
+        } else if (arg == "--checkpoint-compression" && i + 1 < argc) {
+            const string value = argv[++i];
+            if (value == "rle") {
+                compress_checkpoints = true;
+            } else if (value == "none") {
+                compress_checkpoints = false;
+            } else {
+                cerr << "Unsupported checkpoint compression " << value
+                     << ", expected rle or none" << endl;
+                return 1;
+            }
+        } else if (arg == "--incremental" && i + 1 < argc) {
+            incremental_state = argv[++i];
+        } else if (arg == "--room-stats" && i + 1 < argc) {
+            room_stats_file = argv[++i];
+        } else if (arg == "--metrics" && i + 1 < argc) {
+            metrics_file = argv[++i];
+        } else if (arg == "--trace" && i + 1 < argc) {
+            trace_file = argv[++i];
+        } else if (arg == "--close-gaps" && i + 1 < argc) {
+            if (!parse_double(argv[++i], gap_width) || gap_width < 0) {
+                cerr << "Invalid gap width " << argv[i]
+                     << ", expected a non-negative number" << endl;
+                return 1;
+            }
+        } else if (arg == "--export-labels" && i + 1 < argc) {
+            export_groups.clear();
+            stringstream names(argv[++i]);
+            string name;
+            while (getline(names, name, ',')) {
+                VoxelLabel label;
+                if (!parse_voxel_label(name, label)) {
+                    cerr << "Unsupported label " << name
+                         << ", expected intersected, exterior, interior or "
+                            "unlabeled" << endl;
+                    return 1;
+                }
+                export_groups.push_back({name, {label}});
+            }
+        } else if (arg == "--ply" && i + 1 < argc) {
+            ply_file = argv[++i];
+        } else if (arg == "--batch" && i + 1 < argc) {
+            batch_manifest = argv[++i];
+        } else if (arg == "--jobs" && i + 1 < argc) {
+            if (!parse_unsigned(argv[++i], concurrent_jobs)) {
+                cerr << "Invalid job count " << argv[i]
+                     << ", expected a non-negative integer" << endl;
+                return 1;
+            }
+        } else if (arg == "--memory-budget" && i + 1 < argc) {
+            double mib;
+            if (!parse_double(argv[++i], mib) || mib < 0) {
+                cerr << "Invalid memory budget " << argv[i]
+                     << ", expected a non-negative number of MiB" << endl;
+                return 1;
+            }
+            memory_budget = static_cast<size_t>(mib * 1024 * 1024);
+        } else if (arg == "--tiles" && i + 1 < argc) {
+            tiles_directory = argv[++i];
+        } else if (arg == "--tile-budget" && i + 1 < argc) {
+            double mib;
+            if (!parse_double(argv[++i], mib) || !(mib > 0)) {
+                cerr << "Invalid tile budget " << argv[i]
+                     << ", expected a positive number of MiB" << endl;
+                return 1;
+            }
+            tile_budget = static_cast<size_t>(mib * 1024 * 1024);
+        } else if (arg == "--runs") {
+            use_runs = true;
+        } else if (arg == "--resolution" && i + 1 < argc) {
+            if (!parse_double(argv[++i], resolution) || !(resolution > 0)) {
+                cerr << "Invalid resolution " << argv[i]
+                     << ", expected a positive number" << endl;
+                return 1;
+            }
+        } else {
+            filename = argv[i];
+        }
+    }
+    // The hierarchical mode also labels at the coarse level unless told
+    // otherwise
+    if (voxelize_method == VoxelizeMethod::Hierarchical && !exterior_given) {
+        exterior_method = ExteriorMethod::Coarse;
+    }
+    // The runs replace the grid before the surface stage, so there is no grid
+    // to keep for an incremental state or a surface checkpoint
+    if (use_runs && (!incremental_state.empty() ||
+                     checkpoints.count(PipelineStage::Surface) ||
+                     !tiles_directory.empty() || !batch_manifest.empty())) {
+        cerr << "--runs cannot be combined with --incremental, --save surface, "
+                "--tiles or --batch" << endl;
+        return 1;
+    }
+    // A tiled run writes its tiles instead of the usual outputs and never
+    // holds the whole grid
+    const bool tiled = !tiles_directory.empty();
+    if (tiled && (!resume_file.empty() || !checkpoints.empty() ||
+                  !incremental_state.empty() || gap_width > 0 ||
+                  !room_stats_file.empty() || !ply_file.empty() ||
+                  !batch_manifest.empty())) {
+        cerr << "--tiles cannot be combined with --resume, --save, "
+                "--incremental, --close-gaps, --room-stats, --ply or --batch"
+             << endl;
+        return 1;
+    }
+    if (!batch_manifest.empty()) {
+        // The jobs bring their own inputs, resolutions and outputs; metrics
+        // are not recorded since the stages of the jobs overlap
+        if (!resume_file.empty() || !checkpoints.empty() ||
+            !incremental_state.empty() || !metrics_file.empty() ||
+            !trace_file.empty() || !room_stats_file.empty() ||
+            !ply_file.empty()) {
+            cerr << "--batch cannot be combined with --resume, --save, "
+                    "--incremental, --metrics, --trace, --room-stats or --ply"
+                 << endl;
+            return 1;
+        }
+        vec<BatchJob> jobs;
+        if (!read_batch_manifest(batch_manifest, jobs, memory_budget)) {
+            return 1;
+        }
+        BatchOptions options;
+        options.num_threads = num_threads;
+        options.concurrent_jobs = concurrent_jobs;
+        options.memory_budget = memory_budget;
+        options.connectivity = connectivity;
+        options.layout = layout;
+        options.voxelize_method = voxelize_method;
+        options.exterior_method = exterior_method;
+        options.mesh = mesh;
+        options.cityjson_format = cityjson_format;
+        options.indent = indent;
+        options.gap_width = gap_width;
+        options.export_groups = export_groups;
+        return run_batch(jobs, options) ? 0 : 1;
+    }
+
+    // An incremental run may skip stages, and its state already is a
+    // checkpoint of the final grid
+    const bool incremental = !incremental_state.empty();
+    if (incremental && (!resume_file.empty() || !checkpoints.empty())) {
+        cerr << "--incremental cannot be combined with --resume or --save"
+             << endl;
+        return 1;
+    }
+    // The state keeps the sealed voxels as intersected ones, which an update
+    // could not tell from the geometry
+    if (incremental && gap_width > 0) {
+        cerr << "--incremental cannot be combined with --close-gaps" << endl;
+        return 1;
+    }
+
+    if (!metrics_file.empty() || !trace_file.empty()) {
+        enable_metrics();
+    }
+    StageTimer run_stage("hw3");
+
+    // A resumed run skips every stage up to the one in the checkpoint; the
+    // grid carries its own resolution and layout
+    VoxelGrid grid(0, 0, 0, {0, 0, 0});
+    PipelineStage resumed_stage = PipelineStage::Voxelized;
+    const bool resumed = !resume_file.empty();
+    if (resumed) {
+        if (!read_checkpoint(resume_file, grid, resumed_stage)) {
+            return 1;
+        }
+        cout << "Resuming after " << pipeline_stage_name(resumed_stage)
+             << " from " << resume_file << endl;
+    }
+    auto skip = [&](PipelineStage stage) {
+        return resumed && stage <= resumed_stage;
+    };
+    auto save = [&](PipelineStage stage) {
+        const auto checkpoint = checkpoints.find(stage);
+        return checkpoint == checkpoints.end() ||
+               write_checkpoint(checkpoint->second, grid, stage,
+                                compress_checkpoints);
+    };
+
+    ObjectIndex object_index;
+    bool updated = false; // whether the incremental update made the final grid
+    // Ray parity labels from the triangles, so it needs the OBJ too
+    const bool parity = exterior_method == ExteriorMethod::Parity;
+    TriangleStore triangles;
+    vec<double> vertices;
+    if (!skip(PipelineStage::Intersected) ||
+        (parity && !skip(PipelineStage::Labelled))) {
+        std::cout << "Processing: " << filename << " with "
+                  << resolve_thread_count(num_threads) << " threads" << std::endl;
+        BIMObjects bim_objects;
+        tie(bim_objects, vertices) = read_obj(string(filename));
+
+        assign_semantics(bim_objects);
+
+        cout << "Reading obj finished :" << bim_objects.size() << "faces" << endl;
+        // The stages only need the flat triangles; the objects are freed here
+        triangles = make_triangle_store(bim_objects);
+    }
+    if (tiled) {
+        TiledOptions options;
+        options.directory = tiles_directory;
+        options.tile_budget = tile_budget;
+        options.connectivity = connectivity;
+        options.num_threads = num_threads;
+        options.voxelize_method = voxelize_method;
+        options.exterior_method = exterior_method;
+        options.compress = compress_checkpoints;
+        if (!voxelize_tiled(triangles, vertices, resolution, options)) {
+            return 1;
+        }
+        run_stage.stop();
+        if (!metrics_file.empty() && !write_metrics_json(metrics_file)) {
+            return 1;
+        }
+        if (!trace_file.empty() && !write_chrome_trace(trace_file)) {
+            return 1;
+        }
+        return 0;
+    }
+    if (!skip(PipelineStage::Intersected)) {
+        if (!skip(PipelineStage::Voxelized)) {
+            grid = create_voxel(vertices, 2, resolution, layout);
+            cout << "Finished creating voxel" << grid.num_voxels() << endl;
+            if (!save(PipelineStage::Voxelized)) {
+                return 1;
+            }
+        }
+        if (incremental) {
+            object_index = index_bim_objects(grid, triangles);
+            updated = update_from_incremental_state(
+                    incremental_state, triangles, object_index, grid,
+                    connectivity, num_threads, voxelize_method,
+                    exterior_method);
+        }
+        if (!updated) {
+            grid = intersection_with_bim_obj(grid, triangles, num_threads,
+                                             voxelize_method);
+            if (!save(PipelineStage::Intersected)) {
+                return 1;
+            }
+        }
+    }
+
+    if (!updated && !skip(PipelineStage::Labelled)) {
+        // Gaps are sealed for the labelling only; the seals that separate
+        // nothing are given back afterwards
+        const vec<size_t> sealed = gap_width > 0
+                                   ? close_gaps(grid, gap_width, num_threads)
+                                   : vec<size_t>();
+        grid = mark_exterior_interior(grid, connectivity, num_threads,
+                                      exterior_method, &triangles);
+        if (!sealed.empty()) {
+            reopen_gaps(grid, sealed, connectivity);
+        }
+        if (!save(PipelineStage::Labelled)) {
+            return 1;
+        }
+    }
+
+    // The outputs read the grid or its runs alike
+    auto write_outputs = [&](const auto &voxels) {
+        write_voxel_obj("out.obj", voxels, export_groups, mesh);
+        if (!ply_file.empty() &&
+            !write_voxel_ply(ply_file, voxels, export_groups, mesh)) {
+            return false;
+        }
+
+        // Room volumes, areas and extents go into the CityJSON room objects
+        const vec<RoomStatistics> rooms = room_statistics(voxels, num_threads);
+        if (!room_stats_file.empty() &&
+            !write_room_statistics_csv(room_stats_file, voxels, rooms)) {
+            return false;
+        }
+
+        write_voxel_cityjson(cityjson_format == CityJSONFormat::Sequence
+                             ? "out.city.jsonl" : "out.city.json",
+                             voxels, mesh, cityjson_format, indent,
+                             room_attributes(voxels, rooms));
+        return true;
+    };
+
+    if (use_runs) {
+        // The dense grid is freed; the surface is extracted on the runs
+        VoxelRuns runs = encode_voxel_runs(grid, num_threads);
+        grid = VoxelGrid(0, 0, 0, {0, 0, 0});
+        cout << "voxel runs: " << runs.runs.size() << " ("
+             << runs.memory_usage() / (1024.0 * 1024.0) << " MiB)" << endl;
+        if (!skip(PipelineStage::Surface)) {
+            extract_surface(runs, eighteen_connectivity, num_threads);
+        }
+        if (!write_outputs(runs)) {
+            return 1;
+        }
+    } else {
+        if (!updated && !skip(PipelineStage::Surface)) {
+            extract_surface(grid, eighteen_connectivity, num_threads);
+            if (!save(PipelineStage::Surface)) {
+                return 1;
+            }
+        }
+
+        if (incremental && !write_incremental_state(incremental_state, grid,
+                                                    object_index, connectivity,
+                                                    parity)) {
+            return 1;
+        }
+
+        if (!write_outputs(grid)) {
+            return 1;
+        }
+    }
 
+    run_stage.stop();
+    if (!metrics_file.empty() && !write_metrics_json(metrics_file)) {
+        return 1;
+    }
+    if (!trace_file.empty() && !write_chrome_trace(trace_file)) {
+        return 1;
+    }
     return 0;
 }
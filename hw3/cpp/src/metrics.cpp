@@ -0,0 +1,205 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include "types.h"
+#include <chrono>
+#include <cstdint>
+#include <ctime>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <string>
+
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+
+// Per-stage metrics: wall time, CPU time of the process, peak resident memory
+// and named counters (triangles read, exact tests, voxels per label, ...) of
+// every stage that is timed with a StageTimer. Stages nest; a counter goes to
+// the innermost stage that is running. Nothing is recorded until
+// enable_metrics() is called, and until then a StageTimer or a counter costs
+// one test of a flag. The stages can be written as a JSON summary or as
+// Chrome trace events, which chrome://tracing and Perfetto show as a
+// timeline.
+//
+// Recording is not thread-safe: parallel stages count per thread and add the
+// totals from the thread that started them.
+
+struct StageMetrics {
+    string name;
+    unsigned int depth;   // number of enclosing stages
+    double start_seconds; // since enable_metrics()
+    double wall_seconds = 0;
+    double cpu_seconds = 0;
+    double peak_mib = 0; // peak resident memory of the process at the end
+    map<string, uint64_t> counters;
+};
+
+struct MetricsRecorder {
+    bool enabled = false;
+    chrono::steady_clock::time_point start;
+    vec<StageMetrics> stages; // in order of their start
+    vec<size_t> running;      // indices into stages, innermost last
+};
+
+MetricsRecorder &metrics_recorder() {
+    static MetricsRecorder recorder;
+    return recorder;
+}
+
+inline bool metrics_enabled() {
+    return metrics_recorder().enabled;
+}
+
+void enable_metrics() {
+    MetricsRecorder &recorder = metrics_recorder();
+    recorder.enabled = true;
+    recorder.start = chrono::steady_clock::now();
+}
+
+// Peak resident set size of the process in MiB, 0 where unavailable
+double peak_memory_mib() {
+#ifdef _WIN32
+    return 0;
+#else
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+    return usage.ru_maxrss / (1024.0 * 1024.0); // bytes
+#else
+    return usage.ru_maxrss / 1024.0; // KiB
+#endif
+#endif
+}
+
+// CPU time of all threads of the process so far
+double process_cpu_seconds() {
+    return static_cast<double>(clock()) / CLOCKS_PER_SEC;
+}
+
+double metrics_elapsed_seconds() {
+    return chrono::duration<double>(chrono::steady_clock::now() -
+                                    metrics_recorder().start).count();
+}
+
+// Adds `value` to a counter of the innermost running stage
+inline void add_metric_counter(const char *name, uint64_t value) {
+    MetricsRecorder &recorder = metrics_recorder();
+    if (!recorder.enabled || recorder.running.empty()) {
+        return;
+    }
+    recorder.stages[recorder.running.back()].counters[name] += value;
+}
+
+// Times the enclosing scope as a stage, or until stop()
+class StageTimer {
+public:
+    explicit StageTimer(const char *name) {
+        MetricsRecorder &recorder = metrics_recorder();
+        if (!recorder.enabled) {
+            return;
+        }
+        index = recorder.stages.size();
+        StageMetrics stage;
+        stage.name = name;
+        stage.depth = recorder.running.size();
+        stage.start_seconds = metrics_elapsed_seconds();
+        stage.cpu_seconds = process_cpu_seconds();
+        recorder.stages.push_back(stage);
+        recorder.running.push_back(index);
+    }
+
+    StageTimer(const StageTimer &) = delete;
+
+    StageTimer &operator=(const StageTimer &) = delete;
+
+    ~StageTimer() { stop(); }
+
+    void stop() {
+        if (index == NOT_RUNNING) {
+            return;
+        }
+        MetricsRecorder &recorder = metrics_recorder();
+        StageMetrics &stage = recorder.stages[index];
+        stage.wall_seconds = metrics_elapsed_seconds() - stage.start_seconds;
+        stage.cpu_seconds = process_cpu_seconds() - stage.cpu_seconds;
+        stage.peak_mib = peak_memory_mib();
+        // Stages end in reverse order of their start
+        while (!recorder.running.empty() && recorder.running.back() >= index) {
+            recorder.running.pop_back();
+        }
+        index = NOT_RUNNING;
+    }
+
+private:
+    static const size_t NOT_RUNNING = numeric_limits<size_t>::max();
+    size_t index = NOT_RUNNING;
+};
+
+json stage_metrics_to_json(const StageMetrics &stage) {
+    json j;
+    j["name"] = stage.name;
+    j["depth"] = stage.depth;
+    j["start_seconds"] = stage.start_seconds;
+    j["wall_seconds"] = stage.wall_seconds;
+    j["cpu_seconds"] = stage.cpu_seconds;
+    j["peak_rss_mib"] = stage.peak_mib;
+    j["counters"] = json::object();
+    for (const auto &counter: stage.counters) {
+        j["counters"][counter.first] = counter.second;
+    }
+    return j;
+}
+
+// {"stages": [...]} with the stages in order of their start
+bool write_metrics_json(const string &filename) {
+    json j;
+    j["stages"] = json::array();
+    for (const auto &stage: metrics_recorder().stages) {
+        j["stages"].push_back(stage_metrics_to_json(stage));
+    }
+    ofstream out(filename);
+    if (!out.is_open()) {
+        cerr << "Failed to open " << filename << endl;
+        return false;
+    }
+    out << j.dump(2) << endl;
+    return true;
+}
+
+// Chrome trace-event format: one complete ("X") event per stage, with the
+// counters as its arguments. Times are in microseconds.
+bool write_chrome_trace(const string &filename) {
+    json events = json::array();
+    for (const auto &stage: metrics_recorder().stages) {
+        json event;
+        event["name"] = stage.name;
+        event["cat"] = "hw3";
+        event["ph"] = "X";
+        event["ts"] = stage.start_seconds * 1e6;
+        event["dur"] = stage.wall_seconds * 1e6;
+        event["pid"] = 1;
+        event["tid"] = 1;
+        json args = json::object();
+        args["cpu_seconds"] = stage.cpu_seconds;
+        args["peak_rss_mib"] = stage.peak_mib;
+        for (const auto &counter: stage.counters) {
+            args[counter.first] = counter.second;
+        }
+        event["args"] = args;
+        events.push_back(event);
+    }
+    json j;
+    j["traceEvents"] = events;
+    j["displayTimeUnit"] = "ms";
+    ofstream out(filename);
+    if (!out.is_open()) {
+        cerr << "Failed to open " << filename << endl;
+        return false;
+    }
+    out << j.dump() << endl;
+    return true;
+}
+
+#endif
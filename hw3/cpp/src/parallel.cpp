@@ -0,0 +1,55 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <algorithm>
+#include <cstddef>
+#include <thread>
+#include <vector>
+
+// 0 means "use all hardware threads"
+unsigned int resolve_thread_count(unsigned int num_threads) {
+    if (num_threads == 0) {
+        num_threads = std::thread::hardware_concurrency();
+    }
+    return std::max(1u, num_threads);
+}
+
+// Splits [begin, end) into at most num_threads contiguous chunks whose
+// boundaries are multiples of `align` (relative to begin) and calls
+// fn(chunk_begin, chunk_end, chunk_index) for each chunk on its own thread.
+// Chunks never overlap, so writes into disjoint parts of a buffer are
+// race-free without locking.
+template<typename Fn>
+void parallel_for_chunks(size_t begin, size_t end, unsigned int num_threads,
+                         Fn fn, size_t align = 1) {
+    if (end <= begin) {
+        return;
+    }
+    const size_t units = (end - begin + align - 1) / align;
+    const size_t num_chunks =
+            std::min<size_t>(resolve_thread_count(num_threads), units);
+    if (num_chunks <= 1) {
+        fn(begin, end, 0);
+        return;
+    }
+    std::vector<std::thread> workers;
+    workers.reserve(num_chunks - 1);
+    size_t chunk_begin = begin;
+    for (size_t chunk = 0; chunk < num_chunks; chunk++) {
+        // Spread the remainder over the first chunks
+        const size_t chunk_units =
+                units / num_chunks + (chunk < units % num_chunks ? 1 : 0);
+        const size_t chunk_end = std::min(end, chunk_begin + chunk_units * align);
+        if (chunk + 1 == num_chunks) {
+            fn(chunk_begin, chunk_end, chunk);
+        } else {
+            workers.emplace_back(fn, chunk_begin, chunk_end, chunk);
+        }
+        chunk_begin = chunk_end;
+    }
+    for (auto &worker: workers) {
+        worker.join();
+    }
+}
+
+#endif
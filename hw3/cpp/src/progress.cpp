@@ -0,0 +1,37 @@
+#ifndef PROGRESS_H
+#define PROGRESS_H
+
+#include "types.h"
+#include <iostream>
+
+// Progress messages of the pipeline stages go through progress() rather than
+// straight to cout, so that a thread can turn its own messages off. Jobs that
+// run side by side in a batch do: their messages then go to a stream of their
+// own thread, and no two threads ever write to, or format on, one stream.
+
+thread_local bool progress_enabled = true;
+
+ostream &progress() {
+    if (progress_enabled) {
+        return cout;
+    }
+    // A stream without a buffer fails and drops whatever is written to it
+    thread_local ostream discarded(nullptr);
+    return discarded;
+}
+
+// Turns the progress messages of the calling thread off while it exists
+class QuietProgress {
+public:
+    QuietProgress() : was_enabled(progress_enabled) { progress_enabled = false; }
+
+    ~QuietProgress() { progress_enabled = was_enabled; }
+
+    QuietProgress(const QuietProgress &) = delete;
+    QuietProgress &operator=(const QuietProgress &) = delete;
+
+private:
+    bool was_enabled;
+};
+
+#endif
@@ -0,0 +1,299 @@
+#ifndef RAY_PARITY_H
+#define RAY_PARITY_H
+
+#include "metrics.cpp"
+#include "parallel.cpp"
+#include "progress.cpp"
+#include "types.h"
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+
+// Solid voxelization by ray parity. Every (x, y) column of the grid is a ray
+// along z through the voxel centres. The triangles whose footprint covers the
+// column are looked up in a 2D index of BRICK_SIZE x BRICK_SIZE column tiles,
+// the heights where they cross the ray are sorted, and a voxel centre with an
+// odd number of crossings below it lies inside the model. Columns do not
+// depend on each other, so the grid is classified in one parallel pass
+// without any fill; the price is that the model must consist of closed,
+// non-overlapping solids.
+
+// A triangle turned counter-clockwise in the xy plane, with the range of
+// columns its footprint may cover
+struct ParityTriangle {
+    double x[3], y[3], z[3];
+    unsigned int first[2], last[2];
+};
+
+// Edge function of (x, y) against the edge a -> b, positive on its left. It
+// is always evaluated from the lower endpoint, so the two triangles sharing an
+// edge get exactly opposite values and agree on which side a point lies.
+double parity_edge(double ax, double ay, double bx, double by, double x,
+                   double y) {
+    if (bx < ax || (bx == ax && by < ay)) {
+        return -((ax - bx) * (y - by) - (ay - by) * (x - bx));
+    }
+    return (bx - ax) * (y - ay) - (by - ay) * (x - ax);
+}
+
+// Whether a point exactly on the edge a -> b belongs to the triangle on its
+// left. Of the two directions of an edge exactly one owns it, so a ray
+// through a shared edge or vertex is counted once.
+bool parity_edge_owns(double ax, double ay, double bx, double by) {
+    return by < ay || (by == ay && bx < ax);
+}
+
+// Height at which the vertical line through (x, y) crosses the triangle, if
+// it does
+bool parity_crossing(const ParityTriangle &tri, double x, double y,
+                     double &z) {
+    double weights[3];
+    for (int i = 0; i < 3; i++) {
+        const int a = (i + 1) % 3, b = (i + 2) % 3;
+        weights[i] = parity_edge(tri.x[a], tri.y[a], tri.x[b], tri.y[b], x, y);
+        if (weights[i] < 0 ||
+            (weights[i] == 0 &&
+             !parity_edge_owns(tri.x[a], tri.y[a], tri.x[b], tri.y[b]))) {
+            return false;
+        }
+    }
+    const double sum = weights[0] + weights[1] + weights[2];
+    if (sum <= 0) {
+        return false;
+    }
+    z = (weights[0] * tri.z[0] + weights[1] * tri.z[1] +
+         weights[2] * tri.z[2]) / sum;
+    return true;
+}
+
+// Triangles of the model projected onto the columns of the grid, bucketed per
+// tile of BRICK_SIZE x BRICK_SIZE columns
+struct ParityIndex {
+    vec<ParityTriangle> triangles;
+    unsigned int tiles_x, tiles_y;
+    vec<size_t> tile_begin; // tiles_x * tiles_y + 1 offsets into tile_triangles
+    vec<uint32_t> tile_triangles;
+};
+
+ParityIndex build_parity_index(const VoxelGrid &vg,
+                               const TriangleStore &triangles) {
+    ParityIndex index;
+    const unsigned int columns[2] = {vg.size_x, vg.size_y};
+    for (size_t t = 0; t < triangles.size(); t++) {
+        ParityTriangle tri;
+        for (int i = 0; i < 3; i++) {
+            tri.x[i] = triangles.x[i][t];
+            tri.y[i] = triangles.y[i][t];
+            tri.z[i] = triangles.z[i][t];
+        }
+        // Vertical triangles only graze the rays
+        const double area = (tri.x[1] - tri.x[0]) * (tri.y[2] - tri.y[0]) -
+                            (tri.y[1] - tri.y[0]) * (tri.x[2] - tri.x[0]);
+        if (area == 0) {
+            continue;
+        }
+        if (area < 0) {
+            swap(tri.x[1], tri.x[2]);
+            swap(tri.y[1], tri.y[2]);
+            swap(tri.z[1], tri.z[2]);
+        }
+        // Columns whose centre may lie in the footprint, widened by one
+        // so that rounding never drops one
+        bool covers = true;
+        for (int axis = 0; axis < 2 && covers; axis++) {
+            const double *coords = axis == 0 ? tri.x : tri.y;
+            const double lo = *min_element(coords, coords + 3);
+            const double hi = *max_element(coords, coords + 3);
+            const double first = floor((lo - vg.offset_origin[axis]) /
+                                       vg.resolution - 0.5);
+            const double last = ceil((hi - vg.offset_origin[axis]) /
+                                     vg.resolution - 0.5);
+            covers = last >= 0 && first < columns[axis];
+            tri.first[axis] = first < 0 ? 0 : static_cast<unsigned int>(first);
+            tri.last[axis] = last >= columns[axis]
+                             ? columns[axis] - 1
+                             : static_cast<unsigned int>(last);
+        }
+        if (covers) {
+            index.triangles.push_back(tri);
+        }
+    }
+
+    index.tiles_x = (vg.size_x + BRICK_SIZE - 1) / BRICK_SIZE;
+    index.tiles_y = (vg.size_y + BRICK_SIZE - 1) / BRICK_SIZE;
+    const size_t num_tiles = static_cast<size_t>(index.tiles_x) * index.tiles_y;
+    auto for_each_tile = [&](const ParityTriangle &tri, auto fn) {
+        for (unsigned int tx = tri.first[0] / BRICK_SIZE;
+             tx <= tri.last[0] / BRICK_SIZE; tx++) {
+            for (unsigned int ty = tri.first[1] / BRICK_SIZE;
+                 ty <= tri.last[1] / BRICK_SIZE; ty++) {
+                fn(static_cast<size_t>(tx) * index.tiles_y + ty);
+            }
+        }
+    };
+    // Count, then fill, so every tile's triangles are contiguous and in
+    // model order
+    index.tile_begin.assign(num_tiles + 1, 0);
+    for (const auto &tri: index.triangles) {
+        for_each_tile(tri, [&](size_t tile) { index.tile_begin[tile + 1]++; });
+    }
+    for (size_t tile = 0; tile < num_tiles; tile++) {
+        index.tile_begin[tile + 1] += index.tile_begin[tile];
+    }
+    index.tile_triangles.resize(index.tile_begin[num_tiles]);
+    vec<size_t> next(index.tile_begin.begin(), index.tile_begin.end() - 1);
+    for (uint32_t i = 0; i < index.triangles.size(); i++) {
+        for_each_tile(index.triangles[i], [&](size_t tile) {
+            index.tile_triangles[next[tile]++] = i;
+        });
+    }
+    return index;
+}
+
+// Marks every UNLABELED voxel whose centre lies outside the model, by ray
+// parity along z, as EXTERIOR and leaves the ones inside UNLABELED for the
+// room labelling. Columns with an odd number of crossings run through an
+// opening of the model and are left exterior as a whole. On sparse grids the
+// background becomes EXTERIOR and bricks with voxels inside are allocated.
+// Returns the number of exterior voxels.
+size_t mark_exterior_parity(VoxelGrid &vg, const TriangleStore &triangles,
+                            unsigned int num_threads) {
+    const ParityIndex index = build_parity_index(vg, triangles);
+    const VoxelGrid &stored = vg;
+    const bool sparse = vg.is_sparse();
+
+    struct ChunkCounts {
+        size_t exterior = 0;
+        uint64_t crossings = 0;
+        size_t open_columns = 0;
+    };
+    vec<ChunkCounts> chunk_counts(resolve_thread_count(num_threads));
+    // Slabs are whole tiles wide, which are whole bricks, so no two threads
+    // share a brick (or a sparse brick hash)
+    parallel_for_chunks(0, vg.size_x, num_threads,
+                        [&](size_t x_begin, size_t x_end, size_t chunk) {
+        ChunkCounts &counts = chunk_counts[chunk];
+        vec<double> crossings;
+        // Inside flags of the voxels of a tile, column by column
+        vec<uint8_t> inside(BRICK_SIZE * BRICK_SIZE * vg.size_z);
+        for (unsigned int tx = x_begin / BRICK_SIZE;
+             tx * BRICK_SIZE < x_end; tx++) {
+            const unsigned int tile_x_end =
+                    min<unsigned int>(x_end, (tx + 1) * BRICK_SIZE);
+            for (unsigned int ty = 0; ty < index.tiles_y; ty++) {
+                const size_t tile = static_cast<size_t>(tx) * index.tiles_y + ty;
+                const unsigned int tile_y_end =
+                        min(vg.size_y, (ty + 1) * BRICK_SIZE);
+                auto column_inside = [&](unsigned int x, unsigned int y) {
+                    return &inside[((x % BRICK_SIZE) * BRICK_SIZE +
+                                    y % BRICK_SIZE) * vg.size_z];
+                };
+
+                // 1. Sort the crossings of every column and flag the voxel
+                // centres with an odd number of crossings below them
+                for (unsigned int x = tx * BRICK_SIZE; x < tile_x_end; x++) {
+                    const double center_x = vg.offset_origin[0] +
+                                            (x + 0.5) * vg.resolution;
+                    for (unsigned int y = ty * BRICK_SIZE; y < tile_y_end; y++) {
+                        const double center_y = vg.offset_origin[1] +
+                                                (y + 0.5) * vg.resolution;
+                        crossings.clear();
+                        for (size_t i = index.tile_begin[tile];
+                             i < index.tile_begin[tile + 1]; i++) {
+                            const ParityTriangle &tri =
+                                    index.triangles[index.tile_triangles[i]];
+                            double z;
+                            if (x >= tri.first[0] && x <= tri.last[0] &&
+                                y >= tri.first[1] && y <= tri.last[1] &&
+                                parity_crossing(tri, center_x, center_y, z)) {
+                                crossings.push_back(z);
+                            }
+                        }
+                        counts.crossings += crossings.size();
+                        uint8_t *flags = column_inside(x, y);
+                        fill(flags, flags + vg.size_z, 0);
+                        if (crossings.size() % 2 != 0) {
+                            counts.open_columns++;
+                            continue;
+                        }
+                        sort(crossings.begin(), crossings.end());
+                        size_t below = 0;
+                        for (unsigned int z = 0; z < vg.size_z; z++) {
+                            const double center_z = vg.offset_origin[2] +
+                                                    (z + 0.5) * vg.resolution;
+                            while (below < crossings.size() &&
+                                   crossings[below] < center_z) {
+                                below++;
+                            }
+                            flags[z] = below % 2;
+                        }
+                    }
+                }
+
+                // 2. Sparse grids need the bricks that hold inside voxels
+                // before any of their voxels is relabelled
+                if (sparse) {
+                    for (unsigned int x = tx * BRICK_SIZE; x < tile_x_end; x++) {
+                        for (unsigned int y = ty * BRICK_SIZE; y < tile_y_end;
+                             y++) {
+                            const uint8_t *flags = column_inside(x, y);
+                            for (unsigned int z = 0; z < vg.size_z; z++) {
+                                if (flags[z]) {
+                                    vg.sparse_brick(x, y, z);
+                                    z = z / BRICK_SIZE * BRICK_SIZE +
+                                        BRICK_SIZE - 1;
+                                }
+                            }
+                        }
+                    }
+                }
+
+                // 3. Everything empty and outside is exterior; unallocated
+                // bricks only count, they take the new background value
+                for (unsigned int x = tx * BRICK_SIZE; x < tile_x_end; x++) {
+                    for (unsigned int y = ty * BRICK_SIZE; y < tile_y_end; y++) {
+                        const uint8_t *flags = column_inside(x, y);
+                        for (unsigned int z = 0; z < vg.size_z; z++) {
+                            if (sparse && !stored.sparse_brick(x, y, z)) {
+                                const unsigned int brick_end = min(
+                                        vg.size_z,
+                                        (z / BRICK_SIZE + 1) * BRICK_SIZE);
+                                counts.exterior += brick_end - z;
+                                z = brick_end - 1;
+                                continue;
+                            }
+                            if (flags[z] ||
+                                stored(x, y, z).label != VoxelLabel::UNLABELED) {
+                                continue;
+                            }
+                            vg(x, y, z).label = VoxelLabel::EXTERIOR;
+                            vg.room_id(x, y, z) = 0;
+                            counts.exterior++;
+                        }
+                    }
+                }
+            }
+        }
+    }, BRICK_SIZE);
+    if (sparse) {
+        vg.background.label = VoxelLabel::EXTERIOR;
+    }
+
+    size_t exterior = 0, open_columns = 0;
+    for (const auto &counts: chunk_counts) {
+        exterior += counts.exterior;
+        open_columns += counts.open_columns;
+        add_metric_counter("parity_crossings", counts.crossings);
+    }
+    add_metric_counter("parity_triangles", index.triangles.size());
+    add_metric_counter("parity_open_columns", open_columns);
+    if (open_columns > 0) {
+        progress() << "columns through an opening of the model: "
+                   << open_columns << "\n";
+    }
+    return exterior;
+}
+
+#endif
@@ -0,0 +1,235 @@
+#ifndef ROOM_STATS_H
+#define ROOM_STATS_H
+
+#include "cjson.cpp"
+#include "metrics.cpp"
+#include "parallel.cpp"
+#include "progress.cpp"
+#include "types.h"
+#include "voxel_runs.cpp"
+#include "voxelgrid.cpp"
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <string>
+
+// Per-room statistics of a labelled grid: voxel count and volume, the area
+// of the room's boundary by the semantics of the voxels that bound it, its
+// bounding box and centroid. They come from one pass over the grid, split
+// into x-slabs; every thread fills its own table and the tables are merged
+// afterwards. Sums are kept in integer voxel units, so the result does not
+// depend on the thread count.
+
+const unsigned int NUM_SEMANTICS =
+        static_cast<unsigned int>(Semantics::FloorSurface) + 1;
+
+struct RoomStatistics {
+    uint64_t voxels = 0;
+    // Faces between the room and an intersected voxel, by the semantics of
+    // that voxel
+    uint64_t faces[NUM_SEMANTICS] = {};
+    uint64_t floor_faces = 0; // faces with an intersected voxel below
+    unsigned int first[3] = {numeric_limits<unsigned int>::max(),
+                             numeric_limits<unsigned int>::max(),
+                             numeric_limits<unsigned int>::max()};
+    unsigned int last[3] = {0, 0, 0};
+    uint64_t index_sum[3] = {0, 0, 0}; // of the voxel indices, for the centroid
+
+    void merge(const RoomStatistics &other) {
+        voxels += other.voxels;
+        floor_faces += other.floor_faces;
+        for (unsigned int s = 0; s < NUM_SEMANTICS; s++) {
+            faces[s] += other.faces[s];
+        }
+        for (int axis = 0; axis < 3; axis++) {
+            first[axis] = min(first[axis], other.first[axis]);
+            last[axis] = max(last[axis], other.last[axis]);
+            index_sum[axis] += other.index_sum[axis];
+        }
+    }
+};
+
+// Statistics of every room, indexed by room id, of a VoxelGrid or VoxelRuns
+template<typename Grid>
+vec<RoomStatistics> room_statistics(const Grid &vg,
+                                    unsigned int num_threads = 0) {
+    StageTimer stage("room_statistics");
+    vec<vec<RoomStatistics>> chunk_rooms(resolve_thread_count(num_threads));
+    const int size[3] = {static_cast<int>(vg.size_x), static_cast<int>(vg.size_y),
+                         static_cast<int>(vg.size_z)};
+    // Whole bricks per thread, as sparse grids want
+    parallel_for_chunks(0, vg.size_x, num_threads, [&](size_t x_begin,
+                                                       size_t x_end,
+                                                       size_t chunk) {
+        vec<RoomStatistics> &rooms = chunk_rooms[chunk];
+        for_each_voxel_with_labels(vg, x_begin, x_end, {VoxelLabel::INTERIOR},
+                                   [&](unsigned int x, unsigned int y,
+                                       unsigned int z) {
+            const RoomID room_id = vg.room_id(x, y, z);
+            if (room_id >= rooms.size()) {
+                rooms.resize(room_id + 1);
+            }
+            RoomStatistics &room = rooms[room_id];
+            const unsigned int xyz[3] = {x, y, z};
+            room.voxels++;
+            for (int axis = 0; axis < 3; axis++) {
+                room.first[axis] = min(room.first[axis], xyz[axis]);
+                room.last[axis] = max(room.last[axis], xyz[axis]);
+                room.index_sum[axis] += xyz[axis];
+            }
+            // Interior voxels only lie on the border of a tile of a tiled
+            // run, where the neighbours beyond are left out
+            for (int i = 0; i < 6; i++) {
+                const vec<int> &offset = six_connectivity[i];
+                const int adj[3] = {static_cast<int>(x) + offset[0],
+                                    static_cast<int>(y) + offset[1],
+                                    static_cast<int>(z) + offset[2]};
+                if (adj[0] < 0 || adj[1] < 0 || adj[2] < 0 ||
+                    adj[0] >= size[0] || adj[1] >= size[1] ||
+                    adj[2] >= size[2]) {
+                    continue;
+                }
+                const VoxelInfo neighbour = vg(adj[0], adj[1], adj[2]);
+                if (neighbour.label != VoxelLabel::INTERSECTED) {
+                    continue;
+                }
+                room.faces[static_cast<unsigned int>(neighbour.semantics)]++;
+                if (offset[2] < 0) {
+                    room.floor_faces++;
+                }
+            }
+        });
+    }, BRICK_SIZE);
+
+    vec<RoomStatistics> rooms;
+    for (const auto &chunk: chunk_rooms) {
+        if (chunk.size() > rooms.size()) {
+            rooms.resize(chunk.size());
+        }
+        for (size_t i = 0; i < chunk.size(); i++) {
+            rooms[i].merge(chunk[i]);
+        }
+    }
+    // The table is indexed by room id, so count the rooms that have voxels
+    if (metrics_enabled()) {
+        size_t found = 0;
+        for (const auto &room: rooms) {
+            found += room.voxels > 0;
+        }
+        add_metric_counter("rooms", found);
+    }
+    return rooms;
+}
+
+// Model coordinates of the statistics
+struct RoomMeasures {
+    double volume;
+    double floor_area;
+    double areas[NUM_SEMANTICS];
+    double bbox[6]; // xmin, ymin, zmin, xmax, ymax, zmax
+    double centroid[3];
+};
+
+template<typename Grid>
+RoomMeasures room_measures(const Grid &vg, const RoomStatistics &room) {
+    RoomMeasures measures;
+    const double face_area = vg.resolution * vg.resolution;
+    measures.volume = room.voxels * face_area * vg.resolution;
+    measures.floor_area = room.floor_faces * face_area;
+    for (unsigned int s = 0; s < NUM_SEMANTICS; s++) {
+        measures.areas[s] = room.faces[s] * face_area;
+    }
+    for (int axis = 0; axis < 3; axis++) {
+        measures.bbox[axis] =
+                vg.offset_origin[axis] + room.first[axis] * vg.resolution;
+        measures.bbox[axis + 3] =
+                vg.offset_origin[axis] + (room.last[axis] + 1) * vg.resolution;
+        measures.centroid[axis] =
+                vg.offset_origin[axis] +
+                (static_cast<double>(room.index_sum[axis]) / room.voxels + 0.5) *
+                vg.resolution;
+    }
+    return measures;
+}
+
+// The statistics as "attributes" of the room city objects. Rooms without a
+// voxel in the grid (none when the ids come from mark_exterior_interior) are
+// left out.
+template<typename Grid>
+CityObjectAttributes room_attributes(const Grid &vg,
+                                     const vec<RoomStatistics> &rooms) {
+    CityObjectAttributes attributes;
+    for (RoomID room_id = 0; room_id < rooms.size(); room_id++) {
+        const RoomStatistics &room = rooms[room_id];
+        if (room.voxels == 0) {
+            continue;
+        }
+        const RoomMeasures measures = room_measures(vg, room);
+        json j;
+        j["room_id"] = room_id;
+        j["voxel_count"] = room.voxels;
+        j["volume"] = measures.volume;
+        j["floor_area"] = measures.floor_area;
+        j["boundary_area"] = json::object();
+        for (unsigned int s = 0; s < NUM_SEMANTICS; s++) {
+            if (room.faces[s] > 0) {
+                j["boundary_area"][semantics_to_string(static_cast<Semantics>(s))] =
+                        measures.areas[s];
+            }
+        }
+        j["bbox"] = measures.bbox;
+        j["centroid"] = measures.centroid;
+        attributes[room_object_key(room_id)] = j;
+    }
+    return attributes;
+}
+
+// One line per room. The city_object column is the key of the room's object
+// in the CityJSON output.
+template<typename Grid>
+bool write_room_statistics_csv(const string &filename, const Grid &vg,
+                               const vec<RoomStatistics> &rooms) {
+    ofstream out(filename);
+    if (!out.is_open()) {
+        cerr << "Failed to open " << filename << endl;
+        return false;
+    }
+    out << "room_id,city_object,voxel_count,volume,floor_area";
+    for (unsigned int s = 0; s < NUM_SEMANTICS; s++) {
+        out << ",area_" << semantics_to_string(static_cast<Semantics>(s));
+    }
+    out << ",min_x,min_y,min_z,max_x,max_y,max_z,centroid_x,centroid_y,"
+           "centroid_z\n";
+    out << setprecision(15);
+    for (RoomID room_id = 0; room_id < rooms.size(); room_id++) {
+        const RoomStatistics &room = rooms[room_id];
+        if (room.voxels == 0) {
+            continue;
+        }
+        const RoomMeasures measures = room_measures(vg, room);
+        out << room_id << "," << room_object_key(room_id) << "," << room.voxels
+            << "," << measures.volume << "," << measures.floor_area;
+        for (const double area: measures.areas) {
+            out << "," << area;
+        }
+        for (const double bound: measures.bbox) {
+            out << "," << bound;
+        }
+        for (const double coordinate: measures.centroid) {
+            out << "," << coordinate;
+        }
+        out << "\n";
+    }
+    out.close();
+    if (!out) {
+        cerr << "Failed to write " << filename << endl;
+        return false;
+    }
+    progress() << "Room statistics written to " << filename << endl;
+    return true;
+}
+
+#endif
@@ -1,4 +1,6 @@
 
+#include "../batch.cpp"
+#include "../checkpoint.cpp"
 #include "../io.cpp"
 #include "../types.h"
 #include <cassert>
@@ -25,7 +27,157 @@ void test_read_obj() {
   }
 }
 
+void test_parse_obj_faces() {
+  const string obj = "# comment\n"
+                     "v 0 0 0\nv 1 0 0\nv 1 1 0\nv 0 1 0\n"
+                     "vt 0 0\nvn 0 0 1\n"
+                     "g first wall\n"
+                     "f 1/1/1 2/1/1 3/1/1 4/1/1\n" // quad, split into two
+                     "g\r\n"
+                     "f -4//1 -3//1 -2//1\r\n" // relative indices
+                     "f 1 2\n"                   // degenerate, skipped
+                     "f 1 2 9\n";                // out of range, skipped
+  auto [objects, vertices] = parse_obj(obj.data(), obj.data() + obj.size());
+  assert(vertices.size() == 12);
+  assert(vertices[3] == 1 && vertices[10] == 1);
+  assert(objects.size() == 2);
+  const BIMObject &wall = objects["first_wall"];
+  assert(wall.shells.size() == 2);
+  assert(wall.shells[1].vertex(0) == Point3(0, 0, 0));
+  assert(wall.shells[1].vertex(2) == Point3(0, 1, 0));
+  const BIMObject &unnamed = objects["Unnamed_1"];
+  assert(unnamed.shells.size() == 1);
+  assert(unnamed.shells[0].vertex(0) == Point3(0, 0, 0));
+}
+
+void test_parse_obj_numbers() {
+  const string obj = "v -1.5e2 0.1 123456789.123456789\nv +7 -0 1E-3";
+  auto [objects, vertices] = parse_obj(obj.data(), obj.data() + obj.size());
+  assert(objects.empty());
+  const double expected[] = {-150, 0.1, 123456789.123456789, 7, 0, 0.001};
+  assert(vertices.size() == 6);
+  for (int i = 0; i < 6; i++) {
+    assert(vertices[i] == expected[i]);
+  }
+}
+
+void test_checkpoint_round_trip() {
+  const string file = "test_checkpoint.vox";
+  for (VoxelLayout layout : {VoxelLayout::Linear, VoxelLayout::SparseBrick}) {
+    for (bool compress : {true, false}) {
+      VoxelGrid vg(21, 9, 13, {1.5, -2, 0.25}, 2, 0.3, layout);
+      vg.background.label = VoxelLabel::EXTERIOR;
+      unsigned int seed = 7;
+      for (int i = 0; i < 200; i++) {
+        seed = seed * 1103515245 + 12345;
+        const unsigned int x = seed % vg.size_x, y = (seed >> 8) % vg.size_y,
+                           z = (seed >> 16) % vg.size_z;
+        vg(x, y, z).label = VoxelLabel::INTERSECTED;
+        vg(x, y, z).semantics = Semantics::Door;
+        vg(x, y, z).city_object_type = CityObjectType::BuildingRoom;
+        vg.room_id(x, y, z) = seed % 5;
+      }
+      assert(write_checkpoint(file, vg, PipelineStage::Labelled, compress));
+      VoxelGrid read(0, 0, 0, {0, 0, 0});
+      PipelineStage stage;
+      assert(read_checkpoint(file, read, stage));
+      assert(stage == PipelineStage::Labelled);
+      assert(read.layout == layout && read.offset == 2 &&
+             read.resolution == 0.3 && read.origin == vg.origin &&
+             read.offset_origin == vg.offset_origin);
+      assert(read.size_x == vg.size_x && read.size_y == vg.size_y &&
+             read.size_z == vg.size_z);
+      assert(read.background.label == VoxelLabel::EXTERIOR);
+      const VoxelGrid &expected = vg, &actual = read;
+      for (unsigned int x = 0; x < vg.size_x; x++) {
+        for (unsigned int y = 0; y < vg.size_y; y++) {
+          for (unsigned int z = 0; z < vg.size_z; z++) {
+            assert(actual(x, y, z).label == expected(x, y, z).label);
+            assert(actual(x, y, z).semantics == expected(x, y, z).semantics);
+            assert(actual(x, y, z).city_object_type ==
+                   expected(x, y, z).city_object_type);
+            assert(actual.room_id(x, y, z) == expected.room_id(x, y, z));
+          }
+        }
+      }
+    }
+  }
+
+  // A cut-off file is rejected
+  ifstream whole(file, ios::binary);
+  const string bytes((istreambuf_iterator<char>(whole)),
+                     istreambuf_iterator<char>());
+  whole.close();
+  ofstream cut(file, ios::binary);
+  cut.write(bytes.data(), bytes.size() - 1);
+  cut.close();
+  VoxelGrid read(0, 0, 0, {0, 0, 0});
+  PipelineStage stage;
+  assert(!read_checkpoint(file, read, stage));
+  remove(file.c_str());
+
+  // So is one that claims more voxels than it holds, or an unknown label
+  string corrupt = bytes;
+  const uint32_t huge = 1u << 30;
+  memcpy(&corrupt[offsetof(CheckpointHeader, max_x)], &huge, sizeof(huge));
+  assert(!parse_checkpoint(corrupt.data(), corrupt.data() + corrupt.size(),
+                           read, stage));
+  corrupt = bytes;
+  corrupt[sizeof(CheckpointHeader)] = 9;
+  assert(!parse_checkpoint(corrupt.data(), corrupt.data() + corrupt.size(),
+                           read, stage));
+  assert(parse_checkpoint(bytes.data(), bytes.data() + bytes.size(), read,
+                          stage));
+}
+
+void test_batch_manifest() {
+  const string dir = "test_batch";
+  filesystem::create_directory(dir);
+  const string file = dir + "/manifest.json";
+  {
+    ofstream out(file);
+    out << R"({"memory_budget_mib": 2, "jobs": [
+      {"input": "a.obj", "resolution": 0.25, "offset": 3,
+       "cityjson": "out/a.city.json"},
+      {"input": "/data/b.obj", "obj": "b_voxels.obj"}]})";
+  }
+  vec<BatchJob> jobs;
+  size_t budget = 0;
+  assert(read_batch_manifest(file, jobs, budget));
+  assert(budget == 2 * 1024 * 1024);
+  assert(jobs.size() == 2);
+  assert(jobs[0].input == dir + "/a.obj" && jobs[0].resolution == 0.25 &&
+         jobs[0].offset == 3);
+  assert(jobs[0].cityjson_output == dir + "/out/a.city.json");
+  assert(jobs[0].obj_output.empty() && jobs[0].room_stats_output.empty());
+  assert(jobs[1].input == "/data/b.obj" && jobs[1].resolution == 0.5 &&
+         jobs[1].offset == 2);
+  assert(jobs[1].obj_output == dir + "/b_voxels.obj");
+  // A budget from the command line wins
+  budget = 5;
+  assert(read_batch_manifest(file, jobs, budget) && budget == 5);
+  {
+    ofstream out(file);
+    out << R"({"jobs": [{"resolution": 1}]})";
+  }
+  assert(!read_batch_manifest(file, jobs, budget));
+  filesystem::remove_all(dir);
+
+  // The estimate of a grid matches what the grid allocates
+  const vec<double> vertices = {0, 0, 0, 3.2, 1.1, 2.05};
+  for (VoxelLayout layout : {VoxelLayout::Linear, VoxelLayout::Brick}) {
+    const GridExtent extent = grid_extent(vertices, 0.5);
+    assert(extent.num_x == 7 && extent.num_y == 3 && extent.num_z == 5);
+    const VoxelGrid vg = create_voxel(vertices, 2, 0.5, layout);
+    assert(grid_memory_estimate(extent, 2, layout) == vg.memory_usage());
+  }
+}
+
 int main() {
   test_read_obj();
+  test_parse_obj_faces();
+  test_parse_obj_numbers();
+  test_checkpoint_round_trip();
+  test_batch_manifest();
   return 0;
 }
\ No newline at end of file
@@ -0,0 +1,941 @@
+#include "../cjson.cpp"
+#include "../distance_transform.cpp"
+#include "../greedy_mesh.cpp"
+#include "../incremental.cpp"
+#include "../io.cpp"
+#include "../room_stats.cpp"
+#include "../tiled.cpp"
+#include "../types.h"
+#include "../voxel_runs.cpp"
+#include "../voxelgrid.cpp"
+#include <cassert>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+
+// Hollow box of intersected voxels spanning [x0, x1] x [lo, hi] x [lo, hi]
+void add_box_shell(VoxelGrid &vg, unsigned int x0, unsigned int x1,
+                   unsigned int lo, unsigned int hi) {
+  for (unsigned int x = x0; x <= x1; x++) {
+    for (unsigned int y = lo; y <= hi; y++) {
+      for (unsigned int z = lo; z <= hi; z++) {
+        if (x == x0 || x == x1 || y == lo || y == hi || z == lo || z == hi) {
+          vg(x, y, z).label = VoxelLabel::INTERSECTED;
+        }
+      }
+    }
+  }
+}
+
+void add_box_shell(VoxelGrid &vg, unsigned int lo, unsigned int hi) {
+  add_box_shell(vg, lo, hi, lo, hi);
+}
+
+size_t count_label(const VoxelGrid &vg, VoxelLabel label) {
+  size_t count = 0;
+  for (unsigned int x = 0; x < vg.size_x; x++) {
+    for (unsigned int y = 0; y < vg.size_y; y++) {
+      for (unsigned int z = 0; z < vg.size_z; z++) {
+        count += vg(x, y, z).label == label;
+      }
+    }
+  }
+  return count;
+}
+
+void test_closed_room() {
+  VoxelGrid vg(10, 10, 10, {0, 0, 0}, 1, 1.0);
+  add_box_shell(vg, 2, 8);
+  VoxelGrid marked = mark_exterior_interior(vg);
+  assert(count_label(marked, VoxelLabel::INTERIOR) == 5 * 5 * 5);
+  assert(count_label(marked, VoxelLabel::UNLABELED) == 0);
+  assert(marked(5, 5, 5).label == VoxelLabel::INTERIOR);
+  assert(marked.room_id(5, 5, 5) == 0);
+}
+
+// A U-shaped pocket in a solid block: it opens on the +x face, runs towards
+// -x, turns and runs back towards +x; a single forward sweep cannot reach its
+// far end
+void test_concave_pocket_is_exterior() {
+  VoxelGrid vg(10, 10, 10, {0, 0, 0}, 1, 1.0);
+  for (unsigned int x = 2; x <= 8; x++) {
+    for (unsigned int y = 2; y <= 8; y++) {
+      for (unsigned int z = 2; z <= 8; z++) {
+        vg(x, y, z).label = VoxelLabel::INTERSECTED;
+      }
+    }
+  }
+  for (unsigned int x = 4; x <= 8; x++) {
+    vg(x, 3, 5).label = VoxelLabel::UNLABELED; // from the +x face
+  }
+  for (unsigned int y = 4; y <= 7; y++) {
+    vg(4, y, 5).label = VoxelLabel::UNLABELED;
+  }
+  for (unsigned int x = 5; x <= 7; x++) {
+    vg(x, 7, 5).label = VoxelLabel::UNLABELED; // back towards +x
+  }
+  VoxelGrid marked = mark_exterior_interior(vg, Connectivity::Six);
+  assert(marked(7, 7, 5).label == VoxelLabel::EXTERIOR);
+  assert(count_label(marked, VoxelLabel::INTERIOR) == 0);
+  assert(count_label(marked, VoxelLabel::UNLABELED) == 0);
+}
+
+void test_three_rooms() {
+  VoxelGrid vg(20, 10, 10, {0, 0, 0}, 1, 1.0);
+  add_box_shell(vg, 2, 8);
+  add_box_shell(vg, 8, 16, 2, 8);
+  add_box_shell(vg, 12, 16, 2, 8);
+  VoxelGrid marked = mark_exterior_interior(vg, Connectivity::Six);
+  // Rooms are numbered in x, y, z scan order of their first voxel
+  assert(marked.room_id(5, 5, 5) == 0);
+  assert(marked.room_id(10, 5, 5) == 1);
+  assert(marked.room_id(14, 5, 5) == 2);
+  assert(marked(14, 5, 5).label == VoxelLabel::INTERIOR);
+}
+
+// Random walls give many small rooms that cross the slab borders
+void test_room_ids_independent_of_threads() {
+  VoxelGrid vg(30, 20, 20, {0, 0, 0}, 1, 1.0);
+  unsigned int seed = 12345;
+  for (unsigned int x = 0; x < vg.size_x; x++) {
+    for (unsigned int y = 0; y < vg.size_y; y++) {
+      for (unsigned int z = 0; z < vg.size_z; z++) {
+        seed = seed * 1103515245 + 12345;
+        if ((seed >> 16) % 100 < 70) {
+          vg(x, y, z).label = VoxelLabel::INTERSECTED;
+        }
+      }
+    }
+  }
+  VoxelGrid single = mark_exterior_interior(vg, Connectivity::Six, 1);
+  for (unsigned int threads : {2, 3, 7}) {
+    VoxelGrid multi = mark_exterior_interior(vg, Connectivity::Six, threads);
+    assert(multi.room_ids == single.room_ids);
+    for (size_t i = 0; i < single.voxels.size(); i++) {
+      assert(multi.voxels[i].label == single.voxels[i].label);
+    }
+  }
+}
+
+// Large enough to overflow the stack of a recursive fill
+void test_large_room() {
+  VoxelGrid vg(160, 160, 160, {0, 0, 0}, 1, 1.0);
+  add_box_shell(vg, 1, 160);
+  VoxelGrid marked = mark_exterior_interior(vg, Connectivity::TwentySix);
+  assert(count_label(marked, VoxelLabel::INTERIOR) == 158ul * 158 * 158);
+}
+
+// Two rooms, one of them large enough to enclose whole unallocated bricks and
+// split up by scattered walls; the sparse grid must label like the dense one
+void test_sparse_matches_dense() {
+  VoxelGrid dense(70, 40, 45, {0, 0, 0}, 1, 1.0);
+  VoxelGrid sparse(70, 40, 45, {0, 0, 0}, 1, 1.0, VoxelLayout::SparseBrick);
+  for (VoxelGrid *vg : {&dense, &sparse}) {
+    add_box_shell(*vg, 1, 38);
+    add_box_shell(*vg, 45, 60, 3, 20);
+    unsigned int seed = 4321;
+    for (int i = 0; i < 300; i++) {
+      seed = seed * 1103515245 + 12345;
+      const unsigned int x = 2 + (seed >> 8) % 36;
+      const unsigned int y = 2 + (seed >> 12) % 36;
+      const unsigned int z = 2 + (seed >> 20) % 36;
+      (*vg)(x, y, z).label = VoxelLabel::INTERSECTED;
+    }
+  }
+  for (Connectivity connectivity :
+       {Connectivity::Six, Connectivity::Eighteen, Connectivity::TwentySix}) {
+    // Reading through a non-const grid would allocate every sparse brick
+    const VoxelGrid d = mark_exterior_interior(dense, connectivity);
+    const VoxelGrid s = mark_exterior_interior(sparse, connectivity);
+    assert(count_label(d, VoxelLabel::INTERIOR) > 30ul * 30 * 30);
+    for (unsigned int x = 0; x < d.size_x; x++) {
+      for (unsigned int y = 0; y < d.size_y; y++) {
+        for (unsigned int z = 0; z < d.size_z; z++) {
+          assert(s(x, y, z).label == d(x, y, z).label);
+          assert(s.room_id(x, y, z) == d.room_id(x, y, z));
+        }
+      }
+    }
+    // Bricks that only ever held exterior voxels stay unallocated
+    assert(s.memory_usage() < d.memory_usage());
+  }
+}
+
+// Columns longer than one word, so runs and shifts cross word borders
+void test_bitwise_exterior_matches_flood_fill() {
+  VoxelGrid vg(24, 20, 150, {0, 0, 0}, 1, 1.0);
+  add_box_shell(vg, 2, 20, 2, 18);
+  unsigned int seed = 777;
+  for (unsigned int x = 0; x < vg.size_x; x++) {
+    for (unsigned int y = 0; y < vg.size_y; y++) {
+      for (unsigned int z = 0; z < vg.size_z; z++) {
+        seed = seed * 1103515245 + 12345;
+        if ((seed >> 16) % 100 < 45) {
+          vg(x, y, z).label = VoxelLabel::INTERSECTED;
+        }
+      }
+    }
+  }
+  for (Connectivity connectivity :
+       {Connectivity::Six, Connectivity::Eighteen, Connectivity::TwentySix}) {
+    VoxelGrid bfs = mark_exterior_interior(vg, connectivity, 2,
+                                           ExteriorMethod::FloodFill);
+    VoxelGrid bitwise = mark_exterior_interior(vg, connectivity, 2,
+                                               ExteriorMethod::Bitwise);
+    assert(count_label(bfs, VoxelLabel::EXTERIOR) > 0);
+    assert(count_label(bfs, VoxelLabel::INTERIOR) > 0);
+    assert(bitwise.room_ids == bfs.room_ids);
+    for (size_t i = 0; i < bfs.voxels.size(); i++) {
+      assert(bitwise.voxels[i].label == bfs.voxels[i].label);
+    }
+  }
+}
+
+// Nested and leaky boxes in a mostly empty grid, so that most bricks are
+// crossed whole
+void test_coarse_exterior_matches_flood_fill() {
+  VoxelGrid vg(45, 38, 33, {0, 0, 0}, 1, 1.0);
+  add_box_shell(vg, 3, 30, 3, 30);
+  add_box_shell(vg, 9, 20, 9, 20);
+  add_box_shell(vg, 33, 42, 5, 14);
+  vg(3, 12, 12).label = VoxelLabel::UNLABELED; // a hole in the big box
+  unsigned int seed = 99;
+  for (int i = 0; i < 300; i++) {
+    seed = seed * 1103515245 + 12345;
+    vg(21 + seed % 8, 21 + (seed >> 8) % 8, 21 + (seed >> 16) % 8).label =
+        VoxelLabel::INTERSECTED;
+  }
+  for (Connectivity connectivity :
+       {Connectivity::Six, Connectivity::Eighteen, Connectivity::TwentySix}) {
+    VoxelGrid bfs = mark_exterior_interior(vg, connectivity, 2,
+                                           ExteriorMethod::FloodFill);
+    VoxelGrid coarse = mark_exterior_interior(vg, connectivity, 3,
+                                              ExteriorMethod::Coarse);
+    assert(count_label(bfs, VoxelLabel::INTERIOR) > 0);
+    assert(coarse.room_ids == bfs.room_ids);
+    for (size_t i = 0; i < bfs.voxels.size(); i++) {
+      assert(coarse.voxels[i].label == bfs.voxels[i].label);
+    }
+  }
+}
+
+void test_hierarchical_intersection_matches_flat() {
+  VoxelGrid vg(60, 50, 40, {0, 0, 0}, 1, 0.5);
+  BIMObjects objects;
+  // A large slanted roof, a vertical wall and a few small triangles
+  objects["Roof-1"] = BIMObject(
+      "Roof-1", {Triangle3(Point3(0.3, 0.2, 2), Point3(29, 1, 19),
+                           Point3(5, 24, 12)),
+                 Triangle3(Point3(29, 1, 19), Point3(28, 24, 3),
+                           Point3(5, 24, 12))});
+  objects["Roof-1"].sem = GeometricSemantics::Roof;
+  objects["Wall-2"] = BIMObject(
+      "Wall-2", {Triangle3(Point3(10, 3, 0), Point3(10, 20, 0),
+                           Point3(10, 20, 19.5))});
+  objects["Wall-2"].sem = GeometricSemantics::Wall;
+  vec<Triangle3> small;
+  for (int i = 0; i < 20; i++) {
+    const double x = 1 + i * 1.3, y = 2 + i * 0.9, z = 1 + i * 0.7;
+    small.push_back(Triangle3(Point3(x, y, z), Point3(x + 0.8, y, z + 0.2),
+                              Point3(x, y + 0.6, z + 0.9)));
+  }
+  objects["Door-3"] = BIMObject("Door-3", small);
+  objects["Door-3"].sem = GeometricSemantics::Door;
+  for (unsigned int threads : {1, 3}) {
+    const VoxelGrid flat =
+        intersection_with_bim_obj(vg, objects, threads, VoxelizeMethod::Flat);
+    const VoxelGrid hierarchical = intersection_with_bim_obj(
+        vg, objects, threads, VoxelizeMethod::Hierarchical);
+    assert(count_label(flat, VoxelLabel::INTERSECTED) > 1000);
+    for (size_t i = 0; i < flat.voxels.size(); i++) {
+      assert(hierarchical.voxels[i].label == flat.voxels[i].label);
+      assert(hierarchical.voxels[i].semantics == flat.voxels[i].semantics);
+    }
+  }
+}
+
+// A solid block is six rectangles; a second tag splits only the faces it
+// touches, and the face shared by two regions appears once for each
+void test_greedy_boundary_quads() {
+  VoxelGrid vg(12, 10, 10, {0, 0, 0}, 1, 1.0);
+  const VoxelGrid &stored = vg;
+  for (unsigned int x = 2; x < 10; x++) {
+    for (unsigned int y = 3; y < 7; y++) {
+      for (unsigned int z = 1; z < 6; z++) {
+        vg(x, y, z).label = VoxelLabel::INTERSECTED;
+      }
+    }
+  }
+  auto region_of = [&](unsigned int x, unsigned int y, unsigned int z) {
+    if (stored(x, y, z).label != VoxelLabel::INTERSECTED) {
+      return VoxelRegion{NO_REGION, 0};
+    }
+    return VoxelRegion{x < 6 ? 0u : 1u,
+                       static_cast<uint8_t>(z == 5 ? 1 : 0)};
+  };
+  for (unsigned int threads : {1, 3}) {
+    const auto quads = greedy_boundary_quads(vg, region_of, threads);
+    size_t area = 0;
+    for (const auto &quad : quads) {
+      area += (quad.hi[0] - quad.lo[0]) * (quad.hi[1] - quad.lo[1]);
+    }
+    // Two 4x4x5 blocks, each closed on its own
+    assert(area == 2 * 2 * (4 * 4 + 4 * 5 + 4 * 5));
+    // Per region: bottom and top, and the two end caps and two sides, each
+    // split by the top layer's tag into two rectangles
+    assert(quads.size() == 2 * (2 + 4 * 2));
+    unsigned int corners[4][3];
+    for (const auto &quad : quads) {
+      quad_corners(quad, corners);
+      for (const auto &corner : corners) {
+        assert(corner[quad.axis] == quad.plane);
+      }
+      if (quad.axis == 2 && quad.plane == 6) {
+        assert(quad.positive && quad.tag == 1);
+      }
+    }
+  }
+}
+
+// Rings of every shell share each edge with exactly one other ring of the
+// shell, running the other way
+void assert_shells_closed(const RegionShells &shells) {
+  for (size_t shell = 0; shell + 1 < shells.shell_begin.size(); shell++) {
+    map<pair<uint64_t, uint64_t>, int> edges;
+    for (uint32_t q = shells.shell_begin[shell];
+         q < shells.shell_begin[shell + 1]; q++) {
+      const uint32_t begin = shells.ring_begin[q], end = shells.ring_begin[q + 1];
+      for (uint32_t i = begin; i < end; i++) {
+        const uint64_t a = shells.ring_corners[i];
+        const uint64_t b = shells.ring_corners[i + 1 < end ? i + 1 : begin];
+        assert(a != b);
+        edges[{a, b}]++;
+      }
+    }
+    for (const auto &edge : edges) {
+      assert(edge.second == 1);
+      const auto reverse = edges.find({edge.first.second, edge.first.first});
+      assert(reverse != edges.end() && reverse->second == 1);
+    }
+  }
+}
+
+void test_greedy_shells_are_closed() {
+  VoxelGrid vg(12, 10, 10, {0, 0, 0}, 1, 1.0);
+  const VoxelGrid &stored = vg;
+  // Region 0: a hollow box, with a voxel touching it only along an edge
+  add_box_shell(vg, 1, 7);
+  vg(8, 8, 4).label = VoxelLabel::INTERSECTED;
+  // Region 1: a block against the box
+  for (unsigned int x = 8; x < 11; x++) {
+    for (unsigned int y = 1; y < 6; y++) {
+      for (unsigned int z = 1; z < 8; z++) {
+        vg(x, y, z).label = VoxelLabel::INTERSECTED;
+      }
+    }
+  }
+  auto region_of = [&](unsigned int x, unsigned int y, unsigned int z) {
+    if (stored(x, y, z).label != VoxelLabel::INTERSECTED) {
+      return VoxelRegion{NO_REGION, 0};
+    }
+    const bool in_box = x < 8 || y > 7;
+    // An L of tagged voxels, so the merged rectangles meet in T-junctions
+    return VoxelRegion{in_box ? 0u : 1u,
+                       static_cast<uint8_t>(x < 3 && y < 3 ? 1 : 0)};
+  };
+  vec<vec<BoundaryQuad>> region_quads(2);
+  for (const auto &quad : greedy_boundary_quads(vg, region_of)) {
+    region_quads[quad.region].push_back(quad);
+  }
+  bool t_junction = false;
+  for (uint32_t region = 0; region < 2; region++) {
+    const RegionShells shells = region_shells(region_quads[region]);
+    assert(shells.ring_quad.size() == region_quads[region].size());
+    assert_shells_closed(shells);
+    for (size_t q = 0; q + 1 < shells.ring_begin.size(); q++) {
+      t_junction |= shells.ring_begin[q + 1] - shells.ring_begin[q] > 4;
+    }
+    if (region == 0) {
+      // The box with its cavity, and the voxel on its own
+      assert(shells.solid_begin == vec<uint32_t>({0, 2, 3}));
+    } else {
+      assert(shells.solid_begin == vec<uint32_t>({0, 1}));
+    }
+  }
+  assert(t_junction);
+
+  // The building part and its rooms are each one Solid
+  VoxelGrid building(20, 10, 10, {0, 0, 0}, 1, 1.0);
+  add_box_shell(building, 2, 8);
+  add_box_shell(building, 8, 16, 2, 8);
+  VoxelGrid marked = mark_exterior_interior(building, Connectivity::Six);
+  extract_surface(marked);
+  const json dom = export_voxel_to_cityjson(marked, ExportMesh::Greedy);
+  size_t rooms = 0;
+  for (const auto &object : dom["CityObjects"]) {
+    if (object["type"] != "Building") {
+      assert(object["geometry"][0]["type"] == "Solid");
+      rooms += object["type"] == "BuildingRoom";
+    }
+  }
+  assert(rooms > 0);
+}
+
+void test_streamed_cityjson_matches_dom() {
+  VoxelGrid vg(20, 10, 10, {0, 0, 0}, 1, 1.0);
+  add_box_shell(vg, 2, 8);
+  add_box_shell(vg, 8, 16, 2, 8);
+  VoxelGrid marked = mark_exterior_interior(vg, Connectivity::Six);
+  extract_surface(marked);
+  const CityObjectAttributes attributes =
+      room_attributes(marked, room_statistics(marked));
+  assert(!attributes.empty());
+  for (ExportMesh mesh : {ExportMesh::Voxels, ExportMesh::Greedy}) {
+    const json dom = export_voxel_to_cityjson(marked, mesh, attributes);
+    for (int indent : {-1, 2}) {
+      ostringstream streamed;
+      write_voxel_cityjson(streamed, marked, mesh, CityJSONFormat::Document,
+                           indent, attributes);
+      assert(streamed.str() == dom.dump(indent) + "\n");
+    }
+
+    // Every city object turns up in exactly one feature, with the
+    // coordinates of the document, and parents and children are in the same
+    // feature
+    ostringstream sequence;
+    write_voxel_cityjson(sequence, marked, mesh, CityJSONFormat::Sequence, -1,
+                         attributes);
+    istringstream lines(sequence.str());
+    string line;
+    getline(lines, line);
+    const json header = json::parse(line);
+    assert(header["type"] == "CityJSON" && header["CityObjects"].empty());
+    size_t num_objects = 0, num_features = 0;
+    while (getline(lines, line)) {
+      const json feature = json::parse(line);
+      assert(feature["type"] == "CityJSONFeature");
+      assert(feature["CityObjects"].contains(feature["id"]));
+      for (const auto &object : feature["CityObjects"].items()) {
+        const json &expected = dom["CityObjects"][object.key()];
+        assert(object.value()["type"] == expected["type"]);
+        assert(object.value().value("attributes", json()) ==
+               expected.value("attributes", json()));
+        if (expected["geometry"].empty()) {
+          continue;
+        }
+        const json &boundaries = object.value()["geometry"][0]["boundaries"];
+        const json &expected_boundaries = expected["geometry"][0]["boundaries"];
+        assert(boundaries.size() == expected_boundaries.size());
+        // The first ring of the first boundary is enough to check the
+        // vertex renumbering
+        const json *ring = &boundaries[0];
+        const json *expected_ring = &expected_boundaries[0];
+        while ((*ring)[0].is_array()) {
+          ring = &(*ring)[0];
+          expected_ring = &(*expected_ring)[0];
+        }
+        for (size_t i = 0; i < ring->size(); i++) {
+          assert(feature["vertices"][(*ring)[i].get<size_t>()] ==
+                 dom["vertices"][(*expected_ring)[i].get<size_t>()]);
+        }
+      }
+      for (const auto &object : feature["CityObjects"]) {
+        for (const char *link : {"parents", "children"}) {
+          for (const auto &id : object.value(link, json::array())) {
+            assert(feature["CityObjects"].contains(id));
+          }
+        }
+      }
+      num_objects += feature["CityObjects"].size();
+      num_features++;
+    }
+    assert(num_objects == dom["CityObjects"].size());
+    // One building, so one feature
+    assert(num_features == 1);
+  }
+
+  // Names with control characters are escaped as dump() escapes them
+  string name = "a\"b\\c\b\f\n\r\t";
+  name += '\x01';
+  name += '\x1f';
+  const json named = {{"name", name}};
+  ostringstream streamed;
+  {
+    JsonWriter writer(streamed);
+    writer.value(named);
+  }
+  assert(streamed.str() == named.dump());
+}
+
+// Closed box of 12 triangles spanning [lo, hi]
+BIMObject box_object(const string &name, GeometricSemantics sem,
+                     const Point3 &lo, const Point3 &hi) {
+  const double xs[2] = {lo.x(), hi.x()}, ys[2] = {lo.y(), hi.y()},
+               zs[2] = {lo.z(), hi.z()};
+  vec<Point3> corners;
+  for (int i = 0; i < 8; i++) {
+    corners.push_back(Point3(xs[i & 1], ys[(i >> 1) & 1], zs[i >> 2]));
+  }
+  // Corners are numbered by their x, y, z bits
+  const int quads[6][4] = {{0, 2, 3, 1}, {4, 5, 7, 6}, {0, 1, 5, 4},
+                           {2, 6, 7, 3}, {0, 4, 6, 2}, {1, 3, 7, 5}};
+  vec<Triangle3> shells;
+  for (const auto &quad : quads) {
+    shells.push_back(
+        Triangle3(corners[quad[0]], corners[quad[1]], corners[quad[2]]));
+    shells.push_back(
+        Triangle3(corners[quad[0]], corners[quad[2]], corners[quad[3]]));
+  }
+  BIMObject object(name, shells);
+  object.sem = sem;
+  return object;
+}
+
+VoxelGrid full_pipeline(const VoxelGrid &vg, const BIMObjects &objects) {
+  VoxelGrid grid = mark_exterior_interior(intersection_with_bim_obj(vg, objects));
+  extract_surface(grid);
+  return grid;
+}
+// Objects keep their order, ranges and boxes in the flat store, and
+// voxelizing from it gives the brute force grid
+void test_triangle_store() {
+  BIMObjects objects;
+  objects["Wall-1"] = box_object("Wall-1", GeometricSemantics::Wall,
+                                 Point3(1, 1, 0), Point3(9.5, 1.3, 4));
+  objects["Empty-2"] = BIMObject("Empty-2", {});
+  objects["Window-3"] = BIMObject(
+      "Window-3", {Triangle3(Point3(2, 0.5, 1), Point3(4, 0.5, 1),
+                             Point3(3, 2.5, 3.2))});
+  objects["Window-3"].sem = GeometricSemantics::Window;
+  const TriangleStore triangles = make_triangle_store(objects);
+  assert(triangles.size() == 13 && triangles.num_objects() == 3);
+  assert(triangles.object_names ==
+         vec<string>({"Empty-2", "Wall-1", "Window-3"}));
+  assert(triangles.object_begin == vec<uint32_t>({0, 0, 12, 13}));
+  assert(triangles.object[12] == 2 &&
+         triangles.semantics[12] == Semantics::Window);
+  const Bbox3 wall = triangles.object_bbox[1];
+  assert(wall.xmin() == 1 && wall.ymin() == 1 && wall.zmin() == 0 &&
+         wall.xmax() == 9.5 && wall.ymax() == 1.3 && wall.zmax() == 4);
+  assert(triangles.triangle(12).vertex(2) == Point3(3, 2.5, 3.2));
+
+  const VoxelGrid vg(22, 8, 10, {0, 0, 0}, 1, 0.5);
+  const VoxelGrid expected = intersection_with_bim_obj_brute_force(vg, objects);
+  const VoxelGrid stored = intersection_with_bim_obj(vg, triangles, 3);
+  assert(count_label(expected, VoxelLabel::INTERSECTED) > 100);
+  for (size_t i = 0; i < expected.voxels.size(); i++) {
+    assert(stored.voxels[i].label == expected.voxels[i].label);
+    assert(stored.voxels[i].semantics == expected.voxels[i].semantics);
+  }
+}
+
+
+// A room split in two by an inner wall, with a door in the outer wall
+BIMObjects two_room_building() {
+  BIMObjects objects;
+  auto add = [&](const string &name, GeometricSemantics sem, Point3 lo,
+                 Point3 hi) { objects[name] = box_object(name, sem, lo, hi); };
+  add("Floor-1", GeometricSemantics::Floor, Point3(0, 0, 0), Point3(10, 8, 0.3));
+  add("Roof-2", GeometricSemantics::Roof, Point3(0, 0, 3.7), Point3(10, 8, 4));
+  add("Wall-3", GeometricSemantics::Wall, Point3(0, 0, 0), Point3(0.3, 8, 4));
+  add("Wall-4", GeometricSemantics::Wall, Point3(9.7, 0, 0), Point3(10, 8, 4));
+  add("Wall-5", GeometricSemantics::Wall, Point3(0, 0, 0), Point3(10, 0.3, 4));
+  add("Wall-6", GeometricSemantics::Wall, Point3(0, 7.7, 0), Point3(10, 8, 4));
+  add("Wall:Interior-7", GeometricSemantics::InteriorWall, Point3(4.9, 0, 0),
+      Point3(5.2, 8, 4));
+  add("Door-8", GeometricSemantics::Door, Point3(2, -0.05, 0.3),
+      Point3(3, 0.35, 2.3));
+  return objects;
+}
+
+// Every edit must give the grid a full run gives
+void test_incremental_update_matches_full_run() {
+  BIMObjects objects = two_room_building();
+  for (VoxelLayout layout : {VoxelLayout::Linear, VoxelLayout::SparseBrick}) {
+    const VoxelGrid vg = create_voxel({0, 0, 0, 10, 8, 4}, 2, 0.25, layout);
+    const VoxelGrid previous = full_pipeline(vg, objects);
+    const ObjectIndex previous_index =
+        index_bim_objects(vg, make_triangle_store(objects));
+
+    BIMObjects retyped = objects;
+    retyped["Door-8"].sem = GeometricSemantics::Window;
+    BIMObjects moved = objects;
+    moved["Wall:Interior-7"] = box_object(
+        "Wall:Interior-7", GeometricSemantics::InteriorWall, Point3(6.4, 0, 0),
+        Point3(6.7, 8, 4));
+    BIMObjects removed = objects;
+    removed.erase("Door-8");
+    for (const BIMObjects *edited : {&objects, &retyped, &moved, &removed}) {
+      VoxelGrid updated = vg;
+      IncrementalStats stats;
+      const TriangleStore triangles = make_triangle_store(*edited);
+      assert(update_voxel_grid(previous, previous_index, triangles,
+                               index_bim_objects(vg, triangles), updated,
+                               Connectivity::Eighteen, 2, VoxelizeMethod::Flat,
+                               ExteriorMethod::FloodFill, stats));
+      const VoxelGrid full = full_pipeline(vg, *edited);
+      const VoxelGrid &result = updated;
+      for (unsigned int x = 0; x < full.size_x; x++) {
+        for (unsigned int y = 0; y < full.size_y; y++) {
+          for (unsigned int z = 0; z < full.size_z; z++) {
+            assert(result(x, y, z).label == full(x, y, z).label);
+            assert(result(x, y, z).semantics == full(x, y, z).semantics);
+            assert(result(x, y, z).city_object_type ==
+                   full(x, y, z).city_object_type);
+            assert(result.room_id(x, y, z) == full.room_id(x, y, z));
+          }
+        }
+      }
+      // Only the edited objects' voxels are intersected again, and the
+      // labels are kept unless the walls moved
+      assert(stats.changed_objects == (edited == &objects ? 0 : 1));
+      assert(stats.recomputed_voxels < stats.total_voxels / 4);
+      assert((stats.relabelled_voxels > 0) == (edited == &moved));
+    }
+  }
+}
+
+// Tiles stitched together give the grid of a full run, whether the rooms
+// span several tiles or a tile holds just one column
+void test_tiled_matches_full_run() {
+  const BIMObjects objects = two_room_building();
+  const VoxelGrid full = full_pipeline(
+      create_voxel({0, 0, 0, 10, 8, 4}, 2, 0.25, VoxelLayout::Linear), objects);
+  const TriangleStore triangles = make_triangle_store(objects);
+  for (unsigned int tile_size : {1u, 7u, 100u}) {
+    TiledOptions options;
+    options.directory = "test_tiles";
+    options.tile_size = tile_size;
+    options.num_threads = 2;
+    assert(voxelize_tiled(triangles, {0, 0, 0, 10, 8, 4}, 0.25, options));
+    ifstream index_file("test_tiles/tiles.json");
+    const json index = json::parse(index_file, nullptr, false);
+    assert(index["rooms"] == 2);
+    size_t columns = 0;
+    for (const json &tile : index["tiles"]) {
+      VoxelGrid grid(0, 0, 0, {0, 0, 0});
+      PipelineStage stage;
+      assert(read_checkpoint("test_tiles/" + tile["file"].get<string>(), grid,
+                             stage));
+      assert(stage == PipelineStage::Surface && grid.size_z == full.size_z);
+      const unsigned int x0 = tile["first"][0], y0 = tile["first"][1];
+      for (unsigned int x = 0; x < grid.size_x; x++) {
+        for (unsigned int y = 0; y < grid.size_y; y++) {
+          for (unsigned int z = 0; z < grid.size_z; z++) {
+            const VoxelInfo expected = full(x0 + x, y0 + y, z);
+            assert(grid(x, y, z).label == expected.label);
+            assert(grid(x, y, z).semantics == expected.semantics);
+            assert(grid(x, y, z).city_object_type == expected.city_object_type);
+            assert(grid.room_id(x, y, z) == full.room_id(x0 + x, y0 + y, z));
+          }
+        }
+      }
+      columns += grid.size_x * grid.size_y;
+    }
+    assert(columns == full.size_x * full.size_y);
+    filesystem::remove_all("test_tiles");
+  }
+}
+
+// Runs give back the grid they were encoded from, and the surface and the
+// exports taken from them are those of the grid
+void test_voxel_runs_match_grid() {
+  const VoxelGrid labelled = mark_exterior_interior(intersection_with_bim_obj(
+      create_voxel({0, 0, 0, 10, 8, 4}, 2, 0.25, VoxelLayout::Linear),
+      two_room_building()));
+  VoxelRuns runs = encode_voxel_runs(labelled, 3);
+  assert(runs.runs.size() * 4 < labelled.num_voxels());
+  for (VoxelLayout layout : {VoxelLayout::Linear, VoxelLayout::SparseBrick}) {
+    const VoxelGrid decoded = decode_voxel_runs(runs, layout, 2);
+    for (unsigned int x = 0; x < labelled.size_x; x++) {
+      for (unsigned int y = 0; y < labelled.size_y; y++) {
+        for (unsigned int z = 0; z < labelled.size_z; z++) {
+          assert(same_voxel(decoded(x, y, z), decoded.room_id(x, y, z),
+                            labelled(x, y, z), labelled.room_id(x, y, z)));
+          assert(same_voxel(runs(x, y, z), runs.room_id(x, y, z),
+                            labelled(x, y, z), labelled.room_id(x, y, z)));
+        }
+      }
+    }
+  }
+
+  VoxelGrid surface = labelled;
+  extract_surface(surface);
+  extract_surface(runs, eighteen_connectivity, 3);
+  const VoxelRuns expected = encode_voxel_runs(surface);
+  assert(runs.column_begin == expected.column_begin);
+  for (size_t i = 0; i < expected.runs.size(); i++) {
+    assert(runs.runs[i].end == expected.runs[i].end);
+    assert(same_voxel(runs.runs[i].info, runs.runs[i].room_id,
+                      expected.runs[i].info, expected.runs[i].room_id));
+  }
+
+  auto file_bytes = [](const string &file) {
+    ifstream in(file, ios::binary);
+    const string bytes((istreambuf_iterator<char>(in)),
+                       istreambuf_iterator<char>());
+    in.close();
+    remove(file.c_str());
+    return bytes;
+  };
+  const vec<VoxelExportGroup> groups = {
+      {"walls", {VoxelLabel::INTERSECTED}}, {"rooms", {VoxelLabel::INTERIOR}}};
+  for (ExportMesh mesh : {ExportMesh::Voxels, ExportMesh::Greedy}) {
+    assert(write_voxel_obj("test_runs.obj", surface, groups, mesh));
+    const string grid_obj = file_bytes("test_runs.obj");
+    assert(write_voxel_obj("test_runs.obj", runs, groups, mesh));
+    assert(file_bytes("test_runs.obj") == grid_obj);
+    assert(write_voxel_ply("test_runs.ply", surface, groups, mesh));
+    const string grid_ply = file_bytes("test_runs.ply");
+    assert(write_voxel_ply("test_runs.ply", runs, groups, mesh));
+    assert(file_bytes("test_runs.ply") == grid_ply);
+
+    ostringstream grid_json, runs_json;
+    write_voxel_cityjson(grid_json, surface, mesh, CityJSONFormat::Document,
+                         -1, room_attributes(surface, room_statistics(surface)));
+    write_voxel_cityjson(runs_json, runs, mesh, CityJSONFormat::Document, -1,
+                         room_attributes(runs, room_statistics(runs, 3)));
+    assert(runs_json.str() == grid_json.str());
+    assert(grid_json.str().find("objroom1") != string::npos);
+  }
+}
+
+// Two rooms of 5x5x5 and 7x5x5 voxels; the floor under the first is tagged
+void test_room_statistics() {
+  VoxelGrid dense(20, 10, 10, {0, 0, 0}, 1, 1.0);
+  VoxelGrid sparse(20, 10, 10, {0, 0, 0}, 1, 1.0, VoxelLayout::SparseBrick);
+  vec<vec<RoomStatistics>> results;
+  for (VoxelGrid *vg : {&dense, &sparse}) {
+    add_box_shell(*vg, 2, 8);
+    add_box_shell(*vg, 8, 16, 2, 8);
+    for (unsigned int x = 3; x <= 7; x++) {
+      for (unsigned int y = 3; y <= 7; y++) {
+        (*vg)(x, y, 2).semantics = Semantics::FloorSurface;
+      }
+    }
+    const VoxelGrid marked = mark_exterior_interior(*vg, Connectivity::Six);
+    for (unsigned int threads : {1, 3}) {
+      results.push_back(room_statistics(marked, threads));
+    }
+  }
+  const vec<RoomStatistics> &rooms = results[0];
+  assert(rooms.size() == 2);
+  assert(rooms[0].voxels == 125 && rooms[1].voxels == 175);
+  assert(rooms[0].faces[static_cast<int>(Semantics::FloorSurface)] == 25);
+  assert(rooms[0].faces[static_cast<int>(Semantics::UNKOWN)] == 125);
+  assert(rooms[0].floor_faces == 25 && rooms[1].floor_faces == 35);
+  const RoomMeasures measures = room_measures(dense, rooms[0]);
+  // The grid starts one voxel before the origin
+  for (int axis = 0; axis < 3; axis++) {
+    assert(measures.bbox[axis] == 2 && measures.bbox[axis + 3] == 7);
+    assert(measures.centroid[axis] == 4.5);
+  }
+  assert(measures.volume == 125 && measures.floor_area == 25);
+  for (const auto &other : results) {
+    assert(other.size() == rooms.size());
+    for (size_t i = 0; i < rooms.size(); i++) {
+      assert(other[i].voxels == rooms[i].voxels);
+      assert(other[i].floor_faces == rooms[i].floor_faces);
+      for (int axis = 0; axis < 3; axis++) {
+        assert(other[i].first[axis] == rooms[i].first[axis]);
+        assert(other[i].last[axis] == rooms[i].last[axis]);
+        assert(other[i].index_sum[axis] == rooms[i].index_sum[axis]);
+      }
+      for (unsigned int s = 0; s < NUM_SEMANTICS; s++) {
+        assert(other[i].faces[s] == rooms[i].faces[s]);
+      }
+    }
+  }
+}
+
+void test_distance_transform_matches_brute_force() {
+  const unsigned int sx = 7, sy = 5, sz = 6;
+  vec<unsigned int> sites;
+  unsigned int seed = 4242;
+  for (unsigned int i = 0; i < sx * sy * sz; i++) {
+    seed = seed * 1103515245 + 12345;
+    if ((seed >> 16) % 13 == 0) {
+      sites.push_back(i);
+    }
+  }
+  for (unsigned int threads : {1, 3}) {
+    vec<uint32_t> distance(sx * sy * sz, EDT_INFINITY);
+    for (unsigned int site : sites) {
+      distance[site] = 0;
+    }
+    squared_distance_transform(distance, sx, sy, sz, threads);
+    for (unsigned int i = 0; i < distance.size(); i++) {
+      const int x = i / (sy * sz), y = i / sz % sy, z = i % sz;
+      uint32_t expected = EDT_INFINITY;
+      for (unsigned int site : sites) {
+        const int dx = x - static_cast<int>(site / (sy * sz));
+        const int dy = y - static_cast<int>(site / sz % sy);
+        const int dz = z - static_cast<int>(site % sz);
+        expected = min<uint32_t>(expected, dx * dx + dy * dy + dz * dz);
+      }
+      assert(distance[i] == expected);
+    }
+  }
+}
+
+// A room with a one voxel hole in a wall leaks into the exterior unless the
+// hole is sealed; the seal is the only voxel that stays
+void test_close_gaps_seals_hole() {
+  for (VoxelLayout layout : {VoxelLayout::Linear, VoxelLayout::SparseBrick}) {
+    VoxelGrid vg(12, 12, 12, {0, 0, 0}, 1, 1.0, layout);
+    add_box_shell(vg, 2, 8);
+    vg(8, 5, 5).label = VoxelLabel::UNLABELED;
+    const size_t walls = count_label(vg, VoxelLabel::INTERSECTED);
+    assert(count_label(mark_exterior_interior(vg), VoxelLabel::INTERIOR) == 0);
+
+    const vec<size_t> sealed = close_gaps(vg, 1.0);
+    assert(!sealed.empty());
+    VoxelGrid marked = mark_exterior_interior(vg);
+    reopen_gaps(marked, sealed, Connectivity::Eighteen);
+    assert(count_label(marked, VoxelLabel::INTERIOR) == 5 * 5 * 5);
+    assert(count_label(marked, VoxelLabel::INTERSECTED) == walls + 1);
+    assert(marked(8, 5, 5).label == VoxelLabel::INTERSECTED);
+    assert(marked(8, 5, 5).semantics == Semantics::ClosureSurface);
+  }
+}
+
+// A room thinner than the gap width is sealed completely and comes back as a
+// room of its own. Its walls are ClosureSurface geometry, which is not a seal
+// and stays.
+void test_close_gaps_restores_thin_room() {
+  VoxelGrid vg(10, 10, 10, {0, 0, 0}, 1, 1.0);
+  add_box_shell(vg, 2, 5);
+  for_each_stored_voxel(vg, [&](unsigned int x, unsigned int y,
+                                unsigned int z) {
+    if (vg(x, y, z).label == VoxelLabel::INTERSECTED) {
+      vg(x, y, z).semantics = Semantics::ClosureSurface;
+    }
+  });
+  const size_t walls = count_label(vg, VoxelLabel::INTERSECTED);
+  const vec<size_t> sealed = close_gaps(vg, 2.0);
+  VoxelGrid marked = mark_exterior_interior(vg);
+  assert(count_label(marked, VoxelLabel::INTERIOR) == 0);
+  assert(reopen_gaps(marked, sealed, Connectivity::Eighteen) == sealed.size());
+  assert(count_label(marked, VoxelLabel::INTERSECTED) == walls);
+  assert(count_label(marked, VoxelLabel::INTERIOR) == 2 * 2 * 2);
+  assert(marked.room_id(3, 3, 3) == 0 && marked.room_id(4, 4, 4) == 0);
+}
+
+// Two voxels side by side share the four corners of the face between them;
+// every label set is a group of its own
+void test_voxel_obj_and_ply_export() {
+  for (VoxelLayout layout : {VoxelLayout::Linear, VoxelLayout::SparseBrick}) {
+    VoxelGrid vg(4, 4, 4, {0, 0, 0}, 0, 0.5, layout);
+    vg(1, 1, 1).label = VoxelLabel::INTERSECTED;
+    vg(2, 1, 1).label = VoxelLabel::INTERSECTED;
+    vg(1, 2, 1).label = VoxelLabel::INTERIOR;
+    const vec<VoxelExportGroup> groups = {
+        {"walls", {VoxelLabel::INTERSECTED}}, {"rooms", {VoxelLabel::INTERIOR}}};
+    assert(write_voxel_obj("test_export.obj", vg, groups));
+    ifstream obj("test_export.obj");
+    vec<string> group_names;
+    size_t vertices = 0, faces = 0;
+    for (string line; getline(obj, line);) {
+      if (line.rfind("v ", 0) == 0) {
+        vertices++;
+      } else if (line.rfind("f ", 0) == 0) {
+        faces++;
+        istringstream indices(line.substr(2));
+        for (size_t index; indices >> index;) {
+          assert(index >= 1 && index <= vertices);
+        }
+      } else if (line.rfind("g ", 0) == 0) {
+        group_names.push_back(line.substr(2));
+      }
+    }
+    assert(vertices == 12 + 4);
+    assert(faces == 3 * 6);
+    assert(group_names == vec<string>({"walls", "rooms"}));
+    obj.close();
+    remove("test_export.obj");
+
+    // The PLY holds the same mesh, 12 bytes per vertex and 18 per face
+    assert(write_voxel_ply("test_export.ply", vg, groups));
+    ifstream ply("test_export.ply", ios::binary);
+    const string bytes((istreambuf_iterator<char>(ply)),
+                       istreambuf_iterator<char>());
+    const size_t header_end = bytes.find("end_header\n") + 11;
+    assert(bytes.find("element vertex 16\n") < header_end);
+    assert(bytes.find("element face 18\n") < header_end);
+    assert(bytes.size() - header_end == 16 * 12 + 18 * 18);
+    ply.close();
+    remove("test_export.ply");
+  }
+}
+
+// On a closed solid ray parity finds the same inside as the fill; the diagonal
+// of the box faces runs through the column centres, so a ray through a shared
+// edge must be counted once. A cavity inside the solid is no room by parity.
+void test_parity_exterior() {
+  BIMObjects objects;
+  objects["Solid-1"] = box_object("Solid-1", GeometricSemantics::Other,
+                                  Point3(0.5, 0.5, 0.5), Point3(4.5, 4.5, 4.5));
+  auto voxel_at = [](double coordinate) {
+    return static_cast<unsigned int>((coordinate + 1.0) / 0.5);
+  };
+  const TriangleStore triangles = make_triangle_store(objects);
+  for (VoxelLayout layout : {VoxelLayout::Linear, VoxelLayout::SparseBrick}) {
+    const VoxelGrid vg = intersection_with_bim_obj(
+        create_voxel({0, 0, 0, 5, 5, 5}, 2, 0.5, layout), triangles);
+    const VoxelGrid bfs = mark_exterior_interior(vg, Connectivity::Six, 1);
+    for (unsigned int threads : {1, 3}) {
+      const VoxelGrid parity = mark_exterior_interior(
+          vg, Connectivity::Six, threads, ExteriorMethod::Parity, &triangles);
+      for (unsigned int x = 0; x < vg.size_x; x++) {
+        for (unsigned int y = 0; y < vg.size_y; y++) {
+          for (unsigned int z = 0; z < vg.size_z; z++) {
+            assert(parity(x, y, z).label == bfs(x, y, z).label);
+            assert(parity.room_id(x, y, z) == bfs.room_id(x, y, z));
+          }
+        }
+      }
+    }
+
+    BIMObjects hollow = objects;
+    hollow["Cavity-2"] = box_object("Cavity-2", GeometricSemantics::Other,
+                                    Point3(1.9, 1.9, 1.9), Point3(3.1, 3.1, 3.1));
+    const TriangleStore hollow_triangles = make_triangle_store(hollow);
+    const VoxelGrid hollow_vg = intersection_with_bim_obj(
+        create_voxel({0, 0, 0, 5, 5, 5}, 2, 0.5, layout), hollow_triangles);
+    const unsigned int cavity = voxel_at(2.5), solid = voxel_at(1.25);
+    const VoxelGrid filled = mark_exterior_interior(hollow_vg, Connectivity::Six);
+    assert(filled(cavity, cavity, cavity).label == VoxelLabel::INTERIOR);
+    const VoxelGrid parity =
+        mark_exterior_interior(hollow_vg, Connectivity::Six, 3,
+                               ExteriorMethod::Parity, &hollow_triangles);
+    assert(parity(cavity, cavity, cavity).label == VoxelLabel::EXTERIOR);
+    assert(parity(solid, solid, solid).label == VoxelLabel::INTERIOR);
+    assert(parity(0, 0, 0).label == VoxelLabel::EXTERIOR);
+  }
+}
+
+int main() {
+  test_closed_room();
+  test_concave_pocket_is_exterior();
+  test_three_rooms();
+  test_room_ids_independent_of_threads();
+  test_large_room();
+  test_sparse_matches_dense();
+  test_bitwise_exterior_matches_flood_fill();
+  test_coarse_exterior_matches_flood_fill();
+  test_parity_exterior();
+  test_hierarchical_intersection_matches_flat();
+  test_triangle_store();
+  test_greedy_boundary_quads();
+  test_greedy_shells_are_closed();
+  test_voxel_obj_and_ply_export();
+  test_streamed_cityjson_matches_dom();
+  test_incremental_update_matches_full_run();
+  test_tiled_matches_full_run();
+  test_voxel_runs_match_grid();
+  test_room_statistics();
+  test_distance_transform_matches_brute_force();
+  test_close_gaps_seals_hole();
+  test_close_gaps_restores_thin_room();
+  return 0;
+}
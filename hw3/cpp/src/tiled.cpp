@@ -0,0 +1,447 @@
+#ifndef TILED_H
+#define TILED_H
+
+#include "checkpoint.cpp"
+#include "metrics.cpp"
+#include "parallel.cpp"
+#include "progress.cpp"
+#include "types.h"
+#include "voxelgrid.cpp"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <string>
+
+// Out-of-core voxelization for models whose grid does not fit in memory. The
+// grid create_voxel would make is cut into tiles of whole z columns, and only
+// one tile is in memory at a time:
+//
+// 1. The triangles are binned to the tiles in one pass over the store.
+// 2. Every tile is intersected with its triangles, as a region of the whole
+//    grid so the result is exactly that of a full run, and its empty voxels
+//    are split into connected components (label_rooms), then it is spilled
+//    to disk as a checkpoint. Each tile grid carries a halo of one column around
+//    its own columns, so components reach across the tile border; the
+//    component ids on the border and halo rings are kept in memory.
+// 3. The components are stitched: a halo voxel of one tile is a border voxel
+//    of its neighbour, so their components are merged in a union-find. A
+//    merged component that reaches the border of the whole grid is exterior,
+//    the others are rooms, numbered in scan order of their first voxel as
+//    mark_exterior_interior numbers them.
+// 4. Every tile is read back, relabelled, its surface extracted (the halo
+//    supplies the neighbours across the border) and written without the halo
+//    as a checkpoint after the surface stage, ready for --resume.
+//
+// Peak memory is bounded by the tile size, plus the triangles, the surface
+// bricks of the tile and the rings.
+
+struct TiledOptions {
+    string directory;                  // where the tiles are written
+    size_t tile_budget = size_t(1024) << 20; // bytes for the tile in memory
+    unsigned int tile_size = 0; // columns per tile side, 0: from the budget
+    unsigned int offset = 2;
+    Connectivity connectivity = Connectivity::Eighteen;
+    unsigned int num_threads = 0;
+    VoxelizeMethod voxelize_method = VoxelizeMethod::Flat;
+    // Only Parity changes anything: it classifies each tile by ray parity
+    // before the components are found; all others stitch components
+    ExteriorMethod exterior_method = ExteriorMethod::FloodFill;
+    bool compress = true;
+};
+
+// Bytes per voxel of a tile in memory: the grid, the union-find of
+// label_rooms, and the cropped copy that is written at the end
+const size_t TILE_BYTES_PER_VOXEL =
+        2 * (sizeof(VoxelInfo) + sizeof(RoomID)) + sizeof(uint32_t);
+
+// Columns per tile side so that a tile with its halo fits into the budget
+unsigned int tile_size_for_budget(size_t budget, unsigned int size_z) {
+    const double columns =
+            static_cast<double>(budget) / (TILE_BYTES_PER_VOXEL * size_z);
+    const double side = floor(sqrt(columns)) - 2;
+    return side < 1 ? 1 : static_cast<unsigned int>(side);
+}
+
+// The columns [x0, x1] x [y0, y1] on the border of a rectangle, numbered
+// around it, for the component ids kept per tile
+struct TileRing {
+    unsigned int x0, x1, y0, y1;
+
+    size_t columns() const {
+        const size_t w = x1 - x0 + 1, h = y1 - y0 + 1;
+        return w == 1 ? h : (h == 1 ? w : 2 * h + 2 * (w - 2));
+    }
+
+    size_t slot(unsigned int x, unsigned int y) const {
+        const size_t h = y1 - y0 + 1;
+        if (x == x0) {
+            return y - y0;
+        }
+        if (x == x1) {
+            return h + y - y0;
+        }
+        if (y == y0) {
+            return 2 * h + x - x0 - 1;
+        }
+        return 2 * h + (x1 - x0 - 1) + x - x0 - 1;
+    }
+};
+
+struct TileState {
+    unsigned int first[2], end[2];      // own columns of the whole grid
+    unsigned int grid_first[2], grid_end[2]; // columns with the halo
+    uint32_t component_base = 0; // node of component 0 in the stitching
+    uint32_t num_components = 0;
+    TileRing core_ring{}, halo_ring{};
+    // Component + 1 of every voxel on the rings (0: not empty), z-contiguous
+    // per column
+    vec<uint32_t> core_components, halo_components;
+    string part_file, grid_file;
+};
+
+// The triangles of `store` listed in `indices`, in store order, as a store of
+// their own
+TriangleStore tile_triangle_store(const TriangleStore &store,
+                                  const vec<uint32_t> &indices) {
+    TriangleStore tile;
+    for (const uint32_t t: indices) {
+        const uint32_t id = store.object[t];
+        if (tile.object_names.empty() ||
+            tile.object_names.back() != store.object_names[id]) {
+            tile.object_begin.push_back(tile.size());
+            tile.object_names.push_back(store.object_names[id]);
+            tile.object_semantics.push_back(store.object_semantics[id]);
+            tile.object_bbox.push_back(store.object_bbox[id]);
+        }
+        for (int i = 0; i < 3; i++) {
+            tile.x[i].push_back(store.x[i][t]);
+            tile.y[i].push_back(store.y[i][t]);
+            tile.z[i].push_back(store.z[i][t]);
+        }
+        tile.object.push_back(tile.object_names.size() - 1);
+        tile.semantics.push_back(store.semantics[t]);
+    }
+    tile.object_begin.push_back(tile.size());
+    return tile;
+}
+
+bool voxelize_tiled(const TriangleStore &triangles, const vec<double> &vertices,
+                    double resolution, const TiledOptions &options) {
+    StageTimer stage("tiled");
+    // The grid create_voxel would make, without any voxel allocated
+    const GridExtent extent = grid_extent(vertices, resolution);
+    const VoxelGrid domain(extent.num_x, extent.num_y, extent.num_z,
+                           extent.origin, options.offset, resolution,
+                           VoxelLayout::SparseBrick);
+    const unsigned int size[3] = {domain.size_x, domain.size_y, domain.size_z};
+    const vec<double> &origin = domain.offset_origin;
+    const unsigned int tile_size =
+            options.tile_size > 0
+            ? options.tile_size
+            : tile_size_for_budget(options.tile_budget, size[2]);
+    const unsigned int tiles[2] = {(size[0] + tile_size - 1) / tile_size,
+                                   (size[1] + tile_size - 1) / tile_size};
+    progress() << "===Tiled voxelization===\n"
+               << "grid " << size[0] << " x " << size[1] << " x " << size[2]
+               << " in " << tiles[0] << " x " << tiles[1] << " tiles of "
+               << tile_size << " x " << tile_size << " columns" << endl;
+
+    error_code error;
+    filesystem::create_directories(options.directory, error);
+    if (error) {
+        cerr << "Failed to create " << options.directory << ": "
+             << error.message() << endl;
+        return false;
+    }
+    const filesystem::path directory(options.directory);
+
+    vec<TileState> states(static_cast<size_t>(tiles[0]) * tiles[1]);
+    auto tile_index = [&](unsigned int tx, unsigned int ty) {
+        return static_cast<size_t>(tx) * tiles[1] + ty;
+    };
+    for (unsigned int tx = 0; tx < tiles[0]; tx++) {
+        for (unsigned int ty = 0; ty < tiles[1]; ty++) {
+            TileState &state = states[tile_index(tx, ty)];
+            const unsigned int t[2] = {tx, ty};
+            for (int axis = 0; axis < 2; axis++) {
+                state.first[axis] = t[axis] * tile_size;
+                state.end[axis] = min(size[axis], state.first[axis] + tile_size);
+                state.grid_first[axis] =
+                        state.first[axis] > 0 ? state.first[axis] - 1 : 0;
+                state.grid_end[axis] = min(size[axis], state.end[axis] + 1);
+            }
+            state.core_ring = {state.first[0], state.end[0] - 1, state.first[1],
+                               state.end[1] - 1};
+            state.halo_ring = {state.grid_first[0], state.grid_end[0] - 1,
+                               state.grid_first[1], state.grid_end[1] - 1};
+            const string name = "tile_" + to_string(tx) + "_" + to_string(ty);
+            state.part_file = (directory / (name + ".part")).string();
+            state.grid_file = (directory / (name + ".grid")).string();
+        }
+    }
+
+    // 1. Bin the triangles to every tile whose columns, halo included, their
+    // voxel range reaches
+    StageTimer bin_stage("tile_binning");
+    vec<vec<uint32_t>> tile_triangles(states.size());
+    for (uint32_t t = 0; t < triangles.size(); t++) {
+        const Bbox3 bbox = triangles.bbox(t);
+        unsigned int first[2], last[2];
+        bool in_grid = true;
+        for (int axis = 0; axis < 2; axis++) {
+            in_grid = voxel_index_range(bbox.min(axis), bbox.max(axis),
+                                        origin[axis], resolution, size[axis],
+                                        first[axis], last[axis]);
+            if (!in_grid) {
+                break;
+            }
+            first[axis] = (first[axis] > 0 ? first[axis] - 1 : 0) / tile_size;
+            last[axis] = min(last[axis] + 1, size[axis] - 1) / tile_size;
+        }
+        if (!in_grid) {
+            continue;
+        }
+        for (unsigned int tx = first[0]; tx <= last[0]; tx++) {
+            for (unsigned int ty = first[1]; ty <= last[1]; ty++) {
+                tile_triangles[tile_index(tx, ty)].push_back(t);
+            }
+        }
+    }
+    bin_stage.stop();
+
+    // 2. Intersect each tile and split its empty voxels into components
+    StageTimer voxelize_stage("tile_voxelize");
+    vec<uint8_t> exterior_node;       // component reaches the grid border
+    vec<uint64_t> first_voxel;        // smallest scan index in the whole grid
+    auto tile_grid = [&](const TileState &state) {
+        return VoxelGrid(state.grid_end[0] - state.grid_first[0],
+                         state.grid_end[1] - state.grid_first[1], size[2],
+                         {origin[0] + state.grid_first[0] * resolution,
+                          origin[1] + state.grid_first[1] * resolution,
+                          origin[2]},
+                         0, resolution, VoxelLayout::Linear);
+    };
+    size_t tile_number = 0;
+    for (TileState &state: states) {
+        VoxelGrid grid = tile_grid(state);
+        {
+            const TriangleStore store =
+                    tile_triangle_store(triangles, tile_triangles[tile_number]);
+            vec<uint32_t>().swap(tile_triangles[tile_number]);
+            // Intersected as a region of the whole grid, which only
+            // allocates the bricks of the surface in the tile, so that
+            // every voxel box is rounded exactly as in a full run
+            VoxelGrid region = domain;
+            const unsigned int first[3] = {state.grid_first[0],
+                                           state.grid_first[1], 0};
+            const unsigned int last[3] = {state.grid_end[0] - 1,
+                                          state.grid_end[1] - 1, size[2] - 1};
+            intersect_voxel_region(region, store, first, last,
+                                   options.num_threads, options.voxelize_method);
+            const VoxelGrid &intersected = region;
+            for (unsigned int x = 0; x < grid.size_x; x++) {
+                for (unsigned int y = 0; y < grid.size_y; y++) {
+                    for (unsigned int z = 0; z < grid.size_z; z++) {
+                        grid(x, y, z) = intersected(x + first[0],
+                                                    y + first[1], z);
+                    }
+                }
+            }
+            if (options.exterior_method == ExteriorMethod::Parity) {
+                mark_exterior_parity(grid, store, options.num_threads);
+            }
+        }
+        state.num_components =
+                label_rooms(grid, options.connectivity, options.num_threads);
+        state.component_base = exterior_node.size();
+        exterior_node.resize(exterior_node.size() + state.num_components, 0);
+        first_voxel.resize(exterior_node.size(), UINT64_MAX);
+
+        auto component = [&](unsigned int gx, unsigned int gy, unsigned int z) {
+            const unsigned int x = gx - state.grid_first[0];
+            const unsigned int y = gy - state.grid_first[1];
+            return grid(x, y, z).label == VoxelLabel::INTERIOR
+                   ? grid.room_id(x, y, z) + 1 : 0;
+        };
+        for (unsigned int gx = state.first[0]; gx < state.end[0]; gx++) {
+            for (unsigned int gy = state.first[1]; gy < state.end[1]; gy++) {
+                const bool border_column = gx == 0 || gy == 0 ||
+                                           gx == size[0] - 1 ||
+                                           gy == size[1] - 1;
+                for (unsigned int z = 0; z < size[2]; z++) {
+                    const uint32_t c = component(gx, gy, z);
+                    if (c == 0) {
+                        continue;
+                    }
+                    const size_t node = state.component_base + c - 1;
+                    const uint64_t scan =
+                            (static_cast<uint64_t>(gx) * size[1] + gy) * size[2] + z;
+                    first_voxel[node] = min(first_voxel[node], scan);
+                    if (border_column || z == 0 || z == size[2] - 1) {
+                        exterior_node[node] = 1;
+                    }
+                }
+            }
+        }
+        for (auto [ring, ids]: {make_pair(&state.core_ring, &state.core_components),
+                                make_pair(&state.halo_ring, &state.halo_components)}) {
+            ids->assign(ring->columns() * size[2], 0);
+            for (unsigned int gx = ring->x0; gx <= ring->x1; gx++) {
+                for (unsigned int gy = ring->y0; gy <= ring->y1; gy++) {
+                    if (gx != ring->x0 && gx != ring->x1 && gy != ring->y0 &&
+                        gy != ring->y1) {
+                        continue;
+                    }
+                    uint32_t *column = &(*ids)[ring->slot(gx, gy) * size[2]];
+                    for (unsigned int z = 0; z < size[2]; z++) {
+                        column[z] = component(gx, gy, z);
+                    }
+                }
+            }
+        }
+        if (!write_checkpoint(state.part_file, grid, PipelineStage::Labelled,
+                              options.compress)) {
+            return false;
+        }
+        tile_number++;
+    }
+    voxelize_stage.stop();
+
+    // 3. Merge the components across the tile borders
+    StageTimer stitch_stage("tile_stitch");
+    const size_t num_nodes = exterior_node.size();
+    if (num_nodes >= NOT_A_ROOM) {
+        cerr << "Too many components to stitch: " << num_nodes << endl;
+        return false;
+    }
+    vec<uint32_t> parent(num_nodes);
+    for (uint32_t node = 0; node < num_nodes; node++) {
+        parent[node] = node;
+    }
+    for (const TileState &state: states) {
+        const TileRing &ring = state.halo_ring;
+        for (unsigned int gx = ring.x0; gx <= ring.x1; gx++) {
+            for (unsigned int gy = ring.y0; gy <= ring.y1; gy++) {
+                const bool own = gx >= state.first[0] && gx < state.end[0] &&
+                                 gy >= state.first[1] && gy < state.end[1];
+                if (own || (gx != ring.x0 && gx != ring.x1 && gy != ring.y0 &&
+                            gy != ring.y1)) {
+                    continue;
+                }
+                // The halo column is a border column of the tile that owns it
+                const TileState &owner =
+                        states[tile_index(gx / tile_size, gy / tile_size)];
+                const uint32_t *halo =
+                        &state.halo_components[ring.slot(gx, gy) * size[2]];
+                const uint32_t *core = &owner.core_components[
+                        owner.core_ring.slot(gx, gy) * size[2]];
+                for (unsigned int z = 0; z < size[2]; z++) {
+                    if (halo[z] != 0 && core[z] != 0) {
+                        union_rooms(parent, state.component_base + halo[z] - 1,
+                                    owner.component_base + core[z] - 1);
+                    }
+                }
+            }
+        }
+    }
+    for (TileState &state: states) {
+        vec<uint32_t>().swap(state.core_components);
+        vec<uint32_t>().swap(state.halo_components);
+    }
+    // A root is exterior if any of its components is, and starts where the
+    // first of them does
+    for (uint32_t node = 0; node < num_nodes; node++) {
+        const uint32_t root = find_room_root_compress(parent, node);
+        exterior_node[root] |= exterior_node[node];
+        first_voxel[root] = min(first_voxel[root], first_voxel[node]);
+    }
+    vec<pair<uint64_t, uint32_t>> rooms;
+    for (uint32_t node = 0; node < num_nodes; node++) {
+        if (parent[node] == node && !exterior_node[node] &&
+            first_voxel[node] != UINT64_MAX) {
+            rooms.push_back({first_voxel[node], node});
+        }
+    }
+    sort(rooms.begin(), rooms.end());
+    vec<RoomID> room_of_root(num_nodes, 0);
+    for (size_t i = 0; i < rooms.size(); i++) {
+        room_of_root[rooms[i].second] = i;
+    }
+    stitch_stage.stop();
+    progress() << "components: " << num_nodes << ", rooms: " << rooms.size()
+               << endl;
+    add_metric_counter("tiles", states.size());
+    add_metric_counter("tile_components", num_nodes);
+    add_metric_counter("rooms", rooms.size());
+
+    // 4. Relabel every tile, extract its surface and keep its own columns
+    StageTimer finish_stage("tile_finish");
+    json index;
+    index["version"] = 1;
+    index["resolution"] = resolution;
+    index["size"] = {size[0], size[1], size[2]};
+    index["tile_size"] = tile_size;
+    index["rooms"] = rooms.size();
+    index["tiles"] = json::array();
+    for (const TileState &state: states) {
+        VoxelGrid grid(0, 0, 0, {0, 0, 0});
+        PipelineStage part_stage;
+        if (!read_checkpoint(state.part_file, grid, part_stage)) {
+            return false;
+        }
+        for (size_t i = 0; i < grid.voxels.size(); i++) {
+            if (grid.voxels[i].label != VoxelLabel::INTERIOR) {
+                continue;
+            }
+            const uint32_t root = find_room_root(
+                    parent, state.component_base + grid.room_ids[i]);
+            if (exterior_node[root]) {
+                grid.voxels[i].label = VoxelLabel::EXTERIOR;
+                grid.room_ids[i] = 0;
+            } else {
+                grid.room_ids[i] = room_of_root[root];
+            }
+        }
+        extract_surface(grid, eighteen_connectivity, options.num_threads);
+
+        const unsigned int skip[2] = {state.first[0] - state.grid_first[0],
+                                      state.first[1] - state.grid_first[1]};
+        VoxelGrid own(state.end[0] - state.first[0],
+                      state.end[1] - state.first[1], size[2],
+                      {origin[0] + state.first[0] * resolution,
+                       origin[1] + state.first[1] * resolution, origin[2]},
+                      0, resolution, VoxelLayout::Linear);
+        for (unsigned int x = 0; x < own.size_x; x++) {
+            for (unsigned int y = 0; y < own.size_y; y++) {
+                for (unsigned int z = 0; z < own.size_z; z++) {
+                    own(x, y, z) = grid(x + skip[0], y + skip[1], z);
+                    own.room_id(x, y, z) =
+                            grid.room_id(x + skip[0], y + skip[1], z);
+                }
+            }
+        }
+        if (!write_checkpoint(state.grid_file, own, PipelineStage::Surface,
+                              options.compress)) {
+            return false;
+        }
+        filesystem::remove(state.part_file, error);
+        index["tiles"].push_back(
+                {{"file", filesystem::path(state.grid_file).filename().string()},
+                 {"first", {state.first[0], state.first[1]}},
+                 {"size", {own.size_x, own.size_y}}});
+    }
+    const string index_file = (directory / "tiles.json").string();
+    ofstream out(index_file);
+    if (!out.is_open()) {
+        cerr << "Failed to open " << index_file << endl;
+        return false;
+    }
+    out << index.dump(2) << endl;
+    progress() << "Tiles written to " << options.directory << endl;
+    return true;
+}
+
+#endif
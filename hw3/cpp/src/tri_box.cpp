@@ -0,0 +1,168 @@
+#ifndef TRI_BOX_H
+#define TRI_BOX_H
+
+#include "types.h"
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+
+// Separating-axis test (Akenine-Moller) between one triangle and a batch of
+// equally sized axis-aligned boxes. For a fixed triangle and box size every
+// one of the 13 candidate axes reduces to an interval: the triangle and a box
+// with center c overlap along axis a iff dot(a, c) lies in [lo, hi]. Testing a
+// box therefore costs one dot product and two comparisons per axis, and the
+// loops over a batch are plain arrays (structure of arrays) that the compiler
+// vectorizes on both x86 and arm64 without intrinsics.
+//
+// Every decision keeps a safety margin that bounds the rounding error of the
+// computation. Boxes that fall inside a margin are reported as
+// TriBoxOverlap::Uncertain and must be decided with the exact CGAL predicate.
+
+enum class TriBoxOverlap : uint8_t { Disjoint, Overlap, Uncertain };
+
+const unsigned int TRI_BOX_AXES = 13;
+
+// Boxes classified in one call of classify_box_row
+const unsigned int TRI_BOX_BATCH = 64;
+
+// Per-triangle setup, stored as one array per component
+struct TriBoxAxes {
+    double ax[TRI_BOX_AXES], ay[TRI_BOX_AXES], az[TRI_BOX_AXES];
+    double lo[TRI_BOX_AXES], hi[TRI_BOX_AXES];
+    double margin[TRI_BOX_AXES];
+    unsigned int count; // axes that are not exactly zero
+};
+
+// Relative error budget of the double computations below. The actual rounding
+// error is a few ulp; the generous factor keeps accept/reject decisions safe
+// while leaving only near-touching boxes to the exact predicate.
+const double TRI_BOX_RELATIVE_EPS = 1e-10;
+
+void add_tri_box_axis(TriBoxAxes &axes, const double a[3], const double v[3][3],
+                      double half_size, double magnitude, double scale) {
+    if (a[0] == 0 && a[1] == 0 && a[2] == 0) {
+        // Only happens for an edge that is exactly parallel to a box axis; the
+        // face axes already cover that direction
+        return;
+    }
+    const unsigned int k = axes.count++;
+    const double p0 = a[0] * v[0][0] + a[1] * v[0][1] + a[2] * v[0][2];
+    const double p1 = a[0] * v[1][0] + a[1] * v[1][1] + a[2] * v[1][2];
+    const double p2 = a[0] * v[2][0] + a[1] * v[2][1] + a[2] * v[2][2];
+    const double r =
+            half_size * (std::fabs(a[0]) + std::fabs(a[1]) + std::fabs(a[2]));
+    axes.ax[k] = a[0];
+    axes.ay[k] = a[1];
+    axes.az[k] = a[2];
+    axes.lo[k] = std::min({p0, p1, p2}) - r;
+    axes.hi[k] = std::max({p0, p1, p2}) + r;
+    // `scale` is the length the axis would have without cancellation, so the
+    // margin also covers rounding in the edges the axis was built from
+    axes.margin[k] = TRI_BOX_RELATIVE_EPS * scale * magnitude;
+}
+
+// v[i] is vertex i of the triangle
+TriBoxAxes make_tri_box_axes(const double v[3][3], double half_size,
+                             double max_abs_coordinate) {
+    TriBoxAxes axes;
+    axes.count = 0;
+    double e[3][3];
+    double edge_length[3];
+    for (int i = 0; i < 3; i++) {
+        const int j = (i + 1) % 3;
+        for (int c = 0; c < 3; c++) {
+            e[i][c] = v[j][c] - v[i][c];
+        }
+        edge_length[i] =
+                std::fabs(e[i][0]) + std::fabs(e[i][1]) + std::fabs(e[i][2]);
+    }
+    const double magnitude = max_abs_coordinate + half_size;
+
+    // Box face normals
+    for (int c = 0; c < 3; c++) {
+        double a[3] = {0, 0, 0};
+        a[c] = 1;
+        add_tri_box_axis(axes, a, v, half_size, magnitude, 1);
+    }
+    // Triangle normal
+    const double n[3] = {e[0][1] * e[1][2] - e[0][2] * e[1][1],
+                         e[0][2] * e[1][0] - e[0][0] * e[1][2],
+                         e[0][0] * e[1][1] - e[0][1] * e[1][0]};
+    add_tri_box_axis(axes, n, v, half_size, magnitude,
+                     edge_length[0] * edge_length[1]);
+    // Cross products of the box axes with the triangle edges. With a unit
+    // box axis the components are copies of edge components, so they are
+    // exact and an axis is exactly zero iff the edge is parallel to it.
+    for (int c = 0; c < 3; c++) {
+        for (int i = 0; i < 3; i++) {
+            double a[3];
+            a[c] = 0;
+            a[(c + 1) % 3] = -e[i][(c + 2) % 3];
+            a[(c + 2) % 3] = e[i][(c + 1) % 3];
+            add_tri_box_axis(axes, a, v, half_size, magnitude, edge_length[i]);
+        }
+    }
+    return axes;
+}
+
+TriBoxAxes make_tri_box_axes(const Triangle3 &shell, double half_size,
+                             double max_abs_coordinate) {
+    double v[3][3];
+    for (int i = 0; i < 3; i++) {
+        v[i][0] = shell.vertex(i).x();
+        v[i][1] = shell.vertex(i).y();
+        v[i][2] = shell.vertex(i).z();
+    }
+    return make_tri_box_axes(v, half_size, max_abs_coordinate);
+}
+
+// Classifies the boxes centred at (center_x, center_y, center_z[i]) for
+// i < count (count <= TRI_BOX_BATCH), i.e. one row of voxels along z.
+void classify_box_row(const TriBoxAxes &axes, double center_x, double center_y,
+                      const double *center_z, unsigned int count,
+                      TriBoxOverlap *result) {
+    uint8_t disjoint[TRI_BOX_BATCH];
+    uint8_t inside[TRI_BOX_BATCH];
+    // Axes without a z component give the same answer for the whole row
+    bool row_inside = true;
+    for (unsigned int k = 0; k < axes.count; k++) {
+        if (axes.az[k] != 0) {
+            continue;
+        }
+        const double d = axes.ax[k] * center_x + axes.ay[k] * center_y;
+        if (d < axes.lo[k] - axes.margin[k] || d > axes.hi[k] + axes.margin[k]) {
+            std::fill(result, result + count, TriBoxOverlap::Disjoint);
+            return;
+        }
+        row_inside = row_inside && d > axes.lo[k] + axes.margin[k] &&
+                     d < axes.hi[k] - axes.margin[k];
+    }
+    for (unsigned int i = 0; i < count; i++) {
+        disjoint[i] = 0;
+        inside[i] = row_inside;
+    }
+    for (unsigned int k = 0; k < axes.count; k++) {
+        if (axes.az[k] == 0) {
+            continue;
+        }
+        const double base = axes.ax[k] * center_x + axes.ay[k] * center_y;
+        const double az = axes.az[k];
+        const double reject_lo = axes.lo[k] - axes.margin[k];
+        const double reject_hi = axes.hi[k] + axes.margin[k];
+        const double accept_lo = axes.lo[k] + axes.margin[k];
+        const double accept_hi = axes.hi[k] - axes.margin[k];
+        for (unsigned int i = 0; i < count; i++) {
+            const double d = base + az * center_z[i];
+            disjoint[i] |= (d < reject_lo) | (d > reject_hi);
+            inside[i] &= (d > accept_lo) & (d < accept_hi);
+        }
+    }
+    for (unsigned int i = 0; i < count; i++) {
+        result[i] = disjoint[i] ? TriBoxOverlap::Disjoint
+                                : (inside[i] ? TriBoxOverlap::Overlap
+                                             : TriBoxOverlap::Uncertain);
+    }
+}
+
+#endif
@@ -1,10 +1,14 @@
 #ifndef TYPES_H
 #define TYPES_H
 
+#include <cstddef>
+#include <cstdint>
+#include <deque>
 #include <fstream>
 #include <map>
 #include <sstream>
 #include <string>
+#include <unordered_map>
 //-- https://github.com/nlohmann/json
 //-- used to read and write (City)JSON
 #include "json.hpp" //-- it is in the /include/ folder
@@ -59,16 +63,21 @@ bool is_vertical_surface(vec<Point3> points);
 
 typedef map<string, BIMObject> BIMObjects;
 
-pair<BIMObjects, vec<vec<double>>> read_obj(std::ifstream &input);
+// Vertices come back as a flat array: x, y, z of every vertex in turn
+pair<BIMObjects, vec<double>> read_obj(std::ifstream &input);
+pair<BIMObjects, vec<double>> read_obj(const string &filename);
 
-enum class VoxelLabel { UNLABELED, INTERSECTED, EXTERIOR, INTERIOR };
+enum class VoxelLabel : uint8_t { UNLABELED, INTERSECTED, EXTERIOR, INTERIOR };
 
 string voxel_lable_to_string(VoxelLabel label);
 
+// From the lower-case name, e.g. "intersected"
+bool parse_voxel_label(const string &name, VoxelLabel &label);
+
 typedef unsigned int RoomID;
 
 // Maybe we only use Building and BuildingRoom
-enum class CityObjectType {
+enum class CityObjectType : uint8_t {
   UNKOWN,
   Building,
   BuildingPart,
@@ -83,7 +92,7 @@ enum class CityObjectType {
 string city_object_type_to_string(CityObjectType type);
 
 // Maybe we use a couple of these
-enum class Semantics {
+enum class Semantics : uint8_t {
   UNKOWN,
   RoofSurface,
   GroundSurface,
@@ -98,19 +107,45 @@ enum class Semantics {
   FloorSurface
 };
 
+// Packed to 3 bytes; the room id lives in VoxelGrid::room_ids.
 struct VoxelInfo {
   VoxelLabel label;
-  RoomID room_id;
   CityObjectType city_object_type;
   Semantics semantics;
 
   VoxelInfo();
 };
 
+// Memory order of the flat voxel buffer. Linear is x-major with z contiguous;
+// Brick stores 8x8x8 bricks contiguously with Morton order inside a brick so
+// that spatially close voxels share cache lines. SparseBrick keeps no flat
+// buffer at all: bricks are hashed and only allocated on first write, every
+// other voxel has the grid's background value.
+enum class VoxelLayout : uint8_t { Linear, Brick, SparseBrick };
+
+const unsigned int BRICK_SIZE = 8;
+const unsigned int BRICK_VOXELS = BRICK_SIZE * BRICK_SIZE * BRICK_SIZE;
+
+struct VoxelBrick {
+  VoxelInfo voxels[BRICK_VOXELS];
+  RoomID room_ids[BRICK_VOXELS];
+
+  explicit VoxelBrick(const VoxelInfo &fill);
+};
+
+// All allocated bricks that share one brick x index. Keeping a separate hash
+// per x-slab of bricks lets threads that own different slabs allocate bricks
+// without locking. A deque never moves its elements, so references into a
+// brick stay valid while other bricks are added.
+struct SparseBrickSlab {
+  unordered_map<uint64_t, uint32_t> brick_index; // (by, bz) key -> bricks
+  deque<VoxelBrick> bricks;
+};
+
 // Voxel Object
 struct VoxelGrid {
-  vec<vec<vec<VoxelInfo>>>
-      voxels; // 0: empty, 1: intersected, 2: exterior, 3 or lager: interior
+  vec<VoxelInfo> voxels; // flat buffer, addressed through index()
+  vec<RoomID> room_ids;  // side array with the same addressing as voxels
   unsigned int max_x, max_y, max_z;
   // Offset is the number of additional voxels to all axis. Specifying 1 allows
   // you to have 2 addditional voxel on each minimum and maximum side of axis.
@@ -118,9 +153,22 @@ struct VoxelGrid {
   vec<double> offset_origin;
   vec<double> origin;
   double resolution;
+  VoxelLayout layout;
+  // Shape of the grid including offset
+  unsigned int size_x, size_y, size_z;
+  // SparseBrick storage, indexed by x / BRICK_SIZE
+  vec<SparseBrickSlab> sparse_slabs;
+  // Value of every voxel in a brick that is not allocated. UNLABELED until
+  // the exterior is marked, EXTERIOR afterwards.
+  VoxelInfo background;
 
   VoxelGrid(unsigned int x, unsigned int y, unsigned int z, vec<double> origin,
-            unsigned offset = 1, double resolution = 0.5);
+            unsigned offset = 1, double resolution = 0.5,
+            VoxelLayout layout = VoxelLayout::Linear);
+
+  size_t index(unsigned int x, unsigned int y, unsigned int z) const;
+
+  size_t num_voxels() const;
 
   VoxelInfo &operator()(const unsigned int &x, const unsigned int &y,
                         const unsigned int &z);
@@ -128,15 +176,128 @@ struct VoxelGrid {
   VoxelInfo operator()(const unsigned int &x, const unsigned int &y,
                        const unsigned int &z) const;
 
+  RoomID &room_id(unsigned int x, unsigned int y, unsigned int z);
+
+  RoomID room_id(unsigned int x, unsigned int y, unsigned int z) const;
+
   vec<unsigned int> voxel_shape_with_offset() const;
+
+  bool is_sparse() const;
+
+  // Allocated brick holding the voxel, nullptr if it is not allocated. The
+  // non-const version allocates the brick filled with the background value.
+  const VoxelBrick *sparse_brick(unsigned int x, unsigned int y,
+                                 unsigned int z) const;
+
+  VoxelBrick *sparse_brick(unsigned int x, unsigned int y, unsigned int z);
+
+  // Bytes held by the voxel and room id buffers
+  size_t memory_usage() const;
+};
+
+// Position of a voxel inside its brick (Morton order)
+size_t brick_local_index(unsigned int x, unsigned int y, unsigned int z);
+
+uint64_t sparse_brick_key(unsigned int by, unsigned int bz);
+
+// Bounding box of the vertices and the number of voxels per axis, without
+// the offset, of the grid that create_voxel makes for them
+struct GridExtent {
+  vec<double> origin;
+  vec<double> size;
+  int num_x, num_y, num_z;
+};
+
+GridExtent grid_extent(const vec<double> &vertices, double resolution);
+
+size_t grid_memory_estimate(const GridExtent &extent, unsigned int offset,
+                            VoxelLayout layout);
+
+VoxelGrid create_voxel(const vec<double> &vertices, unsigned int offset = 1,
+                       double resolution = 0.5,
+                       VoxelLayout layout = VoxelLayout::Linear);
+
+// The triangles of all BIM objects in flat arrays, in the order of the map,
+// so that the voxelization stages stream through them instead of walking the
+// map and the CGAL triangles. x[i][t] is the x coordinate of vertex i of
+// triangle t; triangles of one object are contiguous.
+struct TriangleStore {
+  vec<double> x[3], y[3], z[3];
+  vec<uint32_t> object;      // object of every triangle
+  vec<Semantics> semantics;  // voxel semantics of every triangle
+  vec<string> object_names;
+  vec<GeometricSemantics> object_semantics;
+  vec<uint32_t> object_begin; // first triangle of every object, then the end
+  vec<Bbox3> object_bbox;
+
+  size_t size() const;
+
+  size_t num_objects() const;
+
+  void vertices(size_t t, double v[3][3]) const;
+
+  Bbox3 bbox(size_t t) const;
+
+  // For the exact CGAL predicates
+  Triangle3 triangle(size_t t) const;
 };
 
-VoxelGrid create_voxel(vec<vec<double>> vertices, unsigned int offset = 1,
-                       double resolution = 0.5);
+// Built once after assign_semantics; the objects can be dropped afterwards
+TriangleStore make_triangle_store(const BIMObjects &bim_objs);
+
+// How triangles are matched with voxels: every voxel of a triangle's bounding
+// box in turn, or coarse cells of BRICK_SIZE^3 voxels first and then only the
+// voxels of the cells the triangle touches. Both give the same grid.
+enum class VoxelizeMethod : uint8_t { Flat, Hierarchical };
 
+// num_threads = 0 uses all hardware threads; the result does not depend on it
 VoxelGrid intersection_with_bim_obj(const VoxelGrid &vg,
-                                    const BIMObjects &bim_objs);
+                                    const TriangleStore &triangles,
+                                    unsigned int num_threads = 0,
+                                    VoxelizeMethod method = VoxelizeMethod::Flat);
+
+VoxelGrid intersection_with_bim_obj(const VoxelGrid &vg,
+                                    const BIMObjects &bim_objs,
+                                    unsigned int num_threads = 0,
+                                    VoxelizeMethod method = VoxelizeMethod::Flat);
+
+// Intersects only the voxels in [first, last] (per axis) of `vg`, which must
+// hold the default VoxelInfo there
+void intersect_voxel_region(VoxelGrid &vg, const TriangleStore &triangles,
+                            const unsigned int first[3],
+                            const unsigned int last[3],
+                            unsigned int num_threads = 0,
+                            VoxelizeMethod method = VoxelizeMethod::Flat);
+
+VoxelGrid intersection_with_bim_obj_brute_force(const VoxelGrid &vg,
+                                                const BIMObjects &bim_objs,
+                                                unsigned int num_threads = 0);
+
+// Neighbourhood used when growing exterior and room regions
+enum class Connectivity : uint8_t { Six = 6, Eighteen = 18, TwentySix = 26 };
+
+// How the exterior is found: a breadth-first fill over single voxels,
+// bitwise propagation over packed occupancy layers (bitgrid.cpp), or a fill
+// that crosses empty BRICK_SIZE^3 cells whole and only walks single voxels in
+// cells with geometry. All give the same labels. Parity instead classifies
+// every voxel by casting a ray along z through the triangles
+// (ray_parity.cpp): enclosed space is then the inside of closed solids, not
+// space walled in by them.
+enum class ExteriorMethod : uint8_t { FloodFill, Bitwise, Coarse, Parity };
+
+// `triangles` are the ones the grid was intersected with; only Parity uses
+// them
+VoxelGrid mark_exterior_interior(
+    const VoxelGrid &vg, Connectivity connectivity = Connectivity::Eighteen,
+    unsigned int num_threads = 0,
+    ExteriorMethod method = ExteriorMethod::FloodFill,
+    const TriangleStore *triangles = nullptr);
+
+// What the exporters write: every face of every voxel, or only the boundary
+// surfaces of each region merged into rectangles (greedy_mesh.cpp)
+enum class ExportMesh : uint8_t { Voxels, Greedy };
 
-VoxelGrid mark_exterior_interior(const VoxelGrid &vg);
+// CityJSON output: one document, or CityJSONSeq (JSON Lines of features)
+enum class CityJSONFormat : uint8_t { Document, Sequence };
 
 #endif
\ No newline at end of file
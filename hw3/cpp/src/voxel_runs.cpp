@@ -0,0 +1,295 @@
+#ifndef VOXEL_RUNS_H
+#define VOXEL_RUNS_H
+
+#include "metrics.cpp"
+#include "parallel.cpp"
+#include "types.h"
+#include "voxelgrid.cpp"
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+
+// Run-length encoded z columns. Along z a column of a labelled grid is mostly
+// a long run of exterior, a few intersected voxels, and long runs of interior,
+// so each column is kept as its runs of equal voxels (VoxelInfo and room id).
+// The runs of all columns are stored in one buffer, columns x-major like the
+// linear grid, with the first run of every column in a side array. A voxel is
+// found by a binary search in its column; scans go run by run and skip
+// whole runs they do not need.
+
+struct VoxelRun {
+    uint32_t end; // one past the last z of the run
+    VoxelInfo info;
+    RoomID room_id;
+};
+
+bool same_voxel(const VoxelInfo &a, RoomID a_room, const VoxelInfo &b,
+                RoomID b_room) {
+    return a.label == b.label && a.city_object_type == b.city_object_type &&
+           a.semantics == b.semantics && a_room == b_room;
+}
+
+struct VoxelRuns {
+    // Shape and position, as in the VoxelGrid the runs were encoded from
+    unsigned int max_x, max_y, max_z;
+    unsigned int offset;
+    vec<double> offset_origin;
+    vec<double> origin;
+    double resolution;
+    unsigned int size_x, size_y, size_z;
+    // First run of column x * size_y + y, and the end of the last column
+    vec<size_t> column_begin;
+    vec<VoxelRun> runs;
+
+    // The shape of `vg`, without any run
+    explicit VoxelRuns(const VoxelGrid &vg)
+        : max_x(vg.max_x), max_y(vg.max_y), max_z(vg.max_z),
+          offset(vg.offset), offset_origin(vg.offset_origin),
+          origin(vg.origin), resolution(vg.resolution), size_x(vg.size_x),
+          size_y(vg.size_y), size_z(vg.size_z) {}
+
+    const VoxelRun *column(unsigned int x, unsigned int y) const {
+        return runs.data() + column_begin[static_cast<size_t>(x) * size_y + y];
+    }
+
+    const VoxelRun *column_end(unsigned int x, unsigned int y) const {
+        return runs.data() +
+               column_begin[static_cast<size_t>(x) * size_y + y + 1];
+    }
+
+    // The run that holds voxel z of the column
+    const VoxelRun &run(unsigned int x, unsigned int y, unsigned int z) const {
+        return *upper_bound(column(x, y), column_end(x, y), z,
+                            [](unsigned int z, const VoxelRun &run) {
+                                return z < run.end;
+                            });
+    }
+
+    VoxelInfo operator()(unsigned int x, unsigned int y, unsigned int z) const {
+        return run(x, y, z).info;
+    }
+
+    RoomID room_id(unsigned int x, unsigned int y, unsigned int z) const {
+        return run(x, y, z).room_id;
+    }
+
+    size_t memory_usage() const {
+        return runs.size() * sizeof(VoxelRun) +
+               column_begin.size() * sizeof(size_t);
+    }
+};
+
+// Appends voxels [previous end, end) of a column, merged into the last run
+// when it is the same voxel and belongs to the column
+void push_voxel_run(vec<VoxelRun> &runs, size_t column_first, uint32_t end,
+                    const VoxelInfo &info, RoomID room_id) {
+    if (runs.size() > column_first &&
+        same_voxel(runs.back().info, runs.back().room_id, info, room_id)) {
+        runs.back().end = end;
+    } else {
+        runs.push_back({end, info, room_id});
+    }
+}
+
+// Builds the columns of `shape` in parallel x-slabs: column(x, y, runs)
+// appends the runs of one column, and the slabs are joined in x order into
+// `column_begin` and `runs`
+template<typename ColumnFn>
+void build_voxel_runs(const VoxelRuns &shape, unsigned int num_threads,
+                      ColumnFn column, vec<size_t> &column_begin,
+                      vec<VoxelRun> &runs) {
+    vec<vec<VoxelRun>> chunk_runs(resolve_thread_count(num_threads));
+    column_begin.assign(static_cast<size_t>(shape.size_x) * shape.size_y + 1,
+                        0);
+    // Whole bricks per thread, so sparse grids can be read slab by slab
+    parallel_for_chunks(0, shape.size_x, num_threads, [&](size_t x_begin,
+                                                          size_t x_end,
+                                                          size_t chunk) {
+        vec<VoxelRun> &part = chunk_runs[chunk];
+        for (unsigned int x = x_begin; x < x_end; x++) {
+            for (unsigned int y = 0; y < shape.size_y; y++) {
+                const size_t first = part.size();
+                column(x, y, part);
+                column_begin[static_cast<size_t>(x) * shape.size_y + y + 1] =
+                        part.size() - first;
+            }
+        }
+    }, BRICK_SIZE);
+    for (size_t i = 1; i < column_begin.size(); i++) {
+        column_begin[i] += column_begin[i - 1];
+    }
+    runs.clear();
+    runs.reserve(column_begin.back());
+    for (auto &part: chunk_runs) {
+        runs.insert(runs.end(), part.begin(), part.end());
+        vec<VoxelRun>().swap(part);
+    }
+}
+
+VoxelRuns encode_voxel_runs(const VoxelGrid &vg, unsigned int num_threads = 0) {
+    StageTimer stage("encode_runs");
+    VoxelRuns result(vg);
+    build_voxel_runs(result, num_threads, [&](unsigned int x, unsigned int y,
+                                              vec<VoxelRun> &runs) {
+        const size_t first = runs.size();
+        for (unsigned int z = 0; z < vg.size_z; z++) {
+            push_voxel_run(runs, first, z + 1, vg(x, y, z),
+                           vg.room_id(x, y, z));
+        }
+    }, result.column_begin, result.runs);
+    add_metric_counter("voxel_runs", result.runs.size());
+    return result;
+}
+
+// The grid of the runs in `layout`. A sparse grid takes the voxel at the
+// origin, on the border of the grid, as its background and only stores the
+// others.
+VoxelGrid decode_voxel_runs(const VoxelRuns &runs, VoxelLayout layout,
+                            unsigned int num_threads = 0) {
+    StageTimer stage("decode_runs");
+    VoxelGrid vg(runs.max_x, runs.max_y, runs.max_z, runs.origin, runs.offset,
+                 runs.resolution, layout);
+    const bool sparse = vg.is_sparse();
+    if (sparse && !runs.runs.empty()) {
+        vg.background = runs.runs.front().info;
+    }
+    parallel_for_chunks(0, runs.size_x, num_threads, [&](size_t x_begin,
+                                                         size_t x_end,
+                                                         size_t) {
+        for (unsigned int x = x_begin; x < x_end; x++) {
+            for (unsigned int y = 0; y < runs.size_y; y++) {
+                unsigned int z = 0;
+                for (const VoxelRun *run = runs.column(x, y);
+                     run != runs.column_end(x, y); run++) {
+                    if (sparse && same_voxel(run->info, run->room_id,
+                                             vg.background, 0)) {
+                        z = run->end;
+                        continue;
+                    }
+                    for (; z < run->end; z++) {
+                        vg(x, y, z) = run->info;
+                        vg.room_id(x, y, z) = run->room_id;
+                    }
+                }
+            }
+        }
+    }, BRICK_SIZE);
+    return vg;
+}
+
+// Calls fn(x, y, z) in scan order for the voxels with one of the labels and x
+// in [x_begin, x_end); runs with other labels are skipped whole
+template<typename Fn>
+void for_each_voxel_with_labels(const VoxelRuns &runs, unsigned int x_begin,
+                                unsigned int x_end,
+                                const vec<VoxelLabel> &labels, Fn fn) {
+    for (unsigned int x = x_begin; x < x_end; x++) {
+        for (unsigned int y = 0; y < runs.size_y; y++) {
+            unsigned int z = 0;
+            for (const VoxelRun *run = runs.column(x, y);
+                 run != runs.column_end(x, y); run++) {
+                if (find(labels.begin(), labels.end(), run->info.label) ==
+                    labels.end()) {
+                    z = run->end;
+                    continue;
+                }
+                for (; z < run->end; z++) {
+                    fn(x, y, z);
+                }
+            }
+        }
+    }
+}
+
+template<typename Fn>
+void for_each_voxel_with_labels(const VoxelRuns &runs,
+                                const vec<VoxelLabel> &labels, Fn fn) {
+    for_each_voxel_with_labels(runs, 0, runs.size_x, labels, fn);
+}
+
+// extract_surface on the runs, with the same result. Only the voxels of
+// intersected runs look at their neighbours; each of the neighbouring columns
+// keeps a cursor at the run of the voxel below, so a lookup moves at most a
+// couple of runs up from there.
+void extract_surface(VoxelRuns &runs,
+                     vec<vec<int>> connectivity = eighteen_connectivity,
+                     unsigned int num_threads = 0) {
+    StageTimer stage("extract_surface");
+    vec<size_t> column_begin;
+    vec<VoxelRun> surface_runs;
+    const int size_x = static_cast<int>(runs.size_x),
+              size_y = static_cast<int>(runs.size_y),
+              size_z = static_cast<int>(runs.size_z);
+    build_voxel_runs(runs, num_threads, [&](unsigned int x, unsigned int y,
+                                            vec<VoxelRun> &out) {
+        const size_t first = out.size();
+        // Cursors of the 3 x 3 columns around this one, at (dx + 1) * 3 +
+        // dy + 1
+        const VoxelRun *cursor[9] = {};
+        for (int dx = -1; dx <= 1; dx++) {
+            for (int dy = -1; dy <= 1; dy++) {
+                const int adj_x = static_cast<int>(x) + dx;
+                const int adj_y = static_cast<int>(y) + dy;
+                if (adj_x >= 0 && adj_y >= 0 && adj_x < size_x &&
+                    adj_y < size_y) {
+                    cursor[(dx + 1) * 3 + dy + 1] = runs.column(adj_x, adj_y);
+                }
+            }
+        }
+        unsigned int z = 0;
+        for (const VoxelRun *run = runs.column(x, y);
+             run != runs.column_end(x, y); run++) {
+            if (run->info.label != VoxelLabel::INTERSECTED) {
+                push_voxel_run(out, first, run->end, run->info, run->room_id);
+                z = run->end;
+                continue;
+            }
+            for (; z < run->end; z++) {
+                const unsigned int below = z > 0 ? z - 1 : 0;
+                for (const VoxelRun *&column: cursor) {
+                    while (column != nullptr && column->end <= below) {
+                        column++;
+                    }
+                }
+                bool exterior = false;
+                const VoxelRun *interior = nullptr;
+                for (const auto &adjacent_voxel: connectivity) {
+                    const VoxelRun *column =
+                            cursor[(adjacent_voxel[0] + 1) * 3 +
+                                   adjacent_voxel[1] + 1];
+                    const int adj_z = static_cast<int>(z) + adjacent_voxel[2];
+                    if (column == nullptr || adj_z < 0 ||
+                        adj_z >= size_z) {
+                        continue;
+                    }
+                    while (column->end <= static_cast<unsigned int>(adj_z)) {
+                        column++;
+                    }
+                    if (column->info.label == VoxelLabel::EXTERIOR) {
+                        exterior = true;
+                        break;
+                    }
+                    if (interior == nullptr &&
+                        column->info.label == VoxelLabel::INTERIOR) {
+                        interior = column;
+                    }
+                }
+                VoxelInfo voxel = run->info;
+                RoomID room_id = run->room_id;
+                if (exterior) {
+                    voxel.city_object_type = CityObjectType::BuildingPart;
+                } else {
+                    voxel.city_object_type = CityObjectType::BuildingRoom;
+                    if (interior != nullptr) {
+                        room_id = interior->room_id;
+                    }
+                }
+                push_voxel_run(out, first, z + 1, voxel, room_id);
+            }
+        }
+    }, column_begin, surface_runs);
+    runs.column_begin = move(column_begin);
+    runs.runs = move(surface_runs);
+}
+
+#endif
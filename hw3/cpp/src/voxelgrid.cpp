@@ -1,64 +1,275 @@
 #ifndef VOXEL_GRID_H
 #define VOXEL_GRID_H
 
+#include "bitgrid.cpp"
+#include "metrics.cpp"
+#include "parallel.cpp"
+#include "progress.cpp"
+#include "ray_parity.cpp"
+#include "tri_box.cpp"
 #include "types.h"
 #include "voxelinfo.cpp"
 #include <algorithm>
 #include <array>
 #include <cassert>
 #include <cstddef>
+#include <iostream>
 #include <limits>
 
 VoxelGrid::VoxelGrid(unsigned int x, unsigned int y, unsigned int z,
-                     vec<double> origin, unsigned offset, double resolution) {
+                     vec<double> origin, unsigned offset, double resolution,
+                     VoxelLayout layout) {
     this->max_x = x;
     this->max_y = y;
     this->max_z = z;
     this->origin = origin;
     this->resolution = resolution;
     this->offset = offset;
+    this->layout = layout;
     this->offset_origin = {origin[0] - offset * resolution,
                            origin[1] - offset * resolution,
                            origin[2] - offset * resolution};
+    this->size_x = max_x + offset * 2;
+    this->size_y = max_y + offset * 2;
+    this->size_z = max_z + offset * 2;
 
-    unsigned int total_voxels =
-            (max_x + offset * 2) * (max_y + offset * 2) * (max_z + offset * 2);
-    voxels.reserve(total_voxels);
-    for (unsigned int i = 0; i < max_x + offset * 2; ++i) {
-        vec<vec<VoxelInfo>> y_voxels;
-        for (unsigned int j = 0; j < max_y + offset * 2; ++j) {
-            vec<VoxelInfo> z_voxels;
-            for (unsigned int k = 0; k < max_z + offset * 2; ++k) {
-                VoxelInfo voxel_info = VoxelInfo();
-                voxel_info.label = VoxelLabel::UNLABELED;
-                z_voxels.push_back(voxel_info);
-            }
-            y_voxels.push_back(z_voxels);
-        }
-        voxels.push_back(y_voxels);
+    if (layout == VoxelLayout::SparseBrick) {
+        sparse_slabs.resize((size_x + BRICK_SIZE - 1) / BRICK_SIZE);
+        return;
+    }
+    // Single allocation for the whole grid instead of one vector per column
+    voxels.assign(num_voxels(), VoxelInfo());
+    room_ids.assign(num_voxels(), 0);
+}
+
+VoxelBrick::VoxelBrick(const VoxelInfo &fill) {
+    fill_n(voxels, BRICK_VOXELS, fill);
+    fill_n(room_ids, BRICK_VOXELS, 0);
+}
+
+// Spreads the lower 3 bits of v so that they occupy every third bit
+static inline size_t spread_brick_bits(unsigned int v) {
+    return (v & 1) | ((v & 2) << 2) | ((v & 4) << 4);
+}
+
+size_t brick_local_index(unsigned int x, unsigned int y, unsigned int z) {
+    return spread_brick_bits(z % BRICK_SIZE) |
+           (spread_brick_bits(y % BRICK_SIZE) << 1) |
+           (spread_brick_bits(x % BRICK_SIZE) << 2);
+}
+
+uint64_t sparse_brick_key(unsigned int by, unsigned int bz) {
+    return (static_cast<uint64_t>(by) << 32) | bz;
+}
+
+size_t VoxelGrid::index(unsigned int x, unsigned int y, unsigned int z) const {
+    assert(layout != VoxelLayout::SparseBrick);
+    if (layout == VoxelLayout::Linear) {
+        return (static_cast<size_t>(x) * size_y + y) * size_z + z;
+    }
+    const size_t bricks_y = (size_y + BRICK_SIZE - 1) / BRICK_SIZE;
+    const size_t bricks_z = (size_z + BRICK_SIZE - 1) / BRICK_SIZE;
+    const size_t brick = (static_cast<size_t>(x / BRICK_SIZE) * bricks_y +
+                          y / BRICK_SIZE) *
+                         bricks_z +
+                         z / BRICK_SIZE;
+    return brick * BRICK_VOXELS + brick_local_index(x, y, z);
+}
+
+size_t VoxelGrid::num_voxels() const {
+    if (layout == VoxelLayout::Linear) {
+        return static_cast<size_t>(size_x) * size_y * size_z;
     }
+    // Brick layouts pad every axis up to a whole number of bricks
+    const size_t bricks_x = (size_x + BRICK_SIZE - 1) / BRICK_SIZE;
+    const size_t bricks_y = (size_y + BRICK_SIZE - 1) / BRICK_SIZE;
+    const size_t bricks_z = (size_z + BRICK_SIZE - 1) / BRICK_SIZE;
+    return bricks_x * bricks_y * bricks_z * BRICK_VOXELS;
+}
+
+bool VoxelGrid::is_sparse() const {
+    return layout == VoxelLayout::SparseBrick;
+}
+
+const VoxelBrick *VoxelGrid::sparse_brick(unsigned int x, unsigned int y,
+                                          unsigned int z) const {
+    const SparseBrickSlab &slab = sparse_slabs[x / BRICK_SIZE];
+    auto found =
+            slab.brick_index.find(sparse_brick_key(y / BRICK_SIZE, z / BRICK_SIZE));
+    return found == slab.brick_index.end() ? nullptr
+                                           : &slab.bricks[found->second];
+}
+
+VoxelBrick *VoxelGrid::sparse_brick(unsigned int x, unsigned int y,
+                                    unsigned int z) {
+    SparseBrickSlab &slab = sparse_slabs[x / BRICK_SIZE];
+    auto inserted = slab.brick_index.emplace(
+            sparse_brick_key(y / BRICK_SIZE, z / BRICK_SIZE), slab.bricks.size());
+    if (inserted.second) {
+        slab.bricks.emplace_back(background);
+    }
+    return &slab.bricks[inserted.first->second];
 }
 
 VoxelInfo &VoxelGrid::operator()(const unsigned int &x, const unsigned int &y,
                                  const unsigned int &z) {
-    assert(x >= 0 && x < max_x);
-    assert(y >= 0 && y < max_y);
-    assert(z >= 0 && z < max_z);
-    return voxels[x][y][z];
+    assert(x < size_x);
+    assert(y < size_y);
+    assert(z < size_z);
+    if (layout == VoxelLayout::SparseBrick) {
+        return sparse_brick(x, y, z)->voxels[brick_local_index(x, y, z)];
+    }
+    return voxels[index(x, y, z)];
 }
 
 VoxelInfo VoxelGrid::operator()(const unsigned int &x, const unsigned int &y,
                                 const unsigned int &z) const {
-    assert(x >= 0 && x < max_x);
-    assert(y >= 0 && y < max_y);
-    assert(z >= 0 && z < max_z);
-    return voxels[x][y][z];
+    assert(x < size_x);
+    assert(y < size_y);
+    assert(z < size_z);
+    if (layout == VoxelLayout::SparseBrick) {
+        const VoxelBrick *brick = sparse_brick(x, y, z);
+        return brick ? brick->voxels[brick_local_index(x, y, z)] : background;
+    }
+    return voxels[index(x, y, z)];
+}
+
+RoomID &VoxelGrid::room_id(unsigned int x, unsigned int y, unsigned int z) {
+    assert(x < size_x && y < size_y && z < size_z);
+    if (layout == VoxelLayout::SparseBrick) {
+        return sparse_brick(x, y, z)->room_ids[brick_local_index(x, y, z)];
+    }
+    return room_ids[index(x, y, z)];
+}
+
+RoomID VoxelGrid::room_id(unsigned int x, unsigned int y,
+                          unsigned int z) const {
+    assert(x < size_x && y < size_y && z < size_z);
+    if (layout == VoxelLayout::SparseBrick) {
+        const VoxelBrick *brick = sparse_brick(x, y, z);
+        return brick ? brick->room_ids[brick_local_index(x, y, z)] : 0;
+    }
+    return room_ids[index(x, y, z)];
 }
 
 vec<unsigned int> VoxelGrid::voxel_shape_with_offset() const {
-    return {max_x + offset * 2, max_y + offset * 2, max_z + offset * 2};
+    return {size_x, size_y, size_z};
 };
 
+size_t VoxelGrid::memory_usage() const {
+    size_t bytes = voxels.capacity() * sizeof(VoxelInfo) +
+                   room_ids.capacity() * sizeof(RoomID);
+    for (const auto &slab: sparse_slabs) {
+        // Brick data plus a rough estimate of one hash node per brick
+        bytes += slab.bricks.size() * (sizeof(VoxelBrick) + 32);
+    }
+    return bytes;
+}
+
+// Index of a voxel in x, y, z scan order, independent of the memory layout
+size_t scan_index(const VoxelGrid &vg, unsigned int x, unsigned int y,
+                  unsigned int z) {
+    return (static_cast<size_t>(x) * vg.size_y + y) * vg.size_z + z;
+}
+
+void scan_index_to_xyz(const VoxelGrid &vg, size_t index, unsigned int &x,
+                       unsigned int &y, unsigned int &z) {
+    z = index % vg.size_z;
+    index /= vg.size_z;
+    y = index % vg.size_y;
+    x = index / vg.size_y;
+}
+
+// Calls fn(x, y, z) in x, y, z scan order for every stored voxel with x in
+// [x_begin, x_end): all voxels of a dense grid, only the voxels of allocated
+// bricks of a sparse one (the others all have the background value). On
+// sparse grids x_begin must be a multiple of BRICK_SIZE.
+template<typename Fn>
+void for_each_stored_voxel(const VoxelGrid &vg, unsigned int x_begin,
+                           unsigned int x_end, Fn fn) {
+    if (!vg.is_sparse()) {
+        for (unsigned int x = x_begin; x < x_end; x++) {
+            for (unsigned int y = 0; y < vg.size_y; y++) {
+                for (unsigned int z = 0; z < vg.size_z; z++) {
+                    fn(x, y, z);
+                }
+            }
+        }
+        return;
+    }
+    const unsigned int bx_end = (x_end + BRICK_SIZE - 1) / BRICK_SIZE;
+    for (unsigned int bx = x_begin / BRICK_SIZE; bx < bx_end; bx++) {
+        // Allocated bricks of this slab, sorted by (by, bz)
+        vec<uint64_t> keys;
+        for (const auto &entry: vg.sparse_slabs[bx].brick_index) {
+            keys.push_back(entry.first);
+        }
+        sort(keys.begin(), keys.end());
+        const unsigned int slab_end = min(x_end, (bx + 1) * BRICK_SIZE);
+        for (unsigned int x = bx * BRICK_SIZE; x < slab_end; x++) {
+            for (size_t row = 0; row < keys.size();) {
+                // Bricks [row, row_end) share the same by
+                const unsigned int by = keys[row] >> 32;
+                size_t row_end = row;
+                while (row_end < keys.size() && (keys[row_end] >> 32) == by) {
+                    row_end++;
+                }
+                const unsigned int y_end = min(vg.size_y, (by + 1) * BRICK_SIZE);
+                for (unsigned int y = by * BRICK_SIZE; y < y_end; y++) {
+                    for (size_t brick = row; brick < row_end; brick++) {
+                        const unsigned int bz = keys[brick] & 0xffffffffu;
+                        const unsigned int z_end =
+                                min(vg.size_z, (bz + 1) * BRICK_SIZE);
+                        for (unsigned int z = bz * BRICK_SIZE; z < z_end; z++) {
+                            fn(x, y, z);
+                        }
+                    }
+                }
+                row = row_end;
+            }
+        }
+    }
+}
+
+template<typename Fn>
+void for_each_stored_voxel(const VoxelGrid &vg, Fn fn) {
+    for_each_stored_voxel(vg, 0, vg.size_x, fn);
+}
+
+// Calls fn(x, y, z) in scan order for the voxels with one of the labels and x
+// in [x_begin, x_end), with x_begin a multiple of BRICK_SIZE on sparse grids
+template<typename Fn>
+void for_each_voxel_with_labels(const VoxelGrid &vg, unsigned int x_begin,
+                                unsigned int x_end,
+                                const vec<VoxelLabel> &labels, Fn fn) {
+    auto selected = [&](VoxelLabel label) {
+        return find(labels.begin(), labels.end(), label) != labels.end();
+    };
+    auto visit = [&](unsigned int x, unsigned int y, unsigned int z) {
+        if (selected(vg(x, y, z).label)) {
+            fn(x, y, z);
+        }
+    };
+    if (vg.is_sparse() && selected(vg.background.label)) {
+        // Unallocated bricks hold the background label and are visited too
+        for (unsigned int x = x_begin; x < x_end; x++) {
+            for (unsigned int y = 0; y < vg.size_y; y++) {
+                for (unsigned int z = 0; z < vg.size_z; z++) {
+                    visit(x, y, z);
+                }
+            }
+        }
+    } else {
+        for_each_stored_voxel(vg, x_begin, x_end, visit);
+    }
+}
+
+template<typename Fn>
+void for_each_voxel_with_labels(const VoxelGrid &vg,
+                                const vec<VoxelLabel> &labels, Fn fn) {
+    for_each_voxel_with_labels(vg, 0, vg.size_x, labels, fn);
+}
+
 vec<double> voxel_index_to_coordinate(const VoxelGrid &vg,
                                       const vec<unsigned int> &voxel_xyz) {
     double x_coord =
@@ -70,32 +281,63 @@ vec<double> voxel_index_to_coordinate(const VoxelGrid &vg,
     return {x_coord, y_coord, z_coord};;
 }
 
-VoxelGrid create_voxel(vec<vec<double>> vertices, unsigned int offset,
-                       double resolution) {
-    double minx, miny, minz = numeric_limits<double>::max();
-    double maxx, maxy, maxz = numeric_limits<double>::min();
+GridExtent grid_extent(const vec<double> &vertices, double resolution) {
+    double minx = numeric_limits<double>::max();
+    double miny = numeric_limits<double>::max();
+    double minz = numeric_limits<double>::max();
+    double maxx = numeric_limits<double>::lowest();
+    double maxy = numeric_limits<double>::lowest();
+    double maxz = numeric_limits<double>::lowest();
+
+    for (size_t i = 0; i + 2 < vertices.size(); i += 3) {
+        const double *vertex = &vertices[i];
+        minx = min(minx, vertex[0]);
+        miny = min(miny, vertex[1]);
+        minz = min(minz, vertex[2]);
 
-    for (const auto &vertex: vertices) {
-        if (vertex.size() >= 3) {
-            minx = min(minx, vertex[0]);
-            miny = min(miny, vertex[1]);
-            minz = min(minz, vertex[2]);
+        maxx = max(maxx, vertex[0]);
+        maxy = max(maxy, vertex[1]);
+        maxz = max(maxz, vertex[2]);
+    }
+    GridExtent extent;
+    extent.origin = {minx, miny, minz};
+    extent.size = {maxx - minx, maxy - miny, maxz - minz};
+    extent.num_x = static_cast<int>(ceil((maxx - minx) / resolution));
+    extent.num_y = static_cast<int>(ceil((maxy - miny) / resolution));
+    extent.num_z = static_cast<int>(ceil((maxz - minz) / resolution));
+    return extent;
+}
 
-            maxx = max(maxx, vertex[0]);
-            maxy = max(maxy, vertex[1]);
-            maxz = max(maxz, vertex[2]);
+// Bytes of the voxel and room id buffers of a grid of the given extent, with
+// the padding of brick layouts. Sparse grids are counted as dense ones since
+// which bricks they allocate is only known after the intersection.
+size_t grid_memory_estimate(const GridExtent &extent, unsigned int offset,
+                            VoxelLayout layout) {
+    size_t voxels = 1;
+    for (const int num: {extent.num_x, extent.num_y, extent.num_z}) {
+        size_t size = num + offset * 2;
+        if (layout != VoxelLayout::Linear) {
+            size = (size + BRICK_SIZE - 1) / BRICK_SIZE * BRICK_SIZE;
         }
+        voxels *= size;
     }
-    double x_diff = maxx - minx;
-    cout << "x diff :" << x_diff << endl;
-    int num_x = static_cast<int>(ceil((maxx - minx) / resolution));
-    int num_y = static_cast<int>(ceil((maxy - miny) / resolution));
-    int num_z = static_cast<int>(ceil((maxz - minz) / resolution));
+    return voxels * (sizeof(VoxelInfo) + sizeof(RoomID));
+}
+
+VoxelGrid create_voxel(const vec<double> &vertices, unsigned int offset,
+                       double resolution, VoxelLayout layout) {
+    StageTimer stage("create_voxel");
+    const GridExtent extent = grid_extent(vertices, resolution);
+    progress() << "x diff :" << extent.size[0] << endl;
 
-    cout << "size of voxel grid 1: " << num_x << " " << num_y << " " << num_z
-         << endl;
-    vec<double> origin = {minx, miny, minz};
-    return VoxelGrid(num_x, num_y, num_z, origin, offset, resolution);
+    progress() << "size of voxel grid 1: " << extent.num_x << " "
+               << extent.num_y << " " << extent.num_z << endl;
+    VoxelGrid vg(extent.num_x, extent.num_y, extent.num_z, extent.origin,
+                 offset, resolution, layout);
+    progress() << "voxel grid memory: " << vg.memory_usage() / (1024.0 * 1024.0)
+               << " MiB (" << vg.num_voxels() << " voxels)" << endl;
+    add_metric_counter("voxels", vg.num_voxels());
+    return vg;
 }
 
 bool simple_intersection(
@@ -123,62 +365,460 @@ bool simple_intersection(
     return overlap_x && overlap_y && overlap_z;
 }
 
-VoxelGrid intersection_with_bim_obj(const VoxelGrid &vg_arg,
-                                    const BIMObjects &bim_objs_arg) {
-    const double resolution = vg_arg.resolution;
-    const double half_res = resolution / 2;
+Semantics geometric_to_voxel_semantics(GeometricSemantics sem) {
+    switch (sem) {
+        case GeometricSemantics::Roof:
+            return Semantics::RoofSurface;
+        case GeometricSemantics::Floor:
+            return Semantics::FloorSurface;
+        case GeometricSemantics::Wall:
+            return Semantics::WallSurface;
+        case GeometricSemantics::Window:
+            return Semantics::Window;
+        case GeometricSemantics::Door:
+            return Semantics::Door;
+        case GeometricSemantics::InteriorWall:
+            return Semantics::InteriorWallSurface;
+        default:
+            return Semantics::UNKOWN;
+    }
+}
+
+// Box of a single voxel, computed the same way for every intersection path so
+// that they agree bit for bit
+double voxel_center(const VoxelGrid &vg, int axis, unsigned int index) {
+    return vg.offset_origin[axis] + index * vg.resolution + vg.resolution / 2;
+}
+
+Bbox3 voxel_bbox(const VoxelGrid &vg, unsigned int x, unsigned int y,
+                 unsigned int z) {
+    const double half_res = vg.resolution / 2;
+    const double center_x = voxel_center(vg, 0, x);
+    const double center_y = voxel_center(vg, 1, y);
+    const double center_z = voxel_center(vg, 2, z);
+    return Bbox3(center_x - half_res, center_y - half_res, center_z - half_res,
+                 center_x + half_res, center_y + half_res, center_z + half_res);
+}
+
+Bbox3 triangle_bbox(const Triangle3 &shell) {
+    const Point3 p0 = shell.vertex(0);
+    const Point3 p1 = shell.vertex(1);
+    const Point3 p2 = shell.vertex(2);
+    return Bbox3(min({p0.x(), p1.x(), p2.x()}), min({p0.y(), p1.y(), p2.y()}),
+                 min({p0.z(), p1.z(), p2.z()}), max({p0.x(), p1.x(), p2.x()}),
+                 max({p0.y(), p1.y(), p2.y()}), max({p0.z(), p1.z(), p2.z()}));
+}
+
+// Closed-interval overlap, same rule as simple_intersection
+bool bbox_overlap(const Bbox3 &a, const Bbox3 &b) {
+    return a.xmax() >= b.xmin() && a.xmin() <= b.xmax() &&
+           a.ymax() >= b.ymin() && a.ymin() <= b.ymax() &&
+           a.zmax() >= b.zmin() && a.zmin() <= b.zmax();
+}
+
+size_t TriangleStore::size() const {
+    return object.size();
+}
+
+size_t TriangleStore::num_objects() const {
+    return object_names.size();
+}
+
+void TriangleStore::vertices(size_t t, double v[3][3]) const {
+    for (int i = 0; i < 3; i++) {
+        v[i][0] = x[i][t];
+        v[i][1] = y[i][t];
+        v[i][2] = z[i][t];
+    }
+}
+
+Bbox3 TriangleStore::bbox(size_t t) const {
+    return Bbox3(min({x[0][t], x[1][t], x[2][t]}),
+                 min({y[0][t], y[1][t], y[2][t]}),
+                 min({z[0][t], z[1][t], z[2][t]}),
+                 max({x[0][t], x[1][t], x[2][t]}),
+                 max({y[0][t], y[1][t], y[2][t]}),
+                 max({z[0][t], z[1][t], z[2][t]}));
+}
+
+Triangle3 TriangleStore::triangle(size_t t) const {
+    return Triangle3(Point3(x[0][t], y[0][t], z[0][t]),
+                     Point3(x[1][t], y[1][t], z[1][t]),
+                     Point3(x[2][t], y[2][t], z[2][t]));
+}
+
+TriangleStore make_triangle_store(const BIMObjects &bim_objs) {
+    StageTimer stage("triangle_store");
+    TriangleStore store;
+    size_t num_triangles = 0;
+    for (const auto &bim: bim_objs) {
+        num_triangles += bim.second.shells.size();
+    }
+    for (int i = 0; i < 3; i++) {
+        store.x[i].reserve(num_triangles);
+        store.y[i].reserve(num_triangles);
+        store.z[i].reserve(num_triangles);
+    }
+    store.object.reserve(num_triangles);
+    store.semantics.reserve(num_triangles);
+    for (const auto &bim: bim_objs) {
+        const uint32_t id = store.object_names.size();
+        const Semantics semantics = geometric_to_voxel_semantics(bim.second.sem);
+        store.object_names.push_back(bim.first);
+        store.object_semantics.push_back(bim.second.sem);
+        store.object_begin.push_back(store.size());
+        for (const auto &shell: bim.second.shells) {
+            for (int i = 0; i < 3; i++) {
+                const Point3 p = shell.vertex(i);
+                store.x[i].push_back(p.x());
+                store.y[i].push_back(p.y());
+                store.z[i].push_back(p.z());
+            }
+            store.object.push_back(id);
+            store.semantics.push_back(semantics);
+        }
+        // Objects without triangles get an empty box at the origin
+        const size_t first = store.object_begin.back();
+        Bbox3 bbox = first < store.size() ? store.bbox(first)
+                                          : Bbox3(0, 0, 0, 0, 0, 0);
+        for (size_t t = first + 1; t < store.size(); t++) {
+            bbox = bbox + store.bbox(t);
+        }
+        store.object_bbox.push_back(bbox);
+    }
+    store.object_begin.push_back(store.size());
+    add_metric_counter("stored_triangles", store.size());
+    return store;
+}
+
+// Inclusive range of voxel indices along one axis whose boxes may touch
+// [min, max]. The range is widened by one voxel on both sides so that rounding
+// never drops a touching voxel; the exact box test rejects the extra ones.
+bool voxel_index_range(double min, double max, double origin, double resolution,
+                       unsigned int size, unsigned int &first,
+                       unsigned int &last) {
+    const double lo = floor((min - origin) / resolution) - 1;
+    const double hi = floor((max - origin) / resolution) + 1;
+    if (hi < 0 || lo >= size) {
+        return false;
+    }
+    first = lo < 0 ? 0 : static_cast<unsigned int>(lo);
+    last = hi >= size ? size - 1 : static_cast<unsigned int>(hi);
+    return true;
+}
+
+// Original voxel-driven path: every voxel is tested against every triangle.
+// Kept as the reference for intersection_with_bim_obj and for benchmarking.
+VoxelGrid intersection_with_bim_obj_brute_force(const VoxelGrid &vg_arg,
+                                                const BIMObjects &bim_objs_arg,
+                                                unsigned int num_threads) {
     VoxelGrid vg(vg_arg.max_x, vg_arg.max_y, vg_arg.max_z, vg_arg.origin,
-                 vg_arg.offset, vg_arg.resolution);
-    for (unsigned int x = 0; x < vg.voxels.size(); x++) {
-        for (unsigned int y = 0; y < vg.voxels[x].size(); y++) {
-            for (unsigned int z = 0; z < vg.voxels[x][y].size(); z++) {
-                vec<unsigned int> voxel_xyz = {x, y, z};
-                vec<double> voxel_center = voxel_index_to_coordinate(vg, voxel_xyz);
-
-                // xmin, ymin, zmin, xmax, ymax, zmax
-                vec<double> bbox = {
-                        voxel_center[0] - half_res, voxel_center[1] - half_res,
-                        voxel_center[2] - half_res, voxel_center[0] + half_res,
-                        voxel_center[1] + half_res, voxel_center[2] + half_res};
-                Bbox3 cgal_bbox =
-                        Bbox3(bbox[0], bbox[1], bbox[2], bbox[3], bbox[4], bbox[5]);
-                for (const auto &bim: bim_objs_arg) {
-                    for (const auto &shell: bim.second.shells) {
-                        bool is_simply_intersect = simple_intersection(shell, bbox);
-                        if (!is_simply_intersect) {
-                            continue;
+                 vg_arg.offset, vg_arg.resolution, vg_arg.layout);
+    auto intersect_slab = [&](size_t x_begin, size_t x_end, size_t) {
+        for (unsigned int x = x_begin; x < x_end; x++) {
+            for (unsigned int y = 0; y < vg.size_y; y++) {
+                for (unsigned int z = 0; z < vg.size_z; z++) {
+                    const Bbox3 cgal_bbox = voxel_bbox(vg, x, y, z);
+                    // xmin, ymin, zmin, xmax, ymax, zmax
+                    vec<double> bbox = {cgal_bbox.xmin(), cgal_bbox.ymin(),
+                                        cgal_bbox.zmin(), cgal_bbox.xmax(),
+                                        cgal_bbox.ymax(), cgal_bbox.zmax()};
+                    for (const auto &bim: bim_objs_arg) {
+                        for (const auto &shell: bim.second.shells) {
+                            bool is_simply_intersect =
+                                    simple_intersection(shell, bbox);
+                            if (!is_simply_intersect) {
+                                continue;
+                            }
+                            bool is_intersect = CGAL::do_intersect(cgal_bbox, shell);
+                            if (is_intersect) {
+                                VoxelInfo &voxel = vg(x, y, z);
+                                voxel.label = VoxelLabel::INTERSECTED;
+                                voxel.semantics =
+                                        geometric_to_voxel_semantics(bim.second.sem);
+                                break;
+                            }
                         }
-                        bool is_intersect = CGAL::do_intersect(cgal_bbox, shell);
-                        if (is_intersect) {
-                            vg.voxels[x][y][z].label = VoxelLabel::INTERSECTED;
-                            if (bim.second.sem == GeometricSemantics::Other) {
-                                vg.voxels[x][y][z].semantics = Semantics::UNKOWN;
-                            } else if (bim.second.sem == GeometricSemantics::Roof) {
-                                vg.voxels[x][y][z].semantics = Semantics::RoofSurface;
-                            } else if (bim.second.sem == GeometricSemantics::Floor) {
-                                vg.voxels[x][y][z].semantics = Semantics::FloorSurface;
-                            } else if (bim.second.sem == GeometricSemantics::Wall) {
-                                vg.voxels[x][y][z].semantics = Semantics::WallSurface;
-                            } else if (bim.second.sem == GeometricSemantics::Window) {
-                                vg.voxels[x][y][z].semantics = Semantics::Window;
-                            } else if (bim.second.sem == GeometricSemantics::Door) {
-                                vg.voxels[x][y][z].semantics = Semantics::Door;
-                            } else if (bim.second.sem == GeometricSemantics::InteriorWall) {
-                                vg.voxels[x][y][z].semantics = Semantics::InteriorWallSurface;
-                            } else {
-                                vg.voxels[x][y][z].semantics = Semantics::UNKOWN;
+                    }
+                }
+            }
+        }
+    };
+    parallel_for_chunks(0, vg.size_x, num_threads, intersect_slab, BRICK_SIZE);
+
+    return vg;
+}
+
+// A triangle together with the voxel index range its bounding box covers
+struct ShellCandidate {
+    uint32_t triangle; // index into the TriangleStore
+    Bbox3 bbox;
+    Semantics semantics;
+    unsigned int first[3], last[3];
+};
+
+// Work done by one thread of the intersection, for the metrics
+struct IntersectionCounts {
+    uint64_t pairs = 0; // triangle/voxel pairs classified
+    uint64_t cells = 0; // triangle/coarse cell pairs classified
+    uint64_t exact = 0; // exact predicate calls
+    uint64_t hits = 0;  // voxels written
+};
+
+// Triangle-driven intersection: each triangle only visits the voxels covered
+// by its bounding box, so the cost follows the surface area of the model
+// instead of voxels x triangles.
+//
+// With VoxelizeMethod::Hierarchical a triangle is first tested against the
+// coarse cells of BRICK_SIZE^3 voxels its bounding box covers, and only the
+// voxels of the cells it touches are tested one by one. Large slanted
+// triangles, whose bounding boxes are mostly empty space, then cost little
+// more than their area. The voxels tested and the order they are tested in
+// are otherwise the same, so both methods give the same grid.
+//
+// The grid is split into x-slabs, one per thread. Every thread walks all
+// triangles in the same order but only writes voxels of its own slab, so the
+// result is identical to a single-threaded run for any thread count.
+//
+// Only the voxels in [region_first, region_last] (per axis) are computed; they
+// must hold the default VoxelInfo beforehand. Voxels outside the region are
+// neither read nor written, which lets an incremental update redo just the
+// part of a grid that a changed object touches.
+void intersect_voxel_region(VoxelGrid &vg, const TriangleStore &triangles,
+                            const unsigned int region_first[3],
+                            const unsigned int region_last[3],
+                            unsigned int num_threads, VoxelizeMethod method) {
+    StageTimer stage("intersect");
+    const vec<unsigned int> shape = vg.voxel_shape_with_offset();
+
+    // Whether the voxel range of a box reaches into the region
+    auto box_in_region = [&](const Bbox3 &bbox) {
+        for (int axis = 0; axis < 3; axis++) {
+            unsigned int first, last;
+            if (!voxel_index_range(bbox.min(axis), bbox.max(axis),
+                                   vg.offset_origin[axis], vg.resolution,
+                                   shape[axis], first, last) ||
+                last < region_first[axis] || first > region_last[axis]) {
+                return false;
+            }
+        }
+        return true;
+    };
+    vec<ShellCandidate> candidates;
+    for (size_t id = 0; id < triangles.num_objects(); id++) {
+        // Objects away from the region are skipped as a whole
+        if (!box_in_region(triangles.object_bbox[id])) {
+            continue;
+        }
+        for (uint32_t t = triangles.object_begin[id];
+             t < triangles.object_begin[id + 1]; t++) {
+            ShellCandidate candidate;
+            candidate.triangle = t;
+            candidate.bbox = triangles.bbox(t);
+            candidate.semantics = triangles.semantics[t];
+            bool in_region = true;
+            for (int axis = 0; axis < 3 && in_region; axis++) {
+                in_region = voxel_index_range(
+                        candidate.bbox.min(axis), candidate.bbox.max(axis),
+                        vg.offset_origin[axis], vg.resolution, shape[axis],
+                        candidate.first[axis], candidate.last[axis]);
+                if (!in_region) {
+                    break;
+                }
+                candidate.first[axis] =
+                        max(candidate.first[axis], region_first[axis]);
+                candidate.last[axis] =
+                        min(candidate.last[axis], region_last[axis]);
+                in_region = candidate.first[axis] <= candidate.last[axis];
+            }
+            if (in_region) {
+                candidates.push_back(candidate);
+            }
+        }
+    }
+
+    // Largest coordinate magnitude in the grid, for the rounding margins
+    double grid_magnitude = 0;
+    for (int axis = 0; axis < 3; axis++) {
+        grid_magnitude = max({grid_magnitude, fabs(vg.offset_origin[axis]),
+                              fabs(vg.offset_origin[axis] +
+                                   shape[axis] * vg.resolution)});
+    }
+    // Coarse cells are padded a little so that every voxel box, rounded the
+    // way voxel_bbox rounds it, lies inside its cell
+    const double cell_half_size = BRICK_SIZE * vg.resolution / 2 * (1 + 1e-9);
+    auto cell_center = [&](int axis, unsigned int cell) {
+        return vg.offset_origin[axis] +
+               (cell * BRICK_SIZE + BRICK_SIZE / 2.0) * vg.resolution;
+    };
+
+    const VoxelGrid &stored = vg;
+    vec<IntersectionCounts> chunk_counts(resolve_thread_count(num_threads));
+    auto intersect_slab = [&](size_t x_begin, size_t x_end, size_t chunk) {
+        IntersectionCounts &counts = chunk_counts[chunk];
+        double center_z[TRI_BOX_BATCH];
+        TriBoxOverlap overlap[TRI_BOX_BATCH];
+        // Tests the voxels [first, last] (per axis) against one triangle
+        auto intersect_voxels = [&](const ShellCandidate &candidate,
+                                    const TriBoxAxes &axes,
+                                    const unsigned int first[3],
+                                    const unsigned int last[3]) {
+            for (unsigned int x = first[0]; x <= last[0]; x++) {
+                const double center_x = voxel_center(vg, 0, x);
+                for (unsigned int y = first[1]; y <= last[1]; y++) {
+                    const double center_y = voxel_center(vg, 1, y);
+                    for (unsigned int z_begin = first[2]; z_begin <= last[2];
+                         z_begin += TRI_BOX_BATCH) {
+                        const unsigned int count = min<unsigned int>(
+                                TRI_BOX_BATCH, last[2] - z_begin + 1);
+                        for (unsigned int i = 0; i < count; i++) {
+                            center_z[i] = voxel_center(vg, 2, z_begin + i);
+                        }
+                        classify_box_row(axes, center_x, center_y, center_z,
+                                         count, overlap);
+                        counts.pairs += count;
+                        for (unsigned int i = 0; i < count; i++) {
+                            if (overlap[i] == TriBoxOverlap::Disjoint) {
+                                continue;
                             }
-                            break;
+                            const unsigned int z = z_begin + i;
+                            // Objects are visited in the same order as the
+                            // brute force path, so the last intersecting
+                            // object decides the semantics. A voxel that
+                            // already holds this object's result cannot
+                            // change and is skipped. Reading through the
+                            // const grid keeps sparse bricks unallocated.
+                            const VoxelInfo current = stored(x, y, z);
+                            if (current.label == VoxelLabel::INTERSECTED &&
+                                current.semantics == candidate.semantics) {
+                                continue;
+                            }
+                            if (overlap[i] == TriBoxOverlap::Uncertain) {
+                                counts.exact++;
+                                const Bbox3 cgal_bbox = voxel_bbox(vg, x, y, z);
+                                if (!bbox_overlap(candidate.bbox, cgal_bbox) ||
+                                    !CGAL::do_intersect(
+                                            cgal_bbox, triangles.triangle(
+                                                    candidate.triangle))) {
+                                    continue;
+                                }
+                            }
+                            VoxelInfo &voxel = vg(x, y, z);
+                            voxel.label = VoxelLabel::INTERSECTED;
+                            voxel.semantics = candidate.semantics;
+                            counts.hits++;
+                        }
+                    }
+                }
+            }
+        };
+
+        double cell_center_z[TRI_BOX_BATCH];
+        TriBoxOverlap cell_overlap[TRI_BOX_BATCH];
+        for (const auto &candidate: candidates) {
+            const unsigned int first[3] = {
+                    max<unsigned int>(candidate.first[0], x_begin),
+                    candidate.first[1], candidate.first[2]};
+            const unsigned int last[3] = {
+                    min<unsigned int>(candidate.last[0], x_end - 1),
+                    candidate.last[1], candidate.last[2]};
+            if (first[0] > last[0]) {
+                continue;
+            }
+            // Fast separating-axis classification; only voxels that touch
+            // the triangle within rounding distance need the exact predicate
+            double v[3][3];
+            triangles.vertices(candidate.triangle, v);
+            const TriBoxAxes axes = make_tri_box_axes(
+                    v, vg.resolution / 2, grid_magnitude);
+            // Triangles that cover no more than a cell's worth of voxels
+            // gain nothing from the coarse test
+            const size_t range_voxels = static_cast<size_t>(
+                    last[0] - first[0] + 1) * (last[1] - first[1] + 1) *
+                                        (last[2] - first[2] + 1);
+            if (method == VoxelizeMethod::Flat ||
+                range_voxels <= BRICK_VOXELS) {
+                intersect_voxels(candidate, axes, first, last);
+                continue;
+            }
+            const TriBoxAxes cell_axes = make_tri_box_axes(
+                    v, cell_half_size, grid_magnitude);
+            const unsigned int first_cell[3] = {first[0] / BRICK_SIZE,
+                                                first[1] / BRICK_SIZE,
+                                                first[2] / BRICK_SIZE};
+            const unsigned int last_cell[3] = {last[0] / BRICK_SIZE,
+                                               last[1] / BRICK_SIZE,
+                                               last[2] / BRICK_SIZE};
+            for (unsigned int cx = first_cell[0]; cx <= last_cell[0]; cx++) {
+                for (unsigned int cy = first_cell[1]; cy <= last_cell[1]; cy++) {
+                    for (unsigned int cz_begin = first_cell[2];
+                         cz_begin <= last_cell[2]; cz_begin += TRI_BOX_BATCH) {
+                        const unsigned int count = min<unsigned int>(
+                                TRI_BOX_BATCH, last_cell[2] - cz_begin + 1);
+                        for (unsigned int i = 0; i < count; i++) {
+                            cell_center_z[i] = cell_center(2, cz_begin + i);
+                        }
+                        classify_box_row(cell_axes, cell_center(0, cx),
+                                         cell_center(1, cy), cell_center_z,
+                                         count, cell_overlap);
+                        counts.cells += count;
+                        for (unsigned int i = 0; i < count; i++) {
+                            if (cell_overlap[i] == TriBoxOverlap::Disjoint) {
+                                continue;
+                            }
+                            // The voxels of the cell within the triangle's range
+                            const unsigned int cell[3] = {cx, cy, cz_begin + i};
+                            unsigned int cell_first[3], cell_last[3];
+                            for (int axis = 0; axis < 3; axis++) {
+                                cell_first[axis] = max(first[axis],
+                                                       cell[axis] * BRICK_SIZE);
+                                cell_last[axis] = min(
+                                        last[axis],
+                                        cell[axis] * BRICK_SIZE + BRICK_SIZE - 1);
+                            }
+                            intersect_voxels(candidate, axes, cell_first,
+                                             cell_last);
                         }
                     }
                 }
             }
         }
+    };
+    // Slabs are whole bricks wide so that no two threads share a brick (or a
+    // sparse brick hash)
+    parallel_for_chunks(region_first[0] / BRICK_SIZE * BRICK_SIZE,
+                        region_last[0] + 1, num_threads, intersect_slab,
+                        BRICK_SIZE);
+
+    add_metric_counter("candidate_triangles", candidates.size());
+    for (const auto &counts: chunk_counts) {
+        add_metric_counter("candidate_pairs", counts.pairs);
+        add_metric_counter("coarse_cell_tests", counts.cells);
+        add_metric_counter("exact_tests", counts.exact);
+        add_metric_counter("accepted_hits", counts.hits);
     }
+}
 
+VoxelGrid intersection_with_bim_obj(const VoxelGrid &vg_arg,
+                                    const TriangleStore &triangles,
+                                    unsigned int num_threads,
+                                    VoxelizeMethod method) {
+    VoxelGrid vg(vg_arg.max_x, vg_arg.max_y, vg_arg.max_z, vg_arg.origin,
+                 vg_arg.offset, vg_arg.resolution, vg_arg.layout);
+    const unsigned int first[3] = {0, 0, 0};
+    const unsigned int last[3] = {vg.size_x - 1, vg.size_y - 1, vg.size_z - 1};
+    intersect_voxel_region(vg, triangles, first, last, num_threads, method);
     return vg;
 }
 
+VoxelGrid intersection_with_bim_obj(const VoxelGrid &vg_arg,
+                                    const BIMObjects &bim_objs_arg,
+                                    unsigned int num_threads,
+                                    VoxelizeMethod method) {
+    return intersection_with_bim_obj(vg_arg, make_triangle_store(bim_objs_arg),
+                                     num_threads, method);
+}
+
 const vec<vec<int>> six_connectivity = {{-1, 0,  0},
                                         {1,  0,  0},
                                         {0,  -1, 0},
@@ -236,141 +876,760 @@ const vec<vec<int>> twenty_six_connectivity = { // 6-connectivity
         {-1, 1,  1},
         {1,  1,  1}};
 
-void mark_interior(VoxelGrid &vg_marked, int x, int y, int z,
-                   unsigned int interior_id, const vec<vec<int>> &connectivity,
-                   const vec<unsigned int> &voxel_shape) {
-    if (x < 0 || y < 0 || z < 0 || x >= voxel_shape[0] || y >= voxel_shape[1] ||
-        z >= voxel_shape[2]) {
-        return;
+const vec<vec<int>> &connectivity_offsets(Connectivity connectivity) {
+    switch (connectivity) {
+        case Connectivity::Six:
+            return six_connectivity;
+        case Connectivity::TwentySix:
+            return twenty_six_connectivity;
+        default:
+            return eighteen_connectivity;
     }
+}
 
-    // Only mark if voxel is currently unmarked (interior and not visited)
-    if (vg_marked.voxels[x][y][z].label == VoxelLabel::UNLABELED) {
-        vg_marked.voxels[x][y][z].label = VoxelLabel::INTERIOR;
-        vg_marked.voxels[x][y][z].room_id = interior_id;
+// Breadth-first fill over the voxels labelled `from` that are connected to the
+// seeds (scan-order indices, see scan_index). Reached voxels get label `to`
+// and `room_id`. A voxel is relabelled when it is queued, so the label itself
+// marks it as visited and every voxel is queued at most once. The consumed
+// front of the queue is dropped regularly, which keeps the memory bounded by
+// the size of the frontier rather than the size of the region. Returns the
+// number of filled voxels.
+size_t flood_fill(VoxelGrid &vg, const vec<size_t> &seeds, VoxelLabel from,
+                  VoxelLabel to, RoomID room_id,
+                  const vec<vec<int>> &connectivity, vec<size_t> &queue) {
+    // Labels are read through the const grid so that looking at a neighbour
+    // never allocates a sparse brick
+    const VoxelGrid &stored = vg;
+    queue.clear();
+    for (const size_t seed: seeds) {
+        unsigned int x, y, z;
+        scan_index_to_xyz(vg, seed, x, y, z);
+        if (stored(x, y, z).label == from) {
+            vg(x, y, z).label = to;
+            vg.room_id(x, y, z) = room_id;
+            queue.push_back(seed);
+        }
+    }
 
+    const int size_x = static_cast<int>(vg.size_x),
+              size_y = static_cast<int>(vg.size_y),
+              size_z = static_cast<int>(vg.size_z);
+    size_t head = 0;
+    size_t filled = queue.size();
+    while (head < queue.size()) {
+        unsigned int x, y, z;
+        scan_index_to_xyz(vg, queue[head++], x, y, z);
         for (const auto &adjacent_voxel: connectivity) {
-            int adj_x = x + adjacent_voxel[0];
-            int adj_y = y + adjacent_voxel[1];
-            int adj_z = z + adjacent_voxel[2];
-            if (adj_x >= voxel_shape[0] || adj_y >= voxel_shape[1] ||
-                adj_z >= voxel_shape[2] || adj_x < 0 || adj_y < 0 || adj_z < 0) {
+            const int adj_x = static_cast<int>(x) + adjacent_voxel[0];
+            const int adj_y = static_cast<int>(y) + adjacent_voxel[1];
+            const int adj_z = static_cast<int>(z) + adjacent_voxel[2];
+            if (adj_x < 0 || adj_y < 0 || adj_z < 0 || adj_x >= size_x ||
+                adj_y >= size_y || adj_z >= size_z) {
+                continue;
+            }
+            if (stored(adj_x, adj_y, adj_z).label != from) {
                 continue;
             }
-            mark_interior(vg_marked, adj_x, adj_y, adj_z, interior_id, connectivity,
-                          voxel_shape);
+            vg(adj_x, adj_y, adj_z).label = to;
+            vg.room_id(adj_x, adj_y, adj_z) = room_id;
+            queue.push_back(scan_index(vg, adj_x, adj_y, adj_z));
+            filled++;
+        }
+        if (head >= 4096 && head * 2 >= queue.size()) {
+            queue.erase(queue.begin(), queue.begin() + head);
+            head = 0;
         }
     }
+    return filled;
+}
+
+const uint32_t NOT_A_ROOM = numeric_limits<uint32_t>::max();
+
+// Root of a union-find tree; the root is always the smallest scan index of its
+// component because union_rooms links the larger root under the smaller one
+uint32_t find_room_root(const vec<uint32_t> &parent, uint32_t index) {
+    while (parent[index] != index) {
+        index = parent[index];
+    }
+    return index;
 }
 
-VoxelGrid mark_exterior_interior(VoxelGrid &vg) {
-    cout << "===Marking exterior and interior voxels===\n";
-    VoxelGrid vg_marked(vg.max_x, vg.max_y, vg.max_z, vg.origin, vg.offset,
-                        vg.resolution);
+uint32_t find_room_root_compress(vec<uint32_t> &parent, uint32_t index) {
+    while (parent[index] != index) {
+        parent[index] = parent[parent[index]];
+        index = parent[index];
+    }
+    return index;
+}
 
-    // Mark exteriror first
-    vec<unsigned int> voxel_shape = vg.voxel_shape_with_offset();
-    vg_marked.voxels = vg.voxels;
-    for (unsigned int x = 0; x < vg.voxels.size(); x++) {
-        for (unsigned int y = 0; y < vg.voxels[x].size(); y++) {
-            for (unsigned int z = 0; z < vg.voxels[x][y].size(); z++) {
-                // TODO: consider conectivity
-                // list up adjacent voxels
-                if (x == 0 && y == 0 && z == 0) { // Start marking from the first voxel
-                    vg_marked.voxels[x][y][z].label = VoxelLabel::EXTERIOR; // exterior
+void union_rooms(vec<uint32_t> &parent, uint32_t a, uint32_t b) {
+    a = find_room_root_compress(parent, a);
+    b = find_room_root_compress(parent, b);
+    if (a < b) {
+        parent[b] = a;
+    } else if (b < a) {
+        parent[a] = b;
+    }
+}
+
+// Room labelling for SparseBrick grids. After mark_exterior_sparse every
+// UNLABELED voxel sits in an allocated bricks, so the rooms are found by
+// filling from each one in scan order, which gives the same ids as the dense
+// path. Also used for dense grids too large for label_rooms.
+unsigned int label_rooms_sparse(VoxelGrid &vg, Connectivity connectivity) {
+    const vec<vec<int>> &neighbours = connectivity_offsets(connectivity);
+    const VoxelGrid &stored = vg;
+    vec<size_t> queue;
+    unsigned int interior_id = 0;
+    for_each_stored_voxel(vg, [&](unsigned int x, unsigned int y, unsigned int z) {
+        if (stored(x, y, z).label == VoxelLabel::UNLABELED) {
+            flood_fill(vg, {scan_index(vg, x, y, z)}, VoxelLabel::UNLABELED,
+                       VoxelLabel::INTERIOR, interior_id, neighbours, queue);
+            interior_id++;
+        }
+    });
+    return interior_id;
+}
+
+// Labels every UNLABELED voxel as INTERIOR with a room id per connected
+// component. The grid is split into x-slabs that are labelled in parallel
+// with a union-find over scan indices, then the slab borders are merged.
+// Room ids follow the scan order of the first voxel of each room, so they are
+// compact and independent of the thread count. Returns the number of rooms.
+unsigned int label_rooms(VoxelGrid &vg, Connectivity connectivity,
+                         unsigned int num_threads) {
+    const size_t num_voxels = static_cast<size_t>(vg.size_x) * vg.size_y * vg.size_z;
+    // The union-find holds 32-bit scan indices
+    if (num_voxels >= NOT_A_ROOM) {
+        cerr << "Grid of " << num_voxels << " voxels too large for parallel "
+             << "room labelling, labelling rooms one at a time" << endl;
+        return label_rooms_sparse(vg, connectivity);
+    }
+    const size_t slice = static_cast<size_t>(vg.size_y) * vg.size_z;
+
+    // Neighbours that come earlier in scan order
+    vec<vec<int>> backward;
+    for (const auto &offset: connectivity_offsets(connectivity)) {
+        if (offset[0] < 0 || (offset[0] == 0 && offset[1] < 0) ||
+            (offset[0] == 0 && offset[1] == 0 && offset[2] < 0)) {
+            backward.push_back(offset);
+        }
+    }
+
+    auto is_room = [&](unsigned int x, unsigned int y, unsigned int z) {
+        return vg(x, y, z).label == VoxelLabel::UNLABELED;
+    };
+    const int size_y = static_cast<int>(vg.size_y),
+              size_z = static_cast<int>(vg.size_z);
+
+    auto link_backward = [&](vec<uint32_t> &parent, unsigned int x,
+                             unsigned int y, unsigned int z,
+                             unsigned int x_begin, bool only_previous_slab) {
+        const uint32_t current = scan_index(vg, x, y, z);
+        for (const auto &offset: backward) {
+            if (only_previous_slab && offset[0] >= 0) {
+                continue;
+            }
+            const int adj_x = static_cast<int>(x) + offset[0];
+            const int adj_y = static_cast<int>(y) + offset[1];
+            const int adj_z = static_cast<int>(z) + offset[2];
+            if (adj_x < static_cast<int>(x_begin) || adj_y < 0 || adj_z < 0 ||
+                adj_y >= size_y || adj_z >= size_z) {
+                continue;
+            }
+            if (is_room(adj_x, adj_y, adj_z)) {
+                union_rooms(parent, current, scan_index(vg, adj_x, adj_y, adj_z));
+            }
+        }
+    };
+
+    vec<uint32_t> parent(num_voxels, NOT_A_ROOM);
+    const unsigned int threads = resolve_thread_count(num_threads);
+    vec<size_t> slab_begin(threads + 1, vg.size_x);
+
+    // 1. Label each slab independently; unions never leave the slab
+    parallel_for_chunks(0, vg.size_x, threads, [&](size_t x_begin, size_t x_end,
+                                                  size_t slab) {
+        slab_begin[slab] = x_begin;
+        for (unsigned int x = x_begin; x < x_end; x++) {
+            for (unsigned int y = 0; y < vg.size_y; y++) {
+                for (unsigned int z = 0; z < vg.size_z; z++) {
+                    if (!is_room(x, y, z)) {
+                        continue;
+                    }
+                    parent[scan_index(vg, x, y, z)] = scan_index(vg, x, y, z);
+                    link_backward(parent, x, y, z, x_begin, false);
                 }
+            }
+        }
+    });
 
-                // If the voxel is exterior, mark all adjacent voxels as exterior
-                if (vg_marked.voxels[x][y][z].label == VoxelLabel::EXTERIOR) {
-                    for (auto const &adjacent_voxel: eighteen_connectivity) {
-                        int adj_x = x + adjacent_voxel[0];
-                        int adj_y = y + adjacent_voxel[1];
-                        int adj_z = z + adjacent_voxel[2];
-
-                        // Skip if adjacent voxel is out of bounds
-                        if (adj_x >= voxel_shape[0] || adj_y >= voxel_shape[1] ||
-                            adj_z >= voxel_shape[2] || adj_x < 0 || adj_y < 0 ||
-                            adj_z < 0) {
-                            continue;
-                        }
-                        // Only when it's empty, mark as exterior so that it doesn't
-                        // overwrite marked voxels;
-                        if (vg_marked.voxels[adj_x][adj_y][adj_z].label ==
-                            VoxelLabel::UNLABELED) {
-                            vg_marked.voxels[adj_x][adj_y][adj_z].label =
-                                    VoxelLabel::EXTERIOR; // exterior
-                        }
+    // 2. Merge components across slab borders
+    for (unsigned int slab = 1; slab < threads; slab++) {
+        const size_t x = slab_begin[slab];
+        if (x == 0 || x >= vg.size_x) {
+            continue;
+        }
+        for (unsigned int y = 0; y < vg.size_y; y++) {
+            for (unsigned int z = 0; z < vg.size_z; z++) {
+                if (is_room(x, y, z)) {
+                    link_backward(parent, x, y, z, x - 1, true);
+                }
+            }
+        }
+    }
+
+    // 3. Number the roots in scan order: count per slab, then offset
+    vec<unsigned int> roots_per_slab(threads + 1, 0);
+    parallel_for_chunks(0, vg.size_x, threads, [&](size_t x_begin, size_t x_end,
+                                                  size_t slab) {
+        unsigned int roots = 0;
+        for (size_t index = x_begin * slice; index < x_end * slice; index++) {
+            roots += parent[index] == index;
+        }
+        roots_per_slab[slab + 1] = roots;
+    });
+    for (unsigned int slab = 1; slab <= threads; slab++) {
+        roots_per_slab[slab] += roots_per_slab[slab - 1];
+    }
+    parallel_for_chunks(0, vg.size_x, threads, [&](size_t x_begin, size_t x_end,
+                                                  size_t slab) {
+        RoomID next_id = roots_per_slab[slab];
+        for (size_t index = x_begin * slice; index < x_end * slice; index++) {
+            if (parent[index] == index) {
+                unsigned int x, y, z;
+                scan_index_to_xyz(vg, index, x, y, z);
+                vg.room_id(x, y, z) = next_id++;
+            }
+        }
+    });
+
+    // 4. Every voxel takes the id of its root. The roots keep theirs from
+    // step 3 untouched, since other slabs read them here
+    parallel_for_chunks(0, vg.size_x, threads, [&](size_t x_begin, size_t x_end,
+                                                  size_t) {
+        for (size_t index = x_begin * slice; index < x_end * slice; index++) {
+            if (parent[index] == NOT_A_ROOM) {
+                continue;
+            }
+            unsigned int x, y, z;
+            scan_index_to_xyz(vg, index, x, y, z);
+            vg(x, y, z).label = VoxelLabel::INTERIOR;
+            const uint32_t root = find_room_root(parent, index);
+            if (root != index) {
+                unsigned int root_x, root_y, root_z;
+                scan_index_to_xyz(vg, root, root_x, root_y, root_z);
+                vg.room_id(x, y, z) = vg.room_id(root_x, root_y, root_z);
+            }
+        }
+    });
+
+    return roots_per_slab[threads];
+}
+
+// Number of BRICK_SIZE^3 bricks along each axis of a grid, with the bricks
+// numbered in x, y, z scan order
+struct BrickCounts {
+    unsigned int bricks[3];
+    size_t num_bricks;
+
+    explicit BrickCounts(const VoxelGrid &vg)
+        : bricks{(vg.size_x + BRICK_SIZE - 1) / BRICK_SIZE,
+                 (vg.size_y + BRICK_SIZE - 1) / BRICK_SIZE,
+                 (vg.size_z + BRICK_SIZE - 1) / BRICK_SIZE},
+          num_bricks(static_cast<size_t>(bricks[0]) * bricks[1] * bricks[2]) {}
+
+    size_t id(unsigned int bx, unsigned int by, unsigned int bz) const {
+        return (static_cast<size_t>(bx) * bricks[1] + by) * bricks[2] + bz;
+    }
+
+    void brick_of(size_t id, unsigned int b[3]) const {
+        b[0] = id / (static_cast<size_t>(bricks[1]) * bricks[2]);
+        b[1] = (id / bricks[2]) % bricks[1];
+        b[2] = id % bricks[2];
+    }
+};
+
+// Exterior fill at brick level. Every brick whose bit is clear in `solid`
+// must hold nothing but UNLABELED voxels, so the fill moves through those a
+// whole brick at a time and only walks single voxels inside solid bricks. The
+// queue holds scan indices of voxels and, tagged with the top bit, indices of
+// non-solid bricks. Voxels of solid bricks are relabelled; non-solid bricks
+// that the exterior reaches are only flagged in `reached` (one bit per brick)
+// and left to the caller. Returns the number of exterior voxels.
+size_t mark_exterior_bricks(VoxelGrid &vg, Connectivity connectivity,
+                            const BrickCounts &counts,
+                            const vec<uint64_t> &solid,
+                            vec<uint64_t> &reached) {
+    const vec<vec<int>> &neighbours = connectivity_offsets(connectivity);
+    const VoxelGrid &stored = vg;
+    const unsigned int *bricks = counts.bricks;
+    const unsigned int shape[3] = {vg.size_x, vg.size_y, vg.size_z};
+    auto brick_id = [&](unsigned int bx, unsigned int by, unsigned int bz) {
+        return counts.id(bx, by, bz);
+    };
+    auto is_solid = [&](size_t id) {
+        return (solid[id / 64] >> (id % 64)) & 1;
+    };
+
+    const uint64_t BRICK_TAG = uint64_t(1) << 63;
+    vec<uint64_t> queue;
+    size_t exterior = 0;
+
+    // Voxels of solid bricks are relabelled one by one, other bricks are
+    // reached as a whole
+    auto reach_voxel = [&](unsigned int x, unsigned int y, unsigned int z) {
+        if (stored(x, y, z).label == VoxelLabel::UNLABELED) {
+            vg(x, y, z).label = VoxelLabel::EXTERIOR;
+            queue.push_back(scan_index(vg, x, y, z));
+            exterior++;
+        }
+    };
+    auto reach_brick = [&](unsigned int bx, unsigned int by, unsigned int bz) {
+        const size_t id = brick_id(bx, by, bz);
+        if ((reached[id / 64] >> (id % 64)) & 1) {
+            return;
+        }
+        reached[id / 64] |= uint64_t(1) << (id % 64);
+        queue.push_back(id | BRICK_TAG);
+        exterior += static_cast<size_t>(
+                min(shape[0] - bx * BRICK_SIZE, BRICK_SIZE)) *
+                    min(shape[1] - by * BRICK_SIZE, BRICK_SIZE) *
+                    min(shape[2] - bz * BRICK_SIZE, BRICK_SIZE);
+    };
+    // Reaches the voxels of brick b whose coordinates lie in [lo, hi] per axis
+    auto reach_brick_part = [&](const unsigned int b[3], const unsigned int lo[3],
+                                const unsigned int hi[3]) {
+        if (!is_solid(brick_id(b[0], b[1], b[2]))) {
+            reach_brick(b[0], b[1], b[2]);
+            return;
+        }
+        for (unsigned int x = lo[0]; x <= hi[0]; x++) {
+            for (unsigned int y = lo[1]; y <= hi[1]; y++) {
+                for (unsigned int z = lo[2]; z <= hi[2]; z++) {
+                    reach_voxel(x, y, z);
+                }
+            }
+        }
+    };
+
+    // Seeds: every voxel on the border of the grid
+    for (unsigned int bx = 0; bx < bricks[0]; bx++) {
+        for (unsigned int by = 0; by < bricks[1]; by++) {
+            const bool x_or_y_border = bx == 0 || by == 0 ||
+                                       bx == bricks[0] - 1 || by == bricks[1] - 1;
+            for (unsigned int bz = 0; bz < bricks[2];
+                 bz += (x_or_y_border || bricks[2] < 2) ? 1 : bricks[2] - 1) {
+                const unsigned int b[3] = {bx, by, bz};
+                for (int axis = 0; axis < 3; axis++) {
+                    unsigned int lo[3], hi[3];
+                    for (int i = 0; i < 3; i++) {
+                        lo[i] = b[i] * BRICK_SIZE;
+                        hi[i] = min(shape[i], (b[i] + 1) * BRICK_SIZE) - 1;
+                    }
+                    // Border layers of this brick along `axis`, if any
+                    if (lo[axis] == 0) {
+                        const unsigned int face_hi[3] = {
+                                axis == 0 ? 0 : hi[0], axis == 1 ? 0 : hi[1],
+                                axis == 2 ? 0 : hi[2]};
+                        reach_brick_part(b, lo, face_hi);
+                    }
+                    if (hi[axis] == shape[axis] - 1) {
+                        lo[axis] = hi[axis];
+                        reach_brick_part(b, lo, hi);
                     }
                 }
             }
         }
     }
 
-    unsigned int interior_id = 0; //
-    for (unsigned int x = 0; x < vg.voxels.size(); x++) {
-        for (unsigned int y = 0; y < vg.voxels[x].size(); y++) {
-            for (unsigned int z = 0; z < vg.voxels[x][y].size(); z++) {
-                // If the voxel is not marked as exterior, mark as interior
-                if (vg_marked.voxels[x][y][z].label == VoxelLabel::UNLABELED) {
-                    mark_interior(vg_marked, x, y, z, interior_id, eighteen_connectivity,
-                                  voxel_shape);
-                    interior_id++;
+    size_t head = 0;
+    while (head < queue.size()) {
+        const uint64_t entry = queue[head++];
+        if (entry & BRICK_TAG) {
+            unsigned int b[3];
+            counts.brick_of(entry & ~BRICK_TAG, b);
+            // Adjacent bricks use the same offsets as adjacent voxels. Of an
+            // solid neighbour only the layer facing this brick touches it.
+            for (const auto &offset: neighbours) {
+                unsigned int n[3], lo[3], hi[3];
+                bool inside = true;
+                for (int i = 0; i < 3 && inside; i++) {
+                    const long nb = static_cast<long>(b[i]) + offset[i];
+                    inside = nb >= 0 && nb < bricks[i];
+                    n[i] = static_cast<unsigned int>(nb);
+                    const unsigned int first = n[i] * BRICK_SIZE;
+                    const unsigned int last =
+                            min(shape[i], (n[i] + 1) * BRICK_SIZE) - 1;
+                    lo[i] = offset[i] < 0 ? last : first;
+                    hi[i] = offset[i] > 0 ? first : last;
+                }
+                if (inside) {
+                    reach_brick_part(n, lo, hi);
+                }
+            }
+        } else {
+            unsigned int x, y, z;
+            scan_index_to_xyz(vg, entry, x, y, z);
+            for (const auto &offset: neighbours) {
+                const long adj[3] = {static_cast<long>(x) + offset[0],
+                                     static_cast<long>(y) + offset[1],
+                                     static_cast<long>(z) + offset[2]};
+                if (adj[0] < 0 || adj[1] < 0 || adj[2] < 0 ||
+                    adj[0] >= shape[0] || adj[1] >= shape[1] ||
+                    adj[2] >= shape[2]) {
+                    continue;
                 }
+                const unsigned int p[3] = {static_cast<unsigned int>(adj[0]),
+                                           static_cast<unsigned int>(adj[1]),
+                                           static_cast<unsigned int>(adj[2])};
+                const unsigned int b[3] = {p[0] / BRICK_SIZE, p[1] / BRICK_SIZE,
+                                           p[2] / BRICK_SIZE};
+                reach_brick_part(b, p, p);
             }
         }
+        if (head >= 4096 && head * 2 >= queue.size()) {
+            queue.erase(queue.begin(), queue.begin() + head);
+            head = 0;
+        }
     }
 
-    cout << "num of classes: " << interior_id << "\n";
+    return exterior;
+}
 
-    return vg_marked;
+// Exterior marking for SparseBrick grids. Before this runs every unallocated
+// brick is entirely UNLABELED, so unallocated bricks are the non-solid ones of
+// the brick-level fill. Afterwards the background becomes EXTERIOR;
+// unallocated bricks that the exterior never reached are enclosed by the
+// building and get allocated so that they keep their UNLABELED voxels for
+// room labelling. Returns the number of exterior voxels.
+size_t mark_exterior_sparse(VoxelGrid &vg, Connectivity connectivity) {
+    const BrickCounts counts(vg);
+    vec<uint64_t> allocated((counts.num_bricks + 63) / 64, 0);
+    vec<uint64_t> reached((counts.num_bricks + 63) / 64, 0);
+    for (unsigned int bx = 0; bx < counts.bricks[0]; bx++) {
+        for (const auto &entry: vg.sparse_slabs[bx].brick_index) {
+            const size_t id = counts.id(bx, entry.first >> 32,
+                                        entry.first & 0xffffffffu);
+            allocated[id / 64] |= uint64_t(1) << (id % 64);
+        }
+    }
+    const size_t exterior =
+            mark_exterior_bricks(vg, connectivity, counts, allocated, reached);
+
+    // Unallocated bricks that were not reached are enclosed
+    for (size_t word = 0; word < allocated.size(); word++) {
+        uint64_t enclosed = ~(allocated[word] | reached[word]);
+        while (enclosed) {
+            const size_t id = word * 64 + __builtin_ctzll(enclosed);
+            enclosed &= enclosed - 1;
+            if (id >= counts.num_bricks) {
+                break;
+            }
+            unsigned int b[3];
+            counts.brick_of(id, b);
+            vg.sparse_brick(b[0] * BRICK_SIZE, b[1] * BRICK_SIZE,
+                            b[2] * BRICK_SIZE);
+        }
+    }
+    vg.background.label = VoxelLabel::EXTERIOR;
+    return exterior;
 }
 
-void extract_surface(VoxelGrid &vg,
-                     vec<vec<int>> connectivity = eighteen_connectivity) {
-    for (unsigned int x = 0; x < vg.voxels.size(); x++) {
-        for (unsigned int y = 0; y < vg.voxels[x].size(); y++) {
-            for (unsigned int z = 0; z < vg.voxels[x][y].size(); z++) {
-                vec<pair<int, VoxelLabel>> neighbour_labels;
-                for (int i = 0; i < connectivity.size(); i++) {
-                    auto adjacent_voxel = connectivity[i];
-                    int adj_x = x + adjacent_voxel[0];
-                    int adj_y = y + adjacent_voxel[1];
-                    int adj_z = z + adjacent_voxel[2];
-                    if (adj_x >= vg.voxels.size() || adj_y >= vg.voxels[x].size() ||
-                        adj_z >= vg.voxels[x][y].size() || adj_x < 0 || adj_y < 0 ||
-                        adj_z < 0) {
-                        continue;
+// The brick-level fill on a dense grid: bricks with any labelled voxel are
+// solid, and the voxels of the empty bricks the exterior reaches are
+// relabelled at the end, a whole brick at a time. Returns the number of
+// exterior voxels.
+size_t mark_exterior_coarse(VoxelGrid &vg, Connectivity connectivity,
+                            unsigned int num_threads) {
+    const BrickCounts counts(vg);
+    const unsigned int *bricks = counts.bricks;
+    vec<uint64_t> solid((counts.num_bricks + 63) / 64, 0);
+    vec<uint64_t> reached((counts.num_bricks + 63) / 64, 0);
+    // A byte per brick first: threads own x-slabs of bricks, which need not
+    // line up with the words of the bit set
+    vec<uint8_t> slab_solid(counts.num_bricks, 0);
+    parallel_for_chunks(0, bricks[0], num_threads,
+                        [&](size_t begin, size_t end, size_t) {
+        for (unsigned int bx = begin; bx < end; bx++) {
+            const unsigned int x_end = min(vg.size_x, (bx + 1) * BRICK_SIZE);
+            for (unsigned int x = bx * BRICK_SIZE; x < x_end; x++) {
+                for (unsigned int y = 0; y < vg.size_y; y++) {
+                    for (unsigned int z = 0; z < vg.size_z; z++) {
+                        if (vg(x, y, z).label != VoxelLabel::UNLABELED) {
+                            slab_solid[counts.id(bx, y / BRICK_SIZE,
+                                                 z / BRICK_SIZE)] = 1;
+                        }
                     }
-                    neighbour_labels.push_back(
-                            make_pair(i, vg.voxels[adj_x][adj_y][adj_z].label));
-                };
-
-                if (vg.voxels[x][y][z].label == VoxelLabel::INTERSECTED) {
-                    if (any_of(neighbour_labels.begin(), neighbour_labels.end(),
-                               [](const auto &pair) {
-                                   return pair.second == VoxelLabel::EXTERIOR;
-                               })) {
-                        vg.voxels[x][y][z].city_object_type = CityObjectType::BuildingPart;
+                }
+            }
+        }
+    });
+    for (size_t id = 0; id < counts.num_bricks; id++) {
+        if (slab_solid[id]) {
+            solid[id / 64] |= uint64_t(1) << (id % 64);
+        }
+    }
+    const size_t exterior =
+            mark_exterior_bricks(vg, connectivity, counts, solid, reached);
+
+    parallel_for_chunks(0, bricks[0], num_threads,
+                        [&](size_t begin, size_t end, size_t) {
+        for (unsigned int bx = begin; bx < end; bx++) {
+            for (unsigned int by = 0; by < bricks[1]; by++) {
+                for (unsigned int bz = 0; bz < bricks[2]; bz++) {
+                    const size_t id = counts.id(bx, by, bz);
+                    if (!((reached[id / 64] >> (id % 64)) & 1)) {
                         continue;
                     }
-                    auto found = find_if(neighbour_labels.begin(), neighbour_labels.end(),
-                                         [](const auto &pair) {
-                                             return pair.second == VoxelLabel::INTERIOR;
-                                         });
-                    if (found != neighbour_labels.end()) {
-                        auto neighbour_xyz = connectivity[found->first];
-                        auto neighbour =
-                                vg.voxels[x + neighbour_xyz[0]][y + neighbour_xyz[1]]
-                                [z + neighbour_xyz[2]];
-                        vg.voxels[x][y][z].city_object_type = CityObjectType::BuildingRoom;
-                        vg.voxels[x][y][z].room_id = neighbour.room_id;
-                    } else {
-                        vg.voxels[x][y][z].city_object_type = CityObjectType::BuildingRoom;
+                    const unsigned int x_end =
+                            min(vg.size_x, (bx + 1) * BRICK_SIZE);
+                    const unsigned int y_end =
+                            min(vg.size_y, (by + 1) * BRICK_SIZE);
+                    const unsigned int z_end =
+                            min(vg.size_z, (bz + 1) * BRICK_SIZE);
+                    for (unsigned int x = bx * BRICK_SIZE; x < x_end; x++) {
+                        for (unsigned int y = by * BRICK_SIZE; y < y_end; y++) {
+                            for (unsigned int z = bz * BRICK_SIZE; z < z_end;
+                                 z++) {
+                                vg(x, y, z).label = VoxelLabel::EXTERIOR;
+                                vg.room_id(x, y, z) = 0;
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    });
+    return exterior;
+}
+
+// Marks the exterior with a breadth-first fill. Every empty voxel on the
+// border of the grid is a seed, so any empty region connected to the outside
+// becomes exterior, whatever its shape. Returns the number of exterior voxels.
+size_t mark_exterior_flood_fill(VoxelGrid &vg, Connectivity connectivity) {
+    vec<size_t> seeds;
+    for (unsigned int x = 0; x < vg.size_x; x++) {
+        for (unsigned int y = 0; y < vg.size_y; y++) {
+            const bool x_or_y_border = x == 0 || y == 0 || x == vg.size_x - 1 ||
+                                       y == vg.size_y - 1;
+            for (unsigned int z = 0; z < vg.size_z; z++) {
+                if (x_or_y_border || z == 0 || z == vg.size_z - 1) {
+                    seeds.push_back(scan_index(vg, x, y, z));
+                }
+            }
+        }
+    }
+    vec<size_t> queue;
+    return flood_fill(vg, seeds, VoxelLabel::UNLABELED, VoxelLabel::EXTERIOR, 0,
+                      connectivity_offsets(connectivity), queue);
+}
+
+// One bit per voxel that has the given label
+BitGrid label_layer(const VoxelGrid &vg, VoxelLabel label,
+                    unsigned int num_threads) {
+    BitGrid layer(vg.size_x, vg.size_y, vg.size_z);
+    parallel_for_chunks(0, vg.size_x, num_threads,
+                        [&](size_t begin, size_t end, size_t) {
+        for (unsigned int x = begin; x < end; x++) {
+            for (unsigned int y = 0; y < vg.size_y; y++) {
+                uint64_t *bits = layer.column(x, y);
+                for (unsigned int z = 0; z < vg.size_z; z++) {
+                    if (vg(x, y, z).label == label) {
+                        bits[z / 64] |= uint64_t(1) << (z % 64);
+                    }
+                }
+            }
+        }
+    });
+    return layer;
+}
+
+// Exterior marking on packed layers: the exterior starts as the empty voxels
+// on the border of the grid and is propagated through the empty layer with
+// bitwise operations until it stops growing. Gives the same voxels as the
+// breadth-first fill. Returns the number of exterior voxels.
+size_t mark_exterior_bitwise(VoxelGrid &vg, Connectivity connectivity,
+                             unsigned int num_threads) {
+    const BitGrid empty = label_layer(vg, VoxelLabel::UNLABELED, num_threads);
+    BitGrid exterior(vg.size_x, vg.size_y, vg.size_z);
+    if (exterior.words_z == 0) {
+        return 0;
+    }
+    const unsigned int top = vg.size_z - 1;
+    for (unsigned int x = 0; x < vg.size_x; x++) {
+        for (unsigned int y = 0; y < vg.size_y; y++) {
+            uint64_t *bits = exterior.column(x, y);
+            const uint64_t *allowed = empty.column(x, y);
+            if (x == 0 || y == 0 || x == vg.size_x - 1 || y == vg.size_y - 1) {
+                copy(allowed, allowed + exterior.words_z, bits);
+            } else {
+                bits[0] |= allowed[0] & 1;
+                bits[top / 64] |= allowed[top / 64] & (uint64_t(1) << (top % 64));
+            }
+        }
+    }
+    const unsigned int sweeps =
+            propagate_to_fixed_point(exterior, empty, connectivity);
+    add_metric_counter("exterior_sweeps", sweeps);
+
+    vec<size_t> counts(resolve_thread_count(num_threads), 0);
+    parallel_for_chunks(0, vg.size_x, num_threads,
+                        [&](size_t begin, size_t end, size_t chunk) {
+        for (unsigned int x = begin; x < end; x++) {
+            for (unsigned int y = 0; y < vg.size_y; y++) {
+                const uint64_t *bits = exterior.column(x, y);
+                for (unsigned int w = 0; w < exterior.words_z; w++) {
+                    uint64_t word = bits[w];
+                    while (word) {
+                        const unsigned int z = w * 64 + __builtin_ctzll(word);
+                        word &= word - 1;
+                        vg(x, y, z).label = VoxelLabel::EXTERIOR;
+                        vg.room_id(x, y, z) = 0;
+                        counts[chunk]++;
                     }
                 }
             }
         }
+    });
+    size_t total = 0;
+    for (const size_t count: counts) {
+        total += count;
+    }
+    return total;
+}
+
+// Voxels per label, for the metrics of the labelling
+void add_label_counters(const VoxelGrid &vg) {
+    const char *names[4] = {"unlabeled_voxels", "intersected_voxels",
+                            "exterior_voxels", "interior_voxels"};
+    size_t counts[4] = {0, 0, 0, 0};
+    size_t stored = 0;
+    for_each_stored_voxel(vg, [&](unsigned int x, unsigned int y, unsigned int z) {
+        counts[static_cast<int>(vg(x, y, z).label)]++;
+        stored++;
+    });
+    counts[static_cast<int>(vg.background.label)] += vg.num_voxels() - stored;
+    for (int i = 0; i < 4; i++) {
+        add_metric_counter(names[i], counts[i]);
+    }
+}
+
+VoxelGrid mark_exterior_interior(const VoxelGrid &vg,
+                                 Connectivity connectivity,
+                                 unsigned int num_threads,
+                                 ExteriorMethod method,
+                                 const TriangleStore *triangles) {
+    StageTimer stage("label");
+    progress() << "===Marking exterior and interior voxels===\n";
+    VoxelGrid vg_marked = vg;
+    if (method == ExteriorMethod::Parity && triangles == nullptr) {
+        cerr << "Ray parity needs the triangles, using the fill instead"
+             << endl;
+        method = ExteriorMethod::FloodFill;
+    }
+    StageTimer exterior_stage("exterior");
+    size_t exterior;
+    // Parity handles sparse grids itself; otherwise sparse grids always use
+    // their brick-level fill
+    if (method == ExteriorMethod::Parity) {
+        exterior = mark_exterior_parity(vg_marked, *triangles, num_threads);
+    } else if (vg_marked.is_sparse()) {
+        exterior = mark_exterior_sparse(vg_marked, connectivity);
+    } else if (method == ExteriorMethod::Bitwise) {
+        exterior = mark_exterior_bitwise(vg_marked, connectivity, num_threads);
+    } else if (method == ExteriorMethod::Coarse) {
+        exterior = mark_exterior_coarse(vg_marked, connectivity, num_threads);
+    } else {
+        exterior = mark_exterior_flood_fill(vg_marked, connectivity);
+    }
+    exterior_stage.stop();
+    progress() << "exterior voxels: " << exterior << "\n";
+
+    // Everything still unlabelled is enclosed; each component is a room
+    StageTimer rooms_stage("rooms");
+    const unsigned int num_rooms =
+            vg_marked.is_sparse()
+            ? label_rooms_sparse(vg_marked, connectivity)
+            : label_rooms(vg_marked, connectivity, num_threads);
+    rooms_stage.stop();
+
+    progress() << "num of classes: " << num_rooms << "\n";
+    add_metric_counter("rooms", num_rooms);
+    if (metrics_enabled()) {
+        add_label_counters(vg_marked);
+    }
+
+    return vg_marked;
+}
+
+void extract_surface(VoxelGrid &vg,
+                     vec<vec<int>> connectivity = eighteen_connectivity,
+                     unsigned int num_threads = 0) {
+    StageTimer stage("extract_surface");
+    const VoxelGrid &stored = vg;
+    // On dense grids the voxels next to the exterior come from one
+    // word-parallel dilation of the exterior layer
+    BitGrid near_exterior(0, 0, 0);
+    bool use_layer = false;
+    for (Connectivity c: {Connectivity::Six, Connectivity::Eighteen,
+                          Connectivity::TwentySix}) {
+        if (!vg.is_sparse() && connectivity == connectivity_offsets(c)) {
+            near_exterior =
+                    dilate(label_layer(vg, VoxelLabel::EXTERIOR, num_threads),
+                           c, num_threads);
+            use_layer = true;
+        }
     }
+    const int size_x = static_cast<int>(vg.size_x),
+              size_y = static_cast<int>(vg.size_y),
+              size_z = static_cast<int>(vg.size_z);
+    const int num_offsets = static_cast<int>(connectivity.size());
+    for_each_stored_voxel(vg, [&](unsigned int x, unsigned int y, unsigned int z) {
+        if (stored(x, y, z).label != VoxelLabel::INTERSECTED) {
+            return;
+        }
+        if (use_layer && near_exterior.test(x, y, z)) {
+            vg(x, y, z).city_object_type = CityObjectType::BuildingPart;
+            return;
+        }
+        vec<pair<int, VoxelLabel>> neighbour_labels;
+        for (int i = 0; i < num_offsets; i++) {
+            auto adjacent_voxel = connectivity[i];
+            int adj_x = x + adjacent_voxel[0];
+            int adj_y = y + adjacent_voxel[1];
+            int adj_z = z + adjacent_voxel[2];
+            if (adj_x >= size_x || adj_y >= size_y ||
+                adj_z >= size_z || adj_x < 0 || adj_y < 0 ||
+                adj_z < 0) {
+                continue;
+            }
+            neighbour_labels.push_back(
+                    make_pair(i, stored(adj_x, adj_y, adj_z).label));
+        };
+
+        VoxelInfo &voxel = vg(x, y, z);
+        if (any_of(neighbour_labels.begin(), neighbour_labels.end(),
+                   [](const auto &pair) {
+                       return pair.second == VoxelLabel::EXTERIOR;
+                   })) {
+            voxel.city_object_type = CityObjectType::BuildingPart;
+            return;
+        }
+        auto found = find_if(neighbour_labels.begin(), neighbour_labels.end(),
+                             [](const auto &pair) {
+                                 return pair.second == VoxelLabel::INTERIOR;
+                             });
+        if (found != neighbour_labels.end()) {
+            auto neighbour_xyz = connectivity[found->first];
+            voxel.city_object_type = CityObjectType::BuildingRoom;
+            vg.room_id(x, y, z) =
+                    stored.room_id(x + neighbour_xyz[0], y + neighbour_xyz[1],
+                                   z + neighbour_xyz[2]);
+        } else {
+            voxel.city_object_type = CityObjectType::BuildingRoom;
+        }
+    });
 }
 
 #endif
\ No newline at end of file
@@ -2,6 +2,7 @@
 #define VOXEL_INFO_H
 
 #include "types.h"
+#include <algorithm>
 #include <array>
 #include <cassert>
 #include <cstddef>
@@ -11,7 +12,6 @@ VoxelInfo::VoxelInfo() {
   this->label = VoxelLabel::UNLABELED;
   this->city_object_type = CityObjectType::UNKOWN;
   this->semantics = Semantics::UNKOWN;
-  this->room_id = 0;
 }
 
 string voxel_lable_to_string(VoxelLabel label) {
@@ -29,4 +29,18 @@ string voxel_lable_to_string(VoxelLabel label) {
   }
 }
 
+bool parse_voxel_label(const string &name, VoxelLabel &label) {
+  for (VoxelLabel candidate :
+       {VoxelLabel::UNLABELED, VoxelLabel::INTERSECTED, VoxelLabel::EXTERIOR,
+        VoxelLabel::INTERIOR}) {
+    string lower = voxel_lable_to_string(candidate);
+    transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+    if (name == lower) {
+      label = candidate;
+      return true;
+    }
+  }
+  return false;
+}
+
 #endif
\ No newline at end of file